@@ -0,0 +1,426 @@
+/**
+ * @file bench.cpp
+ * @author Michal Repcik (xrepcim00)
+ * @brief Microbenchmarks of the hot paths over a sweep of sizes, results are printed as JSON
+ * @note Usage: secret-bench [--quick] [--filter <text>] [--min-time <ms>] [--dir <path>] [--out <path>]
+ */
+#include "chunker.hpp"
+#include "protocol.hpp"
+#include "net_utils.hpp"
+#include "encoder.hpp"
+#include "file_handler.hpp"
+#include "metrics.hpp"
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+constexpr auto BATCH_TARGET = std::chrono::microseconds(2);   ///< Shortest timed batch, hides the clock overhead
+constexpr uint64_t MIN_BATCHES = 16;                          ///< Batches measured at least, however slow
+constexpr size_t MAX_CHUNK = 1400;                            ///< Chunk size of a 1500 B MTU path
+constexpr size_t READ_BLOCK = 64 * 1024;                      ///< Read size of the streaming file benchmark
+
+/**
+ * @struct Options
+ * @brief Command line of the benchmark
+ */
+struct Options {
+    std::chrono::milliseconds minTime{200};    ///< Time spent measuring one case
+    std::string filter;                         ///< Only cases whose name contains this
+    std::string dir;                            ///< Directory for the file benchmarks
+    std::string out;                            ///< Output file (empty = standard output)
+};
+
+/**
+ * @struct Result
+ * @brief Measurement of one case, latencies are per operation
+ */
+struct Result {
+    std::string name;           ///< Benchmarked function
+    size_t size = 0;            ///< Input size in bytes
+    uint64_t operations = 0;    ///< Operations measured
+    uint64_t batch = 0;         ///< Operations per timed batch
+    double meanNs = 0.0;        ///< Average latency
+    uint64_t p50Ns = 0;         ///< Median latency
+    uint64_t p99Ns = 0;         ///< 99th percentile latency
+    uint64_t maxNs = 0;         ///< Slowest batch divided by its size
+    double bytesPerSecond = 0.0; ///< Input bytes processed per second
+};
+
+/**
+ * @brief Keeps the compiler from optimizing away a result
+ */
+template <typename T>
+static void keep(T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+/**
+ * @brief Random bytes, the same for every run
+ */
+static std::vector<uint8_t> randomBytes(size_t size) {
+    std::mt19937_64 gen(size);
+    std::vector<uint8_t> data(size);
+    for (auto& byte : data) {
+        byte = static_cast<uint8_t>(gen());
+    }
+    return data;
+}
+
+/**
+ * @class Suite
+ * @brief Runs the cases that pass the filter and collects their results
+ */
+class Suite {
+public:
+    explicit Suite(const Options& options) : options(options) {}
+
+    /**
+     * @brief Measures one case, ops are timed in batches long enough for the clock to be accurate
+     * @param name Benchmarked function
+     * @param size Input size in bytes
+     * @param op One operation, returns False on error
+     * @return True if no issues, False if the operation failed
+     */
+    template <typename Op>
+    bool run(const std::string& name, size_t size, Op&& op) {
+        if (!options.filter.empty() && name.find(options.filter) == std::string::npos) {
+            return true;
+        }
+        using Clock = std::chrono::steady_clock;
+
+        auto timeBatch = [&op](uint64_t batch, uint64_t& ns) {
+            auto start = Clock::now();
+            for (uint64_t i = 0; i < batch; ++i) {
+                if (!op()) {
+                    return false;
+                }
+            }
+            ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+            return true;
+        };
+
+        // Warm up caches and allocator, then double the batch until it is long enough
+        uint64_t batch = 1;
+        uint64_t ns = 0;
+        if (!timeBatch(1, ns)) {
+            std::cerr << "[BENCH] " << name << " failed" << std::endl;
+            return false;
+        }
+        while (true) {
+            if (!timeBatch(batch, ns)) {
+                std::cerr << "[BENCH] " << name << " failed" << std::endl;
+                return false;
+            }
+            if (std::chrono::nanoseconds(ns) >= BATCH_TARGET) {
+                break;
+            }
+            batch *= 2;
+        }
+
+        auto histogram = std::make_unique<metrics::Histogram>();
+        uint64_t batches = 0;
+        uint64_t totalNs = 0;
+        auto deadline = Clock::now() + options.minTime;
+        while (batches < MIN_BATCHES || Clock::now() < deadline) {
+            if (!timeBatch(batch, ns)) {
+                std::cerr << "[BENCH] " << name << " failed" << std::endl;
+                return false;
+            }
+            histogram->record(ns / batch);
+            totalNs += ns;
+            ++batches;
+        }
+
+        Result result;
+        result.name = name;
+        result.size = size;
+        result.operations = batches * batch;
+        result.batch = batch;
+        result.meanNs = static_cast<double>(totalNs) / static_cast<double>(result.operations);
+        result.p50Ns = histogram->quantile(0.5);
+        result.p99Ns = histogram->quantile(0.99);
+        result.maxNs = histogram->max();
+        result.bytesPerSecond = static_cast<double>(size) * static_cast<double>(result.operations) /
+                                (static_cast<double>(totalNs) / 1e9);
+        results.push_back(result);
+
+        std::cerr << "[BENCH] " << std::left << std::setw(28) << name << std::right << std::setw(10) << size
+                  << " B " << std::setw(12) << std::fixed << std::setprecision(1) << result.meanNs << " ns "
+                  << std::setw(10) << result.bytesPerSecond / 1e6 << " MB/s" << std::endl;
+        return true;
+    }
+
+    /**
+     * @brief Writes all results as one JSON document
+     * @param out Output stream
+     */
+    void writeJson(std::ostream& out) const {
+        out << "{\n"
+            << "  \"version\": \"" << BENCH_VERSION << "\",\n"
+            << "  \"compiler\": \"" << __VERSION__ << "\",\n"
+            << "  \"min_time_ms\": " << options.minTime.count() << ",\n"
+            << "  \"results\": [";
+        out << std::fixed << std::setprecision(1);
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result& r = results[i];
+            out << (i == 0 ? "\n" : ",\n")
+                << "    {\"name\": \"" << r.name << "\", \"size\": " << r.size
+                << ", \"operations\": " << r.operations << ", \"batch\": " << r.batch
+                << ", \"mean_ns\": " << r.meanNs << ", \"p50_ns\": " << r.p50Ns << ", \"p99_ns\": " << r.p99Ns
+                << ", \"max_ns\": " << r.maxNs << ", \"bytes_per_second\": " << r.bytesPerSecond << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+private:
+    const Options& options;         ///< Command line
+    std::vector<Result> results;    ///< Finished cases
+};
+
+/**
+ * @brief Splitting a buffer into chunks and joining them back
+ */
+static bool benchChunker(Suite& suite) {
+    for (size_t size : {1400UL, 64UL * 1024, 1024UL * 1024, 16UL * 1024 * 1024}) {
+        std::vector<uint8_t> data = randomBytes(size);
+        chunker::ByteVector2D chunks = chunker::chunkData(data, MAX_CHUNK);
+
+        bool ok = suite.run("chunker.chunkData", size, [&] {
+            auto result = chunker::chunkData(data, MAX_CHUNK);
+            keep(result);
+            return true;
+        });
+        ok = ok && suite.run("chunker.reassembleData", size, [&] {
+            auto result = chunker::reassembleData(chunks);
+            keep(result);
+            return result.size() == size;
+        });
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Serializing and parsing a Data packet
+ */
+static bool benchProtocol(Suite& suite) {
+    for (size_t size : {64UL, 512UL, 1400UL, 8192UL, 65000UL}) {
+        protocol::Data data;
+        data.chunkNum = 42;
+        data.tag = 0x0123456789abcdefULL;
+        data.payload = randomBytes(size);
+        auto packet = protocol::buildDataPacket(data, 7, 0xfeedfacecafebeefULL);
+        std::vector<uint8_t> serialized = protocol::serializePacket(*packet);
+
+        bool ok = suite.run("protocol.serializePacket", size, [&] {
+            auto result = protocol::serializePacket(*packet);
+            keep(result);
+            return true;
+        });
+        ok = ok && suite.run("protocol.parsePacket", size, [&] {
+            auto result = protocol::parsePacket(serialized.data(), serialized.size());
+            keep(result);
+            return result != nullptr;
+        });
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief ICMP checksums of a packet
+ */
+static bool benchChecksum(Suite& suite) {
+    struct sockaddr_in6 src{};
+    struct sockaddr_in6 dst{};
+    src.sin6_family = AF_INET6;
+    dst.sin6_family = AF_INET6;
+    src.sin6_addr = in6addr_loopback;
+    dst.sin6_addr = in6addr_loopback;
+
+    for (size_t size : {64UL, 512UL, 1500UL, 9000UL, 65535UL}) {
+        std::vector<uint8_t> data = randomBytes(size);
+
+        bool ok = suite.run("net_utils.computeIPv4Checksum", size, [&] {
+            uint16_t sum = net_utils::computeIPv4Checksum(data.data(), data.size());
+            keep(sum);
+            return true;
+        });
+        ok = ok && suite.run("net_utils.computeIPv6Checksum", size, [&] {
+            uint16_t sum = net_utils::computeIPv6Checksum(data.data(), data.size(), src, dst);
+            keep(sum);
+            return true;
+        });
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Whole-buffer AES-256-CBC
+ */
+static bool benchEncoder(Suite& suite) {
+    std::vector<uint8_t> key = encoder::deriveKey("xrepcim00");
+    std::vector<uint8_t> iv = encoder::generateIV();
+
+    for (size_t size : {1024UL, 64UL * 1024, 1024UL * 1024, 16UL * 1024 * 1024}) {
+        std::vector<uint8_t> plain = randomBytes(size);
+        std::vector<uint8_t> cipher;
+        if (!encoder::encrypt(plain, key, iv, cipher)) {
+            std::cerr << "[BENCH] encoder::encrypt failed" << std::endl;
+            return false;
+        }
+
+        std::vector<uint8_t> out;
+        bool ok = suite.run("encoder.encrypt", size, [&] {
+            return encoder::encrypt(plain, key, iv, out);
+        });
+        ok = ok && suite.run("encoder.decrypt", size, [&] {
+            return encoder::decrypt(cipher, key, iv, out) && out.size() == size;
+        });
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Whole-file and streaming reads and writes in the benchmark directory (mostly the page cache)
+ */
+static bool benchFiles(Suite& suite, const std::string& dir) {
+    std::string path = (std::filesystem::path(dir) / ("secret-bench-" + std::to_string(getpid()))).string();
+
+    bool ok = true;
+    for (size_t size : {64UL * 1024, 1024UL * 1024, 16UL * 1024 * 1024}) {
+        std::vector<uint8_t> data = randomBytes(size);
+        std::vector<uint8_t> in;
+
+        ok = suite.run("file_handler.writeFile", size, [&] {
+            return file_handler::writeFile(path, data);
+        });
+        ok = ok && suite.run("file_handler.readFile", size, [&] {
+            return file_handler::readFile(path, in) && in.size() == size;
+        });
+        ok = ok && suite.run("file_handler.FileReader", size, [&] {
+            file_handler::FileReader reader;
+            if (!reader.open(path)) {
+                return false;
+            }
+            size_t total = 0;
+            do {
+                if (!reader.read(in, READ_BLOCK)) {
+                    return false;
+                }
+                total += in.size();
+            } while (!in.empty());
+            return total == size;
+        });
+        // Blocks are copied to the writer like decrypted chunks on the server
+        ok = ok && suite.run("file_handler.FileWriter", size, [&] {
+            file_handler::FileWriter writer;
+            if (!writer.open(path, size)) {
+                return false;
+            }
+            for (size_t offset = 0; offset < size; offset += READ_BLOCK) {
+                size_t n = std::min(READ_BLOCK, size - offset);
+                if (!writer.write(std::vector<uint8_t>(data.begin() + offset, data.begin() + offset + n))) {
+                    return false;
+                }
+            }
+            return writer.commit();
+        });
+        if (!ok) {
+            break;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+    return ok;
+}
+
+/**
+ * @brief Prints usage of the benchmark
+ */
+static void printUsage(void) {
+    std::cerr << "Usage: secret-bench [options]\n"
+              << "  --quick              Measure every case for 20 ms instead of 200 ms\n"
+              << "  --min-time <ms>      Measure every case for this long\n"
+              << "  --filter <text>      Run only cases whose name contains text\n"
+              << "  --dir <path>         Directory for the file benchmarks (default: system temp directory)\n"
+              << "  --out <path>         Write JSON to path instead of standard output\n";
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--quick") {
+            options.minTime = std::chrono::milliseconds(20);
+        }
+        else if (arg == "--min-time" && i + 1 < argc) {
+            try {
+                options.minTime = std::chrono::milliseconds(std::stoul(argv[++i]));
+            } catch (...) {
+                std::cerr << "Error: Invalid --min-time value" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--filter" && i + 1 < argc) {
+            options.filter = argv[++i];
+        }
+        else if (arg == "--dir" && i + 1 < argc) {
+            options.dir = argv[++i];
+        }
+        else if (arg == "--out" && i + 1 < argc) {
+            options.out = argv[++i];
+        }
+        else {
+            printUsage();
+            return 1;
+        }
+    }
+    if (options.dir.empty()) {
+        options.dir = std::filesystem::temp_directory_path().string();
+    }
+
+    Suite suite(options);
+    if (!benchChunker(suite) || !benchProtocol(suite) || !benchChecksum(suite) ||
+        !benchEncoder(suite) || !benchFiles(suite, options.dir)) {
+        return 1;
+    }
+
+    if (options.out.empty()) {
+        suite.writeJson(std::cout);
+        return 0;
+    }
+    std::ofstream file(options.out, std::ios::trunc);
+    suite.writeJson(file);
+    if (!file) {
+        std::cerr << "Error: Cannot write " << options.out << std::endl;
+        return 1;
+    }
+    std::cerr << "[BENCH] Results written to " << options.out << std::endl;
+    return 0;
+}
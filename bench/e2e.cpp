@@ -0,0 +1,537 @@
+/**
+ * @file e2e.cpp
+ * @author Michal Repcik (xrepcim00)
+ * @brief End-to-end benchmark, runs the real client and server against each other and prints the results as JSON
+ * @note Needs the privileges of secret itself (raw sockets, capture), --netns also needs to create namespaces.
+ *       Every case starts a fresh server, sends one file per client at the same time and checks the received
+ *       copies. CPU time and peak RSS come from wait4(), so they cover the whole life of each process.
+ */
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+const std::string NETNS = "secret-e2e";                 ///< Namespace of the server with --netns
+const std::string VETH_HOST = "secret-e2e0";            ///< Host end of the veth pair
+const std::string VETH_PEER = "secret-e2e1";            ///< Server end of the veth pair
+const std::string HOST_ADDRESS = "10.211.0.1/24";       ///< Address of the host end
+const std::string PEER_ADDRESS = "10.211.0.2";          ///< Address of the server end (target of the clients)
+constexpr int VETH_MTU = 65535;                         ///< MTU of the veth pair, every swept chunk size fits
+constexpr auto POLL_INTERVAL = std::chrono::milliseconds(5); ///< Period of child exit checks
+constexpr size_t WRITE_BLOCK = 1024 * 1024;             ///< Block of the generated input files
+
+/**
+ * @struct Options
+ * @brief Command line of the benchmark
+ */
+struct Options {
+    std::string secret = "./secret";                    ///< Binary under test
+    std::vector<uint64_t> sizes{1 << 20, 16 << 20, 64 << 20}; ///< File sizes
+    std::vector<uint64_t> clients{1, 4};                ///< Concurrent client counts
+    std::vector<uint64_t> mtus{1500, 9000, 65535};      ///< Path MTUs passed with -m, they set the chunk size
+    uint64_t repeat = 1;                                ///< Runs of every case
+    bool netns = false;                                 ///< Server in its own namespace behind a veth pair
+    bool keep = false;                                  ///< Keep inputs, copies and logs of the last case
+    std::string impair;                                 ///< --impair of the clients (empty = clean link)
+    std::string dir;                                    ///< Work directory
+    std::string out;                                    ///< Output file (empty = standard output)
+    std::chrono::seconds timeout{120};                  ///< Longest run of one client
+    std::chrono::milliseconds settle{500};              ///< Time the server gets to start capturing
+};
+
+/**
+ * @struct Process
+ * @brief Finished (or killed) child with its resource usage
+ */
+struct Process {
+    pid_t pid = -1;                 ///< Process ID (-1 = not started)
+    Clock::time_point start;        ///< Time of the fork
+    Clock::time_point end;          ///< Time it was reaped
+    int status = 0;                 ///< Wait status
+    struct rusage usage{};          ///< CPU time and peak RSS
+    bool done = false;              ///< Reaped
+};
+
+/**
+ * @struct Result
+ * @brief Measurement of one run of one case
+ */
+struct Result {
+    uint64_t size = 0;              ///< File size
+    uint64_t clients = 0;           ///< Concurrent clients
+    uint64_t mtu = 0;               ///< Path MTU
+    uint64_t run = 0;               ///< Index of the repetition
+    uint64_t completed = 0;         ///< Clients that succeeded with an identical copy
+    double seconds = 0.0;           ///< First client start to last client exit
+    double goodput = 0.0;           ///< File bytes per second over all clients
+    double packetsPerSecond = 0.0;  ///< Packets sent by all clients per second
+    double clientCpuPerGB = 0.0;    ///< Client CPU seconds per GB of file data
+    double serverCpuPerGB = 0.0;    ///< Server CPU seconds per GB of file data
+    long clientRssKB = 0;           ///< Largest peak RSS of a client
+    long serverRssKB = 0;           ///< Peak RSS of the server
+    double latencyMean = 0.0;       ///< Average client completion time
+    double latencyMax = 0.0;        ///< Slowest client completion time
+};
+
+/**
+ * @brief Parses a comma separated list of sizes, K, M and G suffixes are powers of 1024
+ */
+static bool parseList(const std::string& text, std::vector<uint64_t>& values) {
+    values.clear();
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        try {
+            size_t used = 0;
+            uint64_t value = std::stoull(item, &used);
+            std::string suffix = item.substr(used);
+            if (suffix == "K" || suffix == "k") value <<= 10;
+            else if (suffix == "M" || suffix == "m") value <<= 20;
+            else if (suffix == "G" || suffix == "g") value <<= 30;
+            else if (!suffix.empty()) return false;
+            values.push_back(value);
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+    return !values.empty();
+}
+
+/**
+ * @brief Runs a shell command of the namespace setup
+ */
+static bool shell(const std::string& command, bool quiet = false) {
+    int status = std::system((command + (quiet ? " >/dev/null 2>&1" : "")).c_str());
+    if (status != 0 && !quiet) {
+        std::cerr << "[E2E] Command failed: " << command << std::endl;
+    }
+    return status == 0;
+}
+
+/**
+ * @brief Creates the server namespace and the veth pair to it
+ */
+static bool setupNetns(void) {
+    shell("ip netns del " + NETNS, true);
+    std::string mtu = std::to_string(VETH_MTU);
+    return shell("ip netns add " + NETNS) &&
+           shell("ip link add " + VETH_HOST + " mtu " + mtu + " type veth peer name " + VETH_PEER + " mtu " + mtu) &&
+           shell("ip link set " + VETH_PEER + " netns " + NETNS) &&
+           shell("ip addr add " + HOST_ADDRESS + " dev " + VETH_HOST) &&
+           shell("ip link set " + VETH_HOST + " up") &&
+           shell("ip -n " + NETNS + " addr add " + PEER_ADDRESS + "/24 dev " + VETH_PEER) &&
+           shell("ip -n " + NETNS + " link set " + VETH_PEER + " up") &&
+           shell("ip -n " + NETNS + " link set lo up");
+}
+
+/**
+ * @brief Removes the namespace, the veth pair goes with it
+ */
+static void teardownNetns(void) {
+    shell("ip netns del " + NETNS, true);
+}
+
+/**
+ * @brief Starts a child in dir with standard output and error appended to log
+ */
+static Process spawn(const std::vector<std::string>& args, const std::string& dir, const std::string& log) {
+    Process process;
+    process.start = Clock::now();
+    process.pid = fork();
+    if (process.pid == 0) {
+        int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0 || chdir(dir.c_str()) != 0) {
+            _exit(127);
+        }
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+
+        std::vector<char*> argv;
+        for (const auto& arg : args) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+    if (process.pid < 0) {
+        std::cerr << "[E2E] fork failed: " << strerror(errno) << std::endl;
+    }
+    return process;
+}
+
+/**
+ * @brief Reaps the child if it exited
+ * @return True if it is reaped
+ */
+static bool reap(Process& process) {
+    if (process.done || process.pid < 0) {
+        return true;
+    }
+    pid_t pid = wait4(process.pid, &process.status, WNOHANG, &process.usage);
+    if (pid == process.pid) {
+        process.end = Clock::now();
+        process.done = true;
+    }
+    return process.done;
+}
+
+/**
+ * @brief Stops the child and reaps it
+ */
+static void stop(Process& process, int sig) {
+    if (process.done || process.pid < 0) {
+        return;
+    }
+    kill(process.pid, sig);
+    if (wait4(process.pid, &process.status, 0, &process.usage) == process.pid) {
+        process.end = Clock::now();
+        process.done = true;
+    }
+}
+
+/**
+ * @brief CPU seconds of a reaped child
+ */
+static double cpuSeconds(const Process& process) {
+    auto seconds = [](const struct timeval& tv) { return static_cast<double>(tv.tv_sec) + tv.tv_usec / 1e6; };
+    return seconds(process.usage.ru_utime) + seconds(process.usage.ru_stime);
+}
+
+/**
+ * @brief Writes random file of the given size (skipped if it already has that size)
+ */
+static bool makeInput(const std::string& path, uint64_t size, uint64_t seed) {
+    std::error_code ec;
+    if (std::filesystem::file_size(path, ec) == size && !ec) {
+        return true;
+    }
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    std::mt19937_64 gen(seed);
+    std::vector<uint64_t> block(WRITE_BLOCK / sizeof(uint64_t));
+    for (uint64_t written = 0; written < size;) {
+        for (auto& word : block) {
+            word = gen();
+        }
+        size_t n = static_cast<size_t>(std::min<uint64_t>(WRITE_BLOCK, size - written));
+        file.write(reinterpret_cast<const char*>(block.data()), static_cast<std::streamsize>(n));
+        written += n;
+    }
+    return static_cast<bool>(file);
+}
+
+/**
+ * @brief Compares two files byte by byte
+ */
+static bool sameFiles(const std::string& a, const std::string& b) {
+    std::ifstream fa(a, std::ios::binary);
+    std::ifstream fb(b, std::ios::binary);
+    if (!fa || !fb) {
+        return false;
+    }
+    std::vector<char> ba(WRITE_BLOCK);
+    std::vector<char> bb(WRITE_BLOCK);
+    while (fa && fb) {
+        fa.read(ba.data(), static_cast<std::streamsize>(ba.size()));
+        fb.read(bb.data(), static_cast<std::streamsize>(bb.size()));
+        if (fa.gcount() != fb.gcount() || std::memcmp(ba.data(), bb.data(), static_cast<size_t>(fa.gcount())) != 0) {
+            return false;
+        }
+    }
+    return fa.eof() && fb.eof();
+}
+
+/**
+ * @brief Sums the samples of a metric in a Prometheus text file
+ */
+static uint64_t readMetric(const std::string& path, const std::string& name) {
+    std::ifstream file(path);
+    std::string line;
+    uint64_t sum = 0;
+    while (std::getline(file, line)) {
+        if (line.compare(0, name.size(), name) != 0 || line.size() <= name.size() ||
+            (line[name.size()] != ' ' && line[name.size()] != '{')) {
+            continue;
+        }
+        size_t space = line.rfind(' ');
+        try {
+            sum += static_cast<uint64_t>(std::stod(line.substr(space + 1)));
+        } catch (const std::exception&) {}
+    }
+    return sum;
+}
+
+/**
+ * @brief Runs one case: fresh server, all clients at once, checked copies
+ * @return True if the processes could be started
+ */
+static bool runCase(const Options& options, const std::string& inDir, Result& result) {
+    std::string caseDir = options.dir + "/case";
+    std::filesystem::remove_all(caseDir);
+    std::filesystem::create_directories(caseDir + "/out");
+    std::string outDir = caseDir + "/out";
+
+    std::vector<std::string> serverArgs;
+    if (options.netns) {
+        serverArgs = {"ip", "netns", "exec", NETNS};
+    }
+    serverArgs.insert(serverArgs.end(), {options.secret, "-l"});
+    Process server = spawn(serverArgs, outDir, caseDir + "/server.log");
+    if (server.pid < 0) {
+        return false;
+    }
+    std::this_thread::sleep_for(options.settle);
+    if (reap(server)) {
+        std::cerr << "[E2E] Server exited right away, see " << caseDir << "/server.log" << std::endl;
+        return false;
+    }
+
+    std::string target = options.netns ? PEER_ADDRESS : "127.0.0.1";
+    std::vector<Process> clients;
+    std::vector<std::string> names;
+    for (uint64_t i = 0; i < result.clients; ++i) {
+        std::string name = "in-" + std::to_string(result.size) + "-" + std::to_string(i) + ".bin";
+        std::string metrics = caseDir + "/client" + std::to_string(i) + ".prom";
+        names.push_back(name);
+        std::vector<std::string> args{options.secret, "-r", inDir + "/" + name, "-s", target,
+                                      "-m", std::to_string(result.mtu), "--metrics-file", metrics};
+        if (!options.impair.empty()) {
+            args.push_back("--impair");
+            args.push_back(options.impair);
+        }
+        clients.push_back(spawn(args, caseDir, caseDir + "/client" + std::to_string(i) + ".log"));
+    }
+
+    auto deadline = Clock::now() + options.timeout;
+    while (!std::all_of(clients.begin(), clients.end(), [](Process& p) { return reap(p); })) {
+        if (Clock::now() >= deadline) {
+            std::cerr << "[E2E] Clients did not finish in " << options.timeout.count() << " s" << std::endl;
+            for (auto& client : clients) {
+                stop(client, SIGKILL);
+            }
+            break;
+        }
+        std::this_thread::sleep_for(POLL_INTERVAL);
+    }
+    // Server has nothing to flush at exit, every file is committed before the client gets its confirmation
+    stop(server, SIGTERM);
+
+    Clock::time_point first = clients.front().start;
+    Clock::time_point last = clients.front().end;
+    double clientCpu = 0.0;
+    uint64_t packets = 0;
+    for (uint64_t i = 0; i < result.clients; ++i) {
+        const Process& client = clients[i];
+        first = std::min(first, client.start);
+        last = std::max(last, client.end);
+        clientCpu += cpuSeconds(client);
+        result.clientRssKB = std::max(result.clientRssKB, client.usage.ru_maxrss);
+
+        double latency = std::chrono::duration<double>(client.end - client.start).count();
+        result.latencyMean += latency / static_cast<double>(result.clients);
+        result.latencyMax = std::max(result.latencyMax, latency);
+
+        packets += readMetric(caseDir + "/client" + std::to_string(i) + ".prom", "secret_client_packets_sent_total");
+        bool exited = WIFEXITED(client.status) && WEXITSTATUS(client.status) == 0;
+        if (exited && sameFiles(inDir + "/" + names[i], outDir + "/" + names[i])) {
+            ++result.completed;
+        }
+    }
+
+    double gigabytes = static_cast<double>(result.size * result.clients) / 1e9;
+    result.seconds = std::chrono::duration<double>(last - first).count();
+    result.goodput = static_cast<double>(result.size * result.completed) / result.seconds;
+    result.packetsPerSecond = static_cast<double>(packets) / result.seconds;
+    result.clientCpuPerGB = clientCpu / gigabytes;
+    result.serverCpuPerGB = cpuSeconds(server) / gigabytes;
+    result.serverRssKB = server.usage.ru_maxrss;
+    return true;
+}
+
+/**
+ * @brief Writes all results as one JSON document
+ */
+static void writeJson(std::ostream& out, const Options& options, const std::vector<Result>& results) {
+    out << "{\n"
+        << "  \"version\": \"" << BENCH_VERSION << "\",\n"
+        << "  \"network\": \"" << (options.netns ? "veth" : "loopback") << "\",\n"
+        << "  \"impairment\": \"" << options.impair << "\",\n"
+        << "  \"results\": [";
+    out << std::fixed << std::setprecision(3);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        out << (i == 0 ? "\n" : ",\n")
+            << "    {\"size\": " << r.size << ", \"clients\": " << r.clients << ", \"mtu\": " << r.mtu
+            << ", \"run\": " << r.run << ", \"completed\": " << r.completed << ", \"seconds\": " << r.seconds
+            << ", \"goodput_bytes_per_second\": " << r.goodput << ", \"packets_per_second\": " << r.packetsPerSecond
+            << ", \"client_cpu_seconds_per_gb\": " << r.clientCpuPerGB
+            << ", \"server_cpu_seconds_per_gb\": " << r.serverCpuPerGB
+            << ", \"client_peak_rss_kb\": " << r.clientRssKB << ", \"server_peak_rss_kb\": " << r.serverRssKB
+            << ", \"latency_mean_seconds\": " << r.latencyMean << ", \"latency_max_seconds\": " << r.latencyMax
+            << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+/**
+ * @brief Prints usage of the benchmark
+ */
+static void printUsage(void) {
+    std::cerr << "Usage: secret-e2e [options]\n"
+              << "  --secret <path>      Binary under test (default ./secret)\n"
+              << "  --sizes <list>       File sizes, K/M/G suffixes (default 1M,16M,64M)\n"
+              << "  --clients <list>     Concurrent client counts (default 1,4)\n"
+              << "  --mtus <list>        Path MTUs, they set the chunk size (default 1500,9000,65535)\n"
+              << "  --repeat <n>         Runs of every case (default 1)\n"
+              << "  --netns              Run the server in a private namespace behind a veth pair\n"
+              << "  --impair <spec>      Pass --impair spec to every client (loss, delay, rate, ...)\n"
+              << "  --dir <path>         Work directory (default: system temp directory)\n"
+              << "  --keep               Keep the work directory (inputs, copies and logs of the last case)\n"
+              << "  --timeout <s>        Longest run of one case (default 120)\n"
+              << "  --out <path>         Write JSON to path instead of standard output\n";
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool ok = true;
+        if (arg == "--secret" && i + 1 < argc) {
+            options.secret = std::filesystem::absolute(argv[++i]).string();
+        }
+        else if (arg == "--sizes" && i + 1 < argc) {
+            ok = parseList(argv[++i], options.sizes);
+        }
+        else if (arg == "--clients" && i + 1 < argc) {
+            ok = parseList(argv[++i], options.clients);
+        }
+        else if (arg == "--mtus" && i + 1 < argc) {
+            ok = parseList(argv[++i], options.mtus);
+        }
+        else if (arg == "--repeat" && i + 1 < argc) {
+            std::vector<uint64_t> values;
+            ok = parseList(argv[++i], values) && values.size() == 1 && values[0] > 0;
+            options.repeat = ok ? values[0] : 0;
+        }
+        else if (arg == "--timeout" && i + 1 < argc) {
+            std::vector<uint64_t> values;
+            ok = parseList(argv[++i], values) && values.size() == 1 && values[0] > 0;
+            options.timeout = std::chrono::seconds(ok ? values[0] : 0);
+        }
+        else if (arg == "--netns") {
+            options.netns = true;
+        }
+        else if (arg == "--impair" && i + 1 < argc) {
+            options.impair = argv[++i];
+        }
+        else if (arg == "--keep") {
+            options.keep = true;
+        }
+        else if (arg == "--dir" && i + 1 < argc) {
+            options.dir = argv[++i];
+        }
+        else if (arg == "--out" && i + 1 < argc) {
+            options.out = argv[++i];
+        }
+        else {
+            ok = false;
+        }
+        if (!ok) {
+            printUsage();
+            return 1;
+        }
+    }
+    if (options.secret == "./secret") {
+        options.secret = std::filesystem::absolute(options.secret).string();
+    }
+    if (options.dir.empty()) {
+        options.dir = (std::filesystem::temp_directory_path() / ("secret-e2e-" + std::to_string(getpid()))).string();
+    }
+    options.dir = std::filesystem::absolute(options.dir).string();
+    std::string inDir = options.dir + "/in";
+    std::filesystem::create_directories(inDir);
+
+    if (options.netns && !setupNetns()) {
+        teardownNetns();
+        return 1;
+    }
+
+    std::vector<Result> results;
+    bool ok = true;
+    for (uint64_t size : options.sizes) {
+        for (uint64_t clients : options.clients) {
+            for (uint64_t i = 0; i < clients && ok; ++i) {
+                ok = makeInput(inDir + "/in-" + std::to_string(size) + "-" + std::to_string(i) + ".bin", size,
+                               size * 1000 + i);
+            }
+            for (uint64_t mtu : options.mtus) {
+                for (uint64_t run = 0; run < options.repeat && ok; ++run) {
+                    Result result;
+                    result.size = size;
+                    result.clients = clients;
+                    result.mtu = mtu;
+                    result.run = run;
+                    ok = runCase(options, inDir, result);
+                    if (!ok) {
+                        break;
+                    }
+                    results.push_back(result);
+                    std::cerr << "[E2E] size " << size << " clients " << clients << " mtu " << mtu << ": "
+                              << result.completed << "/" << clients << " ok, " << std::fixed << std::setprecision(1)
+                              << result.goodput / 1e6 << " MB/s, " << result.packetsPerSecond << " pkt/s, max "
+                              << std::setprecision(3) << result.latencyMax << " s" << std::endl;
+                }
+            }
+        }
+    }
+
+    if (options.netns) {
+        teardownNetns();
+    }
+    // Logs of a failed case are kept, otherwise only what the benchmark created is removed
+    if (!ok) {
+        return 1;
+    }
+    if (options.keep) {
+        std::cerr << "[E2E] Work directory kept in " << options.dir << std::endl;
+    }
+    else {
+        std::error_code ec;
+        std::filesystem::remove_all(inDir, ec);
+        std::filesystem::remove_all(options.dir + "/case", ec);
+        std::filesystem::remove(options.dir, ec);
+    }
+
+    if (options.out.empty()) {
+        writeJson(std::cout, options, results);
+        return 0;
+    }
+    std::ofstream file(options.out, std::ios::trunc);
+    writeJson(file, options, results);
+    if (!file) {
+        std::cerr << "Error: Cannot write " << options.out << std::endl;
+        return 1;
+    }
+    std::cerr << "[E2E] Results written to " << options.out << std::endl;
+    return 0;
+}
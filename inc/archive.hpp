@@ -0,0 +1,132 @@
+/**
+ * @file archive.hpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#ifndef ARCHIVE_HPP
+#define ARCHIVE_HPP
+
+#include <string>
+#include <vector>
+#include <set>
+#include <cstdint>
+#include "file_handler.hpp"
+
+/**
+ * @namespace archive
+ * @brief Packing of many files into one transfer and unpacking them on the server
+ * @note Layout: manifest (magic, entry count, then type, mode, mtime, size and path of every entry)
+ *       followed by contents of all files back to back, so small files share chunks
+ */
+namespace archive {
+    constexpr uint32_t MAGIC = 0x53415231;          ///< "SAR1"
+    constexpr size_t MAX_PATH_LEN = 4096;           ///< Longest accepted entry path
+    const std::string EXTENSION = ".sar";           ///< Suffix of received archives before unpacking
+    const std::string DEFAULT_NAME = "files";       ///< Archive name when more than one path is packed
+
+    /**
+     * @enum EntryType
+     * @brief Kind of manifest entry
+     */
+    enum EntryType : uint8_t {
+        ENTRY_FILE = 0,
+        ENTRY_DIRECTORY = 1
+    };
+
+    /**
+     * @struct Entry
+     * @brief One file or directory of the archive
+     */
+    struct Entry {
+        uint8_t type;               ///< EntryType
+        uint32_t mode;              ///< Permission bits
+        int64_t mtime;              ///< Modification time in nanoseconds
+        uint64_t size;              ///< Content size (0 for directories)
+        std::string path;           ///< Relative path with '/' separators
+        std::string source;         ///< Local path to read the content from (client only)
+    };
+
+    /**
+     * @class Packer
+     * @brief Streams manifest and file contents of the added paths, one file open at a time
+     */
+    class Packer : public file_handler::Source {
+    public:
+        Packer() = default;
+
+        /**
+         * @brief Destructor closes the file being read
+         */
+        ~Packer() override;
+
+        Packer(const Packer&) = delete;
+        Packer& operator=(const Packer&) = delete;
+        Packer(Packer&&) = delete;
+        Packer& operator=(Packer&&) = delete;
+
+        /**
+         * @brief Adds file, or directory with everything below it, under its own name
+         * @param path Path to the file or directory
+         * @return True if no issues, False if error occurred
+         * @note Symbolic links and special files are skipped
+         */
+        bool add(const std::string& path);
+
+        /**
+         * @brief Builds the manifest, no more paths can be added afterwards
+         * @return True if no issues, False if there is nothing to send
+         */
+        bool finish(void);
+
+        /**
+         * @brief Reads next piece of the archive
+         * @param data Output buffer (overwritten)
+         * @param maxLen Maximum number of bytes to read
+         * @return True if no issues (empty data at the end), False if a file could not be read or shrank
+         */
+        bool read(std::vector<uint8_t>& data, size_t maxLen) override;
+
+        /**
+         * @brief Getters for archive properties
+         */
+        uint64_t getSize() const override { return size; }
+        bool isStream() const override { return false; }
+        const std::vector<uint8_t>& getManifest() const { return manifest; }
+        size_t getEntryCount() const { return entries.size(); }
+        std::string getName() const { return roots.size() == 1 ? roots.front() : DEFAULT_NAME; }
+
+    private:
+        std::vector<Entry> entries;         ///< Added files and directories
+        std::set<std::string> paths;        ///< Entry paths (duplicate detection)
+        std::vector<std::string> roots;     ///< Names of the added paths
+        std::vector<uint8_t> manifest;      ///< Serialized manifest
+        uint64_t size = 0;                  ///< Manifest plus all contents
+        size_t manifestOffset = 0;          ///< Manifest bytes already read
+        size_t current = 0;                 ///< Entry whose content is read next
+        uint64_t left = 0;                  ///< Bytes of the current entry not read yet
+        int fd = -1;                        ///< Opened current file
+
+        /**
+         * @brief Appends entry, rejecting duplicate paths
+         * @param entry Entry to be added
+         * @return True if no issues, False if the path is already in the archive
+         */
+        bool addEntry(Entry&& entry);
+    };
+
+    /**
+     * @brief Checks that an entry path stays inside the destination directory
+     * @param path Entry path
+     * @return True if the path is relative and has no empty, "." or ".." components
+     */
+    bool isSafePath(const std::string& path);
+
+    /**
+     * @brief Recreates files and directories of a received archive
+     * @param archivePath Path to the archive
+     * @param destDir Directory to unpack into
+     * @return True if no issues, False if the archive is malformed or a file could not be written
+     */
+    bool extract(const std::string& archivePath, const std::string& destDir);
+}
+
+#endif // ARCHIVE_HPP
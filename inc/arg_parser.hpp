@@ -6,6 +6,12 @@
 #define ARG_PARSER_HPP
 
 #include <string>
+#include <map>
+#include <vector>
+#include <cstdint>
+#include "disk_writer.hpp"
+#include "impairment.hpp"
+#include "receiver.hpp"
 
 /**
  * @class ArgParser
@@ -36,15 +42,91 @@ public:
      * @brief Getters for better encapsulation and safety
      */
     bool isServer() const { return serverFlag; }
-    std::string getFilePath() const { return filePath; }
-    std::string getTargetAddress() const { return targetAddress; }
+    const std::vector<std::string>& getFilePaths() const { return filePaths; }
+    const std::vector<std::string>& getTargetAddresses() const { return targetAddresses; }
+    size_t getPathMTU() const { return pathMTU; }
+    bool isResume() const { return resumeFlag; }
+    bool isDelta() const { return deltaFlag; }
+    bool isCompress() const { return compressFlag; }
+    bool isMultipath() const { return multipathFlag; }
+    const std::string& getMetricsFile() const { return metricsFile; }
+    const std::string& getMetricsSocket() const { return metricsSocket; }
+    const std::string& getTraceFile() const { return traceFile; }
+    const std::string& getGenerateFile() const { return generateFile; }
+    const Impairment::Config& getImpairment() const { return impairment; }
+    std::string getSpoolDir() const { return spoolDir; }
+    size_t getMemoryLimit() const { return memoryLimit; }
+    unsigned getIdleTimeout() const { return idleTimeout; }
+    size_t getWorkers() const { return workers; }
+    unsigned getStatsInterval() const { return statsInterval; }
+    const std::map<uint64_t, unsigned>& getIdPriorities() const { return idPriorities; }
+    const std::map<std::string, unsigned>& getAddressPriorities() const { return addressPriorities; }
+    DiskWriter::Mode getIoMode() const { return ioMode; }
+    std::string getOutputPath() const { return outputPath; }
+    const std::string& getReplayFile() const { return replayFile; }
+    double getReplaySpeed() const { return replaySpeed; }
+    bool isSink() const { return sinkFlag; }
+    Receiver::Backend getReceiver() const { return receiver; }
+    const Receiver::Capture& getCapture() const { return capture; }
 
 private:
     size_t argc;                   ///< Argument count
     char** argv;                ///< Arguments
-    std::string filePath;       ///< Path to the file
-    std::string targetAddress;  ///< Target IP or hostname
+    std::vector<std::string> filePaths; ///< Files or directories to send
+    std::vector<std::string> targetAddresses; ///< Target IPs or hostnames
     bool serverFlag;            ///< Flag for server initialization
+    size_t pathMTU;             ///< Forced path MTU (0 = discover)
+    bool resumeFlag;            ///< Flag for resuming interrupted transfer (client)
+    bool deltaFlag;             ///< Flag for sending differences only (client)
+    bool compressFlag;          ///< Flag for compressing before encryption (client)
+    bool multipathFlag;         ///< Flag for striping over every address of a target (client)
+    std::string metricsFile;    ///< Stats file rewritten every second
+    std::string metricsSocket;  ///< Unix socket serving the metrics
+    std::string traceFile;      ///< Chrome trace of the pipeline stages
+    std::string generateFile;   ///< Savefile the client writes instead of sending, "null" = discard (client)
+    Impairment::Config impairment; ///< Emulated link in front of the sockets (client)
+    std::string spoolDir;       ///< Checkpoint directory (server)
+    size_t memoryLimit;         ///< Budget for buffered chunks in bytes, 0 = unlimited (server)
+    unsigned idleTimeout;       ///< Seconds before an idle transfer is evicted, 0 = never (server)
+    size_t workers;             ///< Decrypt/write threads, 0 = automatic (server)
+    unsigned statsInterval;     ///< Seconds between queue latency reports, 0 = never (server)
+    std::map<uint64_t, unsigned> idPriorities;          ///< Scheduling weights by client ID (server)
+    std::map<std::string, unsigned> addressPriorities;  ///< Scheduling weights by address (server)
+    DiskWriter::Mode ioMode;    ///< Page cache handling of received files (server)
+    std::string outputPath;     ///< Output of a single transfer, "-" = stdout (server)
+    std::string replayFile;     ///< Savefile fed to the server instead of live capture
+    double replaySpeed;         ///< Replay pace relative to the recording, 0 = as fast as possible
+    bool sinkFlag;              ///< Flag for discarding received files after decryption (server)
+    Receiver::Backend receiver; ///< Way the echo requests are received (server)
+    Receiver::Capture capture;  ///< Settings of the live capture (server)
+
+    /**
+     * @brief Parses comma separated key=value settings of the emulated link
+     * @param spec Impairment specification, e.g. loss=1%,burst=4,delay=20ms,rate=10mbit
+     * @return True if no issues, False if there was an error
+     */
+    bool parseImpairment(const std::string& spec);
+
+    /**
+     * @brief Parses comma separated key=value settings of the live capture
+     * @param spec Capture specification, e.g. dev=eth0,buffer=64,snaplen=9216,immediate=1
+     * @return True if no issues, False if there was an error
+     */
+    bool parseCapture(const std::string& spec);
+
+    /**
+     * @brief Parses <client-id|address>=<weight> into one of the priority maps
+     * @param spec Priority specification
+     * @return True if no issues, False if there was an error
+     */
+    bool parsePriority(const std::string& spec);
+
+    /**
+     * @brief Appends paths listed one per line in a file (or standard input) to filePaths
+     * @param listPath Path to the list, "-" for standard input
+     * @return True if no issues, False if there was an error
+     */
+    bool readFileList(const std::string& listPath);
 };
 
 #endif // ARG_PARSER_HPP
\ No newline at end of file
@@ -0,0 +1,102 @@
+/**
+ * @file bounded_queue.hpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#ifndef BOUNDED_QUEUE_HPP
+#define BOUNDED_QUEUE_HPP
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+/**
+ * @class BoundedQueue
+ * @brief Thread safe FIFO queue with a capacity, producers block while it is full (backpressure)
+ */
+template <typename T>
+class BoundedQueue {
+public:
+    /**
+     * @brief Constructor for BoundedQueue class
+     * @param capacity Maximum number of queued items
+     */
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+    BoundedQueue(BoundedQueue&&) = delete;
+    BoundedQueue& operator=(BoundedQueue&&) = delete;
+
+    /**
+     * @brief Appends item, waits while the queue is full
+     * @param item Item to be queued
+     * @return True if queued, False if the queue was closed
+     */
+    bool push(T&& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return items.size() < capacity || closed; });
+        if (closed) {
+            return false;
+        }
+
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief Takes the oldest item, waits until one arrives or the deadline passes
+     * @param item Taken item (overwritten)
+     * @param deadline Time to give up waiting
+     * @return True if an item was taken, False on timeout or if the queue is closed and empty
+     */
+    bool popUntil(T& item, std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait_until(lock, deadline, [this] { return !items.empty() || closed; });
+        if (items.empty()) {
+            return false;
+        }
+
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief Wakes every waiting thread, producers fail from now on, consumers drain the rest
+     */
+    void close(void) {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+    /**
+     * @brief Getters for queue state
+     */
+    bool isClosed() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return closed;
+    }
+    bool isFull() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return items.size() >= capacity;
+    }
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return items.size();
+    }
+
+private:
+    std::deque<T> items;                ///< Queued items
+    size_t capacity;                    ///< Maximum number of items
+    bool closed = false;                ///< No more items will be accepted
+    std::mutex mutex;                   ///< Mutex protecting the queue
+    std::condition_variable notEmpty;   ///< Signalled when an item is added or the queue closes
+    std::condition_variable notFull;    ///< Signalled when an item is taken or the queue closes
+};
+
+#endif // BOUNDED_QUEUE_HPP
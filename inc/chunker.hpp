@@ -29,6 +29,15 @@ namespace chunker {
      * @return Vector containing reassembled data
      */
     std::vector<uint8_t> reassembleData(ByteVector2D& chunkedData);
+
+    /**
+     * @brief Moves complete chunks from the front of a streaming buffer
+     * @param buffer Buffered data, remainder shorter than maxChunkSize stays inside
+     * @param maxChunkSize Max size of one chunk
+     * @param flush If true, the remainder is emitted as the last (shorter) chunk
+     * @return 2D vector containing chunked data
+     */
+    ByteVector2D takeChunks(std::vector<uint8_t>& buffer, size_t maxChunkSize, bool flush);
 }
 
 #endif // CHUNKER_HPP
\ No newline at end of file
@@ -5,68 +5,328 @@
 #ifndef CLIENT_HPP
 #define CLIENT_HPP
 
+#include <map>
+#include <list>
+#include <memory>
 #include <string>
+#include <vector>
 #include <protocol.hpp>
 #include <chrono>
-#include <random>
 #include "icmp_connection.hpp"
+#include "packet_sink.hpp"
+#include "impairment.hpp"
+#include "file_handler.hpp"
+#include "archive.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+/**
+ * @struct Path
+ * @brief One address of a receiver, chunks are striped over the paths by their observed throughput
+ */
+struct Path {
+    std::unique_ptr<ICMPConnection> connection;     ///< Socket connected to this address of the receiver
+    bool failed = false;                            ///< Sending over the path failed, it takes no more chunks
+    double rate = 0.0;                              ///< Observed link throughput in bytes per second (0 = unknown)
+    double credit = 0.0;                            ///< Weighted round robin counter
+    uint64_t windowBytes = 0;                       ///< Bytes sent since the window started
+    size_t windowQueued = 0;                        ///< Socket backlog when the window started
+    bool windowBacklogged = false;                  ///< Socket had packets waiting at every send of the window
+    std::chrono::steady_clock::time_point windowStart{}; ///< Start of the window (epoch = no window)
+    uint64_t packets = 0;                           ///< Packets sent
+    uint64_t bytes = 0;                             ///< Bytes sent (protocol packets, without ICMP and IP)
+
+    /**
+     * @brief Accounts one send, every RATE_INTERVAL the throughput estimate is updated
+     * @param size Packet size
+     * @param queued Socket backlog right after the send (ICMPConnection::getQueuedBytes)
+     * @note The link only shows its capacity while the socket has packets waiting for it. A window in which
+     *       the backlog emptied only proves a lower bound, the path is then asked for RATE_PROBE more.
+     */
+    void record(size_t size, size_t queued);
+};
+
+/**
+ * @struct Pending
+ * @brief Serialized packet waiting for room in the socket buffer of one destination
+ */
+struct Pending {
+    std::shared_ptr<const std::vector<uint8_t>> packet; ///< Packet bytes, shared by every destination
+    bool striped = false;                           ///< Data chunk that may take any path
+};
+
+/**
+ * @struct Destination
+ * @brief One receiver of the transfer, with its own socket, progress and chunks to (re)send
+ * @note Every destination drains its own backlog at the pace of its link. The client waits only while every
+ *       destination is full, a slower one skips chunks and gets them back after End like any lost chunk
+ *       (files only, a stream waits for the slowest destination).
+ */
+struct Destination {
+    std::vector<Path> paths;                        ///< Addresses of the receiver (one unless multipath)
+    ICMPConnection* connection = nullptr;           ///< First working path, carries control packets
+    bool active = false;                            ///< Takes part in the current pass over the input
+    bool partial = false;                           ///< Receiver has the metadata, only missing ranges are sent
+    std::vector<protocol::ChunkRange> missing;      ///< Chunks to send when partial (ascending)
+    size_t rangeIndex = 0;                          ///< First range of missing that may still match
+    bool done = false;                              ///< Receiver confirmed the file (or never answers)
+    bool confirmed = false;                         ///< Receiver confirmed the Merkle root
+    bool failed = false;                            ///< Receiver rejected the transfer or can not be reached
+    protocol::ResumeState reread;                   ///< Chunks no longer buffered (found = 0 if none)
+    int attempts = 0;                               ///< End packets sent without an answer
+    int repairs = 0;                                ///< Requests for missing chunks answered
+    std::chrono::steady_clock::time_point deadline; ///< Time to send End again
+    uint64_t packets = 0;                           ///< Packets sent
+    uint64_t bytes = 0;                             ///< Bytes sent (protocol packets, without ICMP and IP)
+    uint64_t resent = 0;                            ///< Chunks sent again on request
+    std::list<Pending> backlog;                     ///< Packets waiting for room in the socket buffers
+    size_t backlogBytes = 0;                        ///< Bytes of the backlog
+    bool lagging = false;                           ///< Backlog hit DESTINATION_BACKLOG, chunks are skipped until it halves
+    uint64_t deferred = 0;                          ///< Chunks skipped while lagging
+    std::chrono::steady_clock::time_point lastProgress; ///< Last send that left the backlog (or its start)
+
+    /**
+     * @brief Checks if the chunk goes to this receiver in the current pass
+     * @param chunkNum Index of the chunk
+     * @return True if the chunk should be sent
+     */
+    bool wants(uint64_t chunkNum);
+
+    /**
+     * @brief Picks path for the next chunk, each gets a share proportional to its throughput
+     * @return Working path (the first one while rates are unknown)
+     */
+    Path& nextPath(void);
+};
 
 /**
  * @class Client
- * @brief Manages, encrypts and transmits specified file to a server
+ * @brief Manages, encrypts and transmits specified file to one or more servers
  */
 class Client {
 public:
-    using PacketVector = std::vector<protocol::PacketPtr>;
-
     /**
      * @brief Constructor for Client class
-     * @param filePath Path to the file
-     * @param targetAddress Target ip or hostname
+     * @param filePaths Files or directories to send, "-" for standard input (single path only)
+     * @param targetAddresses Target ips or hostnames, the file is encrypted once and sent to all of them
      * @param xlogin Login for key derivation
-     * @param maxChunkSize Maximum chunk size
+     * @param pathMTU MTU of the path to the server (0 = discover by probing)
+     * @param resume Ask the server for an interrupted transfer of the same file first
+     * @param delta Send only the differences against the server's copy of the file
+     * @param compress Compress the content before encryption
+     * @param multipath Stripe chunks over every address each target resolves to
+     * @param metricsFile Stats file rewritten every second (empty = none)
+     * @param metricsSocket Unix socket serving the metrics (empty = none)
+     * @param traceFile Chrome trace of the stages written on SIGUSR1 and at exit (empty = none)
+     * @param generateFile Write the packets to this pcap savefile (PacketSink::NULL_SINK = discard) instead of sending them
+     * @param impairment Emulated link every packet passes before its socket (disabled config = none)
      */
-    Client(const std::string filePath, 
-           const std::string targetAddress,
-           const std::string xlogin = "xrepcim00", 
-           size_t maxChunkSize = 1440);
+    Client(const std::vector<std::string> filePaths,
+           const std::vector<std::string> targetAddresses,
+           const std::string xlogin = "xrepcim00",
+           size_t pathMTU = 0,
+           bool resume = false,
+           bool delta = false,
+           bool compress = false,
+           bool multipath = false,
+           const std::string metricsFile = "",
+           const std::string metricsSocket = "",
+           const std::string traceFile = "",
+           const std::string generateFile = "",
+           const Impairment::Config& impairment = Impairment::Config());
 
     /**
      * @brief Encapsulates all private sub-processes
      * @return True if no issues, False if there was an error
-     * @return True if no issues, False if there was an error
      */
     bool run(void);
 
 private:
-    const std::string filePath;         ///< Path to the file
-    const std::string targetAddress;    ///< Target IP or hostname
+    const std::vector<std::string> filePaths;   ///< Files or directories to send
+    const std::vector<std::string> targetAddresses; ///< Target IPs or hostnames
     const std::string xlogin;           ///< Login for key derivation
-    size_t maxChunkSize;                ///< Maximum chunk size
+    size_t pathMTU;                     ///< Path MTU (0 until discovered)
+    size_t maxChunkSize = 0;            ///< Maximum chunk size (derived from path MTU)
     uint32_t nextSeqNum = 0;            ///< Sequence number for packet creation
-    uint64_t id = 0;
+    bool resume;                        ///< Resume interrupted transfer if server has one
+    bool delta;                         ///< Send differences against the server's copy
+    bool compress;                      ///< Compress content before encryption
+    bool multipath;                     ///< Use every address of a target
+    uint64_t id = 0;                    ///< Transfer ID (derived from file identity)
+    std::map<uint64_t, protocol::Data> sentChunks; ///< Recently sent chunks the servers may ask for again
+    size_t sentBytes = 0;               ///< Payload bytes held by sentChunks
+    uint64_t lastChunk = 0;             ///< Number of chunks produced so far
+    bool rereadable = false;            ///< Current source can be read again (not a stream)
+    uint64_t statusReplies = 0;         ///< Chunk status packets received
+    std::unique_ptr<metrics::Exporter> exporter; ///< Metrics file and socket (null if disabled)
+    metrics::Rate byteRate;             ///< Bytes sent per second
+    trace::Pipeline pipeline{trace::CLIENT_STAGE_NAMES, trace::CLIENT_STAGES}; ///< Per-stage latency
+    std::unique_ptr<PacketSink> sink;   ///< Packet generator output (null = raw sockets)
+    std::vector<Destination> destinations; ///< Receivers of the transfer
+    std::unique_ptr<Impairment> impairment; ///< Emulated link, destroyed before the sockets it sends on (null = none)
 
     /**
-     * @brief Process file - read, encrypt, chunk and packet file
-     * @param packets Output vector containing all file related packets
+     * @brief Process file - read, encrypt, chunk and send it piece by piece to every active destination
+     * @param reader Opened file or archive
+     * @param name File name announced in metadata
+     * @param kind ContentKind announced in metadata
+     * @param codec Codec announced in metadata
+     * @param iv IV of the transfer (shared by all destinations, so they get the same ciphertext)
      * @return True if no issues, False if there was an error
+     * @note Memory use does not depend on the file size, CPU and disk use do not depend on the destination count
+     */
+    bool streamFile(file_handler::Source& reader, const std::string& name, uint8_t kind, uint8_t codec,
+                    const std::vector<uint8_t>& iv);
+
+    /**
+     * @brief Queues serialized packet for one destination and sends as much of its backlog as its sockets take
+     * @param destination Receiver
+     * @param packet Serialized packet
+     * @param striped Data chunk that may take any path (control packets take the first working one)
+     * @return True if no issues, False if the destination failed
+     */
+    bool sendTo(Destination& destination, std::shared_ptr<const std::vector<uint8_t>> packet, bool striped = false);
+
+    /**
+     * @brief Sends packets from the backlog of the destination until its sockets are full
+     * @param destination Receiver
+     * @return True if no issues, False if the destination failed
+     * @note A backlog that does not move for SEND_STALL_TIMEOUT fails the destination
+     */
+    bool flush(Destination& destination);
+
+    /**
+     * @brief Sends one packet without waiting, a failed send takes the destination out of the transfer
+     * @param destination Receiver
+     * @param packet Serialized packet
+     * @param striped Data chunk that may take any path with room
+     * @return SENT, FULL (every usable path is full) or FAILED
+     * @note A failed path is dropped and the packet goes over another one, only the last path fails the destination
+     */
+    ICMPConnection::SendResult transmit(Destination& destination, const std::vector<uint8_t>& packet, bool striped);
+
+    /**
+     * @brief Waits for room in the backlogs of the destinations of a chunk, draining them meanwhile
+     * @param wanting Destinations the chunk goes to
+     * @param any Wait until one of them has room (the rest lag), otherwise until all of them have
+     */
+    void waitForRoom(const std::vector<Destination*>& wanting, bool any);
+
+    /**
+     * @brief Sends chunk to every destination that wants it and keeps it for a possible retransmission
+     * @param data Chunk to be sent
+     * @return True if some destination is still active, False if all of them failed
+     */
+    bool sendChunk(protocol::Data&& data);
+
+    /**
+     * @brief Acts on a status reply of the server, resends the chunks it names
+     * @param destination Server that sent the reply
+     * @param status Server reply
+     */
+    void handleStatus(Destination& destination, const protocol::ChunkStatus& status);
+
+    /**
+     * @brief Handles status replies that already arrived, without waiting
+     * @return True if some destination is still active, False if all of them failed
+     */
+    bool pollStatus(void);
+
+    /**
+     * @brief Sends End and waits until every active destination confirms the Merkle root, repairing chunks it asks for
+     * @param end End packet of the transfer
+     * @note Destinations that never answer are counted as done, replies may be filtered on the way back
+     */
+    void awaitCompletion(const protocol::Packet& end);
+
+    /**
+     * @brief Asks the server which chunks of this transfer it is missing
+     * @param connection Instance of established connection to the server
+     * @param state Server answer
+     * @return True if the server answered, False on timeout
+     */
+    bool requestResume(ICMPConnection& connection, protocol::ResumeState& state);
+
+    /**
+     * @brief Asks every destination for its state and picks the IV and chunk size shared by the most of them
+     * @param fileSize Size of the file
+     * @param iv IV of the interrupted transfer (output, unchanged if nothing can be resumed)
+     * @note Destinations whose state fits only get their missing ranges, the rest get the whole file
      */
-    bool packageFile(PacketVector& packets);
+    void resumeDestinations(uint64_t fileSize, std::vector<uint8_t>& iv);
 
+    /**
+     * @brief Collects block signatures of the server's copy of the file, window by window
+     * @param connection Instance of established connection to the server
+     * @param name File name announced in metadata
+     * @param blocks Received signatures by block index (output)
+     * @param blockSize Block size of the server's copy (output)
+     * @param basisSize Size of the server's copy (output)
+     * @return True if the server has the file, False if not or it did not answer
+     * @note Windows that keep getting lost are given up on, their blocks are sent as literals
+     */
+    bool requestSignatures(ICMPConnection& connection, const std::string& name,
+                           std::map<uint64_t, protocol::BlockSignature>& blocks,
+                           uint32_t& blockSize, uint64_t& basisSize);
 
     /**
-     * @brief Serialize packets, consturct icmp ones, send them to the target
-     * @param packets Vector containing packets waiting to be sent
+     * @brief Serialize packet, consturct icmp one, send it to the target
+     * @param packet Packet waiting to be sent
      * @param connection Instance of established connection to the server
      * @return True if no issues, False if there was an error
      */
-    bool transmitPackets(PacketVector& packets, ICMPConnection& connection);
+    bool transmitPacket(const protocol::Packet& packet, ICMPConnection& connection);
+
+    /**
+     * @brief Connects to every target (every address of it with multipath) and derives chunk size from the smallest path MTU
+     * @return True if no issues, False if no target can carry any data
+     */
+    bool connectDestinations(void);
+
+    /**
+     * @brief Derives transfer ID from file identity, so a restarted client finds its transfer again
+     * @param reader Opened file
+     * @return Stable transfer ID (random for streams)
+     */
+    uint64_t deriveTransferId(const file_handler::FileReader& reader);
+
+    /**
+     * @brief Derives transfer ID of an archive from its manifest (paths, sizes and modification times)
+     * @param packer Finished archive
+     * @return Stable transfer ID
+     */
+    uint64_t deriveArchiveId(const archive::Packer& packer);
+
+    /**
+     * @brief Opens the single file or packs all paths into an archive
+     * @param name File name for metadata (output)
+     * @param kind ContentKind for metadata (output)
+     * @return Opened source, nullptr on error
+     */
+    std::unique_ptr<file_handler::Source> openSource(std::string& name, uint8_t& kind);
+
+    /**
+     * @brief Prints per-destination progress and outcome
+     */
+    void reportDestinations(void) const;
+
+    /**
+     * @brief Writes progress of the transfer, per destination and per path
+     * @param out Metrics text being built
+     */
+    void collectMetrics(metrics::Writer& out);
+
+    /**
+     * @brief Polls the exporter and writes the trace if SIGUSR1 asked for it
+     */
+    void pollObservers(void);
 
     /**
-     * @brief Generates random number for client
-     * @return Random client ID
+     * @brief Flushes the generator output and prints its packet and byte rates
+     * @param started Time the client started
+     * @return True if no issues, False if the savefile can not be written
      */
-    uint64_t generateId(void);
+    bool finishGenerator(std::chrono::steady_clock::time_point started);
 };
 
-#endif // CLIENT_HPP
\ No newline at end of file
+#endif // CLIENT_HPP
@@ -0,0 +1,133 @@
+/**
+ * @file compress.hpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#ifndef COMPRESS_HPP
+#define COMPRESS_HPP
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include "file_handler.hpp"
+
+/**
+ * @namespace compress
+ * @brief Block-wise LZ compression of the plaintext before it is encrypted
+ * @note Stream of frames: method (1 byte), raw length (32-bit), encoded length (32-bit) and encoded bytes.
+ *       Every block is compressed on its own, so frames decode as they arrive. LZ blocks are sequences of a
+ *       token (literal length and match length nibbles), literals, 16-bit offset and length extensions.
+ */
+namespace compress {
+    constexpr size_t BLOCK_SIZE = 64 * 1024;        ///< Raw bytes per frame (16-bit offsets reach the whole block)
+    constexpr size_t FRAME_HEADER_SIZE = 1 + 4 + 4; ///< Method, raw length and encoded length
+    constexpr double ENTROPY_LIMIT = 7.5;           ///< Bits per byte above which a block is not worth compressing
+
+    /**
+     * @enum Method
+     * @brief How a frame is encoded
+     */
+    enum Method : uint8_t {
+        METHOD_STORED = 0,  ///< Raw bytes (incompressible block)
+        METHOD_LZ = 1       ///< LZ sequences
+    };
+
+    /**
+     * @brief Estimates byte entropy of the block from an evenly spread sample
+     * @param data Block data
+     * @param len Block size
+     * @return True if the block is likely to shrink, False if it looks random (compressed, encrypted, media)
+     */
+    bool isCompressible(const uint8_t* data, size_t len);
+
+    /**
+     * @brief Compresses one block
+     * @param data Block data
+     * @param len Block size (at most BLOCK_SIZE)
+     * @param out Encoded block (overwritten)
+     */
+    void compressBlock(const uint8_t* data, size_t len, std::vector<uint8_t>& out);
+
+    /**
+     * @brief Decompresses one block
+     * @param data Encoded block
+     * @param len Encoded size
+     * @param out Output buffer, exactly rawLen bytes are written
+     * @param rawLen Raw size from the frame header
+     * @return True if no issues, False if the block is malformed
+     */
+    bool decompressBlock(const uint8_t* data, size_t len, uint8_t* out, size_t rawLen);
+
+    /**
+     * @class Compressor
+     * @brief Compresses the input of a transfer while it is being read
+     */
+    class Compressor : public file_handler::Source {
+    public:
+        /**
+         * @brief Constructor for Compressor class
+         * @param input File, archive or delta to be compressed
+         */
+        explicit Compressor(std::unique_ptr<file_handler::Source> input) : input(std::move(input)) {}
+
+        /**
+         * @brief Reads next piece of the compressed stream
+         * @param data Output buffer (overwritten)
+         * @param maxLen Maximum number of bytes to read
+         * @return True if no issues (empty data at the end), False if error occurred
+         */
+        bool read(std::vector<uint8_t>& data, size_t maxLen) override;
+
+        /**
+         * @brief Getters for compression properties, the stream length is known only at its end
+         */
+        uint64_t getSize() const override { return 0; }
+        bool isStream() const override { return true; }
+        uint64_t getRawBytes() const { return rawBytes; }
+        uint64_t getEncodedBytes() const { return encodedBytes; }
+        uint64_t getBlocks() const { return blocks; }
+        uint64_t getStoredBlocks() const { return storedBlocks; }
+
+    private:
+        std::unique_ptr<file_handler::Source> input;    ///< Uncompressed input
+        std::vector<uint8_t> out;                       ///< Produced frames not handed out yet
+        size_t outOffset = 0;                           ///< Bytes of out already handed out
+        bool eof = false;                               ///< Input is exhausted
+        uint64_t rawBytes = 0;                          ///< Input bytes compressed so far
+        uint64_t encodedBytes = 0;                      ///< Frame bytes produced so far
+        uint64_t blocks = 0;                            ///< Frames produced
+        uint64_t storedBlocks = 0;                      ///< Frames sent uncompressed
+
+        /**
+         * @brief Reads one block of the input and appends its frame
+         * @return True if no issues, False if error occurred
+         */
+        bool nextFrame(void);
+    };
+
+    /**
+     * @class Decompressor
+     * @brief Decodes frames of a compressed stream, pieces may split frames anywhere
+     */
+    class Decompressor {
+    public:
+        /**
+         * @brief Decodes every frame completed by the next piece of the stream
+         * @param data Next piece of the compressed stream
+         * @param len Number of bytes
+         * @param raw Decompressed bytes (overwritten, may be empty)
+         * @return True if no issues, False if a frame is malformed
+         */
+        bool update(const uint8_t* data, size_t len, std::vector<uint8_t>& raw);
+
+        /**
+         * @brief Checks that the stream did not end in the middle of a frame
+         * @return True if no issues, False if a frame is incomplete
+         */
+        bool finish(void) const { return pending.empty(); }
+
+    private:
+        std::vector<uint8_t> pending;   ///< Start of a frame whose rest did not arrive yet
+    };
+}
+
+#endif // COMPRESS_HPP
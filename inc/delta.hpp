@@ -0,0 +1,173 @@
+/**
+ * @file delta.hpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#ifndef DELTA_HPP
+#define DELTA_HPP
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include "protocol.hpp"
+#include "encoder.hpp"
+#include "file_handler.hpp"
+
+/**
+ * @namespace delta
+ * @brief rsync style delta transfer against the server's copy of a file
+ * @note The server advertises rolling and strong hashes of fixed size blocks of its copy, the client slides
+ *       a window over the new file and sends literal runs and references to matching blocks. Delta layout:
+ *       magic, block size and basis size, then literal (length, bytes) and copy (first block, count) operations,
+ *       closed by an end operation with the size and SHA-256 of the new file.
+ */
+namespace delta {
+    constexpr uint32_t MAGIC = 0x53444C31;          ///< "SDL1"
+    constexpr uint32_t MIN_BLOCK_SIZE = 2048;       ///< Smallest block (small files get many blocks)
+    constexpr uint32_t MAX_BLOCK_SIZE = 64 * 1024;  ///< Largest block (huge files get fewer signatures)
+    constexpr size_t SIGNATURE_WINDOW = 16;         ///< Signatures packets the server sends per request
+    constexpr size_t MAX_REPLY_PAYLOAD = 1500 - 40 - 8; ///< Reply sockets are not probed, Ethernet MTU fits IPv6 too
+    const std::string EXTENSION = ".delta";         ///< Suffix of received deltas before they are applied
+
+    /**
+     * @enum OpType
+     * @brief Operation of the delta stream
+     */
+    enum OpType : uint8_t {
+        OP_LITERAL = 0,     ///< Length (32-bit) and bytes of the new file
+        OP_COPY = 1,        ///< First block (64-bit) and number of consecutive blocks (32-bit) of the basis
+        OP_END = 2          ///< Size (64-bit) and SHA-256 (32 bytes) of the new file
+    };
+
+    /**
+     * @brief Picks block size for a basis file, about the square root of its size
+     * @param basisSize Size of the basis
+     * @return Block size in bytes
+     */
+    uint32_t chooseBlockSize(uint64_t basisSize);
+
+    /**
+     * @brief Computes rolling checksum of a block
+     * @param data Block data
+     * @param len Block size
+     * @return Checksum (low 16 bits plain sum, high 16 bits position weighted sum)
+     */
+    uint32_t weakHash(const uint8_t* data, size_t len);
+
+    /**
+     * @brief Computes strong hash of a block
+     * @param data Block data
+     * @param len Block size
+     * @return First 8 bytes of SHA-256
+     */
+    uint64_t strongHash(const uint8_t* data, size_t len);
+
+    /**
+     * @brief Number of block signatures that fit into one Signatures packet
+     * @param maxPayload Largest payload the path carries
+     * @return Signatures per packet (0 if not even one fits)
+     */
+    size_t signaturesPerPacket(size_t maxPayload);
+
+    /**
+     * @brief Computes signatures of full blocks of a file
+     * @param path Path to the basis file
+     * @param firstBlock First block to hash
+     * @param maxBlocks Maximum number of blocks to hash
+     * @param sig Signatures (found stays 0 if the file is missing)
+     * @return True if the file exists and could be read, False otherwise
+     */
+    bool computeSignatures(const std::string& path, uint64_t firstBlock, size_t maxBlocks, protocol::Signatures& sig);
+
+    /**
+     * @class Encoder
+     * @brief Turns the new file into a delta stream while it is being read
+     * @note Memory use is bounded by the read size and the longest literal run, not by the file size
+     */
+    class Encoder : public file_handler::Source {
+    public:
+        /**
+         * @brief Constructor for Encoder class
+         * @param input New file
+         * @param blockSize Block size of the signatures
+         * @param basisSize Size of the server's copy
+         * @param blocks Received signatures by block index (missing blocks are sent as literals)
+         */
+        Encoder(std::unique_ptr<file_handler::Source> input, uint32_t blockSize, uint64_t basisSize,
+                const std::map<uint64_t, protocol::BlockSignature>& blocks);
+
+        /**
+         * @brief Reads next piece of the delta stream
+         * @param data Output buffer (overwritten)
+         * @param maxLen Maximum number of bytes to read
+         * @return True if no issues (empty data at the end), False if error occurred
+         */
+        bool read(std::vector<uint8_t>& data, size_t maxLen) override;
+
+        /**
+         * @brief Getters for delta properties, the stream length is known only at its end
+         */
+        uint64_t getSize() const override { return 0; }
+        bool isStream() const override { return true; }
+        uint64_t getLiteralBytes() const { return literalBytes; }
+        uint64_t getCopiedBytes() const { return copiedBytes; }
+
+    private:
+        std::unique_ptr<file_handler::Source> input;    ///< New file
+        uint32_t blockSize;                             ///< Block size of the signatures
+        std::unordered_map<uint32_t, std::vector<std::pair<uint64_t, uint64_t>>> table; ///< Weak hash -> (strong hash, block)
+        std::vector<uint8_t> buf;                       ///< Read but not yet encoded part of the file
+        size_t pos = 0;                                 ///< Start of the current window in buf
+        size_t literalStart = 0;                        ///< Start of the pending literal run in buf
+        bool eof = false;                               ///< Input is exhausted
+        bool finished = false;                          ///< End operation was produced
+        bool rolling = false;                           ///< sumA and sumB describe the current window
+        uint32_t sumA = 0;                              ///< Rolling plain sum of the window
+        uint32_t sumB = 0;                              ///< Rolling weighted sum of the window
+        uint64_t copyFirst = 0;                         ///< First block of the pending copy
+        uint64_t copyCount = 0;                         ///< Blocks of the pending copy
+        std::vector<uint8_t> out;                       ///< Produced delta not handed out yet
+        size_t outOffset = 0;                           ///< Bytes of out already handed out
+        encoder::Sha256 hash;                           ///< Hash of the new file
+        uint64_t fileSize = 0;                          ///< Bytes of the new file read so far
+        uint64_t literalBytes = 0;                      ///< File bytes sent as literals
+        uint64_t copiedBytes = 0;                       ///< File bytes replaced by block references
+
+        /**
+         * @brief Encodes until target bytes of delta are ready or the file ends
+         * @param target Wanted amount of delta
+         * @return True if no issues, False if error occurred
+         */
+        bool produce(size_t target);
+
+        /**
+         * @brief Drops encoded data from buf and appends the next piece of the file
+         * @return True if no issues, False if error occurred
+         */
+        bool fill(void);
+
+        /**
+         * @brief Emits pending literal run up to end (and the pending copy before it)
+         * @param end End of the literal in buf
+         */
+        void flushLiteral(size_t end);
+
+        /**
+         * @brief Emits pending copy operation
+         */
+        void flushCopy(void);
+    };
+
+    /**
+     * @brief Rebuilds the new file from the basis and a received delta, replacing the basis atomically
+     * @param deltaPath Path to the delta stream
+     * @param basisPath Path to the server's copy the signatures were computed from
+     * @param outPath Path of the rebuilt file
+     * @return True if no issues, False if the delta is malformed, the basis changed or the hash does not match
+     */
+    bool apply(const std::string& deltaPath, const std::string& basisPath, const std::string& outPath);
+}
+
+#endif // DELTA_HPP
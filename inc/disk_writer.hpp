@@ -0,0 +1,192 @@
+/**
+ * @file disk_writer.hpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#ifndef DISK_WRITER_HPP
+#define DISK_WRITER_HPP
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
+#include <string>
+#include "trace.hpp"
+
+/**
+ * @class DiskWriter
+ * @brief Dedicated I/O thread writing queued ranges of output files at their offsets
+ * @note One thread serves every output file, contiguous writes to the same file are merged
+ *       into a single pwritev. Producers block while too much data is queued.
+ */
+class DiskWriter {
+public:
+    /**
+     * @enum Mode
+     * @brief How written data passes the page cache
+     */
+    enum class Mode {
+        BUFFERED,   ///< Plain page cache writes
+        DIRECT,     ///< O_DIRECT for the aligned part of the data, page cache only for unaligned edges
+        WRITEBACK   ///< Page cache, sync_file_range starts writeback early and written pages are dropped
+    };
+
+    /**
+     * @struct File
+     * @brief Output file registered with the writer, closed when the last reference goes away
+     */
+    struct File {
+        ~File();
+
+        std::string path;                   ///< Path of the file (for error messages)
+        int fd = -1;                        ///< Buffered descriptor
+        int directFd = -1;                  ///< O_DIRECT descriptor (DIRECT mode only)
+        size_t pending = 0;                 ///< Queued requests (guarded by the writer mutex)
+        std::atomic<bool> failed{false};    ///< Some write failed, the file is unusable
+        uint8_t* staging = nullptr;         ///< Aligned buffer for O_DIRECT writes
+        uint64_t stagingOffset = 0;         ///< File offset of the first staged byte
+        size_t stagingLen = 0;              ///< Staged bytes
+        uint64_t writebackStart = 0;        ///< Start of the window whose writeback was not started yet
+        bool sequential = false;            ///< Pipe or terminal, written with write() in offset order
+    };
+
+    /**
+     * @brief Constructor for DiskWriter class, starts the I/O thread
+     * @param mode Page cache handling
+     * @param maxQueuedBytes Queued bytes above which write() blocks
+     * @param pipeline Stage latencies of the server (nullptr = not measured)
+     */
+    explicit DiskWriter(Mode mode = Mode::BUFFERED, size_t maxQueuedBytes = 64 * 1024 * 1024,
+                        trace::Pipeline* pipeline = nullptr);
+
+    /**
+     * @brief Destructor for DiskWriter class, finishes queued writes and stops the I/O thread
+     */
+    ~DiskWriter();
+
+    DiskWriter(const DiskWriter&) = delete;
+    DiskWriter& operator=(const DiskWriter&) = delete;
+    DiskWriter(DiskWriter&&) = delete;
+    DiskWriter& operator=(DiskWriter&&) = delete;
+
+    /**
+     * @brief Registers opened file with the writer
+     * @param fd Descriptor opened for writing (owned by the returned file from now on)
+     * @param path Path of the file
+     * @param offset Offset of the first write
+     * @param sequential Descriptor can not seek (pipe, FIFO, terminal), offsets only order the writes
+     * @return Registered file
+     */
+    std::shared_ptr<File> open(int fd, const std::string& path, uint64_t offset, bool sequential = false);
+
+    /**
+     * @brief Queues data to be written at the offset, waits while the queue is full
+     * @param file Registered file
+     * @param offset Offset in the file
+     * @param data Data to be written
+     * @return True if queued, False if an earlier write of the file failed
+     */
+    bool write(const std::shared_ptr<File>& file, uint64_t offset, std::vector<uint8_t>&& data);
+
+    /**
+     * @brief Waits until every queued write of the file reached the operating system
+     * @param file Registered file
+     * @return True if no issues, False if some write failed
+     */
+    bool flush(const std::shared_ptr<File>& file);
+
+    /**
+     * @brief Writes the whole buffer at the offset, retrying short writes
+     * @param fd File descriptor
+     * @param data Data to be written
+     * @param len Number of bytes
+     * @param offset Offset in the file
+     * @return True if no issues, False if error occurred
+     */
+    static bool pwriteAll(int fd, const uint8_t* data, size_t len, uint64_t offset);
+
+    /**
+     * @brief Reads the whole buffer from the offset, retrying short reads
+     * @param fd File descriptor
+     * @param data Output buffer
+     * @param len Number of bytes
+     * @param offset Offset in the file
+     * @return True if no issues, False if error occurred or the file ends earlier
+     */
+    static bool preadAll(int fd, uint8_t* data, size_t len, uint64_t offset);
+
+    /**
+     * @brief Writes the whole buffer at the current position, retrying short writes
+     * @param fd File descriptor
+     * @param data Data to be written
+     * @param len Number of bytes
+     * @return True if no issues, False if error occurred
+     */
+    static bool writeAll(int fd, const uint8_t* data, size_t len);
+
+private:
+    /**
+     * @struct Request
+     * @brief Queued write (or flush marker) of one file
+     */
+    struct Request {
+        std::shared_ptr<File> file;         ///< Target file
+        uint64_t offset = 0;                ///< Offset in the file
+        std::vector<uint8_t> data;          ///< Data to be written
+        bool flush = false;                 ///< Write out everything staged for the file
+    };
+
+    Mode mode;                              ///< Page cache handling
+    size_t maxQueuedBytes;                  ///< Producers block above this
+    trace::Pipeline* pipeline;              ///< Stage latencies (null = not measured)
+    size_t queuedBytes = 0;                 ///< Bytes waiting in requests
+    std::deque<Request> requests;           ///< Requests for the I/O thread
+    bool stopping = false;                  ///< Destructor was called
+    std::mutex mutex;                       ///< Mutex protecting the fields above and File::pending
+    std::condition_variable requestCV;      ///< Signalled when a request is queued
+    std::condition_variable doneCV;         ///< Signalled when requests are finished
+    std::thread thread;                     ///< I/O thread
+
+    /**
+     * @brief Main loop of the I/O thread, takes all queued requests at once
+     */
+    void ioLoop(void);
+
+    /**
+     * @brief Writes contiguous requests of one file
+     * @param batch Taken requests
+     * @param begin First request of the range
+     * @param end One past the last request of the range
+     */
+    void writeRange(std::vector<Request>& batch, size_t begin, size_t end);
+
+    /**
+     * @brief Appends data to the O_DIRECT staging buffer, writing it out when it fills up
+     * @param file Target file
+     * @param offset Offset of the data
+     * @param data Data to be written
+     * @param len Number of bytes
+     * @return True if no issues, False if error occurred
+     */
+    bool stageDirect(File& file, uint64_t offset, const uint8_t* data, size_t len);
+
+    /**
+     * @brief Writes staged data, aligned blocks with O_DIRECT and unaligned edges through the page cache
+     * @param file Target file
+     * @param all Also write the unaligned tail (otherwise it stays staged)
+     * @return True if no issues, False if error occurred
+     */
+    bool drainDirect(File& file, bool all);
+
+    /**
+     * @brief Starts writeback of full windows and drops pages of windows already written
+     * @param file Target file
+     * @param end Offset just past the last written byte
+     */
+    void startWriteback(File& file, uint64_t end);
+};
+
+#endif // DISK_WRITER_HPP
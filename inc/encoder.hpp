@@ -7,12 +7,18 @@
 
 #include <vector>
 #include <string>
+#include <cstdint>
+#include <cstddef>
+#include <openssl/evp.h>
 
 /**
  * @namespace encoder
  * @brief Namespace for encoding and decoding data
  */
 namespace encoder {
+    constexpr size_t BLOCK_SIZE = 16;   ///< AES block size
+    constexpr size_t HASH_SIZE = 32;    ///< SHA-256 digest size
+
     /**
      * @brief Encrypts data using key and stores cipher inside cipherData
      * @param data Bytes to be encrypted
@@ -51,6 +57,243 @@ namespace encoder {
      * @return Generated IV
      */
     std::vector<uint8_t> generateIV(void);
+
+    /**
+     * @brief Derives stable 64-bit identifier from arbitrary text (first 8 bytes of SHA-256)
+     * @param identity Text identifying the object
+     * @return Derived identifier
+     */
+    uint64_t deriveId(const std::string& identity);
+
+    /**
+     * @brief Computes size of AES-256-CBC ciphertext (with PKCS#7 padding)
+     * @param plainSize Size of the plaintext
+     * @return Size of the ciphertext
+     */
+    uint64_t cipherSize(uint64_t plainSize);
+
+    /**
+     * @brief Derives key for chunk tags from the AES key, so tags never reuse the encryption key itself
+     * @param key AES key
+     * @return 256-bit tag key, empty if error occurred
+     */
+    std::vector<uint8_t> deriveTagKey(const std::vector<uint8_t>& key);
+
+    /**
+     * @brief Computes tag of one chunk (first 8 bytes of HMAC-SHA256 over transfer ID, chunk number and payload)
+     * @param tagKey Key from deriveTagKey
+     * @param id Transfer ID
+     * @param chunkNum Index of the chunk
+     * @param data Encrypted payload of the chunk
+     * @param len Payload size
+     * @return Tag of the chunk
+     */
+    uint64_t chunkTag(const std::vector<uint8_t>& tagKey, uint64_t id, uint64_t chunkNum,
+                      const uint8_t* data, size_t len);
+
+    /**
+     * @class Sha256
+     * @brief Incremental SHA-256 of data that does not fit into memory at once
+     */
+    class Sha256 {
+    public:
+        /**
+         * @brief Constructor for Sha256 class
+         */
+        Sha256();
+
+        /**
+         * @brief Destructor for Sha256 class (frees digest context)
+         */
+        ~Sha256();
+
+        Sha256(const Sha256&) = delete;
+        Sha256& operator=(const Sha256&) = delete;
+        Sha256(Sha256&&) = delete;
+        Sha256& operator=(Sha256&&) = delete;
+
+        /**
+         * @brief Hashes next part of the data
+         * @param data Bytes to be hashed
+         * @param len Number of bytes
+         * @return True if no issues, False if error occurred
+         */
+        bool update(const uint8_t* data, size_t len);
+
+        /**
+         * @brief Finishes the hash
+         * @return 32 byte digest, empty if error occurred
+         */
+        std::vector<uint8_t> finish(void);
+
+        /**
+         * @brief Checks if the digest context was initialized
+         */
+        bool isValid() const { return ctx != nullptr; }
+
+    private:
+        EVP_MD_CTX* ctx;        ///< OpenSSL digest context
+    };
+
+    /**
+     * @class MerkleTree
+     * @brief Merkle root of a sequence of leaves, built as they come with one pending hash per tree level
+     * @note Leaf is SHA-256 of 0x00 and the data, inner node SHA-256 of 0x01 and both children.
+     *       A lone right edge node is carried up unchanged.
+     */
+    class MerkleTree {
+    public:
+        /**
+         * @brief Constructor for MerkleTree class
+         */
+        MerkleTree();
+
+        /**
+         * @brief Destructor for MerkleTree class (frees digest context)
+         */
+        ~MerkleTree();
+
+        MerkleTree(const MerkleTree&) = delete;
+        MerkleTree& operator=(const MerkleTree&) = delete;
+        MerkleTree(MerkleTree&&) = delete;
+        MerkleTree& operator=(MerkleTree&&) = delete;
+
+        /**
+         * @brief Appends next leaf
+         * @param data Leaf data
+         * @param len Number of bytes
+         * @return True if no issues, False if error occurred
+         */
+        bool addLeaf(const uint8_t* data, size_t len);
+
+        /**
+         * @brief Folds pending subtrees into the root, the tree can keep growing afterwards
+         * @return 32 byte root, empty if there are no leaves or error occurred
+         */
+        std::vector<uint8_t> root(void);
+
+        /**
+         * @brief Appends pending subtrees to a checkpoint
+         * @param out Output buffer (appended)
+         */
+        void saveState(std::vector<uint8_t>& out) const;
+
+        /**
+         * @brief Replaces the tree with pending subtrees read from a checkpoint
+         * @param data Checkpoint data
+         * @param len Length of data
+         * @param offset Position in data (advanced)
+         * @return True if no issues, False if the state is malformed
+         */
+        bool loadState(const uint8_t* data, size_t len, size_t& offset);
+
+        /**
+         * @brief Checks if the digest context was initialized
+         */
+        bool isValid() const { return ctx != nullptr; }
+
+    private:
+        EVP_MD_CTX* ctx;                                            ///< OpenSSL digest context
+        std::vector<std::pair<uint8_t, std::vector<uint8_t>>> levels; ///< Pending subtrees (height, hash), tallest first
+
+        /**
+         * @brief Hashes prefix byte followed by two pieces of data
+         */
+        bool digest(uint8_t prefix, const uint8_t* a, size_t aLen, const uint8_t* b, size_t bLen,
+                    std::vector<uint8_t>& out);
+    };
+
+    /**
+     * @class Encryptor
+     * @brief Incremental AES-256-CBC encryption for data that does not fit into memory at once
+     */
+    class Encryptor {
+    public:
+        /**
+         * @brief Constructor for Encryptor class
+         * @param key AES key
+         * @param iv Random bytes
+         */
+        Encryptor(const std::vector<uint8_t>& key, const std::vector<uint8_t>& iv);
+
+        /**
+         * @brief Destructor for Encryptor class (frees cipher context)
+         */
+        ~Encryptor();
+
+        Encryptor(const Encryptor&) = delete;
+        Encryptor& operator=(const Encryptor&) = delete;
+        Encryptor(Encryptor&&) = delete;
+        Encryptor& operator=(Encryptor&&) = delete;
+
+        /**
+         * @brief Encrypts next part of the plaintext and appends cipher to cipherData
+         * @param data Bytes to be encrypted
+         * @param len Number of bytes
+         * @param cipherData Output buffer (appended)
+         * @return True if no issues, False if error occurred
+         */
+        bool update(const uint8_t* data, size_t len, std::vector<uint8_t>& cipherData);
+
+        /**
+         * @brief Appends padded last block to cipherData
+         * @param cipherData Output buffer (appended)
+         * @return True if no issues, False if error occurred
+         */
+        bool finalize(std::vector<uint8_t>& cipherData);
+
+        /**
+         * @brief Checks if the cipher context was initialized
+         */
+        bool isValid() const { return ctx != nullptr; }
+
+    private:
+        EVP_CIPHER_CTX* ctx;    ///< OpenSSL cipher context
+    };
+
+    /**
+     * @class Decryptor
+     * @brief Incremental AES-256-CBC decryption of block aligned pieces of ciphertext
+     * @note Padding is removed manually from the last piece, so every other piece
+     *       decrypts to exactly as many bytes as it had
+     */
+    class Decryptor {
+    public:
+        /**
+         * @brief Constructor for Decryptor class
+         * @param key AES key
+         * @param iv Random bytes (or last cipher block when continuing a stream)
+         */
+        Decryptor(const std::vector<uint8_t>& key, const std::vector<uint8_t>& iv);
+
+        /**
+         * @brief Destructor for Decryptor class (frees cipher context)
+         */
+        ~Decryptor();
+
+        Decryptor(const Decryptor&) = delete;
+        Decryptor& operator=(const Decryptor&) = delete;
+        Decryptor(Decryptor&&) = delete;
+        Decryptor& operator=(Decryptor&&) = delete;
+
+        /**
+         * @brief Decrypts next piece of the ciphertext
+         * @param cipherData Encrypted bytes (multiple of BLOCK_SIZE)
+         * @param len Number of bytes
+         * @param data Output buffer (overwritten)
+         * @param last True for the last piece of the stream (padding gets stripped)
+         * @return True if no issues, False if error occurred
+         */
+        bool update(const uint8_t* cipherData, size_t len, std::vector<uint8_t>& data, bool last);
+
+        /**
+         * @brief Checks if the cipher context was initialized
+         */
+        bool isValid() const { return ctx != nullptr; }
+
+    private:
+        EVP_CIPHER_CTX* ctx;    ///< OpenSSL cipher context
+    };
 }
 
 #endif // ENCODER_HPP
\ No newline at end of file
@@ -0,0 +1,152 @@
+/**
+ * @file fair_queue.hpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#ifndef FAIR_QUEUE_HPP
+#define FAIR_QUEUE_HPP
+
+#include <deque>
+#include <unordered_map>
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @class FairQueue
+ * @brief Per-flow FIFO queues served by deficit round-robin (DRR)
+ * @note Every visit adds quantum * weight bytes of credit to a flow, a flow sends packets while
+ *       its credit covers them, so flows share the output in proportion to their weights
+ *       regardless of how many packets each of them has queued. A flow may hold a limited number
+ *       of bytes, items beyond the limit are refused so one flow cannot take all the memory. Not thread safe.
+ */
+template <typename T>
+class FairQueue {
+public:
+    /**
+     * @brief Constructor for FairQueue class
+     * @param quantum Credit in bytes a flow of weight 1 gets per round
+     * @param flowLimit Bytes one flow may have queued (0 = unlimited)
+     */
+    explicit FairQueue(size_t quantum, size_t flowLimit = 0) : quantum(quantum), flowLimit(flowLimit) {}
+
+    /**
+     * @brief Appends item to the queue of its flow
+     * @param flow Flow key
+     * @param cost Size of the item in bytes
+     * @param weight Share of the flow (used when the flow becomes active)
+     * @param item Item to be queued
+     * @return True if the item was queued, False if the flow is over its limit (the item is left untouched)
+     */
+    bool push(uint64_t flow, size_t cost, unsigned weight, T&& item) {
+        auto [it, created] = flows.try_emplace(flow);
+        if (created) {
+            it->second.weight = weight == 0 ? 1 : weight;
+            active.push_back(flow);
+        }
+        // Empty flow always takes one item, even one larger than the limit
+        else if (flowLimit != 0 && it->second.bytes + cost > flowLimit) {
+            return false;
+        }
+        it->second.items.emplace_back(cost, std::move(item));
+        it->second.bytes += cost;
+        bytes += cost;
+        ++count;
+        return true;
+    }
+
+    /**
+     * @brief Takes the next item in DRR order
+     * @param item Taken item (overwritten)
+     * @param accept Predicate on the flow key, flows it rejects are skipped this round
+     * @return True if an item was taken, False if the queue is empty or every flow was rejected
+     */
+    template <typename Accept>
+    bool pop(T& item, Accept accept) {
+        size_t rejected = 0;
+        while (!active.empty() && rejected < active.size()) {
+            uint64_t key = active.front();
+            Flow& flow = flows[key];
+
+            if (!accept(key)) {
+                ++rejected;
+                next();
+                continue;
+            }
+
+            if (!credited) {
+                flow.deficit += quantum * flow.weight;
+                credited = true;
+            }
+
+            auto& head = flow.items.front();
+            if (head.first > flow.deficit) {
+                // Credit stays, the flow gets more next round
+                next();
+                continue;
+            }
+
+            flow.deficit -= head.first;
+            flow.bytes -= head.first;
+            bytes -= head.first;
+            item = std::move(head.second);
+            flow.items.pop_front();
+            --count;
+
+            // Idle flows keep no credit, otherwise they could burst later
+            if (flow.items.empty()) {
+                flows.erase(key);
+                active.pop_front();
+                credited = false;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief Lists queued items per flow
+     * @return Pairs of flow key and queue depth
+     */
+    std::vector<std::pair<uint64_t, size_t>> depths() const {
+        std::vector<std::pair<uint64_t, size_t>> result;
+        for (const auto& [key, flow] : flows) {
+            result.emplace_back(key, flow.items.size());
+        }
+        return result;
+    }
+
+    /**
+     * @brief Getters for queue state
+     */
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+    size_t byteSize() const { return bytes; }
+
+private:
+    struct Flow {
+        std::deque<std::pair<size_t, T>> items; ///< Queued items with their cost
+        size_t deficit = 0;                     ///< Unused credit in bytes
+        size_t bytes = 0;                       ///< Cost of the queued items
+        unsigned weight = 1;                    ///< Share of the flow
+    };
+
+    std::unordered_map<uint64_t, Flow> flows;   ///< Flows with queued items
+    std::deque<uint64_t> active;                ///< Round-robin order, front is being served
+    size_t quantum;                             ///< Credit per round for weight 1
+    size_t flowLimit;                           ///< Bytes one flow may have queued (0 = unlimited)
+    size_t count = 0;                           ///< Total queued items
+    size_t bytes = 0;                           ///< Total cost of the queued items
+    bool credited = false;                      ///< Front flow already got its credit this round
+
+    /**
+     * @brief Moves the front flow to the end of the round
+     */
+    void next(void) {
+        active.push_back(active.front());
+        active.pop_front();
+        credited = false;
+    }
+};
+
+#endif // FAIR_QUEUE_HPP
@@ -4,6 +4,10 @@
 
 #include <string>
 #include <vector>
+#include <fstream>
+#include <memory>
+#include <cstdint>
+#include "disk_writer.hpp"
 
 /**
  * @namespace file_handler
@@ -32,6 +36,175 @@ namespace file_handler {
      * @return Name of the file
      */
     std::string getNameFromPath(const std::string& path);
+
+    const std::string STDIO_PATH = "-";             ///< Path meaning standard input (reader) or output (writer)
+
+    /**
+     * @class Source
+     * @brief Sequential input of a transfer (single file or archive of many)
+     */
+    class Source {
+    public:
+        virtual ~Source() = default;
+
+        /**
+         * @brief Reads next piece of the input
+         * @param data Output buffer (overwritten)
+         * @param maxLen Maximum number of bytes to read
+         * @return True if no issues (empty data at the end of input), False if error occurred
+         */
+        virtual bool read(std::vector<uint8_t>& data, size_t maxLen) = 0;
+
+        /**
+         * @brief Getters for input properties
+         */
+        virtual uint64_t getSize() const = 0;
+        virtual bool isStream() const = 0;
+    };
+
+    /**
+     * @class FileReader
+     * @brief Reads file or stream piece by piece, so its size is not limited by memory
+     */
+    class FileReader : public Source {
+    public:
+        FileReader() = default;
+
+        /**
+         * @brief Destructor closes the file (standard input stays open)
+         */
+        ~FileReader() override;
+
+        FileReader(const FileReader&) = delete;
+        FileReader& operator=(const FileReader&) = delete;
+        FileReader(FileReader&&) = delete;
+        FileReader& operator=(FileReader&&) = delete;
+
+        /**
+         * @brief Opens the file and determines its size
+         * @param path Path to the file, STDIO_PATH for standard input
+         * @return True if no issues, False if error occurred
+         */
+        bool open(const std::string& path);
+
+        /**
+         * @brief Reads next piece of the file
+         * @param data Output buffer (overwritten)
+         * @param maxLen Maximum number of bytes to read
+         * @return True if no issues (empty data at the end of file), False if error occurred
+         * @note Reads from a stream may return less than maxLen before it ends
+         */
+        bool read(std::vector<uint8_t>& data, size_t maxLen) override;
+
+        /**
+         * @brief Getters for file properties
+         */
+        uint64_t getSize() const override { return size; }
+        int64_t getModificationTime() const { return mtime; }
+        bool isStream() const override { return stream; }
+
+    private:
+        int fd = -1;            ///< Opened file
+        std::string path;       ///< Path to the file (for error messages)
+        bool stream = false;    ///< Not a regular file, size is unknown
+        uint64_t size = 0;      ///< Size of the file
+        int64_t mtime = 0;      ///< Last modification time (ns since epoch)
+    };
+
+    /**
+     * @class FileWriter
+     * @brief Writes data at increasing offsets of a temporary file which is renamed to its final name once complete
+     * @note With a DiskWriter the writes are queued to its I/O thread, otherwise they are done right away
+     */
+    class FileWriter {
+    public:
+        /**
+         * @brief Constructor for FileWriter class
+         * @param writer I/O thread to queue writes to (nullptr = write synchronously)
+         */
+        explicit FileWriter(DiskWriter* writer = nullptr) : writer(writer) {}
+
+        /**
+         * @brief Destructor removes the temporary file if it was not committed
+         */
+        ~FileWriter();
+
+        FileWriter(const FileWriter&) = delete;
+        FileWriter& operator=(const FileWriter&) = delete;
+        FileWriter(FileWriter&&) = delete;
+        FileWriter& operator=(FileWriter&&) = delete;
+
+        /**
+         * @brief Opens (truncates) temporary file next to the final path and preallocates it
+         * @param path Final path of the file
+         * @param expectedSize Final size of the file (0 = unknown, no preallocation)
+         * @return True if no issues, False if error occurred
+         */
+        bool open(const std::string& path, uint64_t expectedSize = 0);
+
+        /**
+         * @brief Opens output written directly in place, without a temporary file (standard output, FIFO, device)
+         * @param path Path of the output, STDIO_PATH for standard output
+         * @return True if no issues, False if error occurred
+         * @note Opening a FIFO waits until it has a reader
+         */
+        bool openStream(const std::string& path);
+
+        /**
+         * @brief Writes data right after the previously written data
+         * @param data Content to be written (moved to the I/O thread)
+         * @return True if no issues, False if error occurred
+         */
+        bool write(std::vector<uint8_t>&& data);
+
+        /**
+         * @brief Reopens temporary file of an interrupted transfer and cuts it to size
+         * @param path Final path of the file
+         * @param size Number of valid bytes in the temporary file
+         * @param expectedSize Final size of the file (0 = unknown, no preallocation)
+         * @return True if no issues, False if error occurred
+         */
+        bool resume(const std::string& path, uint64_t size, uint64_t expectedSize = 0);
+
+        /**
+         * @brief Waits until written data reached the operating system
+         * @return True if no issues, False if error occurred
+         */
+        bool flush(void);
+
+        /**
+         * @brief Flushes, closes and renames the file to its final path (stream output is only closed)
+         * @return True if no issues, False if error occurred
+         */
+        bool commit(void);
+
+        /**
+         * @brief Closes and removes the temporary file (stream output is only closed)
+         */
+        void discard(void);
+
+        /**
+         * @brief Closes the temporary file but keeps it for a later resume
+         * @return True if no issues, False if error occurred
+         */
+        bool close(void);
+
+    private:
+        DiskWriter* writer;                         ///< I/O thread (nullptr = synchronous writes)
+        std::shared_ptr<DiskWriter::File> file;     ///< Opened temporary file
+        std::string path;                           ///< Final path
+        std::string tempPath;                       ///< Path of the temporary file
+        uint64_t offset = 0;                        ///< Offset of the next write
+        bool stream = false;                        ///< Output opened by openStream()
+
+        /**
+         * @brief Opens temporary file and reserves disk space for the whole file
+         * @param flags Extra open flags
+         * @param expectedSize Final size of the file (0 = unknown)
+         * @return True if no issues, False if error occurred
+         */
+        bool openTemp(int flags, uint64_t expectedSize);
+    };
 }
 
 #endif // FILE_HANDLER_HPP
\ No newline at end of file
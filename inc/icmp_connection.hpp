@@ -11,6 +11,15 @@
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
 #include <cstdint>
+#include <vector>
+
+class PacketSink;
+class Impairment;
+
+constexpr size_t MIN_IPV4_MTU = 576;     ///< Smallest MTU every IPv4 host must accept
+constexpr size_t MIN_IPV6_MTU = 1280;    ///< Smallest MTU every IPv6 link must support
+constexpr size_t DEFAULT_MTU = 1500;     ///< Ethernet MTU, used when the path can not be probed
+constexpr size_t MAX_PROBE_MTU = 9000;   ///< Jumbo frame MTU, upper bound for probing
 
 /**
  * @class ICMPConnection
@@ -18,11 +27,24 @@
  */
 class ICMPConnection {
 public:
+    /**
+     * @enum SendResult
+     * @brief Outcome of a send that does not wait for room in the send buffer
+     */
+    enum class SendResult {
+        SENT,       ///< Packet is on its way
+        FULL,       ///< Send buffer is full, nothing was sent (try again once the socket is writable)
+        FAILED      ///< Send failed for good
+    };
+
     /**
      * @brief Constructor for ICMPConnection class
      * @param targetAddress IP/hostname of the server
+     * @param sink Packet generator output used instead of a raw socket (null = send for real)
+     * @param impairment Emulated link the packets of sendPacket pass first (null = none)
+     * @note With a sink nothing is received and path MTU is not probed, replies never come
      */
-    ICMPConnection(const std::string& targetAddress);
+    ICMPConnection(const std::string& targetAddress, PacketSink* sink = nullptr, Impairment* impairment = nullptr);
 
     /**
      * @brief Desrtructor for ICMPConnection class (closes ocket)
@@ -49,8 +71,80 @@ public:
      * @param payload Data to be sent
      * @param payloadSize Size of the data that is supposed to be sent
      * @return True if no issues, False if there was an error
+     * @note Through an impairment the packet only enters the link, errors of the late send are counted there
      */
     bool sendPacket(const uint8_t* payload, size_t payloadSize);
+
+    /**
+     * @brief Send ICMP Packet to the target address unless the send buffer is full
+     * @param payload Data to be sent
+     * @param payloadSize Size of the data that is supposed to be sent
+     * @return SENT, FULL or FAILED
+     * @note Lets one caller feed several sockets, a slow link only holds up its own packets
+     */
+    SendResult trySendPacket(const uint8_t* payload, size_t payloadSize);
+
+    /**
+     * @brief Send ICMP Echo Reply to the target address (server to client messages)
+     * @param payload Data to be sent
+     * @param payloadSize Size of the data that is supposed to be sent
+     * @return True if no issues, False if there was an error
+     */
+    bool sendReply(const uint8_t* payload, size_t payloadSize);
+
+    /**
+     * @brief Drops replies carrying the given packet type in the kernel, before they take up the receive buffer
+     * @param packetType protocol::PacketType to be dropped
+     * @return True if no issues, False if the filter could not be attached
+     * @note Target kernel echoes every request, so a client sending chunks would otherwise queue a copy of each
+     */
+    bool ignoreEchoedType(uint8_t packetType);
+
+    /**
+     * @brief Drops everything arriving on the socket in the kernel, for sockets that only send
+     * @return True if no issues, False if the filter could not be attached
+     * @note Raw sockets get a copy of every ICMP message from the target, unread they would sit in the buffer
+     */
+    bool ignoreIncoming(void);
+
+    /**
+     * @brief Receives payload of the next ICMP Echo Reply from the target
+     * @param payload Received data (without IP and ICMP headers)
+     * @param timeoutMs Time to wait in milliseconds (0 = only replies that are already queued)
+     * @return True if a reply arrived, False on timeout or error
+     * @note Kernel answers to our own requests are returned as well, caller filters them
+     */
+    bool receivePacket(std::vector<uint8_t>& payload, int timeoutMs);
+
+    /**
+     * @brief Discovers path MTU by binary searching with DF-flagged echo requests
+     * @param maxMTU Upper bound of the search
+     * @return Largest MTU that got an echo reply (DEFAULT_MTU if the target never answers)
+     * @note Lower bound comes from kernel (EMSGSIZE, IP_MTU after ICMP "fragmentation needed")
+     */
+    size_t discoverPathMTU(size_t maxMTU = MAX_PROBE_MTU);
+
+    /**
+     * @brief Overrides path MTU (skips discovery)
+     * @param mtu MTU of the path to the target
+     */
+    void setPathMTU(size_t mtu) { pathMTU = mtu; }
+
+    /**
+     * @brief Getters for path properties
+     */
+    size_t getPathMTU() const { return pathMTU; }
+    const std::string& getTargetAddress() const { return targetAddress; }
+    int getDescriptor() const { return sockfd; }
+
+    /**
+     * @brief Reads how much the socket has waiting for the link (SIOCOUTQ)
+     * @return Bytes of the socket's send buffer in use, including kernel overhead (0 on error)
+     */
+    size_t getQueuedBytes() const;
+    size_t getMaxPayloadSize() const;
+    size_t getIPHeaderSize() const;
+
 private:
     const std::string targetAddress;    ///< IP/hostname of the server
     int sockfd;                         ///< Socket
@@ -58,6 +152,63 @@ private:
     struct sockaddr_in addr4;           ///< IPv4 address
     struct sockaddr_in6 addr6;          ///< IPv6 address
     struct sockaddr_in6 srcAddr6;       ///< Source IPv6 address (for checksum)
+    size_t pathMTU;                     ///< MTU used for sizing packets
+    uint16_t echoId;                    ///< ICMP echo identifier
+    uint16_t sequence;                  ///< ICMP echo sequence number (16-bit field, wraps; ordering uses chunk numbers)
+    std::vector<uint8_t> receiveBuffer; ///< Buffer for received packets (allocated on first receive)
+    PacketSink* sink;                   ///< Generator output replacing the socket (null = none)
+    Impairment* impairment;             ///< Emulated link in front of the socket (null = none)
+    struct sockaddr_storage sinkSource; ///< Source address written into generated packets
+    struct sockaddr_storage sinkTarget; ///< Destination address written into generated packets
+
+    /**
+     * @brief Builds ICMP Echo Request/Reply around payload and sends it
+     * @param payload Data to be sent
+     * @param payloadSize Size of the data
+     * @param seq ICMP sequence number
+     * @param reply True for Echo Reply, False for Echo Request
+     * @param wait Wait for room while the send buffer is full, otherwise fail with ENOBUFS at once
+     * @return 0 on success, errno of the failed sendto otherwise
+     */
+    int sendEcho(const uint8_t* payload, size_t payloadSize, uint16_t seq, bool reply = false, bool wait = true);
+
+    /**
+     * @brief Waits for the next Echo Reply from the target
+     * @param id ICMP identifier of the reply
+     * @param seq ICMP sequence number of the reply
+     * @param payload Data carried by the reply
+     * @param timeoutMs Time to wait in milliseconds (0 = do not wait)
+     * @return True if reply arrived, False on timeout
+     */
+    bool receiveEcho(uint16_t& id, uint16_t& seq, std::vector<uint8_t>& payload, int timeoutMs);
+
+    /**
+     * @brief Waits for Echo Reply with the given sequence number
+     * @param seq Sequence number of the probe
+     * @param timeoutMs Time to wait in milliseconds
+     * @return True if reply arrived, False on timeout
+     */
+    bool awaitEchoReply(uint16_t seq, int timeoutMs);
+
+    /**
+     * @brief Sends one probe of the given MTU and waits for its reply
+     * @param mtu Total IP packet size of the probe
+     * @return True if the probe made it to the target and back
+     */
+    bool probe(size_t mtu);
+
+    /**
+     * @brief Reads path MTU known by the kernel for the connected socket
+     * @return Kernel path MTU, 0 if unknown
+     */
+    size_t queryKernelMTU(void);
+
+    /**
+     * @brief Switches DF flag (path MTU discovery mode) on the socket
+     * @param enable True sets DF on all packets, False restores kernel default
+     * @return True if no issues, False if there was an error
+     */
+    bool setDontFragment(bool enable);
 
 };
 
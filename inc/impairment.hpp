@@ -0,0 +1,155 @@
+/**
+ * @file impairment.hpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#ifndef IMPAIRMENT_HPP
+#define IMPAIRMENT_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include "metrics.hpp"
+
+/**
+ * @class Impairment
+ * @brief Emulated WAN link between the client's framing and its sockets, like netem but inside the process
+ * @note Packets are dropped (independently or in bursts), duplicated, delayed with jitter, reordered and
+ *       serialized at a capped rate. A link thread hands them to the socket once they are due, so the
+ *       sender never blocks on the delay. One instance is one link, every connection sending through it
+ *       shares its rate and queue.
+ */
+class Impairment {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Transmit = std::function<bool(const std::vector<uint8_t>&)>;  ///< Sends one packet, false on error
+
+    /**
+     * @struct Config
+     * @brief Behaviour of the link
+     */
+    struct Config {
+        double loss = 0.0;                      ///< Fraction of packets lost
+        double burst = 1.0;                     ///< Mean length of a loss burst in packets (1 = independent losses)
+        double reorder = 0.0;                   ///< Fraction of packets held back so later ones overtake them
+        double duplicate = 0.0;                 ///< Fraction of packets delivered twice
+        std::chrono::microseconds delay{0};     ///< One-way delay
+        std::chrono::microseconds jitter{0};    ///< Delay varies uniformly by up to this much either way
+        uint64_t rate = 0;                      ///< Link rate in bits per second (0 = unlimited)
+        size_t limit = 1000;                    ///< Packets the link holds, more are tail dropped
+        uint64_t seed = 0;                      ///< Seed of the random decisions (0 = random)
+
+        /**
+         * @brief Checks if the link does anything at all
+         */
+        bool enabled(void) const;
+    };
+
+    /**
+     * @brief Constructor for Impairment class, starts the link thread
+     * @param config Behaviour of the link
+     */
+    Impairment(const Config& config);
+
+    /**
+     * @brief Destructor for Impairment class, stops the link thread (packets still held are lost)
+     */
+    ~Impairment();
+
+    Impairment(const Impairment&) = delete;
+    Impairment& operator=(const Impairment&) = delete;
+    Impairment(Impairment&&) = delete;
+    Impairment& operator=(Impairment&&) = delete;
+
+    /**
+     * @brief Passes one packet through the link
+     * @param payload Packet data
+     * @param payloadSize Size of the data
+     * @param transmit Sends the packet once it is due (called from the link thread)
+     */
+    void submit(const uint8_t* payload, size_t payloadSize, Transmit transmit);
+
+    /**
+     * @brief Waits until every held packet was handed to the socket
+     */
+    void drain(void);
+
+    /**
+     * @brief Writes what the link did to the packets
+     * @param out Metrics text being built
+     */
+    void exportMetrics(metrics::Writer& out) const;
+
+    /**
+     * @brief Prints what the link did to the packets
+     */
+    void report(void) const;
+
+private:
+    /**
+     * @struct Held
+     * @brief Packet on the link
+     */
+    struct Held {
+        Clock::time_point due;          ///< Time the packet reaches the socket
+        uint64_t order = 0;             ///< Submission order, keeps packets due at once in order
+        std::vector<uint8_t> data;      ///< Packet data
+        Transmit transmit;              ///< Sends the packet
+    };
+
+    /**
+     * @struct Later
+     * @brief Orders the queue by due time, earliest on top
+     */
+    struct Later {
+        bool operator()(const Held& a, const Held& b) const {
+            return a.due != b.due ? a.due > b.due : a.order > b.order;
+        }
+    };
+
+    const Config config;                ///< Behaviour of the link
+    const uint64_t seed;                ///< Seed in use, printed so a run can be repeated
+    std::mt19937_64 random;             ///< Source of the random decisions
+    std::uniform_real_distribution<double> uniform{0.0, 1.0}; ///< Uniform [0, 1)
+    double enterBurst;                  ///< Chance a good packet starts a loss burst
+    double leaveBurst;                  ///< Chance a lost packet ends the burst
+    bool inBurst = false;               ///< Link is in a loss burst
+    Clock::time_point linkFree{};       ///< Time the rate-capped link finishes its last packet
+    uint64_t nextOrder = 0;             ///< Order of the next packet
+
+    std::priority_queue<Held, std::vector<Held>, Later> held; ///< Packets on the link
+    std::mutex mutex;                   ///< Mutex protecting the queue and the decisions
+    std::condition_variable cv;         ///< Wakes the link thread (new packet) and drain (queue empty)
+    bool stopping = false;              ///< Link thread should exit
+    bool sending = false;               ///< Link thread is handing a packet to its socket
+    std::thread thread;                 ///< Link thread
+
+    metrics::Counter submitted;         ///< Packets entering the link
+    metrics::Counter delivered;         ///< Packets handed to the socket (duplicates included)
+    metrics::Counter lost;              ///< Packets dropped by the loss model
+    metrics::Counter overflowed;        ///< Packets tail dropped because the link was full
+    metrics::Counter duplicated;        ///< Extra copies delivered
+    metrics::Counter reordered;         ///< Packets held back
+    metrics::Counter failed;            ///< Deliveries the socket refused
+
+    /**
+     * @brief Link thread, hands due packets to their sockets
+     */
+    void run(void);
+
+    /**
+     * @brief Queues one copy of a packet, caller holds the mutex
+     * @param due Time it reaches the socket
+     * @param data Packet data
+     * @param transmit Sends the packet
+     */
+    void hold(Clock::time_point due, std::vector<uint8_t> data, Transmit transmit);
+};
+
+#endif // IMPAIRMENT_HPP
@@ -0,0 +1,256 @@
+/**
+ * @file metrics.hpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <cstdint>
+
+/**
+ * @namespace metrics
+ * @brief Runtime counters and their export in the Prometheus text format
+ * @note Counters are split into per-thread shards, so hot paths never contend on one cache line, and the shards
+ *       are summed only when the metrics are read. The exporter rewrites a stats file (atomically, by rename) and
+ *       answers connections to a local Unix socket with the same text.
+ */
+namespace metrics {
+    constexpr size_t SHARDS = 16;                                   ///< Counter shards (threads share one above this)
+    constexpr auto EXPORT_INTERVAL = std::chrono::seconds(1);       ///< Period of stats file rewrites
+
+    /**
+     * @class Counter
+     * @brief Monotonic event counter, cheap to increment from any thread
+     */
+    class Counter {
+    public:
+        /**
+         * @brief Adds to the shard of the calling thread
+         * @param n Amount to add
+         */
+        void add(uint64_t n = 1) { shards[shardIndex()].value.fetch_add(n, std::memory_order_relaxed); }
+
+        /**
+         * @brief Sums all shards
+         * @return Current value
+         */
+        uint64_t value(void) const;
+
+    private:
+        struct alignas(64) Shard {
+            std::atomic<uint64_t> value{0};     ///< Part of the count added by the threads of this shard
+        };
+        Shard shards[SHARDS];                   ///< Per-thread parts of the count
+
+        /**
+         * @brief Shard of the calling thread, threads get consecutive shards on their first increment
+         */
+        static size_t shardIndex(void);
+    };
+
+    /**
+     * @class HighWater
+     * @brief Largest value a gauge (queue depth, memory) ever reached
+     */
+    class HighWater {
+    public:
+        /**
+         * @brief Raises the mark if the value is above it
+         * @param current Current value of the gauge
+         */
+        void update(uint64_t current);
+
+        /**
+         * @brief Getter for the mark
+         */
+        uint64_t value(void) const { return mark.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint64_t> mark{0};          ///< Highest value seen
+    };
+
+    /**
+     * @class Histogram
+     * @brief HDR-style histogram of nanosecond latencies, buckets grow with the value so the relative error stays fixed
+     * @note Values below 16 have a bucket each, above that every power of two is split into 16 buckets, so a
+     *       quantile is off by at most 1/16 of its value. Recording is a few relaxed atomic adds from any thread.
+     */
+    class Histogram {
+    public:
+        static constexpr int SUB_BITS = 4;                                  ///< 16 buckets per power of two
+        static constexpr int MAX_BITS = 40;                                 ///< About 18 minutes, longer values are clamped
+        static constexpr size_t BUCKETS = (MAX_BITS - SUB_BITS + 1) << SUB_BITS; ///< Number of buckets
+
+        /**
+         * @brief Adds one value
+         * @param value Latency in nanoseconds
+         */
+        void record(uint64_t value);
+
+        /**
+         * @brief Value below which the given share of the recorded values lies
+         * @param q Quantile (0 to 1)
+         * @return Upper bound of the bucket holding the quantile, at most the maximum (0 if empty)
+         */
+        uint64_t quantile(double q) const;
+
+        /**
+         * @brief Getters for the totals
+         */
+        uint64_t count(void) const { return total.load(std::memory_order_relaxed); }
+        uint64_t sum(void) const { return sumNs.load(std::memory_order_relaxed); }
+        uint64_t max(void) const { return maxNs.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint64_t> buckets[BUCKETS] = {};    ///< Values per bucket
+        std::atomic<uint64_t> total{0};                 ///< Recorded values
+        std::atomic<uint64_t> sumNs{0};                 ///< Sum of the recorded values
+        std::atomic<uint64_t> maxNs{0};                 ///< Largest recorded value
+
+        /**
+         * @brief Bucket of a value
+         */
+        static size_t bucketOf(uint64_t value);
+
+        /**
+         * @brief Largest value that falls into a bucket
+         */
+        static uint64_t bucketLimit(size_t bucket);
+    };
+
+    /**
+     * @class Rate
+     * @brief Per-second rate of a counter between two exports
+     */
+    class Rate {
+    public:
+        /**
+         * @brief Computes the rate since the previous update, reads closer than half an interval reuse the last rate
+         * @param total Current counter value
+         * @return Increase per second
+         */
+        double update(uint64_t total);
+
+    private:
+        uint64_t lastTotal = 0;                             ///< Counter value at the previous update
+        std::chrono::steady_clock::time_point lastTime{};   ///< Time of the previous update
+        double rate = 0.0;                                  ///< Last computed rate
+    };
+
+    /**
+     * @brief Formats one label, escaping the value
+     * @param key Label name
+     * @param value Label value
+     * @return key="value"
+     */
+    std::string label(const std::string& key, const std::string& value);
+
+    /**
+     * @class Writer
+     * @brief Builds the text exposition, samples of a family follow its HELP and TYPE lines
+     */
+    class Writer {
+    public:
+        /**
+         * @brief Starts metric family
+         * @param name Metric name
+         * @param type counter, gauge or summary
+         * @param help Description
+         */
+        void family(const std::string& name, const char* type, const std::string& help);
+
+        /**
+         * @brief Adds sample to the current family
+         * @param name Metric name (with _sum or _count suffix for summaries)
+         * @param value Sample value
+         * @param labels Labels made by label(), comma separated (empty = none)
+         */
+        void sample(const std::string& name, uint64_t value, const std::string& labels = "");
+        void sample(const std::string& name, double value, const std::string& labels = "");
+
+        /**
+         * @brief Family with a single sample
+         */
+        void counter(const std::string& name, const std::string& help, uint64_t value);
+        void gauge(const std::string& name, const std::string& help, uint64_t value);
+        void gauge(const std::string& name, const std::string& help, double value);
+
+        /**
+         * @brief Getter for the finished text
+         */
+        std::string str(void) const { return out.str(); }
+
+    private:
+        std::ostringstream out;                 ///< Text built so far
+    };
+
+    /**
+     * @class Exporter
+     * @brief Publishes metrics to a stats file and a Unix socket, driven by the owner's loop
+     * @note The collect callback runs on the thread that calls poll(), so it may read that thread's state directly
+     */
+    class Exporter {
+    public:
+        using Collector = std::function<void(Writer&)>;
+
+        /**
+         * @brief Constructor for Exporter class
+         * @param filePath Stats file rewritten every EXPORT_INTERVAL (empty = none)
+         * @param socketPath Unix socket answering every connection with the metrics (empty = none)
+         * @param collect Writes current metrics
+         */
+        Exporter(const std::string& filePath, const std::string& socketPath, Collector collect);
+
+        /**
+         * @brief Destructor, closes and removes the socket
+         */
+        ~Exporter();
+
+        Exporter(const Exporter&) = delete;
+        Exporter& operator=(const Exporter&) = delete;
+        Exporter(Exporter&&) = delete;
+        Exporter& operator=(Exporter&&) = delete;
+
+        /**
+         * @brief Starts listening on the socket
+         * @return True if no issues, False if the socket can not be created
+         */
+        bool open(void);
+
+        /**
+         * @brief Answers waiting socket connections and rewrites the file when it is due, never blocks on readers
+         */
+        void poll(void);
+
+        /**
+         * @brief Rewrites the file now (final state before exit)
+         */
+        void flush(void);
+
+        /**
+         * @brief Getter for the time poll() should be called again
+         */
+        std::chrono::steady_clock::time_point nextDeadline(void) const { return nextExport; }
+
+    private:
+        std::string filePath;                               ///< Stats file (empty = none)
+        std::string socketPath;                             ///< Unix socket (empty = none)
+        Collector collect;                                  ///< Writes current metrics
+        int listenFd = -1;                                  ///< Listening socket (-1 = none)
+        bool fileFailed = false;                            ///< Writing the file failed before (reported once)
+        std::chrono::steady_clock::time_point nextExport;   ///< Time of the next file rewrite
+
+        /**
+         * @brief Replaces the stats file, readers see either the old or the new content
+         * @param text Metrics
+         */
+        void writeFile(const std::string& text);
+    };
+}
+
+#endif // METRICS_HPP
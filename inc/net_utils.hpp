@@ -6,6 +6,7 @@
 #define NET_UTILS_HPP
 
 #include <string>
+#include <vector>
 #include <stdexcept>
 #include <cstdint>
 #include <netinet/in.h>
@@ -21,6 +22,16 @@ namespace net_utils {
      * @return True if no issues occurred, false otherwise.
      */
     bool getSourceIPv6Address(struct sockaddr_in6& srcAddr);
+
+    /**
+     * @brief Gets the source address the kernel would route packets to the destination from
+     * @param dstAddr Destination address (IPv4 or IPv6)
+     * @param dstLen Size of dstAddr
+     * @param srcAddr Source address (output, same family as dstAddr)
+     * @return True if no issues occurred, false if the destination is unreachable
+     * @note Connects a UDP socket, no packet is sent and no privileges are needed
+     */
+    bool getRouteSource(const struct sockaddr* dstAddr, socklen_t dstLen, struct sockaddr_storage& srcAddr);
     /**
      * @brief Get the length of the link-layer header
      * @param dataLink datalink type
@@ -53,6 +64,20 @@ namespace net_utils {
                        struct sockaddr_in& addr4, 
                        struct sockaddr_in6& addr6);
 
+    /**
+     * @brief Resolves every address of the input, for using all links of a multi-homed host
+     * @param input IP/hostname
+     * @return Textual addresses, IPv4 ones first and without duplicates (empty on error)
+     */
+    std::vector<std::string> resolveAllAddresses(const std::string& input);
+
+    /**
+     * @brief Converts IPv4/IPv6 socket address to its textual form
+     * @param addr Address
+     * @return Textual address, empty string on error
+     */
+    std::string addressToString(const struct sockaddr_storage& addr);
+
     /**
      * @brief Calculates IPv4 checksum
      * @param data Pointer to a data
@@ -0,0 +1,84 @@
+/**
+ * @file packet_sink.hpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#ifndef PACKET_SINK_HPP
+#define PACKET_SINK_HPP
+
+#include <string>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <netinet/in.h>
+
+struct pcap;
+struct pcap_dumper;
+
+/**
+ * @class PacketSink
+ * @brief Output of the packet generator, takes the place of the raw socket of every connection
+ * @note Packets get their IP header here and are written to a pcap savefile (raw IP link type),
+ *       or only counted by the null sink. Everything up to the ICMP checksum is the real send path.
+ */
+class PacketSink {
+public:
+    static constexpr const char* NULL_SINK = "null";  ///< Path selecting the null sink
+
+    /**
+     * @brief Constructor for PacketSink class
+     * @param path Savefile to write, NULL_SINK to discard the packets
+     */
+    PacketSink(const std::string& path);
+
+    /**
+     * @brief Destructor for PacketSink class (flushes and closes the savefile)
+     */
+    ~PacketSink();
+
+    PacketSink(const PacketSink&) = delete;
+    PacketSink& operator=(const PacketSink&) = delete;
+    PacketSink(PacketSink&&) = delete;
+    PacketSink& operator=(PacketSink&&) = delete;
+
+    /**
+     * @brief Creates the savefile
+     * @return True if no issues, False if there was an error
+     */
+    bool open(void);
+
+    /**
+     * @brief Frames ICMP message into an IP packet and writes it, from any connection
+     * @param srcAddr Source address (IPv4 or IPv6, same family as dstAddr)
+     * @param dstAddr Destination address
+     * @param message ICMP/ICMPv6 header and payload, checksum already set
+     * @param size Size of the message
+     * @note Savefile errors only show up in flush()
+     */
+    void write(const struct sockaddr_storage& srcAddr, const struct sockaddr_storage& dstAddr,
+               const uint8_t* message, size_t size);
+
+    /**
+     * @brief Writes out buffered packets
+     * @return True if no issues, False if the savefile can not be written
+     */
+    bool flush(void);
+
+    /**
+     * @brief Getters for the written traffic
+     */
+    uint64_t getPackets() const { return packets; }
+    uint64_t getBytes() const { return bytes; }
+    const std::string& getPath() const { return path; }
+
+private:
+    const std::string path;             ///< Savefile (NULL_SINK = discard)
+    struct pcap* handle = nullptr;      ///< Dead capture handle describing the link type
+    struct pcap_dumper* dumper = nullptr; ///< Open savefile (null for the null sink)
+    std::vector<uint8_t> frame;         ///< Packet being built, reused
+    uint16_t ipId = 0;                  ///< IPv4 identification of the next packet
+    uint64_t packets = 0;               ///< Packets written
+    uint64_t bytes = 0;                 ///< Bytes written (whole IP packets)
+    std::mutex mutex;                   ///< Mutex serializing writers
+};
+
+#endif // PACKET_SINK_HPP
@@ -18,13 +18,48 @@
  * @warning This is a high level, not serialized packet, do not use with memcpy
  */
 namespace protocol {
+    constexpr uint32_t MAGIC_NUMBER = 0xDEADBEEF;   ///< Identifies packets of this protocol
+    constexpr uint8_t VERSION = 6;                  ///< Current protocol version
+    constexpr size_t HEADER_SIZE = 18;              ///< Serialized size of the common packet header
+    constexpr size_t VERSION_OFFSET = 4;            ///< Position of the version in the header (after magic)
+    constexpr size_t TYPE_OFFSET = 5;               ///< Position of the packet type in the header (after magic and version)
+    constexpr size_t DATA_HEADER_SIZE = 16;         ///< Serialized size of the Data fields preceding the payload
+    constexpr size_t ROOT_SIZE = 32;                ///< Merkle root of the plaintext chunks (SHA-256)
+    constexpr uint64_t UNKNOWN_SIZE = UINT64_MAX;   ///< Metadata size and chunk count of a stream, End packet tells them
+    constexpr size_t MAX_FILE_NAME = 255;           ///< Longest file name, its length is serialized in one byte
+
     /**
      * @enum Packet Type
      * @brief Type of the custom packet
      */
     enum PacketType : uint8_t {
         METADATA = 0,
-        DATA = 1
+        DATA = 1,
+        RESUME_REQUEST = 2,     ///< Client asks server what it already has (client -> server)
+        RESUME_STATE = 3,       ///< Server answers with missing chunk ranges (server -> client)
+        END = 4,                ///< End of a stream of unknown length (client -> server)
+        DELTA_REQUEST = 5,      ///< Client asks for block signatures of the server's copy (client -> server)
+        SIGNATURES = 6,         ///< Server answers with a window of block signatures (server -> client)
+        CHUNK_STATUS = 7        ///< Server names chunks to resend or confirms the file (server -> client)
+    };
+
+    /**
+     * @enum ContentKind
+     * @brief What the plaintext of a transfer is
+     */
+    enum ContentKind : uint8_t {
+        CONTENT_FILE = 0,       ///< Single file saved under its name
+        CONTENT_ARCHIVE = 1,    ///< Manifest and contents of many files, unpacked by the server
+        CONTENT_DELTA = 2       ///< Literals and block references against the server's copy of the file
+    };
+
+    /**
+     * @enum Codec
+     * @brief Compression applied to the plaintext before encryption
+     */
+    enum Codec : uint8_t {
+        CODEC_NONE = 0,         ///< Plaintext is the content itself
+        CODEC_LZ = 1            ///< Frames of LZ compressed blocks (see compress.hpp)
     };
 
     /**
@@ -34,8 +69,11 @@ namespace protocol {
     struct Metadata {
         uint8_t fileNameLen;            ///< Length of the filename
         std::string fileName;           ///< Name of the file
-        uint32_t fileSize;              ///< Total size of the file
-        uint32_t totalChunks;           ///< Expected number of chunks
+        uint64_t fileSize;              ///< Total size of the (plaintext) file
+        uint64_t totalChunks;           ///< Expected number of chunks
+        uint32_t chunkSize;             ///< Size of every chunk except the last one (chosen from path MTU)
+        uint8_t kind = CONTENT_FILE;    ///< ContentKind of the plaintext
+        uint8_t codec = CODEC_NONE;     ///< Codec of the plaintext
         std::vector<uint8_t> iv;        ///< IV for decryption (fixed 16B)
 
         /**
@@ -53,7 +91,8 @@ namespace protocol {
     };
 
     struct Data {
-        uint32_t chunkNum;              ///< Number of chunk/Sequence number
+        uint64_t chunkNum;              ///< Index of the chunk (position in ciphertext / chunkSize)
+        uint64_t tag = 0;               ///< Truncated HMAC of transfer ID, chunk number and payload
         std::vector<uint8_t> payload;   ///< Data/chunk of data
 
         /**
@@ -70,17 +109,185 @@ namespace protocol {
         static Data deserialize(const uint8_t* data, size_t len);
     };
 
+    /**
+     * @struct End
+     * @brief End marker sent after the last chunk, fixes the size of a stream that had UNKNOWN_SIZE in metadata
+     */
+    struct End {
+        uint64_t totalChunks;           ///< Number of chunks of the stream
+        uint64_t fileSize;              ///< Total size of the (plaintext) stream
+        std::vector<uint8_t> root;      ///< Merkle root of the plaintext chunks (ROOT_SIZE bytes)
+
+        /**
+         * @brief Serializes abstract End into a vector of bytes
+         * @return Byte vector
+         */
+        std::vector<uint8_t> serialize() const;
+
+        /**
+         * @brief Deserializes data into an abstract End
+         * @param data Data to be deserialized
+         * @param len Length of data
+         */
+        static End deserialize(const uint8_t* data, size_t len);
+    };
+
+    /**
+     * @struct ResumeRequest
+     * @brief Asks the server for the state of transfer identified by packet ID (no fields)
+     */
+    struct ResumeRequest {
+        /**
+         * @brief Serializes abstract ResumeRequest into a vector of bytes
+         * @return Byte vector
+         */
+        std::vector<uint8_t> serialize() const;
+
+        /**
+         * @brief Deserializes data into an abstract ResumeRequest
+         * @param data Data to be deserialized
+         * @param len Length of data
+         */
+        static ResumeRequest deserialize(const uint8_t* data, size_t len);
+    };
+
+    /**
+     * @struct ChunkRange
+     * @brief Half-open range of chunk numbers [first, end)
+     */
+    struct ChunkRange {
+        uint64_t first;     ///< First chunk in the range
+        uint64_t end;       ///< One past the last chunk in the range
+    };
+
+    /**
+     * @struct ResumeState
+     * @brief Server side state of a transfer, tells client which chunks to (re)send
+     */
+    struct ResumeState {
+        uint8_t found = 0;                  ///< 1 if server knows the transfer, other fields are valid only then
+        uint64_t fileSize = 0;              ///< File size from the stored metadata
+        uint32_t chunkSize = 0;             ///< Chunk size from the stored metadata
+        std::vector<uint8_t> iv;            ///< IV the transfer was started with (fixed 16B)
+        std::vector<ChunkRange> missing;    ///< Chunks the server still needs (ascending)
+
+        /**
+         * @brief Serializes abstract ResumeState into a vector of bytes
+         * @return Byte vector
+         */
+        std::vector<uint8_t> serialize() const;
+
+        /**
+         * @brief Deserializes data into an abstract ResumeState
+         * @param data Data to be deserialized
+         * @param len Length of data
+         */
+        static ResumeState deserialize(const uint8_t* data, size_t len);
+    };
+
+    /**
+     * @enum StatusCode
+     * @brief What the server reports about a transfer
+     */
+    enum StatusCode : uint8_t {
+        STATUS_MISSING = 0,     ///< Listed chunks are missing or failed their tag, resend them
+        STATUS_DONE = 1,        ///< Merkle root matched, the file is saved
+        STATUS_FAILED = 2       ///< Transfer was rejected and discarded
+    };
+
+    /**
+     * @struct ChunkStatus
+     * @brief Server answer to chunks and End packets, names the exact chunks to resend
+     */
+    struct ChunkStatus {
+        uint8_t status = STATUS_MISSING;    ///< StatusCode
+        std::vector<ChunkRange> missing;    ///< Chunks to resend (ascending, STATUS_MISSING only)
+
+        /**
+         * @brief Serializes abstract ChunkStatus into a vector of bytes
+         * @return Byte vector
+         */
+        std::vector<uint8_t> serialize() const;
+
+        /**
+         * @brief Deserializes data into an abstract ChunkStatus
+         * @param data Data to be deserialized
+         * @param len Length of data
+         */
+        static ChunkStatus deserialize(const uint8_t* data, size_t len);
+    };
+
+    /**
+     * @struct DeltaRequest
+     * @brief Asks the server for signatures of blocks of its copy of a file, starting at firstBlock
+     */
+    struct DeltaRequest {
+        uint64_t firstBlock = 0;            ///< First block the client still needs
+        uint32_t maxPayload = 0;            ///< Largest payload the path carries, server sizes replies to it
+        std::string fileName;               ///< Name the file is stored under on the server
+
+        /**
+         * @brief Serializes abstract DeltaRequest into a vector of bytes
+         * @return Byte vector
+         */
+        std::vector<uint8_t> serialize() const;
+
+        /**
+         * @brief Deserializes data into an abstract DeltaRequest
+         * @param data Data to be deserialized
+         * @param len Length of data
+         */
+        static DeltaRequest deserialize(const uint8_t* data, size_t len);
+    };
+
+    /**
+     * @struct BlockSignature
+     * @brief Rolling and strong hash of one block
+     */
+    struct BlockSignature {
+        uint32_t weak;                      ///< Rolling checksum (rsync style)
+        uint64_t strong;                    ///< First 8 bytes of the block's SHA-256
+    };
+
+    /**
+     * @struct Signatures
+     * @brief Consecutive block signatures of the server's copy of a file
+     */
+    struct Signatures {
+        uint8_t found = 0;                  ///< 1 if the server has the file, other fields are valid only then
+        uint64_t basisSize = 0;             ///< Size of the server's copy
+        uint32_t blockSize = 0;             ///< Size of every block except the last one
+        uint64_t firstBlock = 0;            ///< Index of the first block in this packet
+        std::vector<BlockSignature> blocks; ///< Signatures of blocks firstBlock, firstBlock + 1, ...
+
+        /**
+         * @brief Serializes abstract Signatures into a vector of bytes
+         * @return Byte vector
+         */
+        std::vector<uint8_t> serialize() const;
+
+        /**
+         * @brief Deserializes data into an abstract Signatures
+         * @param data Data to be deserialized
+         * @param len Length of data
+         */
+        static Signatures deserialize(const uint8_t* data, size_t len);
+    };
+
+    constexpr size_t SIGNATURES_HEADER_SIZE = 1 + 8 + 4 + 8 + 4;   ///< Serialized Signatures without blocks
+    constexpr size_t SIGNATURE_SIZE = 4 + 8;                        ///< Serialized BlockSignature
+
     /**
      * @struct Packet
      * @brief Struct containing custom packet data (6B + metadata/data)
      */
     struct Packet {
-        uint32_t magicNum = 0xDEADBEEF;         ///< https://en.wikipedia.org/wiki/Magic_number_%28programming%29#Magic_debug_values
-        uint8_t version = 1;                    ///< Protocol version
+        uint32_t magicNum = MAGIC_NUMBER;       ///< https://en.wikipedia.org/wiki/Magic_number_%28programming%29#Magic_debug_values
+        uint8_t version = VERSION;              ///< Protocol version
         PacketType packetType;                  ///< Type of the packet
-        uint32_t seqNum;                        ///< Sequence number of the packet
+        uint32_t seqNum;                        ///< Sequence number of the packet (wraps, chunks are ordered by chunkNum)
         uint64_t id;                            ///< Unique client ID
-        std::variant<Metadata, Data> payload;   ///< Custom packet payload (variant instad of unions)
+        std::variant<Metadata, Data, ResumeRequest, ResumeState, End, DeltaRequest, Signatures, ChunkStatus> payload;   ///< Custom packet payload (variant instad of unions)
     };
 
     using PacketPtr = std::unique_ptr<Packet>;
@@ -103,6 +310,69 @@ namespace protocol {
      */
     PacketPtr buildDataPacket(const Data& data, uint32_t seqNum, uint64_t clientId);
 
+    /**
+     * @brief Builds custom Packet
+     * @param data ResumeRequest for building packet
+     * @param seqNum Sequence Number of the packet
+     * @param clientId ID of the client
+     * @return Custom Packet containing resume request
+     */
+    PacketPtr buildResumeRequestPacket(const ResumeRequest& data, uint32_t seqNum, uint64_t clientId);
+
+    /**
+     * @brief Builds custom Packet
+     * @param data ResumeState for building packet
+     * @param seqNum Sequence Number of the packet
+     * @param clientId ID of the client
+     * @return Custom Packet containing resume state
+     */
+    PacketPtr buildResumeStatePacket(const ResumeState& data, uint32_t seqNum, uint64_t clientId);
+
+    /**
+     * @brief Builds custom Packet
+     * @param data End for building packet
+     * @param seqNum Sequence Number of the packet
+     * @param clientId ID of the client
+     * @return Custom Packet containing end-of-stream marker
+     */
+    PacketPtr buildEndPacket(const End& data, uint32_t seqNum, uint64_t clientId);
+
+    /**
+     * @brief Builds custom Packet
+     * @param data DeltaRequest for building packet
+     * @param seqNum Sequence Number of the packet
+     * @param clientId ID of the client
+     * @return Custom Packet containing delta request
+     */
+    PacketPtr buildDeltaRequestPacket(const DeltaRequest& data, uint32_t seqNum, uint64_t clientId);
+
+    /**
+     * @brief Builds custom Packet
+     * @param data Signatures for building packet
+     * @param seqNum Sequence Number of the packet
+     * @param clientId ID of the client
+     * @return Custom Packet containing block signatures
+     */
+    PacketPtr buildSignaturesPacket(const Signatures& data, uint32_t seqNum, uint64_t clientId);
+
+    /**
+     * @brief Builds custom Packet
+     * @param data ChunkStatus for building packet
+     * @param seqNum Sequence Number of the packet
+     * @param clientId ID of the client
+     * @return Custom Packet containing transfer status
+     */
+    PacketPtr buildChunkStatusPacket(const ChunkStatus& data, uint32_t seqNum, uint64_t clientId);
+
+    /**
+     * @brief Reads packet type without parsing the payload
+     * @param data Serialized packet
+     * @param len Length of data
+     * @param type Packet type (output)
+     * @return True if data is a packet of this protocol and version, False otherwise
+     */
+    bool peekPacketType(const uint8_t* data, size_t len, PacketType& type);
+
     /**
      * @brief Serializes any packet using their specific serialization method
      * @param packet Packet to be serialized
@@ -114,7 +384,7 @@ namespace protocol {
      * @brief Parses any packet using their specific deserialization method
      * @param data Data to be deserializad
      * @param len Lenght of data
-     * @return Parsed and deserialized packet
+     * @return Parsed and deserialized packet, nullptr if data does not belong to this protocol
      */
     PacketPtr parsePacket(const uint8_t* data, size_t len);
 }
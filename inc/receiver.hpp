@@ -0,0 +1,213 @@
+/**
+ * @file receiver.hpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#ifndef RECEIVER_HPP
+#define RECEIVER_HPP
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <ctime>
+#include "metrics.hpp"
+
+struct pcap;
+struct pcap_stat;
+
+/**
+ * @class Receiver
+ * @brief Source of the echo requests handled by the server
+ * @note Every backend hands over whole IP packets (IPv4 or IPv6 header first) with their kernel receive
+ *       time, so parsing and reassembly do not depend on where the packets came from.
+ */
+class Receiver {
+public:
+    /**
+     * @brief Called on the receiving thread for every packet
+     * @param packet IP header and everything after it
+     * @param length Received bytes
+     * @param stamp Kernel receive time (recorded time in a replay), CLOCK_REALTIME
+     */
+    using Handler = std::function<void(const uint8_t* packet, size_t length, const struct timespec& stamp)>;
+
+    /**
+     * @enum Backend
+     * @brief Way the packets are received
+     */
+    enum class Backend {
+        PCAP,   ///< libpcap on the "any" device, or a savefile
+        RAW,    ///< Raw ICMP and ICMPv6 sockets read in batches with recvmmsg
+        XDP     ///< AF_XDP socket fed by an XDP program on one interface
+    };
+
+    /**
+     * @struct Capture
+     * @brief Settings of a live capture
+     */
+    struct Capture {
+        std::string device = "any";             ///< Interface to receive on ("any" = all of them)
+        int snaplen = 262144;                   ///< Bytes kept of every packet, covers jumbo frames (PCAP only)
+        int bufferSize = 16 * 1024 * 1024;      ///< Kernel buffer in bytes, rides out bursts
+        bool immediate = true;                  ///< Deliver packets as they arrive, not in timed batches (PCAP only)
+        int timeout = 100;                      ///< Batch timeout in ms without immediate mode (PCAP only)
+        unsigned queue = 0;                     ///< Receive queue the socket is bound to (XDP only)
+        bool xdpNative = false;                 ///< Attach in driver mode instead of generic SKB mode (XDP only)
+    };
+
+    virtual ~Receiver() = default;
+
+    /**
+     * @brief Creates receiver of the given backend
+     * @param backend Way the packets are received
+     * @param replayFile Savefile read instead of the network (PCAP only, empty = live)
+     * @param capture Settings of the live capture
+     * @return New receiver, not opened yet
+     */
+    static std::unique_ptr<Receiver> create(Backend backend, const std::string& replayFile, const Capture& capture);
+
+    /**
+     * @brief Opens the capture and installs its filter
+     * @return True if no issues, False if there was an error
+     */
+    virtual bool open(void) = 0;
+
+    /**
+     * @brief Receives packets until stop() or the end of a savefile
+     * @param handler Called for every packet
+     * @return True if no issues, False if receiving failed
+     */
+    virtual bool run(const Handler& handler) = 0;
+
+    /**
+     * @brief Makes run() return, from any thread
+     */
+    virtual void stop(void) = 0;
+
+    /**
+     * @brief Writes receive and kernel drop counters of the backend
+     * @param out Metrics text being built
+     */
+    virtual void exportMetrics(metrics::Writer& out) = 0;
+
+    /**
+     * @brief Prints receive and kernel drop counters of the backend
+     */
+    virtual void report(void) = 0;
+};
+
+/**
+ * @class PcapReceiver
+ * @brief Receiver on libpcap, live on the "any" device or from a pcap/pcapng savefile
+ */
+class PcapReceiver : public Receiver {
+public:
+    /**
+     * @brief Constructor for PcapReceiver class
+     * @param replayFile Savefile to read (empty = live capture)
+     * @param capture Settings of the live capture
+     */
+    PcapReceiver(const std::string& replayFile, const Capture& capture);
+
+    /**
+     * @brief Destructor for PcapReceiver class (closes the capture)
+     */
+    ~PcapReceiver() override;
+
+    PcapReceiver(const PcapReceiver&) = delete;
+    PcapReceiver& operator=(const PcapReceiver&) = delete;
+
+    bool open(void) override;
+    bool run(const Handler& handler) override;
+    void stop(void) override;
+    void exportMetrics(metrics::Writer& out) override;
+    void report(void) override;
+
+private:
+    const std::string replayFile;       ///< Savefile (empty = live)
+    const Capture capture;              ///< Settings of the live capture
+    struct pcap* handle = nullptr;      ///< Capture handle
+    int headerLen = 0;                  ///< Link header in front of the IP header
+    const Handler* handler = nullptr;   ///< Handler of the running loop
+    metrics::Counter truncated;         ///< Packets cut short by the snapshot length
+    std::mutex mutex;                   ///< Mutex protecting handle against stop() and exportMetrics()
+
+    /**
+     * @brief Creates and activates the live capture
+     * @return Capture handle, nullptr on error
+     */
+    struct pcap* openLive(void);
+
+    /**
+     * @brief Reads the kernel counters of a live capture
+     * @param stats Counters (output)
+     * @return True if the counters are available
+     */
+    bool readStats(struct pcap_stat& stats);
+
+    /**
+     * @brief libpcap callback, strips the link header and passes the packet on
+     */
+    static void onPacket(unsigned char* user, const struct pcap_pkthdr* header, const unsigned char* packet);
+};
+
+/**
+ * @class RawReceiver
+ * @brief Receiver on raw ICMP and ICMPv6 sockets, without libpcap and its read timeout
+ * @note Each wakeup takes up to RAW_BATCH packets per socket with one recvmmsg. A socket filter passes only
+ *       echo requests, the kernel timestamps every packet and reports the drops of its receive buffer.
+ *       IPv6 raw sockets deliver no IP header, one is rebuilt from the source address.
+ */
+class RawReceiver : public Receiver {
+public:
+    /**
+     * @brief Constructor for RawReceiver class
+     * @param capture Settings of the capture (device and buffer size)
+     */
+    RawReceiver(const Capture& capture);
+
+    /**
+     * @brief Destructor for RawReceiver class (closes the sockets)
+     */
+    ~RawReceiver() override;
+
+    RawReceiver(const RawReceiver&) = delete;
+    RawReceiver& operator=(const RawReceiver&) = delete;
+
+    bool open(void) override;
+    bool run(const Handler& handler) override;
+    void stop(void) override;
+    void exportMetrics(metrics::Writer& out) override;
+    void report(void) override;
+
+private:
+    const Capture capture;              ///< Settings of the capture
+    int fd4 = -1;                       ///< Raw ICMP socket
+    int fd6 = -1;                       ///< Raw ICMPv6 socket (-1 without IPv6)
+    int stopFd = -1;                    ///< eventfd waking run() for stop()
+    std::vector<uint8_t> buffers;       ///< Receive buffers of one batch
+    metrics::Counter received;          ///< Packets read from the sockets
+    metrics::Counter batches;           ///< recvmmsg calls that returned packets
+    std::atomic<uint64_t> dropped4{0};  ///< Receive buffer drops of the ICMP socket (SO_RXQ_OVFL)
+    std::atomic<uint64_t> dropped6{0};  ///< Receive buffer drops of the ICMPv6 socket
+
+    /**
+     * @brief Creates one raw socket with timestamps, drop counter and filter
+     * @param family AF_INET or AF_INET6
+     * @return Socket, -1 on error
+     */
+    int openSocket(int family);
+
+    /**
+     * @brief Reads one batch from a socket and hands the packets over
+     * @param fd Socket to read
+     * @param handler Called for every packet
+     * @return False if the socket failed
+     */
+    bool readBatch(int fd, const Handler& handler);
+};
+
+#endif // RECEIVER_HPP
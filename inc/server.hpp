@@ -8,12 +8,89 @@
 #include <string>
 #include <map>
 #include <vector>
-#include <queue>
 #include <condition_variable>
 #include <mutex>
 #include <thread>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <set>
+#include <deque>
+#include <optional>
+#include <sys/socket.h>
 #include "protocol.hpp"
-#include "chunker.hpp"
+#include "bounded_queue.hpp"
+#include "fair_queue.hpp"
+#include "disk_writer.hpp"
+#include "transfer.hpp"
+#include "icmp_connection.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "receiver.hpp"
+
+constexpr unsigned DEFAULT_IDLE_TIMEOUT = 300;  ///< Seconds without packets before a transfer is evicted
+constexpr unsigned DEFAULT_PRIORITY = 1;        ///< Scheduling weight of clients without configured priority
+constexpr unsigned MAX_PRIORITY = 1000;         ///< Highest accepted scheduling weight
+
+/**
+ * @struct ServerConfig
+ * @brief Tunables of the server, all of them optional
+ */
+struct ServerConfig {
+    std::string spoolDir;                               ///< Checkpoint directory (empty = disabled)
+    size_t memoryLimit = 0;                             ///< Budget for buffered chunks in bytes (0 = unlimited)
+    std::chrono::seconds idleTimeout{DEFAULT_IDLE_TIMEOUT}; ///< Idle time before eviction (0 = never)
+    size_t workers = 0;                                 ///< Decrypt/write threads (0 = pick by CPU count)
+    std::chrono::seconds statsInterval{0};              ///< Period of queue latency reports (0 = never)
+    std::map<uint64_t, unsigned> idPriorities;          ///< Scheduling weight per client ID
+    std::map<std::string, unsigned> addressPriorities;  ///< Scheduling weight per source address
+    DiskWriter::Mode ioMode = DiskWriter::Mode::BUFFERED; ///< Page cache handling of output files
+    std::string outputPath;                             ///< Output of a single transfer, "-" = stdout (empty = metadata file names)
+    std::string metricsFile;                            ///< Stats file rewritten every second (empty = none)
+    std::string metricsSocket;                          ///< Unix socket serving the metrics (empty = none)
+    std::string traceFile;                              ///< Chrome trace written on SIGUSR1 and at exit (empty = no spans)
+    std::string replayFile;                             ///< Savefile ingested instead of the live capture (empty = live)
+    double replaySpeed = 0.0;                           ///< Multiple of the recorded timing (0 = as fast as possible)
+    bool sink = false;                                  ///< Discard received files instead of writing them
+    Receiver::Backend receiver = Receiver::Backend::PCAP; ///< Way the echo requests are received
+    Receiver::Capture capture;                          ///< Device, buffer and libpcap settings of the live capture
+};
+
+/**
+ * @struct ServerCounters
+ * @brief Events of the whole server, counted by any thread and summed when the metrics are exported
+ */
+struct ServerCounters {
+    metrics::Counter capturedPackets;       ///< Echo requests handed over by the capture
+    metrics::Counter capturedBytes;         ///< Their ICMP payload bytes
+    metrics::Counter foreignPackets;        ///< Echo requests that are not ours (plain pings, other versions)
+    metrics::Counter malformedPackets;      ///< Our packets that are truncated or do not parse
+    metrics::Counter chunks;                ///< Data packets handed to transfers
+    metrics::Counter chunkBytes;            ///< Their payload bytes
+    metrics::Counter corruptChunks;         ///< Chunks dropped for a wrong tag
+    metrics::Counter startedTransfers;      ///< Transfers created (or restored)
+    metrics::Counter completedTransfers;    ///< Transfers whose Merkle root matched
+    metrics::Counter failedTransfers;       ///< Transfers dropped because of an error
+    metrics::Counter evictedTransfers;      ///< Transfers evicted for memory or idleness
+    metrics::Counter statusReplies;         ///< Chunk status packets sent
+    metrics::Counter replyErrors;           ///< Replies that could not be sent
+    metrics::Counter queueDrops;            ///< Packets dropped because the client's fair queue was full
+    metrics::HighWater captureQueueHigh;    ///< Most packets ever waiting in the fair queue
+    metrics::HighWater workerQueueHigh;     ///< Most packets ever waiting for one worker
+    metrics::HighWater memoryHigh;          ///< Most bytes ever buffered by all transfers
+};
+
+/**
+ * @struct TransferProgress
+ * @brief Snapshot of one transfer for the metrics, published by its worker
+ */
+struct TransferProgress {
+    uint64_t writtenChunks = 0;     ///< Chunks decrypted and written in order
+    uint64_t bufferedChunks = 0;    ///< Out-of-order chunks waiting in memory or the spool
+    uint64_t totalChunks = 0;       ///< Chunks of the file (UNKNOWN_SIZE for streams)
+    uint64_t writtenBytes = 0;      ///< Plaintext bytes written
+    size_t memory = 0;              ///< Bytes held in memory
+};
 
 /**
  * @class Server
@@ -24,11 +101,22 @@ public:
     using PacketPtr = protocol::PacketPtr;
     using PacketVector = std::vector<PacketPtr>;
 
+    /**
+     * @struct QueuedPacket
+     * @brief Parsed packet together with the address it came from
+     */
+    struct QueuedPacket {
+        PacketPtr packet;                   ///< Parsed packet
+        struct sockaddr_storage source;     ///< Source address (for replies to the client)
+        std::chrono::steady_clock::time_point enqueued; ///< Time the packet entered its current queue
+    };
+
     /**
      * @brief Constructor for Server.
      * @param xlogin Login string used for key derivation (default: "xrepcim00").
+     * @param config Spool directory, memory budget and idle timeout.
      */
-    explicit Server(const std::string xlogin = "xrepcim00");
+    explicit Server(const std::string xlogin = "xrepcim00", const ServerConfig config = ServerConfig());
 
     /**
      * @brief Destructor. Ensures proper cleanup of resources and threads.
@@ -38,27 +126,68 @@ public:
     /**
      * @brief Starts the server workflow (capture, consume, process).
      * @return True if no issues occurred, false otherwise.
+     * @note With an output path the server returns after the first transfer ends, with a replay file
+     *       after every packet of the file was handled.
      */
     bool run(void);
 
 private:
     const std::string xlogin;               ///< Login for key derivation
-    std::queue<PacketPtr> packetQueue;      ///< Shared packet queue
+    const ServerConfig config;              ///< Server tunables
+    FairQueue<QueuedPacket> packetQueue;    ///< Shared packet queue, one flow per client ID
     std::mutex queueMutex;                  ///< Mutex protecting packetQueue
     std::condition_variable queueCV;        ///< Condition variable for packetQueue
-    std::thread consumerThread;             ///< Thread for consuming/processing packets
-    bool running = false;                   ///< Server running state flag
+    std::condition_variable spaceCV;        ///< Signals a replay waiting for packetQueue to shrink
+    std::thread consumerThread;             ///< Thread dispatching packets to workers
+    std::atomic<bool> running{false};       ///< Server running state flag
 
-    ///< Packet map ordered by client ID and sequence number
-    std::map<uint64_t, std::map<uint32_t, PacketPtr>> clientPackets;
+    std::vector<uint8_t> key;               ///< AES key derived from login
+    trace::Pipeline pipeline{trace::SERVER_STAGE_NAMES, trace::SERVER_STAGES}; ///< Per-stage latency (outlives workers)
+    std::unique_ptr<DiskWriter> diskWriter; ///< I/O thread shared by all output files (outlives workers)
 
-    ///< Map tracking total chunk count per client
-    std::map<uint64_t, uint32_t> clientTotalChunks;
+    /**
+     * @struct Worker
+     * @brief Decrypt/write thread owning the transfers whose ID maps to it
+     */
+    struct Worker {
+        explicit Worker(size_t capacity) : queue(capacity) {}
 
-    struct PacketLoopContext {
-        int headerLen;   ///< Length of packet header in capture
-        Server* server;  ///< Pointer back to owning server
+        BoundedQueue<QueuedPacket> queue;                           ///< Packets for this worker
+        std::map<uint64_t, std::unique_ptr<Transfer>> transfers;    ///< Transfers in progress ordered by client ID
+        std::deque<uint64_t> finished;                              ///< Recently completed transfers (late End copies)
+        std::thread thread;                                         ///< Worker thread
+        std::map<uint64_t, TransferProgress> progress;              ///< Last published state of the transfers
+        std::mutex progressMutex;                                   ///< Mutex protecting progress
     };
+    std::vector<std::unique_ptr<Worker>> workers;   ///< Worker pool
+    std::atomic<size_t> memoryUsage{0};             ///< Sum of memory held by all transfers
+
+    uint64_t reportedPackets = 0;                   ///< Dispatched packets at the last report
+    ServerCounters counters;                        ///< Event counters for the metrics
+    std::unique_ptr<metrics::Exporter> exporter;    ///< Metrics file and socket (null if disabled)
+    metrics::Rate packetRate;                       ///< Captured packets per second
+    metrics::Rate byteRate;                         ///< Captured bytes per second
+
+    /**
+     * @struct ReplyConnection
+     * @brief Send-only raw socket towards one client address
+     */
+    struct ReplyConnection {
+        std::unique_ptr<ICMPConnection> connection;     ///< Socket with a drop-all receive filter
+        std::set<uint64_t> clients;                     ///< Clients answered through it
+        std::chrono::steady_clock::time_point lastUsed; ///< Time of the last reply
+    };
+    std::map<std::string, ReplyConnection> replyConnections; ///< Reply sockets ordered by client address
+    std::mutex replyMutex;                  ///< Mutex protecting replyConnections
+
+    std::unique_ptr<Receiver> receiver;     ///< Source of the echo requests (created by run())
+    std::chrono::steady_clock::time_point replayStart{}; ///< Time the first replayed packet was handled
+    double replayFirstStamp = -1.0;         ///< Capture time of the first replayed packet (-1 = none yet)
+
+    std::optional<uint64_t> outputOwner;    ///< Client whose transfer goes to the output path
+    std::set<uint64_t> rejectedClients;     ///< Clients turned away because the output was taken
+    std::mutex outputMutex;                 ///< Mutex protecting outputOwner and rejectedClients
+    std::atomic<bool> outputFailed{false};  ///< Transfer to the output path did not complete
 
     /**
      * @brief Initializes packet capture loop.
@@ -67,39 +196,181 @@ private:
     bool startPacketCapture(void);
 
     /**
-     * @brief Callback invoked by libpcap when a packet is captured.
-     * @param user User data pointer (contains PacketLoopContext).
-     * @param header libpcap header for captured packet.
-     * @param packet Raw packet bytes.
+     * @brief Paces a replayed packet to its recorded time and waits while the fair queue is full.
+     * @param stamp Recorded time of the packet.
+     * @note Replay reads faster than any link, without the wait the whole file would end up queued.
+     */
+    void throttleReplay(const struct timespec& stamp);
+
+    /**
+     * @brief Waits until every replayed packet was handled, stops the threads and prints the ingest rate.
+     * @param started Time the replay began.
      */
-    static void packetCaptureLoop(u_char* user, 
-                                  const struct pcap_pkthdr* header, 
-                                  const u_char* packet);
+    void finishReplay(std::chrono::steady_clock::time_point started);
 
     /**
-     * @brief Consumes packets from the queue and dispatches them for processing.
+     * @brief Parses a received packet and queues it for its worker, called on the capture thread.
+     * @param packet IP header and everything after it.
+     * @param length Received bytes.
+     * @param stamp Kernel receive time of the packet.
+     */
+    void ingestPacket(const uint8_t* packet, size_t length, const struct timespec& stamp);
+
+    /**
+     * @brief Consumes packets from the queue and dispatches them to workers.
      */
     void packetConsumerLoop(void);
 
     /**
-     * @brief Processes a fully reassembled set of client packets.
-     * @param metadata Metadata describing the file/data.
-     * @param chunks Vector of raw payload chunks.
+     * @brief Processes packets of one worker and evicts its idle transfers.
+     * @param worker Worker run by the calling thread.
+     */
+    void workerLoop(Worker& worker);
+
+    /**
+     * @brief Picks the worker that owns the transfer.
+     * @param clientId Transfer ID.
+     * @return Owning worker.
+     */
+    Worker& workerFor(uint64_t clientId);
+
+    /**
+     * @brief Looks up scheduling weight of a client, client ID takes precedence over address.
+     * @param clientId Transfer ID.
+     * @param source Address of the client.
+     * @return Scheduling weight.
+     */
+    unsigned priorityFor(uint64_t clientId, const struct sockaddr_storage& source) const;
+
+    /**
+     * @brief Prints queue depths (total and of the busiest clients) and per-stage latency quantiles.
+     */
+    void reportStats(void);
+
+    /**
+     * @brief Writes counters, queue depths and high-water marks, receiver statistics and per-transfer progress.
+     * @param out Metrics text being built.
+     */
+    void collectMetrics(metrics::Writer& out);
+
+    /**
+     * @brief Publishes progress of the worker's transfers for the metrics.
+     * @param worker Worker run by the calling thread.
+     */
+    void publishProgress(Worker& worker);
+
+    /**
+     * @brief Updates total memory use after a transfer changed its own.
+     * @param before Memory held by the transfer before the change.
+     * @param after Memory held by the transfer after the change.
+     */
+    void accountMemory(size_t before, size_t after);
+
+    /**
+     * @brief Hands packet over to the transfer of its client, finishes or drops the transfer.
+     * @param worker Worker owning the transfer.
+     * @param queued Parsed packet with its source address.
+     */
+    void handlePacket(Worker& worker, QueuedPacket&& queued);
+
+    /**
+     * @brief Creates transfer, picking up its checkpoint if it was parked in the spool before.
+     * @param clientId Transfer ID.
+     * @return New transfer.
+     */
+    std::unique_ptr<Transfer> openTransfer(uint64_t clientId);
+
+    /**
+     * @brief Removes transfer from memory and from the memory accounting.
+     * @param worker Worker owning the transfer.
+     * @param it Transfer to remove.
+     * @param discard Also delete its output and spool files.
+     */
+    void dropTransfer(Worker& worker, std::map<uint64_t, std::unique_ptr<Transfer>>::iterator it, bool discard);
+
+    /**
+     * @brief Spills (or evicts if spilling is not possible) the largest transfers until memory use drops below the budget.
+     * @param worker Worker whose transfers may be spilled.
+     */
+    void enforceMemoryBudget(Worker& worker);
+
+    /**
+     * @brief Parks (spool enabled) or discards transfers that received no packets for the idle timeout.
+     * @param worker Worker whose transfers are checked.
+     */
+    void evictIdleTransfers(Worker& worker);
+
+    /**
+     * @brief Answers resume request with the state of the transfer.
+     * @param worker Worker owning the transfer.
+     * @param clientId Transfer ID from the request.
+     * @param source Address of the client.
+     */
+    void handleResumeRequest(Worker& worker, uint64_t clientId, const struct sockaddr_storage& source);
+
+    /**
+     * @brief Answers delta request with signatures of the server's copy of the file, one window of packets.
+     * @param clientId Transfer ID from the request.
+     * @param request Requested file and first block.
+     * @param source Address of the client.
+     */
+    void handleDeltaRequest(uint64_t clientId, const protocol::DeltaRequest& request,
+                            const struct sockaddr_storage& source);
+
+    /**
+     * @brief Tells the client what became of its transfer.
+     * @param clientId Transfer ID.
+     * @param status StatusCode of the transfer.
+     * @param missing Chunks the client should resend (STATUS_MISSING only).
+     * @param source Address of the client.
+     */
+    void sendStatus(uint64_t clientId, uint8_t status, std::vector<protocol::ChunkRange> missing,
+                    const struct sockaddr_storage& source);
+
+    /**
+     * @brief Sends packet to the client inside an ICMP Echo Reply.
+     * @param packet Packet to be sent.
+     * @param destination Address of the client.
+     * @return True if no issues occurred, false otherwise.
+     */
+    bool sendToClient(const protocol::Packet& packet, const struct sockaddr_storage& destination);
+
+    /**
+     * @brief Closes reply sockets no longer needed by a client.
+     * @param clientId Client whose transfer ended.
+     * @note Sockets of other clients behind the same address stay open.
+     */
+    void releaseReplyConnection(uint64_t clientId);
+
+    /**
+     * @brief Closes reply sockets that sent nothing for the idle timeout.
+     * @note Covers clients that only asked for resume state or signatures and never started a transfer.
+     */
+    void closeIdleReplyConnections(void);
+
+    /**
+     * @brief Creates transfer writing to the configured output (metadata file name, output path or sink).
+     * @param clientId Transfer ID.
+     * @return New transfer.
+     */
+    std::unique_ptr<Transfer> createTransfer(uint64_t clientId);
+
+    /**
+     * @brief Loads transfers interrupted by a previous run from the spool directory.
      */
-    void processPackets(const protocol::Metadata& metadata, 
-                        chunker::ByteVector2D&& chunks);
+    void restoreTransfers(void);
 
     /**
-     * @brief Updates metadata state for a given client if its first (metadata) packet is available.
-     * @param clientId ID of the client whose metadata is being updated.
+     * @brief Gives the output path to the first client that sends a packet.
+     * @param clientId Transfer ID.
+     * @return True if the client owns the output, false if another client does.
      */
-    void updateClientMetadata(uint64_t clientId);
+    bool claimOutput(uint64_t clientId);
 
     /**
-     * @brief Attempts to reassemble all packets for a client once enough data is received.
-     * @param clientId ID of the client being checked for completion.
+     * @brief Makes the capture loop return, so run() finishes.
      */
-    void tryReassemble(uint64_t clientId);
+    void stopCapture(void);
 };
 
 #endif // SERVER_HPP
\ No newline at end of file
@@ -0,0 +1,93 @@
+/**
+ * @file spool.hpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#ifndef SPOOL_HPP
+#define SPOOL_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/**
+ * @class Spool
+ * @brief On-disk storage of one transfer: ciphertext chunks at their offsets and a state blob
+ * @note Files are <dir>/<id>.chunks and <dir>/<id>.state (id in hex)
+ */
+class Spool {
+public:
+    /**
+     * @brief Constructor for Spool class
+     * @param dir Spool directory
+     * @param id Transfer ID
+     */
+    Spool(const std::string& dir, uint64_t id);
+
+    /**
+     * @brief Destructor for Spool class (closes chunk file)
+     */
+    ~Spool();
+
+    Spool(const Spool&) = delete;
+    Spool& operator=(const Spool&) = delete;
+    Spool(Spool&&) = delete;
+    Spool& operator=(Spool&&) = delete;
+
+    /**
+     * @brief Stores chunk at chunkNum * chunkSize in the chunk file
+     * @param chunkNum Index of the chunk
+     * @param chunkSize Size of a full chunk
+     * @param data Chunk data
+     * @return True if no issues, False if error occurred
+     */
+    bool writeChunk(uint64_t chunkNum, uint32_t chunkSize, const std::vector<uint8_t>& data);
+
+    /**
+     * @brief Loads chunk previously stored with writeChunk
+     * @param chunkNum Index of the chunk
+     * @param chunkSize Size of a full chunk
+     * @param len Size of this chunk
+     * @param data Chunk data (overwritten)
+     * @return True if no issues, False if error occurred
+     */
+    bool readChunk(uint64_t chunkNum, uint32_t chunkSize, size_t len, std::vector<uint8_t>& data);
+
+    /**
+     * @brief Atomically replaces the state file (write to temporary file, then rename)
+     * @param state Serialized state
+     * @return True if no issues, False if error occurred
+     */
+    bool saveState(const std::vector<uint8_t>& state);
+
+    /**
+     * @brief Loads the state file
+     * @param state Serialized state (overwritten)
+     * @return True if no issues, False if error occurred
+     */
+    bool loadState(std::vector<uint8_t>& state);
+
+    /**
+     * @brief Deletes both files of the transfer
+     */
+    void remove(void);
+
+    /**
+     * @brief Lists transfers that have a state file in the directory
+     * @param dir Spool directory
+     * @return IDs of stored transfers
+     */
+    static std::vector<uint64_t> listTransfers(const std::string& dir);
+
+private:
+    std::string chunkPath;  ///< Path of the chunk file
+    std::string statePath;  ///< Path of the state file
+    int fd;                 ///< Chunk file descriptor (opened lazily)
+
+    /**
+     * @brief Opens chunk file if it is not opened yet
+     * @return True if no issues, False if error occurred
+     */
+    bool openChunks(void);
+};
+
+#endif // SPOOL_HPP
@@ -0,0 +1,173 @@
+/**
+ * @file trace.hpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "metrics.hpp"
+
+/**
+ * @namespace trace
+ * @brief Latency histograms of the pipeline stages and optional spans for a Chrome trace
+ * @note Every stage always feeds its histogram. With tracing enabled the spans also go into a ring buffer
+ *       that is dumped as Chrome trace JSON (chrome://tracing, Perfetto) on SIGUSR1 and at exit.
+ */
+namespace trace {
+    constexpr size_t TRACE_CAPACITY = 1 << 20;      ///< Spans kept, older ones are overwritten
+    constexpr auto DUMP_CHECK_INTERVAL = std::chrono::seconds(1); ///< Longest delay of a requested dump
+
+    /**
+     * @enum ServerStage
+     * @brief Stages a packet passes on the server
+     */
+    enum ServerStage : size_t {
+        SERVER_KERNEL_QUEUE,    ///< Wait in the kernel, from the receive timestamp to the capture callback
+        SERVER_CAPTURE,         ///< Capture callback, from the receiver to the fair queue
+        SERVER_PARSE,           ///< parsePacket
+        SERVER_CAPTURE_QUEUE,   ///< Wait in the fair queue
+        SERVER_WORKER_QUEUE,    ///< Wait in the queue of a worker
+        SERVER_PROCESS,         ///< Whole handling of the packet by the worker
+        SERVER_REASSEMBLE,      ///< Tag check, buffering and in-order processing of a chunk
+        SERVER_DECRYPT,         ///< Decryption and Merkle leaf of a chunk
+        SERVER_WRITE,           ///< Write of a batch by the I/O thread
+        SERVER_STAGES
+    };
+
+    /**
+     * @enum ClientStage
+     * @brief Stages the file passes on the client
+     */
+    enum ClientStage : size_t {
+        CLIENT_READ,            ///< Read of the source (file, archive, delta or compressor)
+        CLIENT_ENCRYPT,         ///< Encryption and Merkle leaves of a read
+        CLIENT_CHUNK,           ///< Cutting and tagging the chunks of a read
+        CLIENT_SERIALIZE,       ///< Building and serializing a Data packet
+        CLIENT_SEND,            ///< Sending a packet to one destination
+        CLIENT_STAGES
+    };
+
+    extern const char* const SERVER_STAGE_NAMES[SERVER_STAGES];    ///< Names of ServerStage
+    extern const char* const CLIENT_STAGE_NAMES[CLIENT_STAGES];    ///< Names of ClientStage
+
+    /**
+     * @class Pipeline
+     * @brief Histograms of the stages of one process and the spans of its trace
+     */
+    class Pipeline {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        /**
+         * @brief Constructor for Pipeline class
+         * @param names Stage names
+         * @param count Number of stages
+         */
+        Pipeline(const char* const* names, size_t count);
+
+        Pipeline(const Pipeline&) = delete;
+        Pipeline& operator=(const Pipeline&) = delete;
+
+        /**
+         * @brief Records one pass through a stage, from any thread
+         * @param stage Index of the stage
+         * @param start Time the stage began
+         * @param end Time the stage ended
+         * @param arg Chunk number or transfer ID shown with the span
+         */
+        void record(size_t stage, Clock::time_point start, Clock::time_point end, uint64_t arg = 0);
+
+        /**
+         * @brief Starts keeping spans for the trace
+         * @param path Chrome trace file written by dump()
+         */
+        void enableTrace(const std::string& path);
+
+        /**
+         * @brief Writes the kept spans as Chrome trace JSON (nothing without tracing)
+         * @return True if no issues, False if the file can not be written
+         */
+        bool dump(void);
+
+        /**
+         * @brief Writes quantiles, sum and count of every stage as one Prometheus summary
+         * @param out Metrics text being built
+         * @param name Metric name
+         */
+        void exportMetrics(metrics::Writer& out, const std::string& name) const;
+
+        /**
+         * @brief Getters for the stages
+         */
+        size_t size(void) const { return histograms.size(); }
+        const char* name(size_t stage) const { return names[stage]; }
+        const metrics::Histogram& histogram(size_t stage) const { return *histograms[stage]; }
+        bool isTracing(void) const { return !tracePath.empty(); }
+
+    private:
+        /**
+         * @struct Span
+         * @brief One pass through a stage
+         */
+        struct Span {
+            uint32_t stage = 0;         ///< Index of the stage
+            uint32_t thread = 0;        ///< Kernel thread ID
+            uint64_t startNs = 0;       ///< Start relative to the creation of the pipeline
+            uint64_t durationNs = 0;    ///< Duration
+            uint64_t arg = 0;           ///< Chunk number or transfer ID
+        };
+
+        const char* const* names;                                   ///< Stage names
+        std::vector<std::unique_ptr<metrics::Histogram>> histograms; ///< Latency per stage
+        Clock::time_point epoch;                                    ///< Zero of the trace timestamps
+        std::string tracePath;                                      ///< Trace file (empty = tracing off)
+        std::vector<Span> spans;                                    ///< Ring buffer of spans
+        size_t nextSpan = 0;                                        ///< Slot of the next span
+        bool wrapped = false;                                       ///< Ring buffer overwrote old spans
+        std::mutex spanMutex;                                       ///< Mutex protecting the ring buffer
+    };
+
+    /**
+     * @class Scope
+     * @brief Records the stage for the lifetime of the object, does nothing without a pipeline
+     */
+    class Scope {
+    public:
+        Scope(Pipeline* pipeline, size_t stage, uint64_t arg = 0)
+            : pipeline(pipeline), stage(stage), arg(arg),
+              start(pipeline ? Pipeline::Clock::now() : Pipeline::Clock::time_point{}) {}
+        ~Scope() {
+            if (pipeline) {
+                pipeline->record(stage, start, Pipeline::Clock::now(), arg);
+            }
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        Pipeline* pipeline;                 ///< Pipeline of the process (null = not measured)
+        size_t stage;                       ///< Index of the stage
+        uint64_t arg;                       ///< Chunk number or transfer ID
+        Pipeline::Clock::time_point start;  ///< Time the stage began
+    };
+
+    /**
+     * @brief Makes SIGUSR1 request a trace dump
+     */
+    void installDumpSignal(void);
+
+    /**
+     * @brief Checks and clears a pending dump request
+     * @return True if SIGUSR1 arrived since the last call
+     */
+    bool takeDumpRequest(void);
+}
+
+#endif // TRACE_HPP
@@ -0,0 +1,198 @@
+/**
+ * @file transfer.hpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#ifndef TRANSFER_HPP
+#define TRANSFER_HPP
+
+#include <map>
+#include <set>
+#include <memory>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <chrono>
+#include <optional>
+#include "protocol.hpp"
+#include "encoder.hpp"
+#include "file_handler.hpp"
+#include "spool.hpp"
+#include "compress.hpp"
+#include "trace.hpp"
+
+/**
+ * @class Transfer
+ * @brief Server side state of one file transfer
+ * @note Chunks are decrypted and written as soon as they are next in order,
+ *       only out-of-order chunks are kept in memory (or in the spool)
+ */
+class Transfer {
+public:
+    /**
+     * @brief Constructor for Transfer class
+     * @param id Transfer ID (client ID from packet header)
+     * @param key AES key for decryption
+     * @param spoolDir Directory for checkpoints, empty disables them
+     * @param writer I/O thread for the output file (nullptr = write synchronously)
+     * @param outputPath Output written in place of the file named by metadata (empty = use metadata)
+     * @param pipeline Stage latencies of the server (nullptr = not measured)
+     */
+    Transfer(uint64_t id, const std::vector<uint8_t>& key, const std::string& spoolDir = "",
+             DiskWriter* writer = nullptr, const std::string& outputPath = "", trace::Pipeline* pipeline = nullptr);
+
+    /**
+     * @brief Validates metadata, opens output file and processes already received chunks
+     * @param metadata Metadata of the transfer
+     * @return True if no issues, False if the transfer can not continue
+     */
+    bool setMetadata(const protocol::Metadata& metadata);
+
+    /**
+     * @brief Stores chunk and processes every chunk that is next in order
+     * @param data Received chunk
+     * @return True if no issues, False if the transfer can not continue
+     */
+    bool addChunk(protocol::Data&& data);
+
+    /**
+     * @brief Stores the Merkle root, fixes size of a stream whose metadata had UNKNOWN_SIZE and processes the last chunks
+     * @param end End marker
+     * @return True if no issues, False if the transfer can not continue
+     */
+    bool setEnd(const protocol::End& end);
+
+    /**
+     * @brief Loads transfer from its last checkpoint in the spool directory
+     * @return True if no issues, False if there is no usable checkpoint
+     */
+    bool restore(void);
+
+    /**
+     * @brief Persists output progress, out-of-order chunks and the received-chunk bitmap
+     * @return True if no issues (or checkpoints are disabled), False if error occurred
+     */
+    bool checkpoint(void);
+
+    /**
+     * @brief Moves out-of-order chunks from memory to the spool (checkpoint)
+     * @return True if memory was released, False if the transfer can not spill (no spool or metadata)
+     */
+    bool spill(void);
+
+    /**
+     * @brief Checkpoints the transfer and releases all of its memory and files, it can be restored later
+     * @return True if the transfer was parked, False if it can not be (no spool or metadata)
+     */
+    bool park(void);
+
+    /**
+     * @brief Describes what the server has, for the client to send only the rest
+     * @param maxRanges Maximum number of ranges (the last one is extended to the end)
+     * @return Resume state of the transfer
+     */
+    protocol::ResumeState getResumeState(size_t maxRanges) const;
+
+    /**
+     * @brief Hands out chunks dropped since the last call because their tag did not match
+     * @return Indexes of the corrupted chunks
+     */
+    std::vector<uint64_t> takeCorruptChunks(void);
+
+    /**
+     * @brief Rate limits requests for missing chunks, so a burst of End copies asks only once
+     * @param interval Minimum time between two requests
+     * @return True if a request may be sent now
+     */
+    bool claimNack(std::chrono::milliseconds interval);
+
+    /**
+     * @brief Removes output and spool files of an unfinished transfer
+     */
+    void discard(void);
+
+    /**
+     * @brief Getters for transfer state
+     */
+    bool hasMetadata() const { return metadataReceived; }
+    bool hasEnd() const { return !expectedRoot.empty(); }
+    bool isComplete() const { return metadataReceived && hasEnd() && nextChunk == metadata.totalChunks; }
+    const protocol::Metadata& getMetadata() const { return metadata; }
+    bool canSpill() const { return spool && metadataReceived && !stream; }
+    uint64_t getWrittenChunks() const { return nextChunk; }
+    uint64_t getWrittenBytes() const { return writtenBytes; }
+    size_t getBufferedChunks() const { return pendingChunks.size() + spooledChunks.size(); }
+
+    /**
+     * @brief Memory held by buffered chunks (payload plus container overhead estimate)
+     * @return Bytes held by the transfer
+     */
+    size_t getMemoryUsage() const { return memoryUsage; }
+
+    /**
+     * @brief Time of the last packet that belonged to the transfer
+     * @return Last activity time
+     */
+    std::chrono::steady_clock::time_point getLastActivity() const { return lastActivity; }
+
+    /**
+     * @brief Marks the transfer as active now
+     */
+    void touch() { lastActivity = std::chrono::steady_clock::now(); }
+
+private:
+    uint64_t id;                                            ///< Transfer ID
+    std::vector<uint8_t> key;                               ///< AES key
+    std::vector<uint8_t> tagKey;                            ///< Key of the chunk tags
+    protocol::Metadata metadata;                            ///< Metadata of the transfer
+    bool metadataReceived = false;                          ///< Metadata packet arrived
+    bool stream = false;                                    ///< Size was unknown in metadata (no checkpoints)
+    std::optional<protocol::End> pendingEnd;                ///< End packet that arrived before metadata
+    std::string outputPath;                                 ///< Output overriding the metadata file name
+    uint64_t nextChunk = 0;                                 ///< Index of the next chunk to be written
+    uint64_t writtenBytes = 0;                              ///< Plaintext bytes decrypted so far (before decompression)
+    std::map<uint64_t, std::vector<uint8_t>> pendingChunks; ///< Out-of-order chunks in memory
+    std::set<uint64_t> spooledChunks;                       ///< Out-of-order chunks in the spool
+    std::vector<uint8_t> chainBlock;                        ///< Last processed cipher block (CBC IV of next chunk)
+    uint64_t chunksSinceCheckpoint = 0;                     ///< Processed chunks since last checkpoint
+    size_t memoryUsage = 0;                                 ///< Bytes held by pendingChunks and spooledChunks
+    std::chrono::steady_clock::time_point lastActivity;     ///< Time of the last received packet
+    std::unique_ptr<encoder::Decryptor> decryptor;          ///< Decryption state (CBC chain)
+    std::unique_ptr<compress::Decompressor> decompressor;   ///< Decompression state (null for CODEC_NONE)
+    std::unique_ptr<Spool> spool;                           ///< Checkpoint storage (null if disabled)
+    encoder::MerkleTree merkle;                             ///< Merkle tree of the processed plaintext chunks
+    std::vector<uint8_t> expectedRoot;                      ///< Merkle root from the End packet (empty until it arrives)
+    std::vector<uint64_t> corruptChunks;                    ///< Chunks dropped for a wrong tag, not reported yet
+    std::chrono::steady_clock::time_point lastNack;         ///< Time of the last request for missing chunks
+    file_handler::FileWriter output;                        ///< Output file
+    trace::Pipeline* pipeline;                              ///< Stage latencies (null = not measured)
+
+    /**
+     * @brief Decrypts and writes chunks while the next one in order is available
+     * @return True if no issues, False if the transfer can not continue
+     */
+    bool processReadyChunks(void);
+
+    /**
+     * @brief Checks the size of a chunk against metadata
+     * @param chunkNum Index of the chunk
+     * @return Expected size of the chunk, 0 if the chunk does not belong to the transfer
+     */
+    size_t expectedChunkSize(uint64_t chunkNum) const;
+
+    /**
+     * @brief Checks the size of a chunk, while the stream length is unknown any chunk can be the last one
+     * @param chunkNum Index of the chunk
+     * @param size Size of the chunk
+     * @return True if the chunk fits the transfer
+     */
+    bool isValidChunk(uint64_t chunkNum, size_t size) const;
+
+    /**
+     * @brief Checks if the chunk was already received
+     * @param chunkNum Index of the chunk
+     * @return True if chunk was written, is pending or spooled
+     */
+    bool hasChunk(uint64_t chunkNum) const;
+};
+
+#endif // TRANSFER_HPP
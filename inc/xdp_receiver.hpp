@@ -0,0 +1,110 @@
+/**
+ * @file xdp_receiver.hpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#ifndef XDP_RECEIVER_HPP
+#define XDP_RECEIVER_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include "receiver.hpp"
+
+struct xdp_ring_offset;
+struct xdp_statistics;
+
+/**
+ * @class XdpReceiver
+ * @brief Receiver on an AF_XDP socket, packets skip the kernel network stack
+ * @note A small XDP program on the interface redirects echo requests carrying the protocol magic and version
+ *       to the socket's RX ring, everything else (ARP, plain pings, path MTU probes) goes on to the kernel.
+ *       The packets are parsed straight from the UMEM frames the kernel copied them into and the frames are
+ *       handed back afterwards. One socket serves one receive queue of one interface; generic (SKB) mode works
+ *       on any interface, veth included, native mode needs driver support.
+ */
+class XdpReceiver : public Receiver {
+public:
+    /**
+     * @brief Constructor for XdpReceiver class
+     * @param capture Settings of the capture (device, queue and XDP mode)
+     */
+    XdpReceiver(const Capture& capture);
+
+    /**
+     * @brief Destructor for XdpReceiver class (detaches the program and frees the rings)
+     */
+    ~XdpReceiver() override;
+
+    XdpReceiver(const XdpReceiver&) = delete;
+    XdpReceiver& operator=(const XdpReceiver&) = delete;
+
+    bool open(void) override;
+    bool run(const Handler& handler) override;
+    void stop(void) override;
+    void exportMetrics(metrics::Writer& out) override;
+    void report(void) override;
+
+private:
+    /**
+     * @struct Ring
+     * @brief Single producer, single consumer ring shared with the kernel
+     */
+    struct Ring {
+        uint32_t* producer = nullptr;   ///< Producer index (kernel for RX, us for fill)
+        uint32_t* consumer = nullptr;   ///< Consumer index (us for RX, kernel for fill)
+        void* entries = nullptr;        ///< xdp_desc (RX) or frame addresses (fill)
+        void* map = nullptr;            ///< Mapping of the ring
+        size_t mapSize = 0;             ///< Size of the mapping
+        uint32_t mask = 0;              ///< Entries - 1, the size is a power of two
+    };
+
+    const Capture capture;              ///< Settings of the capture
+    unsigned ifindex = 0;               ///< Interface the program is attached to
+    int mapFd = -1;                     ///< XSKMAP from receive queue to socket
+    int progFd = -1;                    ///< Loaded XDP program
+    int linkFd = -1;                    ///< Attachment of the program, closing it detaches the program
+    int xskFd = -1;                     ///< AF_XDP socket
+    int stopFd = -1;                    ///< eventfd waking run() for stop()
+    uint8_t* umem = nullptr;            ///< Frames the kernel copies packets into
+    Ring fill;                          ///< Free frames handed to the kernel
+    Ring rx;                            ///< Received packets
+    metrics::Counter received;          ///< Packets read from the RX ring
+    metrics::Counter batches;           ///< Wakeups that found packets
+
+    /**
+     * @brief Creates the XSKMAP and loads the program redirecting our packets into it
+     * @return True if no issues, False if there was an error
+     */
+    bool loadProgram(void);
+
+    /**
+     * @brief Creates the socket with its UMEM and rings and binds it to the receive queue
+     * @return True if no issues, False if there was an error
+     */
+    bool createSocket(void);
+
+    /**
+     * @brief Maps one ring of the socket
+     * @param ring Ring to fill in
+     * @param offset Page offset selecting the ring
+     * @param layout Offsets of the indexes and entries inside the mapping
+     * @param entries Number of entries
+     * @param entrySize Size of one entry
+     * @return True if no issues, False if there was an error
+     */
+    bool mapRing(Ring& ring, off_t offset, const struct xdp_ring_offset& layout, uint32_t entries, size_t entrySize);
+
+    /**
+     * @brief Hands over the received packets and returns their frames to the fill ring
+     * @param handler Called for every packet
+     */
+    void readBatch(const Handler& handler);
+
+    /**
+     * @brief Reads the drop counters of the socket
+     * @param stats Counters (output)
+     * @return True if the counters are available
+     */
+    bool readStatistics(struct xdp_statistics& stats);
+};
+
+#endif // XDP_RECEIVER_HPP
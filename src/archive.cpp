@@ -0,0 +1,340 @@
+/**
+ * @file archive.cpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#include "archive.hpp"
+#include <fstream>
+#include <filesystem>
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+
+constexpr size_t ENTRY_HEADER_SIZE = 1 + 4 + 8 + 8 + 2;  ///< Type, mode, mtime, size and path length
+constexpr size_t COPY_BUFFER_SIZE = 64 * 1024;          ///< Piece of content copied at once when unpacking
+
+/**
+ * @brief Appends big endian number of the given width to the buffer
+ */
+template <typename T>
+static void appendBE(std::vector<uint8_t>& out, T value) {
+    for (size_t i = sizeof(T); i > 0; --i) {
+        out.push_back(static_cast<uint8_t>(static_cast<uint64_t>(value) >> ((i - 1) * 8)));
+    }
+}
+
+/**
+ * @brief Reads big endian number of the given width from the stream
+ */
+template <typename T>
+static bool readBE(std::istream& in, T& value) {
+    uint8_t buf[sizeof(T)];
+    if (!in.read(reinterpret_cast<char*>(buf), sizeof(buf))) {
+        return false;
+    }
+    uint64_t result = 0;
+    for (uint8_t byte : buf) {
+        result = (result << 8) | byte;
+    }
+    value = static_cast<T>(result);
+    return true;
+}
+
+/**
+ * @brief Creates archive entry from file status
+ */
+static archive::Entry makeEntry(const struct stat& st, const std::string& path, const std::string& source) {
+    archive::Entry entry;
+    entry.type = S_ISDIR(st.st_mode) ? archive::ENTRY_DIRECTORY : archive::ENTRY_FILE;
+    entry.mode = st.st_mode & 07777;
+    entry.mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    entry.size = S_ISDIR(st.st_mode) ? 0 : static_cast<uint64_t>(st.st_size);
+    entry.path = path;
+    entry.source = source;
+    return entry;
+}
+
+/**
+ * @brief Sets modification time of an opened file or directory
+ */
+static void setModificationTime(int fd, int64_t mtime) {
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = static_cast<time_t>(mtime / 1000000000);
+    times[1].tv_nsec = static_cast<long>(mtime % 1000000000);
+    futimens(fd, times);
+}
+
+archive::Packer::~Packer() {
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+bool archive::Packer::addEntry(Entry&& entry) {
+    if (entry.path.size() > MAX_PATH_LEN) {
+        std::cerr << "[ARCHIVE] Path is too long: " << entry.path << std::endl;
+        return false;
+    }
+    if (!paths.insert(entry.path).second) {
+        std::cerr << "[ARCHIVE] " << entry.path << " was given twice" << std::endl;
+        return false;
+    }
+
+    entries.push_back(std::move(entry));
+    return true;
+}
+
+bool archive::Packer::add(const std::string& path) {
+    std::error_code ec;
+    std::filesystem::path root = std::filesystem::absolute(path, ec).lexically_normal();
+    if (!root.has_filename()) {
+        root = root.parent_path();
+    }
+    std::string name = root.filename().string();
+
+    struct stat st;
+    if (ec || name.empty() || lstat(path.c_str(), &st) != 0) {
+        std::cerr << "[ARCHIVE] Cannot pack " << path << std::endl;
+        return false;
+    }
+
+    if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+        std::cerr << "[ARCHIVE] Skipping " << path << ", not a regular file or directory" << std::endl;
+        return true;
+    }
+    if (!addEntry(makeEntry(st, name, path))) {
+        return false;
+    }
+    roots.push_back(name);
+    if (S_ISREG(st.st_mode)) {
+        return true;
+    }
+
+    // Sorted walk gives the same archive (and transfer ID) for an unchanged tree
+    std::vector<std::pair<std::string, std::string>> found;
+    std::filesystem::recursive_directory_iterator it(path, ec), end;
+    for (; !ec && it != end; it.increment(ec)) {
+        std::string relative = it->path().lexically_relative(path).generic_string();
+        found.emplace_back(name + "/" + relative, it->path().string());
+    }
+    if (ec) {
+        std::cerr << "[ARCHIVE] Cannot read directory " << path << " (" << ec.message() << ")" << std::endl;
+        return false;
+    }
+    std::sort(found.begin(), found.end());
+
+    for (const auto& [entryPath, source] : found) {
+        if (lstat(source.c_str(), &st) != 0) {
+            std::cerr << "[ARCHIVE] Cannot stat " << source << std::endl;
+            return false;
+        }
+        if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+            std::cerr << "[ARCHIVE] Skipping " << source << ", not a regular file or directory" << std::endl;
+            continue;
+        }
+        if (!addEntry(makeEntry(st, entryPath, source))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool archive::Packer::finish(void) {
+    if (entries.empty()) {
+        std::cerr << "[ARCHIVE] Nothing to send" << std::endl;
+        return false;
+    }
+
+    manifest.clear();
+    appendBE<uint32_t>(manifest, MAGIC);
+    appendBE<uint64_t>(manifest, entries.size());
+
+    uint64_t contentSize = 0;
+    for (const auto& entry : entries) {
+        appendBE<uint8_t>(manifest, entry.type);
+        appendBE<uint32_t>(manifest, entry.mode);
+        appendBE<int64_t>(manifest, entry.mtime);
+        appendBE<uint64_t>(manifest, entry.size);
+        appendBE<uint16_t>(manifest, static_cast<uint16_t>(entry.path.size()));
+        manifest.insert(manifest.end(), entry.path.begin(), entry.path.end());
+        contentSize += entry.size;
+    }
+
+    size = manifest.size() + contentSize;
+    return true;
+}
+
+bool archive::Packer::read(std::vector<uint8_t>& data, size_t maxLen) {
+    data.clear();
+
+    if (manifestOffset < manifest.size()) {
+        size_t n = std::min(maxLen, manifest.size() - manifestOffset);
+        data.assign(manifest.begin() + manifestOffset, manifest.begin() + manifestOffset + n);
+        manifestOffset += n;
+    }
+
+    // Contents follow each other without gaps, so one read spans as many small files as fit
+    while (data.size() < maxLen) {
+        if (fd < 0) {
+            while (current < entries.size() && (entries[current].type != ENTRY_FILE || entries[current].size == 0)) {
+                ++current;
+            }
+            if (current == entries.size()) {
+                break;
+            }
+
+            fd = ::open(entries[current].source.c_str(), O_RDONLY);
+            if (fd < 0) {
+                std::cerr << "[ARCHIVE] Cannot open " << entries[current].source << std::endl;
+                return false;
+            }
+            left = entries[current].size;
+        }
+
+        size_t offset = data.size();
+        size_t n = static_cast<size_t>(std::min<uint64_t>(left, maxLen - offset));
+        data.resize(offset + n);
+        ssize_t ret = ::read(fd, data.data() + offset, n);
+        if (ret < 0 && errno == EINTR) {
+            data.resize(offset);
+            continue;
+        }
+        if (ret <= 0) {
+            // Manifest already promised the size, a shorter file can not be sent any more
+            std::cerr << "[ARCHIVE] " << entries[current].source << " changed while being sent" << std::endl;
+            return false;
+        }
+        data.resize(offset + static_cast<size_t>(ret));
+        left -= static_cast<uint64_t>(ret);
+
+        if (left == 0) {
+            ::close(fd);
+            fd = -1;
+            ++current;
+        }
+    }
+    return true;
+}
+
+bool archive::isSafePath(const std::string& path) {
+    if (path.empty() || path.size() > MAX_PATH_LEN || path.front() == '/') {
+        return false;
+    }
+
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+        std::string part = path.substr(start, end - start);
+        if (part.empty() || part == "." || part == "..") {
+            return false;
+        }
+        start = end + 1;
+    }
+    return path.find('\0') == std::string::npos;
+}
+
+bool archive::extract(const std::string& archivePath, const std::string& destDir) {
+    std::ifstream in(archivePath, std::ios::binary);
+    std::error_code ec;
+    uint64_t archiveSize = std::filesystem::file_size(archivePath, ec);
+    if (!in.is_open() || ec) {
+        std::cerr << "[ARCHIVE] Cannot open " << archivePath << std::endl;
+        return false;
+    }
+
+    uint32_t magic;
+    uint64_t count;
+    if (!readBE(in, magic) || !readBE(in, count) || magic != MAGIC || count > archiveSize / ENTRY_HEADER_SIZE) {
+        std::cerr << "[ARCHIVE] " << archivePath << " is not an archive" << std::endl;
+        return false;
+    }
+
+    std::vector<Entry> entries;
+    for (uint64_t i = 0; i < count; ++i) {
+        Entry& entry = entries.emplace_back();
+        uint16_t pathLen;
+        if (!readBE(in, entry.type) || !readBE(in, entry.mode) || !readBE(in, entry.mtime) ||
+            !readBE(in, entry.size) || !readBE(in, pathLen)) {
+            std::cerr << "[ARCHIVE] Truncated manifest in " << archivePath << std::endl;
+            return false;
+        }
+        entry.path.resize(pathLen);
+        if (!in.read(&entry.path[0], pathLen)) {
+            std::cerr << "[ARCHIVE] Truncated manifest in " << archivePath << std::endl;
+            return false;
+        }
+
+        // Client controls the paths, nothing may land outside of the destination
+        if (!isSafePath(entry.path) || (entry.type != ENTRY_FILE && entry.type != ENTRY_DIRECTORY)) {
+            std::cerr << "[ARCHIVE] Refusing entry " << entry.path << std::endl;
+            return false;
+        }
+    }
+
+    std::vector<char> buffer(COPY_BUFFER_SIZE);
+    for (const auto& entry : entries) {
+        std::filesystem::path target = std::filesystem::path(destDir) / entry.path;
+        if (entry.type == ENTRY_DIRECTORY) {
+            std::filesystem::create_directories(target, ec);
+            if (ec) {
+                std::cerr << "[ARCHIVE] Cannot create directory " << target.string() << " (" << ec.message() << ")" << std::endl;
+                return false;
+            }
+            continue;
+        }
+
+        std::filesystem::create_directories(target.parent_path(), ec);
+        int fd = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, entry.mode & 0777);
+        if (ec || fd < 0) {
+            std::cerr << "[ARCHIVE] Cannot create " << target.string() << std::endl;
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            return false;
+        }
+
+        uint64_t left = entry.size;
+        while (left > 0) {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(left, buffer.size()));
+            if (!in.read(buffer.data(), n) ||
+                !DiskWriter::writeAll(fd, reinterpret_cast<const uint8_t*>(buffer.data()), n)) {
+                std::cerr << "[ARCHIVE] Cannot unpack " << target.string() << std::endl;
+                ::close(fd);
+                return false;
+            }
+            left -= n;
+        }
+
+        fchmod(fd, entry.mode & 0777);
+        setModificationTime(fd, entry.mtime);
+        ::close(fd);
+    }
+
+    if (in.peek() != std::ifstream::traits_type::eof()) {
+        std::cerr << "[ARCHIVE] Trailing data in " << archivePath << std::endl;
+        return false;
+    }
+
+    // Directories last (deepest first), writing their files would change them again
+    for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+        if (it->type != ENTRY_DIRECTORY) {
+            continue;
+        }
+        std::filesystem::path target = std::filesystem::path(destDir) / it->path;
+        int fd = ::open(target.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (fd >= 0) {
+            fchmod(fd, it->mode & 0777);
+            setModificationTime(fd, it->mtime);
+            ::close(fd);
+        }
+    }
+    return true;
+}
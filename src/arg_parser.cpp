@@ -3,45 +3,478 @@
  * @author Michal Repcik (xrepcim00)
  */
 #include "arg_parser.hpp"
+#include "icmp_connection.hpp"
+#include "server.hpp"
 #include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <arpa/inet.h>
+
+/**
+ * @brief Splits a number from its unit suffix
+ * @param text Value such as 20ms or 1.5%
+ * @param value Number (output)
+ * @param unit Suffix, lowercase (output)
+ * @return True if the text starts with a non-negative number
+ */
+static bool splitUnit(const std::string& text, double& value, std::string& unit) {
+    size_t used = 0;
+    try {
+        value = std::stod(text, &used);
+    } catch (const std::exception&) {
+        return false;
+    }
+    unit = text.substr(used);
+    std::transform(unit.begin(), unit.end(), unit.begin(), [](unsigned char c) { return std::tolower(c); });
+    return value >= 0;
+}
 
 ArgParser::ArgParser(size_t argc, char* argv[]) 
-    : argc(argc), argv(argv), serverFlag(false) {}
+    : argc(argc), argv(argv), serverFlag(false), pathMTU(0), resumeFlag(false), deltaFlag(false),
+      compressFlag(false), multipathFlag(false), memoryLimit(0), idleTimeout(DEFAULT_IDLE_TIMEOUT), workers(0), statsInterval(0),
+      ioMode(DiskWriter::Mode::BUFFERED), replaySpeed(0.0), sinkFlag(false),
+      receiver(Receiver::Backend::PCAP) {}
 
 bool ArgParser::parse(void) {
     for (size_t i = 1; i < argc; ++i) {
         std::string arg = argv[i];
         if (arg == "-r" && i + 1 < argc) {
-            filePath = argv[++i];
+            filePaths.push_back(argv[++i]);
+        } 
+        else if (arg == "--files-from" && i + 1 < argc) {
+            if (!readFileList(argv[++i])) {
+                return false;
+            }
         } 
         else if (arg == "-s" && i + 1 < argc) {
-            targetAddress = argv[++i];
+            targetAddresses.push_back(argv[++i]);
         } 
         else if (arg == "-l") {
             serverFlag = true;
         } 
+        else if (arg == "-m" && i + 1 < argc) {
+            try {
+                pathMTU = std::stoul(argv[++i]);
+            } catch (const std::exception&) {
+                pathMTU = 0;
+            }
+            if (pathMTU < MIN_IPV4_MTU || pathMTU > 65535) {
+                std::cerr << "[ARG_PARSER] Error: MTU must be in range " << MIN_IPV4_MTU << "-65535" << std::endl;
+                return false;
+            }
+        } 
+        else if (arg == "-o" && i + 1 < argc) {
+            outputPath = argv[++i];
+        } 
+        else if (arg == "--resume") {
+            resumeFlag = true;
+        } 
+        else if (arg == "--delta") {
+            deltaFlag = true;
+        } 
+        else if (arg == "--compress") {
+            compressFlag = true;
+        } 
+        else if (arg == "--multipath") {
+            multipathFlag = true;
+        } 
+        else if (arg == "--metrics-file" && i + 1 < argc) {
+            metricsFile = argv[++i];
+        } 
+        else if (arg == "--metrics-socket" && i + 1 < argc) {
+            metricsSocket = argv[++i];
+        } 
+        else if (arg == "--trace-file" && i + 1 < argc) {
+            traceFile = argv[++i];
+        } 
+        else if (arg == "--generate" && i + 1 < argc) {
+            generateFile = argv[++i];
+        } 
+        else if (arg == "--impair" && i + 1 < argc) {
+            if (!parseImpairment(argv[++i])) {
+                return false;
+            }
+        } 
+        else if (arg == "--spool-dir" && i + 1 < argc) {
+            spoolDir = argv[++i];
+        } 
+        else if (arg == "--memory-limit" && i + 1 < argc) {
+            try {
+                memoryLimit = std::stoul(argv[++i]) * 1024 * 1024;
+            } catch (const std::exception&) {
+                std::cerr << "[ARG_PARSER] Error: Memory limit must be a number of MiB" << std::endl;
+                return false;
+            }
+        } 
+        else if (arg == "--workers" && i + 1 < argc) {
+            try {
+                workers = std::stoul(argv[++i]);
+            } catch (const std::exception&) {
+                workers = 0;
+            }
+            if (workers == 0 || workers > 256) {
+                std::cerr << "[ARG_PARSER] Error: Worker count must be in range 1-256" << std::endl;
+                return false;
+            }
+        } 
+        else if (arg == "--stats-interval" && i + 1 < argc) {
+            try {
+                statsInterval = static_cast<unsigned>(std::stoul(argv[++i]));
+            } catch (const std::exception&) {
+                std::cerr << "[ARG_PARSER] Error: Stats interval must be a number of seconds" << std::endl;
+                return false;
+            }
+        } 
+        else if (arg == "--io-mode" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode == "buffered") {
+                ioMode = DiskWriter::Mode::BUFFERED;
+            }
+            else if (mode == "direct") {
+                ioMode = DiskWriter::Mode::DIRECT;
+            }
+            else if (mode == "writeback") {
+                ioMode = DiskWriter::Mode::WRITEBACK;
+            }
+            else {
+                std::cerr << "[ARG_PARSER] Error: I/O mode must be buffered, direct or writeback" << std::endl;
+                return false;
+            }
+        } 
+        else if (arg == "--priority" && i + 1 < argc) {
+            if (!parsePriority(argv[++i])) {
+                return false;
+            }
+        } 
+        else if (arg == "--replay" && i + 1 < argc) {
+            replayFile = argv[++i];
+            serverFlag = true;
+        } 
+        else if (arg == "--replay-speed" && i + 1 < argc) {
+            try {
+                replaySpeed = std::stod(argv[++i]);
+            } catch (const std::exception&) {
+                replaySpeed = -1.0;
+            }
+            if (!(replaySpeed >= 0.0)) {
+                std::cerr << "[ARG_PARSER] Error: Replay speed must be a non-negative number" << std::endl;
+                return false;
+            }
+        } 
+        else if (arg == "--sink") {
+            sinkFlag = true;
+        } 
+        else if (arg == "--capture" && i + 1 < argc) {
+            if (!parseCapture(argv[++i])) {
+                return false;
+            }
+        } 
+        else if (arg == "--receiver" && i + 1 < argc) {
+            std::string backend = argv[++i];
+            if (backend == "pcap") {
+                receiver = Receiver::Backend::PCAP;
+            }
+            else if (backend == "raw") {
+                receiver = Receiver::Backend::RAW;
+            }
+            else if (backend == "xdp") {
+                receiver = Receiver::Backend::XDP;
+            }
+            else {
+                std::cerr << "[ARG_PARSER] Error: Receiver must be pcap, raw or xdp" << std::endl;
+                return false;
+            }
+        } 
+        else if (arg == "--idle-timeout" && i + 1 < argc) {
+            try {
+                idleTimeout = static_cast<unsigned>(std::stoul(argv[++i]));
+            } catch (const std::exception&) {
+                std::cerr << "[ARG_PARSER] Error: Idle timeout must be a number of seconds" << std::endl;
+                return false;
+            }
+        } 
         else {
             displayHelp();
             return false;
         }
     }
 
-    if (filePath.empty() && !serverFlag) {
+    if (filePaths.empty() && !serverFlag) {
         std::cerr << "[ARG_PARSER] Error: Missing required argument -r <file>" << std::endl;
         return false;
     }
-    if (targetAddress.empty() && !serverFlag) {
+    if (filePaths.size() > 1 && std::count(filePaths.begin(), filePaths.end(), "-") != 0) {
+        std::cerr << "[ARG_PARSER] Error: Standard input can not be sent together with other files" << std::endl;
+        return false;
+    }
+    if (targetAddresses.empty() && !serverFlag) {
         std::cerr << "[ARG_PARSER] Error: Missing required argument -s <ip|hostname>" << std::endl;
         return false;
     }
 
+    if (!outputPath.empty() && !spoolDir.empty()) {
+        std::cerr << "[ARG_PARSER] Error: -o can not be combined with --spool-dir, streamed output can not be resumed" << std::endl;
+        return false;
+    }
+    if (impairment.enabled() && serverFlag) {
+        std::cerr << "[ARG_PARSER] Error: --impair applies to the client only" << std::endl;
+        return false;
+    }
+    if (!generateFile.empty() && (resumeFlag || deltaFlag)) {
+        std::cerr << "[ARG_PARSER] Error: --generate can not be combined with --resume or --delta, they need a server" << std::endl;
+        return false;
+    }
+    if (sinkFlag && !outputPath.empty()) {
+        std::cerr << "[ARG_PARSER] Error: --sink can not be combined with -o" << std::endl;
+        return false;
+    }
+    if (replaySpeed > 0.0 && replayFile.empty()) {
+        std::cerr << "[ARG_PARSER] Error: --replay-speed needs --replay <file>" << std::endl;
+        return false;
+    }
+    if (receiver != Receiver::Backend::PCAP && !replayFile.empty()) {
+        std::cerr << "[ARG_PARSER] Error: --replay reads savefiles with libpcap, it can not be combined with --receiver "
+                  << (receiver == Receiver::Backend::RAW ? "raw" : "xdp") << std::endl;
+        return false;
+    }
+    if (receiver == Receiver::Backend::XDP && capture.device == "any") {
+        std::cerr << "[ARG_PARSER] Error: --receiver xdp needs an interface, e.g. --capture dev=eth0" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool ArgParser::parseImpairment(const std::string& spec) {
+    size_t start = 0;
+    while (start <= spec.size()) {
+        size_t end = spec.find(',', start);
+        if (end == std::string::npos) {
+            end = spec.size();
+        }
+        std::string setting = spec.substr(start, end - start);
+        start = end + 1;
+
+        size_t eq = setting.find('=');
+        std::string key = setting.substr(0, eq);
+        double value = 0.0;
+        std::string unit;
+        if (eq == std::string::npos || !splitUnit(setting.substr(eq + 1), value, unit)) {
+            std::cerr << "[ARG_PARSER] Error: Impairment setting " << setting << " is not <key>=<value>" << std::endl;
+            return false;
+        }
+
+        bool ok = true;
+        if (key == "loss" || key == "reorder" || key == "dup") {
+            // Percent like netem, the sign is optional
+            ok = (unit.empty() || unit == "%") && value <= 100.0;
+            double fraction = value / 100.0;
+            (key == "loss" ? impairment.loss : key == "reorder" ? impairment.reorder : impairment.duplicate) = fraction;
+        }
+        else if (key == "delay" || key == "jitter") {
+            double scale = unit == "us" ? 1.0 : unit == "s" ? 1e6 : 1e3;
+            ok = unit.empty() || unit == "us" || unit == "ms" || unit == "s";
+            auto time = std::chrono::microseconds(static_cast<int64_t>(value * scale));
+            (key == "delay" ? impairment.delay : impairment.jitter) = time;
+        }
+        else if (key == "rate") {
+            double scale = unit == "kbit" ? 1e3 : unit == "mbit" ? 1e6 : unit == "gbit" ? 1e9 : 1.0;
+            ok = unit.empty() || unit == "bit" || unit == "kbit" || unit == "mbit" || unit == "gbit";
+            impairment.rate = static_cast<uint64_t>(value * scale);
+        }
+        else if (key == "burst") {
+            ok = unit.empty() && value >= 1.0;
+            impairment.burst = value;
+        }
+        else if (key == "limit") {
+            ok = unit.empty() && value >= 1.0;
+            impairment.limit = static_cast<size_t>(value);
+        }
+        else if (key == "seed") {
+            ok = unit.empty();
+            impairment.seed = static_cast<uint64_t>(value);
+        }
+        else {
+            std::cerr << "[ARG_PARSER] Error: Unknown impairment " << key
+                      << " (loss, burst, reorder, dup, delay, jitter, rate, limit, seed)" << std::endl;
+            return false;
+        }
+        if (!ok) {
+            std::cerr << "[ARG_PARSER] Error: Invalid value of impairment " << key << ": " << setting.substr(eq + 1)
+                      << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ArgParser::parseCapture(const std::string& spec) {
+    size_t start = 0;
+    while (start <= spec.size()) {
+        size_t end = spec.find(',', start);
+        if (end == std::string::npos) {
+            end = spec.size();
+        }
+        std::string setting = spec.substr(start, end - start);
+        start = end + 1;
+
+        size_t eq = setting.find('=');
+        std::string key = setting.substr(0, eq);
+        if (eq != std::string::npos && key == "xdp") {
+            std::string mode = setting.substr(eq + 1);
+            if (mode != "generic" && mode != "native") {
+                std::cerr << "[ARG_PARSER] Error: XDP mode must be generic or native" << std::endl;
+                return false;
+            }
+            capture.xdpNative = mode == "native";
+            continue;
+        }
+        if (eq != std::string::npos && key == "dev") {
+            capture.device = setting.substr(eq + 1);
+            if (capture.device.empty()) {
+                std::cerr << "[ARG_PARSER] Error: Capture device can not be empty" << std::endl;
+                return false;
+            }
+            continue;
+        }
+        double value = 0.0;
+        std::string unit;
+        if (eq == std::string::npos || !splitUnit(setting.substr(eq + 1), value, unit)) {
+            std::cerr << "[ARG_PARSER] Error: Capture setting " << setting << " is not <key>=<value>" << std::endl;
+            return false;
+        }
+
+        bool ok = unit.empty();
+        if (key == "snaplen") {
+            ok = ok && value >= 68.0 && value <= 262144.0;
+            capture.snaplen = static_cast<int>(value);
+        }
+        else if (key == "buffer") {
+            // MiB like --memory-limit
+            ok = ok && value >= 1.0 && value <= 2047.0;
+            capture.bufferSize = static_cast<int>(value * 1024 * 1024);
+        }
+        else if (key == "immediate") {
+            ok = ok && (value == 0.0 || value == 1.0);
+            capture.immediate = value != 0.0;
+        }
+        else if (key == "timeout") {
+            ok = ok && value >= 1.0 && value <= 60000.0;
+            capture.timeout = static_cast<int>(value);
+        }
+        else if (key == "queue") {
+            ok = ok && value >= 0.0 && value <= 63.0 && value == static_cast<double>(static_cast<unsigned>(value));
+            capture.queue = static_cast<unsigned>(value);
+        }
+        else {
+            std::cerr << "[ARG_PARSER] Error: Unknown capture setting " << key
+                      << " (dev, snaplen, buffer, immediate, timeout, queue, xdp)" << std::endl;
+            return false;
+        }
+        if (!ok) {
+            std::cerr << "[ARG_PARSER] Error: Invalid value of capture setting " << key << ": " << setting.substr(eq + 1)
+                      << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ArgParser::parsePriority(const std::string& spec) {
+    size_t eq = spec.rfind('=');
+    unsigned weight = 0;
+    if (eq != std::string::npos) {
+        try {
+            weight = static_cast<unsigned>(std::stoul(spec.substr(eq + 1)));
+        } catch (const std::exception&) {
+            weight = 0;
+        }
+    }
+    if (eq == std::string::npos || eq == 0 || weight == 0 || weight > MAX_PRIORITY) {
+        std::cerr << "[ARG_PARSER] Error: Priority must be <client-id|address>=<1-" << MAX_PRIORITY << ">" << std::endl;
+        return false;
+    }
+
+    // Addresses are stored in the form the server prints them
+    std::string key = spec.substr(0, eq);
+    unsigned char addr[sizeof(struct in6_addr)];
+    char text[INET6_ADDRSTRLEN];
+    for (int family : {AF_INET, AF_INET6}) {
+        if (inet_pton(family, key.c_str(), addr) == 1 && inet_ntop(family, addr, text, sizeof(text))) {
+            addressPriorities[text] = weight;
+            return true;
+        }
+    }
+
+    try {
+        size_t used = 0;
+        uint64_t id = std::stoull(key, &used, 0);
+        if (used == key.size()) {
+            idPriorities[id] = weight;
+            return true;
+        }
+    } catch (const std::exception&) {}
+
+    std::cerr << "[ARG_PARSER] Error: " << key << " is neither a client ID nor an IP address" << std::endl;
+    return false;
+}
+
+bool ArgParser::readFileList(const std::string& listPath) {
+    std::ifstream file;
+    if (listPath != "-") {
+        file.open(listPath);
+        if (!file.is_open()) {
+            std::cerr << "[ARG_PARSER] Error: Cannot open file list " << listPath << std::endl;
+            return false;
+        }
+    }
+    std::istream& in = listPath == "-" ? std::cin : file;
+
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            filePaths.push_back(line);
+        }
+    }
     return true;
 }
 
 void ArgParser::displayHelp(void) {
     std::cout << "Usage: " << argv[0] << " [options]\n"
               << "\nOptions:\n"
-              << "  -r <file>            Specifies the file to transfer\n"
-              << "  -s <ip|hostname>     Target IP or hostname\n"
-              << "  -l                   Runs the program as a server\n";
+              << "  -r <file|dir>        File or directory to transfer, repeatable, - reads standard input\n"
+              << "  --files-from <list>  Also transfer the paths listed one per line in list (- = stdin)\n"
+              << "  -s <ip|hostname>     Target IP or hostname, repeatable (encrypted once, sent to all)\n"
+              << "  -l                   Runs the program as a server\n"
+              << "  -m <mtu>             Path MTU to use instead of probing for it\n"
+              << "  -o <path>            Write the first transfer to path (- = stdout, FIFO) and exit (server)\n"
+              << "  --resume             Continue interrupted transfer of the same file (client)\n"
+              << "  --delta              Send only what differs from the server's copy of the file (client)\n"
+              << "  --compress           Compress content before encryption, incompressible blocks are sent as is (client)\n"
+              << "  --multipath          Stripe chunks over every address the target resolves to (client)\n"
+              << "  --spool-dir <dir>    Checkpoint transfers to dir so they survive restarts (server)\n"
+              << "  --memory-limit <MiB> Spill or evict transfers above this much buffered data (server)\n"
+              << "  --idle-timeout <s>   Evict transfers idle for this long, 0 = never (server, default "
+              << DEFAULT_IDLE_TIMEOUT << ")\n"
+              << "  --workers <n>        Decrypt/write threads (server, default by CPU count, at most 4)\n"
+              << "  --stats-interval <s> Print queue depths and per-stage latency quantiles every s seconds (server)\n"
+              << "  --priority <id|ip>=<w> Scheduling weight of a client ID or address, repeatable (server)\n"
+              << "  --metrics-file <path> Rewrite Prometheus text metrics to path every second\n"
+              << "  --metrics-socket <path> Serve Prometheus text metrics on a Unix socket\n"
+              << "  --trace-file <path>  Write per-stage spans as Chrome trace JSON on SIGUSR1 and at exit\n"
+              << "  --generate <file|null> Write the packets to a pcap savefile (null = discard) instead of sending (client)\n"
+              << "  --impair <k=v,...>   Emulate a WAN link: loss=%, burst=n, reorder=%, dup=%, delay=ms, jitter=ms,\n"
+              << "                       rate=<n>[k|m|g]bit, limit=packets, seed=n (client)\n"
+              << "  --io-mode <mode>     Output writes: buffered, direct (O_DIRECT) or writeback (server)\n"
+              << "  --replay <file>      Run the server on a pcap/pcapng savefile instead of live capture and exit\n"
+              << "  --replay-speed <x>   Pace the replay at x times the recorded speed (default 0 = as fast as possible)\n"
+              << "  --sink               Decrypt and verify received files but discard their content (server)\n"
+              << "  --receiver <backend> Receive with pcap (libpcap, default), raw (raw sockets and recvmmsg) or\n"
+              << "                       xdp (AF_XDP socket, needs --capture dev=<if>) (server)\n"
+              << "  --capture <k=v,...>  Live capture: dev=<if|any>, snaplen=bytes, buffer=MiB, immediate=0|1,\n"
+              << "                       timeout=ms, queue=n, xdp=generic|native (server, default dev=any,\n"
+              << "                       snaplen=262144, buffer=16, immediate=1, queue=0, xdp=generic)\n";
 }
\ No newline at end of file
@@ -31,4 +31,19 @@ std::vector<uint8_t> chunker::reassembleData(chunker::ByteVector2D& chunkedData)
     }
 
     return data;
-}
\ No newline at end of file
+}
+
+chunker::ByteVector2D chunker::takeChunks(std::vector<uint8_t>& buffer, size_t maxChunkSize, bool flush) {
+    size_t usable = flush ? buffer.size() : buffer.size() - buffer.size() % maxChunkSize;
+    chunker::ByteVector2D chunks;
+    size_t offset = 0;
+
+    while (offset < usable) {
+        size_t size = std::min(maxChunkSize, usable - offset);
+        chunks.emplace_back(buffer.begin() + offset, buffer.begin() + offset + size);
+        offset += size;
+    }
+
+    buffer.erase(buffer.begin(), buffer.begin() + offset);
+    return chunks;
+}
@@ -7,98 +7,1225 @@
 #include "encoder.hpp"
 #include "chunker.hpp"
 #include "protocol.hpp"
+#include "delta.hpp"
+#include "compress.hpp"
+#include "net_utils.hpp"
 #include <iostream>
 
-Client::Client(const std::string filePath, 
-               const std::string targetAddress,
+#include <filesystem>
+#include <algorithm>
+#include <random>
+#include <unistd.h>
+#include <poll.h>
+
+constexpr size_t READ_CHUNKS = 256;
+constexpr int RESUME_TIMEOUT_MS = 1000;
+constexpr int RESUME_ATTEMPTS = 3;
+constexpr int DELTA_TIMEOUT_MS = 500;          ///< Silence after which a signature window is asked for again
+constexpr int DELTA_ATTEMPTS = 3;               ///< Requests without any new signature before giving up
+constexpr int END_COPIES = 3;                   ///< End packet is tiny and losing it stalls the stream
+constexpr int COMPLETION_TIMEOUT_MS = 500;      ///< Silence after which End is sent again
+constexpr int COMPLETION_ATTEMPTS = 3;          ///< End resends without any answer before giving up waiting
+constexpr int REPAIR_ROUNDS = 32;               ///< Requests for missing chunks answered before giving up
+constexpr size_t RETRANSMIT_BUFFER = 32 * 1024 * 1024; ///< Payload bytes of sent chunks kept for repairs
+constexpr int REREAD_PASSES = 3;                ///< Times the source is read again for chunks that left the buffer
+constexpr auto RATE_INTERVAL = std::chrono::milliseconds(100); ///< Backlogged time per throughput sample
+constexpr size_t DESTINATION_BACKLOG = 16 * 1024 * 1024; ///< Bytes queued for one destination before it lags
+constexpr auto SEND_STALL_TIMEOUT = std::chrono::seconds(5); ///< Backlog that does not move fails its destination
+constexpr int ROOM_POLL_MS = 100;               ///< Longest wait for a full socket between observer polls
+constexpr double RATE_PROBE = 1.25;             ///< Growth asked of a path whose link kept up with it
+constexpr double RATE_SMOOTHING = 0.25;         ///< Weight of a new sample in the throughput estimate
+const std::string STDIN_FILE_NAME = "stdin";    ///< File name sent for standard input
+
+Client::Client(const std::vector<std::string> filePaths, 
+               const std::vector<std::string> targetAddresses,
                const std::string xlogin,
-               size_t maxChunkSize)
-    : filePath(std::move(filePath)),
-      targetAddress(std::move(targetAddress)),
+               size_t pathMTU,
+               bool resume,
+               bool delta,
+               bool compress,
+               bool multipath,
+               const std::string metricsFile,
+               const std::string metricsSocket,
+               const std::string traceFile,
+               const std::string generateFile,
+               const Impairment::Config& impairment)
+    : filePaths(std::move(filePaths)),
+      targetAddresses(std::move(targetAddresses)),
       xlogin(std::move(xlogin)),
-      maxChunkSize(maxChunkSize) 
-      { id = generateId(); }
+      pathMTU(pathMTU),
+      resume(resume),
+      delta(delta),
+      compress(compress),
+      multipath(multipath) {
+    if (!metricsFile.empty() || !metricsSocket.empty()) {
+        exporter = std::make_unique<metrics::Exporter>(metricsFile, metricsSocket,
+                                                       [this](metrics::Writer& out) { collectMetrics(out); });
+    }
+    if (!generateFile.empty()) {
+        sink = std::make_unique<PacketSink>(generateFile);
+    }
+    if (impairment.enabled()) {
+        this->impairment = std::make_unique<Impairment>(impairment);
+    }
+    if (!traceFile.empty()) {
+        pipeline.enableTrace(traceFile);
+        trace::installDumpSignal();
+    }
+}
+
+/**
+ * @brief Generates transfer ID for content that can not be resumed
+ */
+static uint64_t randomId(void) {
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_int_distribution<uint64_t> dist;
+    return dist(gen);
+}
+
+uint64_t Client::deriveTransferId(const file_handler::FileReader& reader) {
+    // Stream has no identity to derive from, it can not be resumed anyway
+    if (reader.isStream()) {
+        return randomId();
+    }
+
+    char host[256] = {0};
+    gethostname(host, sizeof(host) - 1);
+
+    std::error_code ec;
+    std::string absolute = std::filesystem::absolute(filePaths.front(), ec).string();
+
+    return encoder::deriveId(std::string(host) + "|" + absolute + "|" +
+                             std::to_string(reader.getSize()) + "|" +
+                             std::to_string(reader.getModificationTime()));
+}
+
+uint64_t Client::deriveArchiveId(const archive::Packer& packer) {
+    char host[256] = {0};
+    gethostname(host, sizeof(host) - 1);
+
+    std::string identity = std::string(host) + "|";
+    for (const auto& path : filePaths) {
+        std::error_code ec;
+        identity += std::filesystem::absolute(path, ec).string() + "|";
+    }
+    const auto& manifest = packer.getManifest();
+    identity.append(manifest.begin(), manifest.end());
+
+    return encoder::deriveId(identity);
+}
+
+std::unique_ptr<file_handler::Source> Client::openSource(std::string& name, uint8_t& kind) {
+    std::error_code ec;
+    if (filePaths.size() == 1 && !std::filesystem::is_directory(filePaths.front(), ec)) {
+        auto reader = std::make_unique<file_handler::FileReader>();
+        if (!reader->open(filePaths.front())) {
+            return nullptr;
+        }
+        id = deriveTransferId(*reader);
+        name = filePaths.front() == file_handler::STDIO_PATH ? STDIN_FILE_NAME
+                                                             : file_handler::getNameFromPath(filePaths.front());
+        kind = protocol::CONTENT_FILE;
+        return reader;
+    }
+
+    // Many files share one session, one metadata packet and one padded chunk
+    auto packer = std::make_unique<archive::Packer>();
+    for (const auto& path : filePaths) {
+        if (!packer->add(path)) {
+            return nullptr;
+        }
+    }
+    if (!packer->finish()) {
+        return nullptr;
+    }
+    std::cerr << "[CLIENT] Packed " << packer->getEntryCount() << " entries, " << packer->getSize()
+              << " bytes" << std::endl;
+
+    id = deriveArchiveId(*packer);
+    name = packer->getName();
+    kind = protocol::CONTENT_ARCHIVE;
+    return packer;
+}
+
+bool Client::requestResume(ICMPConnection& connection, protocol::ResumeState& state) {
+    auto request = protocol::buildResumeRequestPacket(protocol::ResumeRequest{}, nextSeqNum++, id);
+    std::vector<uint8_t> payload;
+
+    for (int attempt = 0; attempt < RESUME_ATTEMPTS; ++attempt) {
+        if (!transmitPacket(*request, connection)) {
+            return false;
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(RESUME_TIMEOUT_MS);
+        while (std::chrono::steady_clock::now() < deadline) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            if (!connection.receivePacket(payload, static_cast<int>(left))) {
+                break;
+            }
+
+            // Kernel echoes of our own requests come back too, only server answers matter
+            try {
+                auto packet = protocol::parsePacket(payload.data(), payload.size());
+                if (packet && packet->id == id && packet->packetType == protocol::RESUME_STATE) {
+                    state = std::get<protocol::ResumeState>(packet->payload);
+                    return true;
+                }
+            } catch (const std::exception&) {
+                continue;
+            }
+        }
+    }
+    return false;
+}
+
+bool Destination::wants(uint64_t chunkNum) {
+    if (!partial) {
+        return true;
+    }
+    while (rangeIndex < missing.size() && missing[rangeIndex].end <= chunkNum) {
+        ++rangeIndex;
+    }
+    return rangeIndex < missing.size() && chunkNum >= missing[rangeIndex].first;
+}
+
+void Path::record(size_t size, size_t queued) {
+    ++packets;
+    bytes += size;
+
+    auto now = std::chrono::steady_clock::now();
+    if (windowStart == std::chrono::steady_clock::time_point{}) {
+        windowStart = now;
+        windowQueued = queued;
+        windowBytes = 0;
+        windowBacklogged = true;
+        return;
+    }
+    windowBytes += size;
+    windowBacklogged = windowBacklogged && queued != 0;
+    if (now - windowStart < RATE_INTERVAL) {
+        return;
+    }
+
+    double seconds = std::chrono::duration<double>(now - windowStart).count();
+    double sample;
+    if (windowBacklogged) {
+        // Link limited the whole window, what it drained is its rate (the backlog counts kernel overhead
+        // too, but changes little next to the window)
+        sample = (static_cast<double>(windowBytes) + static_cast<double>(windowQueued) -
+                  static_cast<double>(queued)) / seconds;
+    }
+    else {
+        // Link kept up, so it carries at least what we sent, ask for a little more until it backs up
+        sample = static_cast<double>(windowBytes) / seconds * RATE_PROBE;
+    }
+    if (sample > 0.0) {
+        rate = rate == 0.0 ? sample : rate + RATE_SMOOTHING * (sample - rate);
+    }
+    windowStart = now;
+    windowQueued = queued;
+    windowBytes = 0;
+    windowBacklogged = true;
+}
+
+Path& Destination::nextPath(void) {
+    // Paths not measured yet get the best known rate, so they are tried (and measured) too
+    double best = 0.0;
+    for (const auto& path : paths) {
+        if (!path.failed) {
+            best = std::max(best, path.rate);
+        }
+    }
+
+    // Smooth weighted round robin interleaves the paths instead of sending bursts to each
+    Path* chosen = nullptr;
+    double total = 0.0;
+    for (auto& path : paths) {
+        if (path.failed) {
+            continue;
+        }
+        double weight = path.rate != 0.0 ? path.rate : best != 0.0 ? best : 1.0;
+        path.credit += weight;
+        total += weight;
+        if (chosen == nullptr || path.credit > chosen->credit) {
+            chosen = &path;
+        }
+    }
+    if (chosen == nullptr) {
+        return paths.front();
+    }
+    chosen->credit -= total;
+    return *chosen;
+}
+
+ICMPConnection::SendResult Client::transmit(Destination& destination, const std::vector<uint8_t>& packet,
+                                            bool striped) {
+    using SendResult = ICMPConnection::SendResult;
+    while (true) {
+        auto first = std::find_if(destination.paths.begin(), destination.paths.end(),
+                                  [](const Path& p) { return !p.failed; });
+        if (first == destination.paths.end()) {
+            return SendResult::FAILED;
+        }
+        Path* path = striped ? &destination.nextPath() : &*first;
+
+        auto start = std::chrono::steady_clock::now();
+        SendResult result = path->connection->trySendPacket(packet.data(), packet.size());
+        // Chunk takes any other path with room, the full one gets its share back once its link drains it
+        for (auto& other : destination.paths) {
+            if (!striped || result != SendResult::FULL) {
+                break;
+            }
+            if (&other != path && !other.failed) {
+                path = &other;
+                result = path->connection->trySendPacket(packet.data(), packet.size());
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        if (result == SendResult::SENT) {
+            pipeline.record(trace::CLIENT_SEND, start, end, packet.size());
+            path->record(packet.size(), path->connection->getQueuedBytes());
+            ++destination.packets;
+            destination.bytes += packet.size();
+            return result;
+        }
+        if (result == SendResult::FULL) {
+            return result;
+        }
 
-uint64_t Client::generateId(void) {
-        std::random_device rd;
-        std::mt19937_64 gen(rd());
-        std::uniform_int_distribution<uint64_t> dist;
-        return dist(gen);
+        path->failed = true;
+        auto next = std::find_if(destination.paths.begin(), destination.paths.end(),
+                                 [](const Path& p) { return !p.failed; });
+        if (next == destination.paths.end()) {
+            std::cerr << "[CLIENT] Sending to " << destination.connection->getTargetAddress()
+                      << " failed, dropping it from the transfer" << std::endl;
+            destination.failed = true;
+            destination.active = false;
+            return result;
+        }
+        std::cerr << "[CLIENT] Sending to " << path->connection->getTargetAddress()
+                  << " failed, continuing over the other addresses" << std::endl;
+        destination.connection = next->connection.get();
+    }
 }
 
-bool Client::packageFile(Client::PacketVector& packets) {
-    std::vector<uint8_t> data;
+bool Client::flush(Destination& destination) {
+    while (!destination.backlog.empty() && !destination.failed) {
+        const Pending& pending = destination.backlog.front();
+        auto result = transmit(destination, *pending.packet, pending.striped);
+        if (result == ICMPConnection::SendResult::FULL) {
+            if (std::chrono::steady_clock::now() - destination.lastProgress < SEND_STALL_TIMEOUT) {
+                break;
+            }
+            std::cerr << "[CLIENT] Link to " << destination.connection->getTargetAddress()
+                      << " stopped taking packets, dropping it from the transfer" << std::endl;
+            destination.failed = true;
+            destination.active = false;
+        }
+        if (result != ICMPConnection::SendResult::SENT) {
+            break;
+        }
+        destination.backlogBytes -= pending.packet->size();
+        destination.backlog.pop_front();
+        destination.lastProgress = std::chrono::steady_clock::now();
+    }
+
+    if (destination.failed) {
+        destination.backlog.clear();
+        destination.backlogBytes = 0;
+    }
+    // Lagging ends only with half the backlog gone, so the skipped chunks form few long ranges
+    if (destination.lagging && destination.backlogBytes <= DESTINATION_BACKLOG / 2) {
+        destination.lagging = false;
+    }
+    return !destination.failed;
+}
 
-    if (!file_handler::readFile(filePath, data)) {
+bool Client::sendTo(Destination& destination, std::shared_ptr<const std::vector<uint8_t>> packet, bool striped) {
+    if (destination.failed) {
         return false;
     }
+    if (destination.backlog.empty()) {
+        destination.lastProgress = std::chrono::steady_clock::now();
+    }
+    destination.backlogBytes += packet->size();
+    destination.backlog.push_back(Pending{std::move(packet), striped});
+    return flush(destination);
+}
 
-    std::vector<uint8_t> cipherData;
-    std::vector<uint8_t> iv = encoder::generateIV();
-    std::vector<uint8_t> key = encoder::deriveKey(xlogin);
+/**
+ * @brief Checks if the destination can not take another chunk right now
+ */
+static bool isFull(const Destination& destination) {
+    return destination.lagging || destination.backlogBytes >= DESTINATION_BACKLOG;
+}
+
+void Client::waitForRoom(const std::vector<Destination*>& wanting, bool any) {
+    while (true) {
+        // Only full destinations are watched, the sockets of the others are writable and would end the poll at once
+        std::vector<struct pollfd> fds;
+        bool room = false;
+        for (Destination* destination : wanting) {
+            if (!destination->active) {
+                continue;
+            }
+            if (!isFull(*destination)) {
+                room = true;
+                continue;
+            }
+            for (auto& path : destination->paths) {
+                if (!path.failed) {
+                    fds.push_back(pollfd{path.connection->getDescriptor(), POLLOUT, 0});
+                }
+            }
+        }
+        if (fds.empty() || (any && room)) {
+            return;
+        }
+
+        poll(fds.data(), fds.size(), ROOM_POLL_MS);
+        for (Destination* destination : wanting) {
+            if (destination->active) {
+                flush(*destination);
+            }
+        }
+        pollObservers();
+    }
+}
+
+bool Client::sendChunk(protocol::Data&& data) {
+    // Serialized once, every destination gets the same bytes
+    std::shared_ptr<const std::vector<uint8_t>> serialized;
+    {
+        trace::Scope scope(&pipeline, trace::CLIENT_SERIALIZE, data.chunkNum);
+        auto packet = protocol::buildDataPacket(data, nextSeqNum++, id);
+        serialized = std::make_shared<const std::vector<uint8_t>>(protocol::serializePacket(*packet));
+    }
+
+    std::vector<Destination*> wanting;
+    for (auto& destination : destinations) {
+        if (destination.active) {
+            flush(destination);
+        }
+        if (destination.active && destination.wants(data.chunkNum)) {
+            wanting.push_back(&destination);
+        }
+    }
+    // Pace of the fastest destination, the others fall behind instead of holding it up. Chunks of a stream
+    // can not be read again once they leave the retransmit buffer, so a stream goes at the pace of the slowest
+    waitForRoom(wanting, rereadable);
+
+    bool keep = false;
+    for (Destination* destination : wanting) {
+        if (!destination->active) {
+            continue;
+        }
+        if (isFull(*destination)) {
+            if (destination->deferred == 0) {
+                std::cerr << "[CLIENT] " << destination->connection->getTargetAddress()
+                          << " is slower than the other targets, it gets the skipped chunks after End" << std::endl;
+            }
+            destination->lagging = true;
+            ++destination->deferred;
+            keep = true;
+            continue;
+        }
+        keep |= sendTo(*destination, serialized, true);
+    }
+
+    bool active = false;
+    for (const auto& destination : destinations) {
+        active |= destination.active;
+    }
 
-    if (iv.size() != 16 || key.empty()) {
+    // Skipped chunks are kept too, the lagging destination asks for them
+    if (keep) {
+        sentBytes += data.payload.size();
+        sentChunks[data.chunkNum] = std::move(data);
+        while (sentBytes > RETRANSMIT_BUFFER) {
+            sentBytes -= sentChunks.begin()->second.payload.size();
+            sentChunks.erase(sentChunks.begin());
+        }
+    }
+    return active;
+}
+
+void Client::handleStatus(Destination& destination, const protocol::ChunkStatus& status) {
+    const std::string& address = destination.connection->getTargetAddress();
+    if (status.status == protocol::STATUS_FAILED) {
+        std::cerr << "[CLIENT] " << address << " rejected the transfer" << std::endl;
+        destination.failed = true;
+        destination.active = false;
+        return;
+    }
+    if (status.status == protocol::STATUS_DONE) {
+        destination.done = true;
+        destination.confirmed = true;
+        return;
+    }
+
+    for (const auto& range : status.missing) {
+        // Server does not know the length of a stream until End, chunks past it do not exist
+        uint64_t end = std::min(range.end, lastChunk);
+        for (uint64_t chunkNum = range.first; chunkNum < end; ++chunkNum) {
+            auto it = sentChunks.find(chunkNum);
+            if (it == sentChunks.end() && rereadable) {
+                // Same key, IV and chunk size reproduce the chunks, exactly like resuming
+                destination.reread.found = 1;
+                destination.reread.missing = status.missing;
+                return;
+            }
+            if (it == sentChunks.end()) {
+                std::cerr << "[CLIENT] Chunk " << chunkNum << " of the stream is no longer buffered for "
+                          << address << std::endl;
+                destination.failed = true;
+                destination.active = false;
+                return;
+            }
+            auto packet = protocol::buildDataPacket(it->second, nextSeqNum++, id);
+            if (!sendTo(destination, std::make_shared<const std::vector<uint8_t>>(protocol::serializePacket(*packet)),
+                        true)) {
+                return;
+            }
+            ++destination.resent;
+        }
+    }
+}
+
+/**
+ * @brief Parses reply if it is a status of the given transfer
+ */
+static bool parseStatus(const std::vector<uint8_t>& payload, uint64_t id, protocol::ChunkStatus& status) {
+    // Most replies are kernel echoes of our own chunks, the type alone rules them out
+    protocol::PacketType type;
+    if (!protocol::peekPacketType(payload.data(), payload.size(), type) || type != protocol::CHUNK_STATUS) {
+        return false;
+    }
+    try {
+        auto packet = protocol::parsePacket(payload.data(), payload.size());
+        if (!packet || packet->id != id) {
+            return false;
+        }
+        status = std::get<protocol::ChunkStatus>(packet->payload);
+        return true;
+    } catch (const std::exception&) {
         return false;
     }
+}
+
+/**
+ * @brief Checks if the client still waits for the destination to confirm the file
+ */
+static bool isWaiting(const Destination& destination) {
+    return destination.active && !destination.done && !destination.failed && !destination.reread.found;
+}
+
+bool Client::pollStatus(void) {
+    std::vector<uint8_t> payload;
+    bool active = false;
+    for (auto& destination : destinations) {
+        // Server answers over the path that carried the chunk, any of them may have a reply
+        for (auto& path : destination.paths) {
+            while (destination.active && path.connection->receivePacket(payload, 0)) {
+                protocol::ChunkStatus status;
+                if (parseStatus(payload, id, status)) {
+                    ++statusReplies;
+                    handleStatus(destination, status);
+                }
+            }
+        }
+        active |= destination.active;
+    }
+    pollObservers();
+    return active;
+}
+
+void Client::awaitCompletion(const protocol::Packet& end) {
+    auto serialized = std::make_shared<const std::vector<uint8_t>>(protocol::serializePacket(end));
+    auto timeout = std::chrono::milliseconds(COMPLETION_TIMEOUT_MS);
+
+    for (auto& destination : destinations) {
+        if (!destination.active) {
+            continue;
+        }
+        for (int copy = 0; copy < END_COPIES && sendTo(destination, serialized); ++copy) {}
+        destination.attempts = 0;
+        destination.repairs = 0;
+        destination.deadline = std::chrono::steady_clock::now() + timeout;
+    }
+    // Generated traffic has no receiver that could answer
+    if (sink) {
+        return;
+    }
+
+    std::vector<uint8_t> payload;
+    while (true) {
+        // One poll over all sockets, a slow receiver does not hold up the others
+        std::vector<struct pollfd> fds;
+        std::vector<std::pair<Destination*, ICMPConnection*>> sockets;
+        std::vector<Destination*> waiting;
+        auto now = std::chrono::steady_clock::now();
+        auto wakeup = now + timeout;
+        for (auto& destination : destinations) {
+            if (!isWaiting(destination)) {
+                continue;
+            }
+            // Silence while our own backlog still drains is not the receiver's
+            short events = POLLIN;
+            if (!destination.backlog.empty()) {
+                events |= POLLOUT;
+                destination.deadline = now + timeout;
+            }
+            for (auto& path : destination.paths) {
+                fds.push_back(pollfd{path.connection->getDescriptor(), events, 0});
+                sockets.emplace_back(&destination, path.connection.get());
+            }
+            waiting.push_back(&destination);
+            wakeup = std::min(wakeup, destination.deadline);
+        }
+        if (waiting.empty()) {
+            return;
+        }
+
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(wakeup - now).count();
+        poll(fds.data(), fds.size(), static_cast<int>(std::max<int64_t>(wait, 0)));
+
+        for (Destination* destination : waiting) {
+            if (!destination->backlog.empty()) {
+                flush(*destination);
+            }
+        }
+
+        for (size_t i = 0; i < fds.size(); ++i) {
+            Destination& destination = *sockets[i].first;
+            if (!(fds[i].revents & POLLIN)) {
+                continue;
+            }
+            while (isWaiting(destination) && sockets[i].second->receivePacket(payload, 0)) {
+                protocol::ChunkStatus status;
+                if (!parseStatus(payload, id, status)) {
+                    continue;
+                }
+                ++statusReplies;
+                handleStatus(destination, status);
+                if (!isWaiting(destination)) {
+                    break;
+                }
+                if (++destination.repairs > REPAIR_ROUNDS) {
+                    std::cerr << "[CLIENT] Chunks to " << destination.connection->getTargetAddress()
+                              << " keep getting lost or damaged, giving up" << std::endl;
+                    destination.failed = true;
+                    destination.active = false;
+                    break;
+                }
+                // Repair counts as an answer, the server is alive
+                destination.attempts = 0;
+                destination.deadline = std::chrono::steady_clock::now() + timeout;
+            }
+        }
+
+        pollObservers();
+
+        now = std::chrono::steady_clock::now();
+        for (Destination* destination : waiting) {
+            if (!isWaiting(*destination) || destination->deadline > now) {
+                continue;
+            }
+            if (++destination->attempts >= COMPLETION_ATTEMPTS) {
+                // Replies may be filtered on the way back, the file could still be fine
+                std::cerr << "[CLIENT] " << destination->connection->getTargetAddress()
+                          << " did not confirm the file" << std::endl;
+                destination->done = true;
+                continue;
+            }
+            if (sendTo(*destination, serialized)) {
+                destination->deadline = now + timeout;
+            }
+        }
+    }
+}
+
+void Client::resumeDestinations(uint64_t fileSize, std::vector<uint8_t>& iv) {
+    std::vector<protocol::ResumeState> states(destinations.size());
+    std::map<std::pair<std::vector<uint8_t>, uint32_t>, size_t> votes;
+
+    for (size_t i = 0; i < destinations.size(); ++i) {
+        protocol::ResumeState& state = states[i];
+        // Server state is only usable if it describes this file and fits the current path
+        if (requestResume(*destinations[i].connection, state) && state.found && state.fileSize == fileSize &&
+            state.iv.size() == encoder::BLOCK_SIZE && state.chunkSize != 0 && state.chunkSize <= maxChunkSize &&
+            state.chunkSize % encoder::BLOCK_SIZE == 0) {
+            ++votes[{state.iv, state.chunkSize}];
+        }
+        else {
+            state.found = 0;
+        }
+    }
+    if (votes.empty()) {
+        return;
+    }
 
-    if (!encoder::encrypt(data, key, iv, cipherData)) {
+    // Fan-out sends one ciphertext, destinations on another IV get the whole file under this one
+    auto best = std::max_element(votes.begin(), votes.end(),
+                                 [](const auto& a, const auto& b) { return a.second < b.second; });
+    iv = best->first.first;
+    maxChunkSize = best->first.second;
+
+    for (size_t i = 0; i < destinations.size(); ++i) {
+        if (states[i].found && states[i].iv == iv && states[i].chunkSize == maxChunkSize) {
+            destinations[i].partial = true;
+            destinations[i].missing = std::move(states[i].missing);
+            std::cerr << "[CLIENT] Resuming transfer to " << destinations[i].connection->getTargetAddress()
+                      << ", " << destinations[i].missing.size() << " missing range(s)" << std::endl;
+        }
+    }
+}
+
+bool Client::requestSignatures(ICMPConnection& connection, const std::string& name,
+                               std::map<uint64_t, protocol::BlockSignature>& blocks,
+                               uint32_t& blockSize, uint64_t& basisSize) {
+    protocol::DeltaRequest request;
+    request.maxPayload = static_cast<uint32_t>(std::min(connection.getMaxPayloadSize(), delta::MAX_REPLY_PAYLOAD));
+    request.fileName = name;
+    size_t window = delta::signaturesPerPacket(request.maxPayload) * delta::SIGNATURE_WINDOW;
+
+    bool answered = false;
+    uint64_t totalBlocks = 0;
+    std::vector<uint8_t> payload;
+    int failures = 0;
+
+    while (failures < DELTA_ATTEMPTS) {
+        auto packet = protocol::buildDeltaRequestPacket(request, nextSeqNum++, id);
+        if (!transmitPacket(*packet, connection)) {
+            return false;
+        }
+
+        bool progress = false;
+        while (connection.receivePacket(payload, DELTA_TIMEOUT_MS)) {
+            std::unique_ptr<protocol::Packet> reply;
+            try {
+                reply = protocol::parsePacket(payload.data(), payload.size());
+            } catch (const std::exception&) {
+                continue;
+            }
+            if (!reply || reply->id != id || reply->packetType != protocol::SIGNATURES) {
+                continue;
+            }
+
+            const auto& sig = std::get<protocol::Signatures>(reply->payload);
+            if (!sig.found) {
+                return false;
+            }
+            if (!answered) {
+                if (sig.blockSize < delta::MIN_BLOCK_SIZE || sig.blockSize > delta::MAX_BLOCK_SIZE) {
+                    return false;
+                }
+                blockSize = sig.blockSize;
+                basisSize = sig.basisSize;
+                totalBlocks = basisSize / blockSize;
+                answered = true;
+            }
+            else if (sig.blockSize != blockSize || sig.basisSize != basisSize) {
+                continue;
+            }
+
+            for (size_t i = 0; i < sig.blocks.size() && sig.firstBlock + i < totalBlocks; ++i) {
+                progress |= blocks.emplace(sig.firstBlock + i, sig.blocks[i]).second;
+            }
+            // Window complete, no need to wait for the timeout
+            uint64_t windowEnd = std::min<uint64_t>(totalBlocks, request.firstBlock + window);
+            bool complete = true;
+            for (uint64_t index = request.firstBlock; index < windowEnd && complete; ++index) {
+                complete = blocks.count(index) != 0;
+            }
+            if (complete) {
+                break;
+            }
+        }
+
+        while (request.firstBlock < totalBlocks && blocks.count(request.firstBlock) != 0) {
+            ++request.firstBlock;
+        }
+        if (answered && request.firstBlock >= totalBlocks) {
+            return true;
+        }
+        failures = progress ? 0 : failures + 1;
+    }
+
+    // Blocks without a signature are simply sent as literals
+    if (answered) {
+        std::cerr << "[CLIENT] Got signatures of " << blocks.size() << " of " << totalBlocks << " blocks" << std::endl;
+    }
+    return answered;
+}
+
+bool Client::streamFile(file_handler::Source& reader, const std::string& name, uint8_t kind, uint8_t codec,
+                        const std::vector<uint8_t>& iv) {
+    std::vector<uint8_t> key = encoder::deriveKey(xlogin);
+    std::vector<uint8_t> tagKey = encoder::deriveTagKey(key);
+
+    if (iv.size() != 16 || key.empty() || tagKey.empty()) {
         return false;
     }
 
-    auto chunks = chunker::chunkData(cipherData, maxChunkSize);
+    encoder::Encryptor encryptor(key, iv);
+    encoder::MerkleTree merkle;
+    if (!encryptor.isValid() || !merkle.isValid()) {
+        return false;
+    }
 
     protocol::Metadata meta;
-    meta.fileName = file_handler::getNameFromPath(filePath);
-    meta.fileSize = static_cast<uint32_t>(cipherData.size());
-    meta.totalChunks = static_cast<uint32_t>(chunks.size());
+    meta.fileName = name;
+    meta.kind = kind;
+    meta.codec = codec;
+    if (reader.isStream()) {
+        // Length of a pipe is known only at its end, the End packet tells it
+        meta.fileSize = protocol::UNKNOWN_SIZE;
+        meta.totalChunks = protocol::UNKNOWN_SIZE;
+    }
+    else {
+        uint64_t cipherSize = encoder::cipherSize(reader.getSize());
+        meta.fileSize = reader.getSize();
+        meta.totalChunks = (cipherSize + maxChunkSize - 1) / maxChunkSize;
+    }
+    meta.chunkSize = static_cast<uint32_t>(maxChunkSize);
     meta.iv = iv;
 
-    auto metaPacket = protocol::buildMetadataPacket(meta, nextSeqNum++, id);
-    packets.push_back(std::move(metaPacket));
+    rereadable = !reader.isStream();
+    for (auto& destination : destinations) {
+        destination.rangeIndex = 0;
+        destination.reread = protocol::ResumeState{};
+        destination.reread.fileSize = meta.fileSize;
+        destination.reread.chunkSize = meta.chunkSize;
+        destination.reread.iv = iv;
+        destination.backlog.clear();
+        destination.backlogBytes = 0;
+        destination.lagging = false;
+    }
+
+    // Destinations resuming a transfer already have the metadata
+    auto metaPacket = std::make_shared<const std::vector<uint8_t>>(
+        protocol::serializePacket(*protocol::buildMetadataPacket(meta, nextSeqNum++, id)));
+    for (auto& destination : destinations) {
+        if (destination.active && !destination.partial) {
+            sendTo(destination, metaPacket);
+        }
+    }
+
+    // Read whole number of chunks at once so cipher buffer never grows past one block
+    size_t readSize = maxChunkSize * READ_CHUNKS;
+    std::vector<uint8_t> plain;
+    std::vector<uint8_t> cipherBuffer;
+    std::vector<uint8_t> leaf;
+    uint64_t chunkNum = 0;
+    uint64_t bytesRead = 0;
+    bool eof = false;
+    sentChunks.clear();
+    sentBytes = 0;
 
-    for (size_t i = 0; i < chunks.size(); ++i) {
-        protocol::Data data;
-        data.chunkNum = static_cast<uint32_t>(i);
-        data.payload = std::move(chunks[i]);
+    while (!eof) {
+        {
+            trace::Scope scope(&pipeline, trace::CLIENT_READ, bytesRead);
+            if (!reader.read(plain, readSize)) {
+                return false;
+            }
+        }
+        eof = plain.empty();
+        bytesRead += plain.size();
 
-        auto packet = protocol::buildDataPacket(data, nextSeqNum++, id);
-        packets.push_back(std::move(packet));
+        {
+            trace::Scope scope(&pipeline, trace::CLIENT_ENCRYPT, chunkNum);
+            // Leaf i is the plaintext of chunk i, the last (possibly empty) one is whatever is left at the end
+            for (size_t used = 0; used < plain.size();) {
+                size_t n = std::min(maxChunkSize - leaf.size(), plain.size() - used);
+                leaf.insert(leaf.end(), plain.begin() + used, plain.begin() + used + n);
+                used += n;
+                if (leaf.size() == maxChunkSize) {
+                    if (!merkle.addLeaf(leaf.data(), leaf.size())) {
+                        return false;
+                    }
+                    leaf.clear();
+                }
+            }
+            if (eof && !merkle.addLeaf(leaf.data(), leaf.size())) {
+                return false;
+            }
+
+            bool ok = eof ? encryptor.finalize(cipherBuffer)
+                          : encryptor.update(plain.data(), plain.size(), cipherBuffer);
+            if (!ok) {
+                return false;
+            }
+        }
+
+        // Chunks are cut and tagged before any is sent, so sending does not count into the stage
+        std::vector<protocol::Data> ready;
+        {
+            trace::Scope scope(&pipeline, trace::CLIENT_CHUNK, chunkNum);
+            for (auto& chunk : chunker::takeChunks(cipherBuffer, maxChunkSize, eof)) {
+                protocol::Data data;
+                data.chunkNum = chunkNum++;
+                data.payload = std::move(chunk);
+                data.tag = encoder::chunkTag(tagKey, id, data.chunkNum, data.payload.data(), data.payload.size());
+                ready.push_back(std::move(data));
+            }
+        }
+        for (auto& data : ready) {
+            if (!sendChunk(std::move(data))) {
+                return false;
+            }
+        }
+        lastChunk = chunkNum;
+
+        // Damaged chunks are reported as they arrive, resend them while they are still buffered
+        if (!pollStatus()) {
+            return false;
+        }
     }
 
+    if (!reader.isStream() && chunkNum != meta.totalChunks) {
+        std::cerr << "[CLIENT] File changed while being sent" << std::endl;
+        return false;
+    }
+
+    protocol::End end{chunkNum, bytesRead, merkle.root()};
+    if (end.root.size() != protocol::ROOT_SIZE) {
+        return false;
+    }
+    auto endPacket = protocol::buildEndPacket(end, nextSeqNum++, id);
+    awaitCompletion(*endPacket);
     return true;
 }
 
-bool Client::transmitPackets(PacketVector& packets, ICMPConnection& connection) {
-    for (auto& packet : packets) {
-        auto serialized = protocol::serializePacket(*packet);
-         
-        if (!connection.sendPacket(serialized.data(), serialized.size())) {
+bool Client::connectDestinations(void) {
+    for (const auto& target : targetAddresses) {
+        std::vector<std::string> addresses;
+        if (multipath) {
+            addresses = net_utils::resolveAllAddresses(target);
+        }
+        if (addresses.empty()) {
+            addresses.push_back(target);
+        }
+
+        // With multipath an address that does not work only narrows the stripe
+        Destination destination;
+        for (const auto& address : addresses) {
+            Path path;
+            path.connection = std::make_unique<ICMPConnection>(address, sink.get(), impairment.get());
+            ICMPConnection& connection = *path.connection;
+            if (!connection.connect()) {
+                std::cerr << "[CLIENT] Failed to establish connection to " << address << std::endl;
+                continue;
+            }
+
+            if (pathMTU == 0) {
+                connection.discoverPathMTU();
+            }
+            else {
+                connection.setPathMTU(pathMTU);
+            }
+
+            size_t overhead = protocol::HEADER_SIZE + protocol::DATA_HEADER_SIZE;
+            if (connection.getMaxPayloadSize() <= overhead) {
+                std::cerr << "[CLIENT] Path MTU " << connection.getPathMTU() << " to " << address << " is too small"
+                          << std::endl;
+                continue;
+            }
+            // Whole AES blocks per chunk, so every chunk decrypts to exactly its own length
+            size_t chunkSize = connection.getMaxPayloadSize() - overhead;
+            chunkSize -= chunkSize % encoder::BLOCK_SIZE;
+            // Packets are built once for all destinations and paths, so the narrowest path decides
+            maxChunkSize = maxChunkSize == 0 ? chunkSize : std::min(maxChunkSize, chunkSize);
+
+            // Only server replies matter from here on, a failed filter just costs reading the echoes
+            connection.ignoreEchoedType(protocol::DATA);
+            destination.paths.push_back(std::move(path));
+        }
+        if (destination.paths.empty()) {
             return false;
         }
+        if (destination.paths.size() > 1) {
+            std::cerr << "[CLIENT] Striping chunks to " << target << " over " << destination.paths.size()
+                      << " addresses" << std::endl;
+        }
+
+        destination.connection = destination.paths.front().connection.get();
+        destination.active = true;
+        destinations.push_back(std::move(destination));
+    }
+    return true;
+}
+
+bool Client::transmitPacket(const protocol::Packet& packet, ICMPConnection& connection) {
+    auto serialized = protocol::serializePacket(packet);
+
+    return connection.sendPacket(serialized.data(), serialized.size());
+}
+
+void Client::reportDestinations(void) const {
+    for (const auto& destination : destinations) {
+        const char* outcome = destination.failed ? "failed" : destination.confirmed ? "confirmed" : "unconfirmed";
+        std::cerr << "[CLIENT] " << destination.connection->getTargetAddress() << ": " << destination.packets
+                  << " packets, " << destination.bytes << " bytes, " << destination.resent << " chunks resent, "
+                  << destination.deferred << " deferred, " << outcome << std::endl;
+        if (destination.paths.size() < 2) {
+            continue;
+        }
+        for (const auto& path : destination.paths) {
+            std::cerr << "[CLIENT]   via " << path.connection->getTargetAddress() << ": " << path.packets
+                      << " packets, " << path.bytes << " bytes, "
+                      << static_cast<uint64_t>(path.rate / (1024 * 1024)) << " MiB/s observed"
+                      << (path.failed ? ", failed" : "") << std::endl;
+        }
     }
+}
+
+void Client::collectMetrics(metrics::Writer& out) {
+    uint64_t bytes = 0;
+    for (const auto& destination : destinations) {
+        bytes += destination.bytes;
+    }
+    out.counter("secret_client_chunks_total", "Chunks read, encrypted and tagged.", lastChunk);
+    out.gauge("secret_client_retransmit_buffer_bytes", "Payload bytes of sent chunks kept for repairs.",
+              static_cast<uint64_t>(sentBytes));
+    out.counter("secret_client_status_replies_total", "Chunk status packets received.", statusReplies);
+    out.gauge("secret_client_bytes_per_second", "Bytes sent to all targets per second over the last export interval.",
+              byteRate.update(bytes));
 
+    out.family("secret_client_packets_sent_total", "counter", "Packets sent to a target.");
+    for (const auto& destination : destinations) {
+        out.sample("secret_client_packets_sent_total", destination.packets,
+                   metrics::label("target", destination.connection->getTargetAddress()));
+    }
+    out.family("secret_client_bytes_sent_total", "counter", "Protocol bytes sent to a target.");
+    for (const auto& destination : destinations) {
+        out.sample("secret_client_bytes_sent_total", destination.bytes,
+                   metrics::label("target", destination.connection->getTargetAddress()));
+    }
+    out.family("secret_client_chunks_resent_total", "counter", "Chunks sent again on request of a target.");
+    for (const auto& destination : destinations) {
+        out.sample("secret_client_chunks_resent_total", destination.resent,
+                   metrics::label("target", destination.connection->getTargetAddress()));
+    }
+    out.family("secret_client_chunks_deferred_total", "counter", "Chunks skipped while a target lagged behind the others.");
+    for (const auto& destination : destinations) {
+        out.sample("secret_client_chunks_deferred_total", destination.deferred,
+                   metrics::label("target", destination.connection->getTargetAddress()));
+    }
+    out.family("secret_client_backlog_bytes", "gauge", "Bytes waiting for room in the socket buffers of a target.");
+    for (const auto& destination : destinations) {
+        out.sample("secret_client_backlog_bytes", static_cast<uint64_t>(destination.backlogBytes),
+                   metrics::label("target", destination.connection->getTargetAddress()));
+    }
+    out.family("secret_client_target_state", "gauge", "1 for the state the target is in.");
+    for (const auto& destination : destinations) {
+        const char* state = destination.failed ? "failed" : destination.confirmed ? "confirmed" :
+                            destination.done ? "unconfirmed" : "sending";
+        out.sample("secret_client_target_state", static_cast<uint64_t>(1),
+                   metrics::label("target", destination.connection->getTargetAddress()) + "," +
+                   metrics::label("state", state));
+    }
+
+    out.family("secret_client_path_bytes_sent_total", "counter", "Protocol bytes sent over one address of a target.");
+    for (const auto& destination : destinations) {
+        for (const auto& path : destination.paths) {
+            out.sample("secret_client_path_bytes_sent_total", path.bytes,
+                       metrics::label("address", path.connection->getTargetAddress()));
+        }
+    }
+    out.family("secret_client_path_rate_bytes_per_second", "gauge", "Observed link throughput of a path (0 = unknown).");
+    for (const auto& destination : destinations) {
+        for (const auto& path : destination.paths) {
+            out.sample("secret_client_path_rate_bytes_per_second", path.rate,
+                       metrics::label("address", path.connection->getTargetAddress()));
+        }
+    }
+
+    pipeline.exportMetrics(out, "secret_client_stage_latency_seconds");
+    if (impairment) {
+        impairment->exportMetrics(out);
+    }
+}
+
+void Client::pollObservers(void) {
+    if (exporter) {
+        exporter->poll();
+    }
+    if (trace::takeDumpRequest()) {
+        pipeline.dump();
+    }
+}
+
+bool Client::finishGenerator(std::chrono::steady_clock::time_point started) {
+    if (!sink->flush()) {
+        return false;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::cerr << "[CLIENT] Generated " << sink->getPackets() << " packets (" << sink->getBytes() << " bytes) in "
+              << seconds << " s, " << static_cast<uint64_t>(static_cast<double>(sink->getPackets()) / seconds)
+              << " packets/s, " << static_cast<double>(sink->getBytes()) / seconds / 1e6 << " MB/s" << std::endl;
     return true;
 }
 
 bool Client::run(void) {
+    auto started = std::chrono::steady_clock::now();
     try {
-        Client::PacketVector packets;
-        if (!packageFile(packets)) {
-            std::cerr << "[CLIENT] Failed to package file into packets" << std::endl;
+        if (exporter && !exporter->open()) {
+            return false;
+        }
+        if (sink && !sink->open()) {
+            return false;
+        }
+        if (!connectDestinations()) {
             return false;
         }
 
-        ICMPConnection icmpConnection(targetAddress);
-        if (!icmpConnection.connect()) {
-            std::cerr << "[CLIENT] Failed to establish connection to the server" << std::endl;
+        std::string name;
+        uint8_t kind;
+        auto source = openSource(name, kind);
+        if (!source) {
             return false;
         }
+        file_handler::Source& reader = *source;
 
-        if (!transmitPackets(packets, icmpConnection)) {
-            std::cerr << "[CLIENT] Failed to transmit packets" << std::endl;
+        if (resume && reader.isStream()) {
+            std::cerr << "[CLIENT] Input is a stream, it can not be resumed" << std::endl;
+            resume = false;
+        }
+        // Compressed transfer always starts over under a random ID, asking would only cost a round trip
+        if (resume && compress) {
+            std::cerr << "[CLIENT] Compressed transfer can not be resumed, sending it whole" << std::endl;
+            resume = false;
+        }
+
+        // Metadata carries the name length in one byte, the server adds .delta or .sar on its side
+        if (name.size() > protocol::MAX_FILE_NAME) {
+            std::cerr << "[CLIENT] File name " << name << " is longer than " << protocol::MAX_FILE_NAME
+                      << " bytes" << std::endl;
             return false;
         }
-        return true;
+
+        std::vector<uint8_t> iv = encoder::generateIV();
+        if (resume) {
+            resumeDestinations(reader.getSize(), iv);
+        }
+        // New content under a new ID, whatever the servers had does not apply and the IV must not be reused
+        auto startOver = [&]() {
+            id = randomId();
+            iv = encoder::generateIV();
+            for (auto& destination : destinations) {
+                destination.partial = false;
+                destination.missing.clear();
+            }
+        };
+
+        // Server's copy turns everything it already has into block references
+        delta::Encoder* encoder = nullptr;
+        if (delta && destinations.size() > 1) {
+            std::cerr << "[CLIENT] Delta transfer needs a single target, sending it whole" << std::endl;
+        }
+        else if (delta && (kind != protocol::CONTENT_FILE || reader.isStream())) {
+            std::cerr << "[CLIENT] Delta transfer needs a single regular file, sending it whole" << std::endl;
+        }
+        else if (delta && name.size() + delta::EXTENSION.size() > protocol::MAX_FILE_NAME) {
+            std::cerr << "[CLIENT] Name of " << name << " leaves no room for the delta suffix, sending it whole"
+                      << std::endl;
+        }
+        else if (delta) {
+            std::map<uint64_t, protocol::BlockSignature> blocks;
+            uint32_t blockSize = 0;
+            uint64_t basisSize = 0;
+            if (requestSignatures(*destinations.front().connection, name, blocks, blockSize, basisSize) &&
+                !blocks.empty()) {
+                auto deltaSource = std::make_unique<delta::Encoder>(std::move(source), blockSize, basisSize, blocks);
+                encoder = deltaSource.get();
+                source = std::move(deltaSource);
+                kind = protocol::CONTENT_DELTA;
+                startOver();
+            }
+            else {
+                std::cerr << "[CLIENT] Server has no usable copy of " << name << ", sending it whole" << std::endl;
+            }
+        }
+
+        // Compression goes last, literals of a delta and archive manifests compress too
+        compress::Compressor* compressor = nullptr;
+        uint8_t codec = protocol::CODEC_NONE;
+        if (compress) {
+            auto compressSource = std::make_unique<compress::Compressor>(std::move(source));
+            compressor = compressSource.get();
+            source = std::move(compressSource);
+            codec = protocol::CODEC_LZ;
+            startOver();
+        }
+
+        bool sent = streamFile(*source, name, kind, codec, iv);
+        for (int pass = 0; sent && pass < REREAD_PASSES; ++pass) {
+            // Destinations that lost chunks which already left the buffer get them from a new read
+            bool reread = false;
+            for (auto& destination : destinations) {
+                destination.active = destination.reread.found != 0;
+                if (destination.active) {
+                    destination.partial = true;
+                    destination.missing = std::move(destination.reread.missing);
+                    reread = true;
+                }
+            }
+            if (!reread) {
+                break;
+            }
+
+            std::cerr << "[CLIENT] Reading " << name << " again to resend chunks that left the buffer" << std::endl;
+            source = openSource(name, kind);
+            sent = source && streamFile(*source, name, kind, codec, iv);
+        }
+
+        bool failed = !sent;
+        for (auto& destination : destinations) {
+            if (destination.reread.found) {
+                std::cerr << "[CLIENT] Lost chunks to " << destination.connection->getTargetAddress()
+                          << " could not be resent, run again with --resume" << std::endl;
+                destination.failed = true;
+            }
+            failed |= destination.failed;
+        }
+        if (!sent) {
+            std::cerr << "[CLIENT] Failed to transmit file" << std::endl;
+        }
+        if (compressor) {
+            std::cerr << "[CLIENT] Compressed " << compressor->getRawBytes() << " bytes to "
+                      << compressor->getEncodedBytes() << ", " << compressor->getStoredBlocks() << " of "
+                      << compressor->getBlocks() << " blocks stored uncompressed" << std::endl;
+        }
+        if (encoder) {
+            std::cerr << "[CLIENT] Delta sent " << encoder->getLiteralBytes() << " literal bytes, "
+                      << encoder->getCopiedBytes() << " bytes matched the server's copy" << std::endl;
+        }
+        if (impairment) {
+            impairment->drain();
+            impairment->report();
+        }
+        if (destinations.size() > 1 || destinations.front().paths.size() > 1) {
+            reportDestinations();
+        }
+        if (sink && !finishGenerator(started)) {
+            failed = true;
+        }
+        if (exporter) {
+            exporter->flush();
+        }
+        if (pipeline.isTracing()) {
+            for (size_t i = 0; i < pipeline.size(); ++i) {
+                const metrics::Histogram& histogram = pipeline.histogram(i);
+                std::cerr << "[CLIENT] Stage " << pipeline.name(i) << ": " << histogram.count() << " passes, p50 "
+                          << histogram.quantile(0.5) / 1000 << " us, p99 " << histogram.quantile(0.99) / 1000
+                          << " us, max " << histogram.max() / 1000 << " us" << std::endl;
+            }
+            pipeline.dump();
+        }
+        return !failed;
     } catch (const std::invalid_argument& e) {
         std::cerr << "[CLIENT] Invalid input: " << e.what() << std::endl;
         return false;
@@ -111,4 +1238,3 @@ bool Client::run(void) {
     }
     return true;
 }
-
@@ -0,0 +1,307 @@
+/**
+ * @file compress.cpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#include "compress.hpp"
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+constexpr size_t MIN_MATCH = 4;                     ///< Shortest match worth an offset
+constexpr size_t MIN_BLOCK = 64;                    ///< Smaller blocks are always stored
+constexpr size_t SAMPLE_SIZE = 4096;                ///< Bytes looked at by the entropy estimate
+constexpr size_t MAX_OFFSET = 65535;                ///< Farthest match reachable by a 16-bit offset
+constexpr int HASH_BITS = 13;                       ///< Match finder table of 8192 positions
+constexpr int SKIP_SHIFT = 6;                       ///< Step grows by one every 64 bytes without a match
+constexpr size_t MAX_ENCODED = compress::BLOCK_SIZE + compress::BLOCK_SIZE / 255 + 16; ///< Worst case LZ block
+
+/**
+ * @brief Reads 4 bytes as one number for hashing and comparing
+ */
+static uint32_t load32(const uint8_t* p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/**
+ * @brief Multiplicative hash of 4 bytes
+ */
+static uint32_t hash32(uint32_t value) {
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/**
+ * @brief Writes the rest of a length that did not fit into its token nibble
+ */
+static void appendLength(std::vector<uint8_t>& out, size_t len) {
+    while (len >= 255) {
+        out.push_back(255);
+        len -= 255;
+    }
+    out.push_back(static_cast<uint8_t>(len));
+}
+
+/**
+ * @brief Reads the rest of a length that did not fit into its token nibble
+ */
+static bool readLength(const uint8_t* data, size_t len, size_t& pos, size_t& value) {
+    uint8_t byte;
+    do {
+        if (pos >= len) {
+            return false;
+        }
+        byte = data[pos++];
+        value += byte;
+    } while (byte == 255);
+    return true;
+}
+
+/**
+ * @brief Appends one sequence: literals followed by a match (matchLen 0 = literals only, end of block)
+ */
+static void appendSequence(std::vector<uint8_t>& out, const uint8_t* literals, size_t literalLen,
+                           size_t offset, size_t matchLen) {
+    size_t matchCode = matchLen == 0 ? 0 : matchLen - MIN_MATCH;
+    out.push_back(static_cast<uint8_t>((std::min<size_t>(literalLen, 15) << 4) | std::min<size_t>(matchCode, 15)));
+    if (literalLen >= 15) {
+        appendLength(out, literalLen - 15);
+    }
+    out.insert(out.end(), literals, literals + literalLen);
+
+    if (matchLen == 0) {
+        return;
+    }
+    out.push_back(static_cast<uint8_t>(offset));
+    out.push_back(static_cast<uint8_t>(offset >> 8));
+    if (matchCode >= 15) {
+        appendLength(out, matchCode - 15);
+    }
+}
+
+/**
+ * @brief Appends big endian 32-bit number
+ */
+static void appendU32(std::vector<uint8_t>& out, uint32_t value) {
+    out.push_back(static_cast<uint8_t>(value >> 24));
+    out.push_back(static_cast<uint8_t>(value >> 16));
+    out.push_back(static_cast<uint8_t>(value >> 8));
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+/**
+ * @brief Reads big endian 32-bit number
+ */
+static uint32_t readU32(const uint8_t* p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+           (static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+bool compress::isCompressible(const uint8_t* data, size_t len) {
+    if (len < MIN_BLOCK) {
+        return false;
+    }
+
+    size_t step = std::max<size_t>(1, len / SAMPLE_SIZE);
+    size_t counts[256] = {0};
+    size_t samples = 0;
+    for (size_t i = 0; i < len; i += step) {
+        ++counts[data[i]];
+        ++samples;
+    }
+
+    double entropy = 0.0;
+    for (size_t count : counts) {
+        if (count != 0) {
+            double p = static_cast<double>(count) / static_cast<double>(samples);
+            entropy -= p * std::log2(p);
+        }
+    }
+    return entropy < ENTROPY_LIMIT;
+}
+
+void compress::compressBlock(const uint8_t* data, size_t len, std::vector<uint8_t>& out) {
+    out.clear();
+    out.reserve(len + len / 255 + 16);
+
+    int32_t table[1 << HASH_BITS];
+    std::fill(std::begin(table), std::end(table), -1);
+
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (pos + MIN_MATCH <= len) {
+        uint32_t sequence = load32(data + pos);
+        uint32_t h = hash32(sequence);
+        int32_t candidate = table[h];
+        table[h] = static_cast<int32_t>(pos);
+
+        if (candidate < 0 || pos - static_cast<size_t>(candidate) > MAX_OFFSET ||
+            load32(data + candidate) != sequence) {
+            // Skip faster through data that does not repeat
+            pos += 1 + ((pos - anchor) >> SKIP_SHIFT);
+            continue;
+        }
+
+        size_t ref = static_cast<size_t>(candidate);
+        size_t matchLen = MIN_MATCH;
+        while (pos + matchLen < len && data[ref + matchLen] == data[pos + matchLen]) {
+            ++matchLen;
+        }
+
+        appendSequence(out, data + anchor, pos - anchor, pos - ref, matchLen);
+        pos += matchLen;
+        anchor = pos;
+
+        // Position just before the next search keeps the table fresh across long matches
+        if (pos + MIN_MATCH <= len) {
+            table[hash32(load32(data + pos - 2))] = static_cast<int32_t>(pos - 2);
+        }
+    }
+
+    appendSequence(out, data + anchor, len - anchor, 0, 0);
+}
+
+bool compress::decompressBlock(const uint8_t* data, size_t len, uint8_t* out, size_t rawLen) {
+    size_t pos = 0;
+    size_t written = 0;
+
+    while (pos < len) {
+        uint8_t token = data[pos++];
+
+        size_t literalLen = token >> 4;
+        if (literalLen == 15 && !readLength(data, len, pos, literalLen)) {
+            return false;
+        }
+        if (literalLen > len - pos || literalLen > rawLen - written) {
+            return false;
+        }
+        std::memcpy(out + written, data + pos, literalLen);
+        pos += literalLen;
+        written += literalLen;
+
+        // Last sequence has literals only
+        if (pos == len) {
+            break;
+        }
+
+        if (len - pos < 2) {
+            return false;
+        }
+        size_t offset = data[pos] | (static_cast<size_t>(data[pos + 1]) << 8);
+        pos += 2;
+        size_t matchLen = token & 0x0F;
+        if (matchLen == 15 && !readLength(data, len, pos, matchLen)) {
+            return false;
+        }
+        matchLen += MIN_MATCH;
+        if (offset == 0 || offset > written || matchLen > rawLen - written) {
+            return false;
+        }
+
+        // Overlapping copy repeats the last offset bytes, so it has to go byte by byte
+        const uint8_t* from = out + written - offset;
+        if (offset >= matchLen) {
+            std::memcpy(out + written, from, matchLen);
+        }
+        else {
+            for (size_t i = 0; i < matchLen; ++i) {
+                out[written + i] = from[i];
+            }
+        }
+        written += matchLen;
+    }
+    return written == rawLen;
+}
+
+bool compress::Compressor::nextFrame(void) {
+    // Full blocks compress better than whatever one read of a pipe returns
+    std::vector<uint8_t> block;
+    std::vector<uint8_t> piece;
+    while (block.size() < BLOCK_SIZE) {
+        if (!input->read(piece, BLOCK_SIZE - block.size())) {
+            return false;
+        }
+        if (piece.empty()) {
+            eof = true;
+            break;
+        }
+        block.insert(block.end(), piece.begin(), piece.end());
+    }
+    if (block.empty()) {
+        return true;
+    }
+
+    std::vector<uint8_t> encoded;
+    if (isCompressible(block.data(), block.size())) {
+        compressBlock(block.data(), block.size(), encoded);
+    }
+
+    bool stored = encoded.empty() || encoded.size() >= block.size();
+    const std::vector<uint8_t>& payload = stored ? block : encoded;
+    out.push_back(stored ? METHOD_STORED : METHOD_LZ);
+    appendU32(out, static_cast<uint32_t>(block.size()));
+    appendU32(out, static_cast<uint32_t>(payload.size()));
+    out.insert(out.end(), payload.begin(), payload.end());
+
+    rawBytes += block.size();
+    encodedBytes += FRAME_HEADER_SIZE + payload.size();
+    ++blocks;
+    if (stored) {
+        ++storedBlocks;
+    }
+    return true;
+}
+
+bool compress::Compressor::read(std::vector<uint8_t>& data, size_t maxLen) {
+    while (!eof && out.size() - outOffset < maxLen) {
+        if (!nextFrame()) {
+            return false;
+        }
+    }
+
+    size_t n = std::min(maxLen, out.size() - outOffset);
+    data.assign(out.begin() + static_cast<std::ptrdiff_t>(outOffset),
+                out.begin() + static_cast<std::ptrdiff_t>(outOffset + n));
+    outOffset += n;
+    if (outOffset == out.size()) {
+        out.clear();
+        outOffset = 0;
+    }
+    return true;
+}
+
+bool compress::Decompressor::update(const uint8_t* data, size_t len, std::vector<uint8_t>& raw) {
+    raw.clear();
+    pending.insert(pending.end(), data, data + len);
+
+    size_t pos = 0;
+    while (pending.size() - pos >= FRAME_HEADER_SIZE) {
+        uint8_t method = pending[pos];
+        size_t rawLen = readU32(pending.data() + pos + 1);
+        size_t encodedLen = readU32(pending.data() + pos + 5);
+        if (rawLen == 0 || rawLen > BLOCK_SIZE || encodedLen > MAX_ENCODED ||
+            (method == METHOD_STORED && encodedLen != rawLen) || method > METHOD_LZ) {
+            std::cerr << "[COMPRESS] Invalid frame header" << std::endl;
+            return false;
+        }
+        if (pending.size() - pos - FRAME_HEADER_SIZE < encodedLen) {
+            break;
+        }
+
+        const uint8_t* payload = pending.data() + pos + FRAME_HEADER_SIZE;
+        size_t offset = raw.size();
+        raw.resize(offset + rawLen);
+        if (method == METHOD_STORED) {
+            std::memcpy(raw.data() + offset, payload, rawLen);
+        }
+        else if (!decompressBlock(payload, encodedLen, raw.data() + offset, rawLen)) {
+            std::cerr << "[COMPRESS] Corrupted block" << std::endl;
+            return false;
+        }
+        pos += FRAME_HEADER_SIZE + encodedLen;
+    }
+
+    pending.erase(pending.begin(), pending.begin() + static_cast<std::ptrdiff_t>(pos));
+    return true;
+}
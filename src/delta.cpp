@@ -0,0 +1,381 @@
+/**
+ * @file delta.cpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#include "delta.hpp"
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+
+constexpr size_t READ_SIZE = 1024 * 1024;           ///< Piece of the new file read at once
+constexpr size_t MAX_LITERAL = 1024 * 1024;         ///< Longest literal run kept in memory before it is emitted
+constexpr size_t COPY_PIECE = 1024 * 1024;          ///< Piece of the basis copied at once when applying
+constexpr size_t DIGEST_SIZE = SHA256_DIGEST_LENGTH;
+
+/**
+ * @brief Appends big endian number of the given width to the buffer
+ */
+template <typename T>
+static void appendBE(std::vector<uint8_t>& out, T value) {
+    for (size_t i = sizeof(T); i > 0; --i) {
+        out.push_back(static_cast<uint8_t>(static_cast<uint64_t>(value) >> ((i - 1) * 8)));
+    }
+}
+
+/**
+ * @brief Reads big endian number of the given width from the stream
+ */
+template <typename T>
+static bool readBE(std::istream& in, T& value) {
+    uint8_t buf[sizeof(T)];
+    if (!in.read(reinterpret_cast<char*>(buf), sizeof(buf))) {
+        return false;
+    }
+    uint64_t result = 0;
+    for (uint8_t byte : buf) {
+        result = (result << 8) | byte;
+    }
+    value = static_cast<T>(result);
+    return true;
+}
+
+uint32_t delta::chooseBlockSize(uint64_t basisSize) {
+    uint64_t size = static_cast<uint64_t>(std::sqrt(static_cast<double>(basisSize)));
+    size = (size + 1023) / 1024 * 1024;
+    return static_cast<uint32_t>(std::clamp<uint64_t>(size, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE));
+}
+
+uint32_t delta::weakHash(const uint8_t* data, size_t len) {
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for (size_t i = 0; i < len; ++i) {
+        a += data[i];
+        b += static_cast<uint32_t>(len - i) * data[i];
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+uint64_t delta::strongHash(const uint8_t* data, size_t len) {
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256(data, len, hash);
+
+    uint64_t result = 0;
+    for (size_t i = 0; i < sizeof(result); ++i) {
+        result = (result << 8) | hash[i];
+    }
+    return result;
+}
+
+size_t delta::signaturesPerPacket(size_t maxPayload) {
+    size_t overhead = protocol::HEADER_SIZE + protocol::SIGNATURES_HEADER_SIZE;
+    if (maxPayload <= overhead) {
+        return 0;
+    }
+    return (maxPayload - overhead) / protocol::SIGNATURE_SIZE;
+}
+
+bool delta::computeSignatures(const std::string& path, uint64_t firstBlock, size_t maxBlocks, protocol::Signatures& sig) {
+    sig = protocol::Signatures();
+    sig.firstBlock = firstBlock;
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        return false;
+    }
+
+    sig.found = 1;
+    sig.basisSize = static_cast<uint64_t>(st.st_size);
+    sig.blockSize = chooseBlockSize(sig.basisSize);
+
+    // Only full blocks are advertised, the tail of the basis is never referenced
+    uint64_t fullBlocks = sig.basisSize / sig.blockSize;
+    std::vector<uint8_t> block(sig.blockSize);
+    for (uint64_t index = firstBlock; index < fullBlocks && index - firstBlock < maxBlocks; ++index) {
+        if (!DiskWriter::preadAll(fd, block.data(), block.size(), index * sig.blockSize)) {
+            std::cerr << "[DELTA] Cannot read " << path << std::endl;
+            ::close(fd);
+            return false;
+        }
+        sig.blocks.push_back({weakHash(block.data(), block.size()), strongHash(block.data(), block.size())});
+    }
+
+    ::close(fd);
+    return true;
+}
+
+delta::Encoder::Encoder(std::unique_ptr<file_handler::Source> input, uint32_t blockSize, uint64_t basisSize,
+                        const std::map<uint64_t, protocol::BlockSignature>& blocks)
+    : input(std::move(input)), blockSize(blockSize) {
+    for (const auto& [index, block] : blocks) {
+        table[block.weak].emplace_back(block.strong, index);
+    }
+
+    appendBE<uint32_t>(out, MAGIC);
+    appendBE<uint32_t>(out, blockSize);
+    appendBE<uint64_t>(out, basisSize);
+}
+
+bool delta::Encoder::fill(void) {
+    // Everything before the pending literal is encoded already
+    buf.erase(buf.begin(), buf.begin() + static_cast<std::ptrdiff_t>(literalStart));
+    pos -= literalStart;
+    literalStart = 0;
+
+    std::vector<uint8_t> piece;
+    if (!input->read(piece, READ_SIZE)) {
+        return false;
+    }
+    if (piece.empty()) {
+        eof = true;
+        return true;
+    }
+
+    hash.update(piece.data(), piece.size());
+    fileSize += piece.size();
+    buf.insert(buf.end(), piece.begin(), piece.end());
+    return true;
+}
+
+void delta::Encoder::flushCopy(void) {
+    if (copyCount == 0) {
+        return;
+    }
+    out.push_back(OP_COPY);
+    appendBE<uint64_t>(out, copyFirst);
+    appendBE<uint32_t>(out, static_cast<uint32_t>(copyCount));
+    copyCount = 0;
+}
+
+void delta::Encoder::flushLiteral(size_t end) {
+    if (end <= literalStart) {
+        return;
+    }
+    flushCopy();
+
+    size_t len = end - literalStart;
+    out.push_back(OP_LITERAL);
+    appendBE<uint32_t>(out, static_cast<uint32_t>(len));
+    out.insert(out.end(), buf.begin() + static_cast<std::ptrdiff_t>(literalStart),
+               buf.begin() + static_cast<std::ptrdiff_t>(end));
+    literalBytes += len;
+    literalStart = end;
+}
+
+bool delta::Encoder::produce(size_t target) {
+    while (!finished && out.size() - outOffset < target) {
+        // Rolling needs the byte right after the window too
+        if (!eof && buf.size() - pos <= blockSize) {
+            if (!fill()) {
+                return false;
+            }
+            continue;
+        }
+
+        if (buf.size() - pos < blockSize) {
+            // No full window left, the rest can only be a literal
+            flushLiteral(buf.size());
+            flushCopy();
+
+            std::vector<uint8_t> digest = hash.finish();
+            if (digest.size() != DIGEST_SIZE) {
+                return false;
+            }
+            out.push_back(OP_END);
+            appendBE<uint64_t>(out, fileSize);
+            out.insert(out.end(), digest.begin(), digest.end());
+            finished = true;
+            break;
+        }
+
+        const uint8_t* window = buf.data() + pos;
+        if (!rolling) {
+            uint32_t weak = weakHash(window, blockSize);
+            sumA = weak & 0xFFFF;
+            sumB = weak >> 16;
+            rolling = true;
+        }
+
+        auto candidates = table.find((sumA & 0xFFFF) | (sumB << 16));
+        if (candidates != table.end()) {
+            uint64_t strong = strongHash(window, blockSize);
+            auto match = std::find_if(candidates->second.begin(), candidates->second.end(),
+                                      [strong](const auto& entry) { return entry.first == strong; });
+            if (match != candidates->second.end()) {
+                flushLiteral(pos);
+
+                // Unchanged regions are runs of consecutive blocks, one operation covers the whole run
+                if (copyCount != 0 && copyFirst + copyCount == match->second) {
+                    ++copyCount;
+                }
+                else {
+                    flushCopy();
+                    copyFirst = match->second;
+                    copyCount = 1;
+                }
+                copiedBytes += blockSize;
+                pos += blockSize;
+                literalStart = pos;
+                rolling = false;
+                continue;
+            }
+        }
+
+        // Slide by one byte: drop the first byte of the window, add the byte after it
+        if (pos + blockSize < buf.size()) {
+            uint32_t outByte = buf[pos];
+            uint32_t inByte = buf[pos + blockSize];
+            sumA = sumA - outByte + inByte;
+            sumB = sumB - blockSize * outByte + sumA;
+        }
+        else {
+            rolling = false;
+        }
+        ++pos;
+
+        if (pos - literalStart >= MAX_LITERAL) {
+            flushLiteral(pos);
+        }
+    }
+    return true;
+}
+
+bool delta::Encoder::read(std::vector<uint8_t>& data, size_t maxLen) {
+    if (!produce(maxLen)) {
+        return false;
+    }
+
+    size_t n = std::min(maxLen, out.size() - outOffset);
+    data.assign(out.begin() + static_cast<std::ptrdiff_t>(outOffset),
+                out.begin() + static_cast<std::ptrdiff_t>(outOffset + n));
+    outOffset += n;
+    if (outOffset == out.size()) {
+        out.clear();
+        outOffset = 0;
+    }
+    return true;
+}
+
+bool delta::apply(const std::string& deltaPath, const std::string& basisPath, const std::string& outPath) {
+    std::ifstream in(deltaPath, std::ios::binary);
+    uint32_t magic;
+    uint32_t blockSize;
+    uint64_t basisSize;
+    if (!in.is_open() || !readBE(in, magic) || !readBE(in, blockSize) || !readBE(in, basisSize) ||
+        magic != MAGIC || blockSize < MIN_BLOCK_SIZE || blockSize > MAX_BLOCK_SIZE) {
+        std::cerr << "[DELTA] " << deltaPath << " is not a delta" << std::endl;
+        return false;
+    }
+
+    int basis = ::open(basisPath.c_str(), O_RDONLY);
+    struct stat st;
+    if (basis < 0 || fstat(basis, &st) != 0 || static_cast<uint64_t>(st.st_size) != basisSize) {
+        std::cerr << "[DELTA] " << basisPath << " changed since its signatures were sent" << std::endl;
+        if (basis >= 0) {
+            ::close(basis);
+        }
+        return false;
+    }
+
+    file_handler::FileWriter output;
+    if (!output.open(outPath)) {
+        ::close(basis);
+        return false;
+    }
+
+    encoder::Sha256 hash;
+    uint64_t written = 0;
+    bool ok = false;
+    while (true) {
+        uint8_t op;
+        if (!readBE(in, op)) {
+            std::cerr << "[DELTA] Truncated delta " << deltaPath << std::endl;
+            break;
+        }
+
+        if (op == OP_LITERAL) {
+            uint32_t len;
+            if (!readBE(in, len) || len > MAX_LITERAL) {
+                std::cerr << "[DELTA] Invalid literal in " << deltaPath << std::endl;
+                break;
+            }
+            std::vector<uint8_t> data(len);
+            if (!in.read(reinterpret_cast<char*>(data.data()), len)) {
+                std::cerr << "[DELTA] Truncated delta " << deltaPath << std::endl;
+                break;
+            }
+            hash.update(data.data(), data.size());
+            written += data.size();
+            if (!output.write(std::move(data))) {
+                break;
+            }
+        }
+        else if (op == OP_COPY) {
+            uint64_t first;
+            uint32_t count;
+            if (!readBE(in, first) || !readBE(in, count) || count == 0 ||
+                first > basisSize / blockSize || count > basisSize / blockSize - first) {
+                std::cerr << "[DELTA] Invalid block reference in " << deltaPath << std::endl;
+                break;
+            }
+
+            uint64_t offset = first * blockSize;
+            uint64_t left = static_cast<uint64_t>(count) * blockSize;
+            bool copied = true;
+            while (left > 0 && copied) {
+                std::vector<uint8_t> data(static_cast<size_t>(std::min<uint64_t>(left, COPY_PIECE)));
+                copied = DiskWriter::preadAll(basis, data.data(), data.size(), offset);
+                if (copied) {
+                    hash.update(data.data(), data.size());
+                    written += data.size();
+                    offset += data.size();
+                    left -= data.size();
+                    copied = output.write(std::move(data));
+                }
+            }
+            if (!copied) {
+                std::cerr << "[DELTA] Cannot copy blocks of " << basisPath << std::endl;
+                break;
+            }
+        }
+        else if (op == OP_END) {
+            uint64_t size;
+            std::vector<uint8_t> digest(DIGEST_SIZE);
+            if (!readBE(in, size) || !in.read(reinterpret_cast<char*>(digest.data()), DIGEST_SIZE)) {
+                std::cerr << "[DELTA] Truncated delta " << deltaPath << std::endl;
+                break;
+            }
+            // Wrong basis (or a corrupted delta) would silently produce a different file
+            if (size != written || digest != hash.finish()) {
+                std::cerr << "[DELTA] Rebuilt " << outPath << " does not match the sent file" << std::endl;
+                break;
+            }
+            ok = in.peek() == std::ifstream::traits_type::eof();
+            if (!ok) {
+                std::cerr << "[DELTA] Trailing data in " << deltaPath << std::endl;
+            }
+            break;
+        }
+        else {
+            std::cerr << "[DELTA] Unknown operation in " << deltaPath << std::endl;
+            break;
+        }
+    }
+
+    ::close(basis);
+    if (!ok) {
+        output.discard();
+        return false;
+    }
+    return output.commit();
+}
@@ -0,0 +1,339 @@
+/**
+ * @file disk_writer.cpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#include "disk_writer.hpp"
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+constexpr size_t DIRECT_ALIGN = 4096;               ///< Offset, length and memory alignment required by O_DIRECT
+constexpr size_t STAGING_SIZE = 1024 * 1024;        ///< O_DIRECT staging buffer per file
+constexpr uint64_t WRITEBACK_WINDOW = 8 * 1024 * 1024; ///< Granularity of sync_file_range calls
+constexpr size_t MAX_IOV = 64;                      ///< Requests merged into one pwritev
+
+DiskWriter::File::~File() {
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    if (directFd >= 0) {
+        ::close(directFd);
+    }
+    std::free(staging);
+}
+
+DiskWriter::DiskWriter(Mode mode, size_t maxQueuedBytes, trace::Pipeline* pipeline)
+    : mode(mode), maxQueuedBytes(maxQueuedBytes), pipeline(pipeline) {
+    thread = std::thread(&DiskWriter::ioLoop, this);
+}
+
+DiskWriter::~DiskWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    requestCV.notify_all();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+bool DiskWriter::pwriteAll(int fd, const uint8_t* data, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t ret = pwrite(fd, data, len, static_cast<off_t>(offset));
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += ret;
+        len -= static_cast<size_t>(ret);
+        offset += static_cast<uint64_t>(ret);
+    }
+    return true;
+}
+
+bool DiskWriter::preadAll(int fd, uint8_t* data, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t ret = pread(fd, data, len, static_cast<off_t>(offset));
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (ret == 0) {
+            return false;
+        }
+        data += ret;
+        len -= static_cast<size_t>(ret);
+        offset += static_cast<uint64_t>(ret);
+    }
+    return true;
+}
+
+bool DiskWriter::writeAll(int fd, const uint8_t* data, size_t len) {
+    while (len > 0) {
+        ssize_t ret = ::write(fd, data, len);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += ret;
+        len -= static_cast<size_t>(ret);
+    }
+    return true;
+}
+
+std::shared_ptr<DiskWriter::File> DiskWriter::open(int fd, const std::string& path, uint64_t offset, bool sequential) {
+    auto file = std::make_shared<File>();
+    file->fd = fd;
+    file->path = path;
+    file->writebackStart = offset - offset % WRITEBACK_WINDOW;
+    file->sequential = sequential;
+
+    // Page cache modes make no sense for pipes, they are always written as they come
+    if (mode == Mode::DIRECT && !sequential) {
+        void* buffer = nullptr;
+        file->directFd = ::open(path.c_str(), O_WRONLY | O_DIRECT);
+        if (file->directFd < 0 || posix_memalign(&buffer, DIRECT_ALIGN, STAGING_SIZE) != 0) {
+            // Some file systems (tmpfs) refuse O_DIRECT, the page cache still works
+            std::cerr << "[DISK_WRITER] O_DIRECT unavailable for " << path << ": " << strerror(errno)
+                      << ", using buffered writes" << std::endl;
+            if (file->directFd >= 0) {
+                ::close(file->directFd);
+                file->directFd = -1;
+            }
+            std::free(buffer);
+            return file;
+        }
+        file->staging = static_cast<uint8_t*>(buffer);
+    }
+    return file;
+}
+
+bool DiskWriter::write(const std::shared_ptr<File>& file, uint64_t offset, std::vector<uint8_t>&& data) {
+    if (file->failed) {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    // A single write larger than the limit still goes through once the queue is empty
+    doneCV.wait(lock, [this, &data] { return queuedBytes == 0 || queuedBytes + data.size() <= maxQueuedBytes; });
+
+    queuedBytes += data.size();
+    ++file->pending;
+    requests.push_back(Request{file, offset, std::move(data), false});
+    requestCV.notify_one();
+    return true;
+}
+
+bool DiskWriter::flush(const std::shared_ptr<File>& file) {
+    std::unique_lock<std::mutex> lock(mutex);
+    ++file->pending;
+    requests.push_back(Request{file, 0, {}, true});
+    requestCV.notify_one();
+
+    doneCV.wait(lock, [&file] { return file->pending == 0; });
+    return !file->failed;
+}
+
+void DiskWriter::ioLoop(void) {
+    std::vector<Request> batch;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            requestCV.wait(lock, [this] { return !requests.empty() || stopping; });
+            if (requests.empty()) {
+                break;
+            }
+            batch.assign(std::make_move_iterator(requests.begin()), std::make_move_iterator(requests.end()));
+            requests.clear();
+        }
+
+        size_t bytes = 0;
+        size_t begin = 0;
+        while (begin < batch.size()) {
+            Request& first = batch[begin];
+            bytes += first.data.size();
+
+            if (first.flush) {
+                if (first.file->staging && !first.file->failed && !drainDirect(*first.file, true)) {
+                    first.file->failed = true;
+                }
+                ++begin;
+                continue;
+            }
+
+            // Requests of one file that continue each other become one system call
+            size_t end = begin + 1;
+            uint64_t next = first.offset + first.data.size();
+            while (end < batch.size() && end - begin < MAX_IOV && !batch[end].flush &&
+                   batch[end].file == first.file && batch[end].offset == next) {
+                next += batch[end].data.size();
+                bytes += batch[end].data.size();
+                ++end;
+            }
+
+            if (!first.file->failed) {
+                trace::Scope scope(pipeline, trace::SERVER_WRITE, next - first.offset);
+                writeRange(batch, begin, end);
+            }
+            begin = end;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queuedBytes -= bytes;
+            for (auto& request : batch) {
+                --request.file->pending;
+            }
+        }
+        batch.clear();
+        doneCV.notify_all();
+    }
+}
+
+void DiskWriter::writeRange(std::vector<Request>& batch, size_t begin, size_t end) {
+    File& file = *batch[begin].file;
+
+    if (file.staging) {
+        for (size_t i = begin; i < end; ++i) {
+            if (!stageDirect(file, batch[i].offset, batch[i].data.data(), batch[i].data.size())) {
+                file.failed = true;
+                return;
+            }
+        }
+        return;
+    }
+
+    std::vector<struct iovec> iov;
+    for (size_t i = begin; i < end; ++i) {
+        iov.push_back({batch[i].data.data(), batch[i].data.size()});
+    }
+
+    uint64_t offset = batch[begin].offset;
+    size_t index = 0;
+    while (index < iov.size()) {
+        int count = static_cast<int>(iov.size() - index);
+        ssize_t ret = file.sequential ? writev(file.fd, iov.data() + index, count)
+                                      : pwritev(file.fd, iov.data() + index, count, static_cast<off_t>(offset));
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "[DISK_WRITER] Cannot write " << file.path << ": " << strerror(errno) << std::endl;
+            file.failed = true;
+            return;
+        }
+
+        // Short write, skip what made it and continue with the rest
+        offset += static_cast<uint64_t>(ret);
+        size_t done = static_cast<size_t>(ret);
+        while (index < iov.size() && done >= iov[index].iov_len) {
+            done -= iov[index].iov_len;
+            ++index;
+        }
+        if (index < iov.size()) {
+            iov[index].iov_base = static_cast<uint8_t*>(iov[index].iov_base) + done;
+            iov[index].iov_len -= done;
+        }
+    }
+
+    if (mode == Mode::WRITEBACK && !file.sequential) {
+        startWriteback(file, offset);
+    }
+}
+
+bool DiskWriter::stageDirect(File& file, uint64_t offset, const uint8_t* data, size_t len) {
+    if (file.stagingLen != 0 && offset != file.stagingOffset + file.stagingLen) {
+        if (!drainDirect(file, true)) {
+            return false;
+        }
+    }
+    if (file.stagingLen == 0) {
+        file.stagingOffset = offset;
+    }
+
+    while (len > 0) {
+        // Data sits at the same position modulo alignment in memory as in the file
+        size_t lead = file.stagingOffset % DIRECT_ALIGN;
+        size_t room = STAGING_SIZE - lead - file.stagingLen;
+        size_t n = std::min(room, len);
+
+        std::memcpy(file.staging + lead + file.stagingLen, data, n);
+        file.stagingLen += n;
+        data += n;
+        len -= n;
+
+        if (lead + file.stagingLen == STAGING_SIZE && !drainDirect(file, false)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DiskWriter::drainDirect(File& file, bool all) {
+    size_t lead = file.stagingOffset % DIRECT_ALIGN;
+    uint8_t* data = file.staging + lead;
+    uint64_t offset = file.stagingOffset;
+    size_t len = file.stagingLen;
+
+    if (lead != 0 && len > 0) {
+        size_t head = std::min(len, DIRECT_ALIGN - lead);
+        if (!pwriteAll(file.fd, data, head, offset)) {
+            std::cerr << "[DISK_WRITER] Cannot write " << file.path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        data += head;
+        offset += head;
+        len -= head;
+    }
+
+    size_t aligned = len - len % DIRECT_ALIGN;
+    if (aligned > 0 && !pwriteAll(file.directFd, data, aligned, offset)) {
+        std::cerr << "[DISK_WRITER] Cannot write " << file.path << " directly: " << strerror(errno) << std::endl;
+        return false;
+    }
+    data += aligned;
+    offset += aligned;
+    len -= aligned;
+
+    if (all && len > 0) {
+        if (!pwriteAll(file.fd, data, len, offset)) {
+            std::cerr << "[DISK_WRITER] Cannot write " << file.path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        offset += len;
+        len = 0;
+    }
+
+    // Unaligned tail waits for more data, it starts at an aligned offset now
+    std::memmove(file.staging, data, len);
+    file.stagingOffset = offset;
+    file.stagingLen = len;
+    return true;
+}
+
+void DiskWriter::startWriteback(File& file, uint64_t end) {
+    while (end - file.writebackStart >= WRITEBACK_WINDOW) {
+        sync_file_range(file.fd, static_cast<off_t>(file.writebackStart), WRITEBACK_WINDOW, SYNC_FILE_RANGE_WRITE);
+
+        // Previous window had a whole window worth of time to reach the disk, wait for it and drop its pages
+        if (file.writebackStart >= WRITEBACK_WINDOW) {
+            off_t previous = static_cast<off_t>(file.writebackStart - WRITEBACK_WINDOW);
+            sync_file_range(file.fd, previous, WRITEBACK_WINDOW,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(file.fd, previous, WRITEBACK_WINDOW, POSIX_FADV_DONTNEED);
+        }
+        file.writebackStart += WRITEBACK_WINDOW;
+    }
+}
@@ -7,9 +7,272 @@
 #include <openssl/evp.h>
 #include <openssl/sha.h>
 #include <openssl/rand.h>
+#include <openssl/hmac.h>
+#include <endian.h>
+#include <cstring>
 
 constexpr size_t KEY_SIZE = 32;
 constexpr size_t IV_SIZE  = 16;
+constexpr uint8_t LEAF_PREFIX = 0x00;   ///< Domain separation of leaves
+constexpr uint8_t NODE_PREFIX = 0x01;   ///< Domain separation of inner nodes
+constexpr size_t MAX_LEVELS = 64;       ///< One pending subtree per bit of the leaf count
+const std::string TAG_LABEL = "chunk tag";
+
+uint64_t encoder::cipherSize(uint64_t plainSize) {
+    return (plainSize / BLOCK_SIZE + 1) * BLOCK_SIZE;
+}
+
+encoder::Sha256::Sha256()
+    : ctx(EVP_MD_CTX_new()) {
+    if (!ctx || EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) != 1) {
+        std::cerr << "EVP_DigestInit_ex failed" << std::endl;
+        EVP_MD_CTX_free(ctx);
+        ctx = nullptr;
+    }
+}
+
+encoder::Sha256::~Sha256() {
+    if (ctx) {
+        EVP_MD_CTX_free(ctx);
+    }
+}
+
+bool encoder::Sha256::update(const uint8_t* data, size_t len) {
+    return ctx && EVP_DigestUpdate(ctx, data, len) == 1;
+}
+
+std::vector<uint8_t> encoder::Sha256::finish(void) {
+    std::vector<uint8_t> digest(SHA256_DIGEST_LENGTH);
+    unsigned int len = 0;
+    if (!ctx || EVP_DigestFinal_ex(ctx, digest.data(), &len) != 1) {
+        std::cerr << "EVP_DigestFinal_ex failed" << std::endl;
+        return {};
+    }
+    return digest;
+}
+
+encoder::MerkleTree::MerkleTree()
+    : ctx(EVP_MD_CTX_new()) {
+    if (!ctx) {
+        std::cerr << "EVP_MD_CTX_new failed" << std::endl;
+    }
+}
+
+encoder::MerkleTree::~MerkleTree() {
+    if (ctx) {
+        EVP_MD_CTX_free(ctx);
+    }
+}
+
+bool encoder::MerkleTree::digest(uint8_t prefix, const uint8_t* a, size_t aLen, const uint8_t* b, size_t bLen,
+                                 std::vector<uint8_t>& out) {
+    out.resize(HASH_SIZE);
+    unsigned int len = 0;
+    if (!ctx || EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) != 1 ||
+        EVP_DigestUpdate(ctx, &prefix, 1) != 1 || EVP_DigestUpdate(ctx, a, aLen) != 1 ||
+        EVP_DigestUpdate(ctx, b, bLen) != 1 || EVP_DigestFinal_ex(ctx, out.data(), &len) != 1) {
+        std::cerr << "Merkle tree hashing failed" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool encoder::MerkleTree::addLeaf(const uint8_t* data, size_t len) {
+    std::vector<uint8_t> hash;
+    if (!digest(LEAF_PREFIX, data, len, nullptr, 0, hash)) {
+        return false;
+    }
+
+    // Two subtrees of the same height merge, like carrying in binary addition
+    uint8_t height = 0;
+    while (!levels.empty() && levels.back().first == height) {
+        std::vector<uint8_t> node;
+        if (!digest(NODE_PREFIX, levels.back().second.data(), HASH_SIZE, hash.data(), HASH_SIZE, node)) {
+            return false;
+        }
+        hash = std::move(node);
+        levels.pop_back();
+        ++height;
+    }
+    levels.emplace_back(height, std::move(hash));
+    return true;
+}
+
+std::vector<uint8_t> encoder::MerkleTree::root(void) {
+    if (levels.empty()) {
+        return {};
+    }
+
+    std::vector<uint8_t> hash = levels.back().second;
+    for (auto it = levels.rbegin() + 1; it != levels.rend(); ++it) {
+        std::vector<uint8_t> node;
+        if (!digest(NODE_PREFIX, it->second.data(), HASH_SIZE, hash.data(), HASH_SIZE, node)) {
+            return {};
+        }
+        hash = std::move(node);
+    }
+    return hash;
+}
+
+void encoder::MerkleTree::saveState(std::vector<uint8_t>& out) const {
+    out.push_back(static_cast<uint8_t>(levels.size()));
+    for (const auto& [height, hash] : levels) {
+        out.push_back(height);
+        out.insert(out.end(), hash.begin(), hash.end());
+    }
+}
+
+bool encoder::MerkleTree::loadState(const uint8_t* data, size_t len, size_t& offset) {
+    if (offset >= len || data[offset] > MAX_LEVELS) {
+        return false;
+    }
+    size_t count = data[offset++];
+    if ((len - offset) / (1 + HASH_SIZE) < count) {
+        return false;
+    }
+
+    levels.clear();
+    for (size_t i = 0; i < count; ++i) {
+        uint8_t height = data[offset++];
+        // Heights strictly decrease from the tallest subtree
+        if (height >= MAX_LEVELS || (!levels.empty() && height >= levels.back().first)) {
+            return false;
+        }
+        levels.emplace_back(height, std::vector<uint8_t>(data + offset, data + offset + HASH_SIZE));
+        offset += HASH_SIZE;
+    }
+    return true;
+}
+
+encoder::Encryptor::Encryptor(const std::vector<uint8_t>& key, const std::vector<uint8_t>& iv)
+    : ctx(nullptr) {
+    if (key.size() != KEY_SIZE || iv.size() != IV_SIZE) {
+        std::cerr << "Incorrect key or IV size" << std::endl;
+        return;
+    }
+
+    ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        std::cerr << "EVP_CIPHER_CTX_new failed" << std::endl;
+        return;
+    }
+
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, key.data(), iv.data()) != 1) {
+        std::cerr << "EVP_EncryptInit_ex failed" << std::endl;
+        EVP_CIPHER_CTX_free(ctx);
+        ctx = nullptr;
+    }
+}
+
+encoder::Encryptor::~Encryptor() {
+    if (ctx) {
+        EVP_CIPHER_CTX_free(ctx);
+    }
+}
+
+bool encoder::Encryptor::update(const uint8_t* data, size_t len, std::vector<uint8_t>& cipherData) {
+    if (!ctx) {
+        return false;
+    }
+
+    size_t offset = cipherData.size();
+    cipherData.resize(offset + len + EVP_MAX_BLOCK_LENGTH);
+
+    int outLen = 0;
+    if (EVP_EncryptUpdate(ctx, cipherData.data() + offset, &outLen, data, static_cast<int>(len)) != 1) {
+        std::cerr << "EVP_EncryptUpdate failed" << std::endl;
+        cipherData.resize(offset);
+        return false;
+    }
+
+    cipherData.resize(offset + outLen);
+    return true;
+}
+
+bool encoder::Encryptor::finalize(std::vector<uint8_t>& cipherData) {
+    if (!ctx) {
+        return false;
+    }
+
+    size_t offset = cipherData.size();
+    cipherData.resize(offset + EVP_MAX_BLOCK_LENGTH);
+
+    int outLen = 0;
+    if (EVP_EncryptFinal_ex(ctx, cipherData.data() + offset, &outLen) != 1) {
+        std::cerr << "EVP_EncryptFinal_ex failed" << std::endl;
+        cipherData.resize(offset);
+        return false;
+    }
+
+    cipherData.resize(offset + outLen);
+    return true;
+}
+
+encoder::Decryptor::Decryptor(const std::vector<uint8_t>& key, const std::vector<uint8_t>& iv)
+    : ctx(nullptr) {
+    if (key.size() != KEY_SIZE || iv.size() != IV_SIZE) {
+        std::cerr << "Incorrect key or IV size" << std::endl;
+        return;
+    }
+
+    ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        std::cerr << "EVP_CIPHER_CTX_new failed" << std::endl;
+        return;
+    }
+
+    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, key.data(), iv.data()) != 1) {
+        std::cerr << "EVP_DecryptInit_ex failed" << std::endl;
+        EVP_CIPHER_CTX_free(ctx);
+        ctx = nullptr;
+        return;
+    }
+
+    // Padding is stripped by hand so the context never holds back a block
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+}
+
+encoder::Decryptor::~Decryptor() {
+    if (ctx) {
+        EVP_CIPHER_CTX_free(ctx);
+    }
+}
+
+bool encoder::Decryptor::update(const uint8_t* cipherData, size_t len, std::vector<uint8_t>& data, bool last) {
+    if (!ctx || len % BLOCK_SIZE != 0) {
+        return false;
+    }
+
+    data.resize(len);
+    int outLen = 0;
+    if (EVP_DecryptUpdate(ctx, data.data(), &outLen, cipherData, static_cast<int>(len)) != 1) {
+        std::cerr << "EVP_DecryptUpdate failed" << std::endl;
+        return false;
+    }
+    data.resize(outLen);
+
+    if (!last) {
+        return true;
+    }
+
+    // PKCS#7: last byte tells how many padding bytes (all with the same value) were added
+    if (data.empty()) {
+        return false;
+    }
+    uint8_t padLen = data.back();
+    if (padLen == 0 || padLen > BLOCK_SIZE || padLen > data.size()) {
+        std::cerr << "Invalid padding" << std::endl;
+        return false;
+    }
+    for (size_t i = data.size() - padLen; i < data.size(); ++i) {
+        if (data[i] != padLen) {
+            std::cerr << "Invalid padding" << std::endl;
+            return false;
+        }
+    }
+    data.resize(data.size() - padLen);
+    return true;
+}
 
 /* source: https://wiki.openssl.org/index.php/EVP_Symmetric_Encryption_and_Decryption adapted to fit C++ standard*/
 bool encoder::encrypt(std::vector<uint8_t>& data, std::vector<uint8_t>& key, 
@@ -112,6 +375,54 @@ std::vector<uint8_t> encoder::deriveKey(const std::string& login) {
     return key;
 }
 
+uint64_t encoder::deriveId(const std::string& identity) {
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(identity.data()), identity.size(), hash);
+
+    uint64_t id = 0;
+    for (size_t i = 0; i < sizeof(id); ++i) {
+        id = (id << 8) | hash[i];
+    }
+    return id;
+}
+
+std::vector<uint8_t> encoder::deriveTagKey(const std::vector<uint8_t>& key) {
+    std::vector<uint8_t> tagKey(HASH_SIZE);
+    unsigned int len = 0;
+    if (!HMAC(EVP_sha256(), key.data(), static_cast<int>(key.size()),
+              reinterpret_cast<const unsigned char*>(TAG_LABEL.data()), TAG_LABEL.size(), tagKey.data(), &len)) {
+        std::cerr << "Tag key derivation failed" << std::endl;
+        return {};
+    }
+    return tagKey;
+}
+
+uint64_t encoder::chunkTag(const std::vector<uint8_t>& tagKey, uint64_t id, uint64_t chunkNum,
+                           const uint8_t* data, size_t len) {
+    // Binding the ID and position stops a valid chunk from being replayed elsewhere
+    std::vector<uint8_t> message(2 * sizeof(uint64_t) + len);
+    uint64_t netId = htobe64(id);
+    uint64_t netChunk = htobe64(chunkNum);
+    std::memcpy(message.data(), &netId, sizeof(netId));
+    std::memcpy(message.data() + sizeof(netId), &netChunk, sizeof(netChunk));
+    if (len > 0) {
+        std::memcpy(message.data() + 2 * sizeof(uint64_t), data, len);
+    }
+
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int macLen = 0;
+    if (!HMAC(EVP_sha256(), tagKey.data(), static_cast<int>(tagKey.size()), message.data(), message.size(),
+              mac, &macLen)) {
+        return 0;
+    }
+
+    uint64_t tag = 0;
+    for (size_t i = 0; i < sizeof(tag); ++i) {
+        tag = (tag << 8) | mac[i];
+    }
+    return tag;
+}
+
 std::vector<uint8_t> encoder::generateIV(void) {
     std::vector<uint8_t> iv(IV_SIZE);
     if (RAND_bytes(iv.data(), static_cast<int>(iv.size())) != 1) {
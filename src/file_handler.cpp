@@ -6,6 +6,12 @@
 #include <fstream>
 #include <filesystem>
 #include <iostream>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <climits>
+#include <cstdio>
 
 bool file_handler::readFile(const std::string& path, std::vector<uint8_t>& data) {
     data.clear();
@@ -71,4 +77,246 @@ std::string file_handler::getNameFromPath(const std::string& path) {
         std::cerr << "Error: Invalid path: " << path << " (" << e.what() << ")" << std::endl;
         return {};
     }
-}
\ No newline at end of file
+}
+
+file_handler::FileReader::~FileReader() {
+    if (fd > STDIN_FILENO) {
+        ::close(fd);
+    }
+}
+
+bool file_handler::FileReader::open(const std::string& path) {
+    this->path = path;
+    fd = path == STDIO_PATH ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Error: Cannot open file: " << path << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        std::cerr << "Error: Cannot determine file size: " << path << std::endl;
+        return false;
+    }
+
+    // Pipes, FIFOs and terminals have no size, they are read until end of stream
+    stream = !S_ISREG(st.st_mode);
+    size = stream ? 0 : static_cast<uint64_t>(st.st_size);
+    mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+bool file_handler::FileReader::read(std::vector<uint8_t>& data, size_t maxLen) {
+    data.resize(maxLen);
+
+    // Pipes hand out whatever the writer produced so far, which keeps a slow stream moving
+    ssize_t ret;
+    do {
+        ret = ::read(fd, data.data(), maxLen);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        std::cerr << "Error: Failed to read file: " << path << std::endl;
+        data.clear();
+        return false;
+    }
+
+    data.resize(static_cast<size_t>(ret));
+    return true;
+}
+
+file_handler::FileWriter::~FileWriter() {
+    if (file) {
+        discard();
+    }
+}
+
+bool file_handler::FileWriter::openTemp(int flags, uint64_t expectedSize) {
+    int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | flags, 0644);
+    if (fd < 0) {
+        std::cerr << "Error: Cannot open file for writing: " << tempPath << std::endl;
+        return false;
+    }
+
+    // Space for the whole file in one go keeps it unfragmented, the size grows only as data is written
+    if (expectedSize > offset &&
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(expectedSize - offset)) != 0 &&
+        errno != EOPNOTSUPP) {
+        std::cerr << "Error: Cannot preallocate " << expectedSize << " bytes for " << tempPath << ": "
+                  << strerror(errno) << std::endl;
+        ::close(fd);
+        return false;
+    }
+
+    if (writer) {
+        file = writer->open(fd, tempPath, offset);
+    }
+    else {
+        file = std::make_shared<DiskWriter::File>();
+        file->fd = fd;
+        file->path = tempPath;
+    }
+    return true;
+}
+
+/**
+ * @brief Name the file is written under until it is complete
+ * @param path Final path
+ * @return path + ".part", for a name the suffix would push past NAME_MAX its tail is replaced by a hash of the name
+ * @note Hash is FNV-1a, so a restarted server finds the same file to resume
+ */
+static std::string partPath(const std::string& path) {
+    const std::string suffix = ".part";
+    size_t nameStart = path.find_last_of('/') + 1;
+    size_t nameLen = path.size() - nameStart;
+    if (nameLen + suffix.size() <= NAME_MAX) {
+        return path + suffix;
+    }
+
+    // Names sharing a long prefix still get their own temporary file
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = nameStart; i < path.size(); ++i) {
+        hash ^= static_cast<uint8_t>(path[i]);
+        hash *= 0x100000001b3ULL;
+    }
+    char tail[18];
+    std::snprintf(tail, sizeof(tail), "~%016llx", static_cast<unsigned long long>(hash));
+    size_t keep = NAME_MAX - suffix.size() - (sizeof(tail) - 1);
+    return path.substr(0, nameStart + keep) + tail + suffix;
+}
+
+bool file_handler::FileWriter::open(const std::string& path, uint64_t expectedSize) {
+    this->path = path;
+    tempPath = partPath(path);
+    offset = 0;
+
+    return openTemp(O_TRUNC, expectedSize);
+}
+
+bool file_handler::FileWriter::openStream(const std::string& path) {
+    this->path = path;
+    tempPath = path == STDIO_PATH ? "standard output" : path;
+    offset = 0;
+    stream = true;
+
+    // Own descriptor, so closing the output does not close standard output of the process
+    int fd = path == STDIO_PATH ? dup(STDOUT_FILENO) : ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cerr << "Error: Cannot open output: " << tempPath << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    bool sequential = fstat(fd, &st) != 0 || !S_ISREG(st.st_mode);
+    if (writer) {
+        file = writer->open(fd, tempPath, 0, sequential);
+    }
+    else {
+        file = std::make_shared<DiskWriter::File>();
+        file->fd = fd;
+        file->path = tempPath;
+        file->sequential = sequential;
+    }
+    return true;
+}
+
+bool file_handler::FileWriter::write(std::vector<uint8_t>&& data) {
+    if (data.empty()) {
+        return true;
+    }
+    if (!file) {
+        return false;
+    }
+
+    uint64_t at = offset;
+    offset += data.size();
+
+    if (writer) {
+        if (!writer->write(file, at, std::move(data))) {
+            std::cerr << "Error: Failed to write to file: " << tempPath << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool ok = file->sequential ? DiskWriter::writeAll(file->fd, data.data(), data.size())
+                               : DiskWriter::pwriteAll(file->fd, data.data(), data.size(), at);
+    if (!ok) {
+        std::cerr << "Error: Failed to write to file: " << tempPath << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool file_handler::FileWriter::resume(const std::string& path, uint64_t size, uint64_t expectedSize) {
+    this->path = path;
+    tempPath = partPath(path);
+
+    std::error_code ec;
+    if (!std::filesystem::exists(tempPath, ec) || std::filesystem::file_size(tempPath, ec) < size) {
+        std::cerr << "Error: Partial file is missing or too short: " << tempPath << std::endl;
+        return false;
+    }
+    std::filesystem::resize_file(tempPath, size, ec);
+    if (ec) {
+        std::cerr << "Error: Cannot truncate " << tempPath << " (" << ec.message() << ")" << std::endl;
+        return false;
+    }
+
+    offset = size;
+    return openTemp(0, expectedSize);
+}
+
+bool file_handler::FileWriter::flush(void) {
+    if (!file) {
+        return false;
+    }
+    if (writer && !writer->flush(file)) {
+        std::cerr << "Error: Failed to flush file: " << tempPath << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool file_handler::FileWriter::commit(void) {
+    if (stream) {
+        return close();
+    }
+    if (!close()) {
+        std::filesystem::remove(tempPath);
+        return false;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tempPath, path, ec);
+    if (ec) {
+        std::cerr << "Error: Cannot rename " << tempPath << " to " << path << " (" << ec.message() << ")" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void file_handler::FileWriter::discard(void) {
+    if (file && writer) {
+        // Queued writes must not recreate the file after it is removed
+        writer->flush(file);
+    }
+    file.reset();
+
+    // Whatever reached a stream is out already
+    if (stream) {
+        return;
+    }
+    std::error_code ec;
+    std::filesystem::remove(tempPath, ec);
+}
+
+bool file_handler::FileWriter::close(void) {
+    if (!file) {
+        return false;
+    }
+
+    bool ok = flush();
+    file.reset();
+    return ok;
+}
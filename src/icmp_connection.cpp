@@ -4,20 +4,38 @@
  */
 #include "icmp_connection.hpp"
 #include "net_utils.hpp"
+#include "packet_sink.hpp"
+#include "impairment.hpp"
 #include "protocol.hpp"
 #include <iostream>
+#include <vector>
+#include <chrono>
+#include <algorithm>
 #include <unistd.h>
 #include <cstring>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <linux/filter.h>
 #include <netinet/icmp6.h>
 
-constexpr size_t MAX_PAYLOAD_SIZE = 1472;
-constexpr size_t MAX_PACKET_SIZE = 1500;
+constexpr size_t IPV4_HEADER_SIZE = 20;
+constexpr size_t IPV6_HEADER_SIZE = 40;
+constexpr size_t ICMP_HEADER_SIZE = 8;
+constexpr int PROBE_TIMEOUT_MS = 300;
+constexpr int PROBE_ATTEMPTS = 2;
+constexpr size_t MAX_PACKET_SIZE = 65535;
+constexpr auto SEND_BLOCK_TIMEOUT = std::chrono::seconds(5); ///< Longest wait for room in a full send buffer
+constexpr int SEND_POLL_MS = 10;                ///< Wait for the socket to become writable between send attempts
 
-ICMPConnection::ICMPConnection(const std::string& targetAddress)
-    : targetAddress(targetAddress), sockfd(-1), isIPv4(false) {
+ICMPConnection::ICMPConnection(const std::string& targetAddress, PacketSink* sink, Impairment* impairment)
+    : targetAddress(targetAddress), sockfd(-1), isIPv4(false),
+      pathMTU(DEFAULT_MTU), echoId(getpid() & 0xFFFF), sequence(0), sink(sink), impairment(impairment) {
     memset(&addr4, 0, sizeof(addr4));
     memset(&addr6, 0, sizeof(addr6));
     memset(&srcAddr6, 0, sizeof(srcAddr6));
+    memset(&sinkSource, 0, sizeof(sinkSource));
+    memset(&sinkTarget, 0, sizeof(sinkTarget));
 }
 
 ICMPConnection::~ICMPConnection() {
@@ -34,6 +52,24 @@ bool ICMPConnection::connect(void) {
         return false;
     }
 
+    // Generated packets carry the addresses a real send would, the checksums match them
+    if (sink) {
+        isIPv4 = result == net_utils::IPv4;
+        if (isIPv4) {
+            memcpy(&sinkTarget, &addr4, sizeof(addr4));
+        }
+        else {
+            memcpy(&sinkTarget, &addr6, sizeof(addr6));
+        }
+        socklen_t targetLen = isIPv4 ? sizeof(addr4) : sizeof(addr6);
+        if (!net_utils::getRouteSource(reinterpret_cast<struct sockaddr*>(&sinkTarget), targetLen, sinkSource)) {
+            std::cerr << "[ICMP_CONNECTION] No route to " << targetAddress << std::endl;
+            return false;
+        }
+        memcpy(&srcAddr6, &sinkSource, sizeof(srcAddr6));
+        return true;
+    }
+
     int protocol, domain;
     if (result == net_utils::IPv4) {
         isIPv4 = true;
@@ -57,56 +93,379 @@ bool ICMPConnection::connect(void) {
         return false;
     }
 
+    // Connected raw socket only receives from the target and lets kernel report path MTU
+    const struct sockaddr* addr = isIPv4 ? reinterpret_cast<const struct sockaddr*>(&addr4)
+                                         : reinterpret_cast<const struct sockaddr*>(&addr6);
+    socklen_t addrLen = isIPv4 ? sizeof(addr4) : sizeof(addr6);
+    if (::connect(sockfd, addr, addrLen) < 0) {
+        std::cerr << "[ICMP_CONNECTION] Could not connect raw socket: " << strerror(errno) << std::endl;
+        return false;
+    }
+
     return true;
 }
 
-bool ICMPConnection::sendPacket(const uint8_t* payload, size_t payloadSize) {
-    if (payloadSize > MAX_PAYLOAD_SIZE) {
-        std::cerr << "[ICMP_CONNECTION] Payload size is higher than allowed" << std::endl;
+size_t ICMPConnection::getQueuedBytes() const {
+    int queued = 0;
+    if (sink || ioctl(sockfd, SIOCOUTQ, &queued) < 0 || queued < 0) {
+        return 0;
+    }
+    return static_cast<size_t>(queued);
+}
+
+size_t ICMPConnection::getIPHeaderSize() const {
+    return isIPv4 ? IPV4_HEADER_SIZE : IPV6_HEADER_SIZE;
+}
+
+size_t ICMPConnection::getMaxPayloadSize() const {
+    return pathMTU - getIPHeaderSize() - ICMP_HEADER_SIZE;
+}
+
+bool ICMPConnection::ignoreEchoedType(uint8_t packetType) {
+    if (sink) {
+        return true;
+    }
+
+    // IPv4 raw sockets see the IP header (variable length), IPv6 ones start at the ICMPv6 header
+    uint32_t typeOffset = static_cast<uint32_t>(ICMP_HEADER_SIZE + protocol::TYPE_OFFSET);
+    std::vector<struct sock_filter> code;
+    if (isIPv4) {
+        code.push_back(BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0));
+        code.push_back(BPF_STMT(BPF_LD | BPF_B | BPF_IND, typeOffset));
+    }
+    else {
+        code.push_back(BPF_STMT(BPF_LD | BPF_B | BPF_ABS, typeOffset));
+    }
+    code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, packetType, 0, 1));
+    code.push_back(BPF_STMT(BPF_RET | BPF_K, 0));
+    code.push_back(BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF));
+
+    struct sock_fprog program{static_cast<unsigned short>(code.size()), code.data()};
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) < 0) {
+        std::cerr << "[ICMP_CONNECTION] Could not attach receive filter: " << strerror(errno) << std::endl;
         return false;
     }
-    char buffer[MAX_PACKET_SIZE];
-    memset(buffer, 0, sizeof(buffer));
+    return true;
+}
 
-    size_t packetSize;
-    static uint16_t sequence = 0;
+bool ICMPConnection::ignoreIncoming(void) {
+    if (sink) {
+        return true;
+    }
+
+    struct sock_filter code[] = {BPF_STMT(BPF_RET | BPF_K, 0)};
+    struct sock_fprog program{1, code};
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) < 0) {
+        std::cerr << "[ICMP_CONNECTION] Could not attach receive filter: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    // Whatever arrived before the filter is discarded too
+    uint8_t discard;
+    while (recv(sockfd, &discard, sizeof(discard), MSG_DONTWAIT) >= 0) {
+    }
+    return true;
+}
 
+bool ICMPConnection::setDontFragment(bool enable) {
+    int ret;
     if (isIPv4) {
-        struct icmphdr* icmp = reinterpret_cast<struct icmphdr*>(buffer);
-        icmp->type = ICMP_ECHO;
+        int mode = enable ? IP_PMTUDISC_DO : IP_PMTUDISC_WANT;
+        ret = setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode));
+    }
+    else {
+        int mode = enable ? IPV6_PMTUDISC_DO : IPV6_PMTUDISC_WANT;
+        ret = setsockopt(sockfd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &mode, sizeof(mode));
+        int dontFrag = enable ? 1 : 0;
+        if (ret == 0) {
+            ret = setsockopt(sockfd, IPPROTO_IPV6, IPV6_DONTFRAG, &dontFrag, sizeof(dontFrag));
+        }
+    }
+    return ret == 0;
+}
+
+size_t ICMPConnection::queryKernelMTU(void) {
+    int mtu = 0;
+    socklen_t len = sizeof(mtu);
+    int ret = isIPv4 ? getsockopt(sockfd, IPPROTO_IP, IP_MTU, &mtu, &len)
+                     : getsockopt(sockfd, IPPROTO_IPV6, IPV6_MTU, &mtu, &len);
+    if (ret < 0 || mtu <= 0) {
+        return 0;
+    }
+    return static_cast<size_t>(mtu);
+}
+
+bool ICMPConnection::receiveEcho(uint16_t& id, uint16_t& seq, std::vector<uint8_t>& payload, int timeoutMs) {
+    if (sink) {
+        return false;
+    }
+
+    // Draining a queue of kernel echoes calls this often, the buffer is reused
+    std::vector<uint8_t>& buffer = receiveBuffer;
+    buffer.resize(MAX_PACKET_SIZE);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+    while (true) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (left <= 0 && timeoutMs != 0) {
+            return false;
+        }
+
+        struct pollfd pfd{sockfd, POLLIN, 0};
+        if (poll(&pfd, 1, static_cast<int>(std::max<int64_t>(left, 0))) <= 0) {
+            return false;
+        }
+
+        ssize_t received = recv(sockfd, buffer.data(), buffer.size(), 0);
+        if (received <= 0) {
+            continue;
+        }
+
+        // IPv4 raw sockets deliver the IP header as well, IPv6 ones do not
+        size_t offset = 0;
+        if (isIPv4) {
+            offset = (buffer[0] & 0x0F) * 4;
+        }
+        if (static_cast<size_t>(received) < offset + ICMP_HEADER_SIZE) {
+            continue;
+        }
+
+        if (isIPv4) {
+            const auto* icmp = reinterpret_cast<const struct icmphdr*>(buffer.data() + offset);
+            if (icmp->type != ICMP_ECHOREPLY) {
+                continue;
+            }
+            id = icmp->un.echo.id;
+            seq = ntohs(icmp->un.echo.sequence);
+        }
+        else {
+            const auto* icmp6 = reinterpret_cast<const struct icmp6_hdr*>(buffer.data());
+            if (icmp6->icmp6_type != ICMP6_ECHO_REPLY) {
+                continue;
+            }
+            id = icmp6->icmp6_id;
+            seq = ntohs(icmp6->icmp6_seq);
+        }
+
+        payload.assign(buffer.begin() + offset + ICMP_HEADER_SIZE, buffer.begin() + received);
+        return true;
+    }
+}
+
+bool ICMPConnection::awaitEchoReply(uint16_t seq, int timeoutMs) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    std::vector<uint8_t> payload;
+    uint16_t replyId, replySeq;
+
+    while (true) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (left <= 0 || !receiveEcho(replyId, replySeq, payload, static_cast<int>(left))) {
+            return false;
+        }
+        if (replyId == echoId && replySeq == seq) {
+            return true;
+        }
+    }
+}
+
+bool ICMPConnection::receivePacket(std::vector<uint8_t>& payload, int timeoutMs) {
+    uint16_t replyId, replySeq;
+    return receiveEcho(replyId, replySeq, payload, timeoutMs);
+}
+
+bool ICMPConnection::probe(size_t mtu) {
+    // Probe payload is zeroed, so the server never mistakes it for protocol traffic
+    std::vector<uint8_t> payload(mtu - getIPHeaderSize() - ICMP_HEADER_SIZE, 0);
+
+    for (int attempt = 0; attempt < PROBE_ATTEMPTS; ++attempt) {
+        uint16_t seq = ++sequence;
+        int err = sendEcho(payload.data(), payload.size(), seq);
+        if (err == EMSGSIZE) {
+            return false;
+        }
+        if (err != 0) {
+            continue;
+        }
+        if (awaitEchoReply(seq, PROBE_TIMEOUT_MS)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t ICMPConnection::discoverPathMTU(size_t maxMTU) {
+    if (sink) {
+        return pathMTU;
+    }
+
+    size_t low = isIPv4 ? MIN_IPV4_MTU : MIN_IPV6_MTU;
+    size_t high = maxMTU;
+
+    if (!setDontFragment(true)) {
+        std::cerr << "[ICMP_CONNECTION] Could not set DF flag, using default MTU" << std::endl;
+        pathMTU = DEFAULT_MTU;
+        return pathMTU;
+    }
+
+    size_t kernelMTU = queryKernelMTU();
+    if (kernelMTU != 0 && kernelMTU < high) {
+        high = kernelMTU;
+    }
+    if (high < low) {
+        high = low;
+    }
+
+    bool answered = false;
+    if (probe(high)) {
+        low = high;
+        answered = true;
+    }
+    else if (probe(low)) {
+        answered = true;
+        // Binary search for the largest size that still comes back
+        size_t tooBig = high;
+        while (tooBig - low > 1) {
+            // Router "fragmentation needed" messages shrink the kernel path MTU
+            kernelMTU = queryKernelMTU();
+            if (kernelMTU != 0 && kernelMTU < tooBig && kernelMTU > low) {
+                tooBig = kernelMTU + 1;
+            }
+            size_t mid = low + (tooBig - low) / 2;
+            if (probe(mid)) {
+                low = mid;
+            }
+            else {
+                tooBig = mid;
+            }
+        }
+    }
+
+    setDontFragment(false);
+
+    if (!answered) {
+        std::cerr << "[ICMP_CONNECTION] Target does not answer MTU probes, using default MTU" << std::endl;
+        pathMTU = (kernelMTU != 0 && kernelMTU < DEFAULT_MTU) ? kernelMTU : DEFAULT_MTU;
+        return pathMTU;
+    }
+
+    pathMTU = low;
+    return pathMTU;
+}
+
+int ICMPConnection::sendEcho(const uint8_t* payload, size_t payloadSize, uint16_t seq, bool reply, bool wait) {
+    std::vector<uint8_t> buffer(ICMP_HEADER_SIZE + payloadSize, 0);
+    size_t packetSize = buffer.size();
+
+    if (isIPv4) {
+        struct icmphdr* icmp = reinterpret_cast<struct icmphdr*>(buffer.data());
+        icmp->type = reply ? ICMP_ECHOREPLY : ICMP_ECHO;
         icmp->code = 0;
-        icmp->un.echo.id = getpid() & 0xFFFF;
-        icmp->un.echo.sequence = htons(++sequence);
+        icmp->un.echo.id = echoId;
+        icmp->un.echo.sequence = htons(seq);
         icmp->checksum = 0;
 
-        memcpy(buffer + sizeof(*icmp), payload, payloadSize);
-        packetSize = sizeof(*icmp) + payloadSize;
+        memcpy(buffer.data() + sizeof(*icmp), payload, payloadSize);
 
-        icmp->checksum = net_utils::computeIPv4Checksum(reinterpret_cast<uint8_t*>(buffer), packetSize);
+        icmp->checksum = net_utils::computeIPv4Checksum(buffer.data(), packetSize);
 
-        ssize_t sent = sendto(sockfd, buffer, packetSize, 0, reinterpret_cast<struct sockaddr*>(&addr4), sizeof(addr4));
-        if (sent < 0) {
-            std::cerr << "[ICMP_CONNECTION] Failed to send ICMPv4 packet: " << strerror(errno) << std::endl;
-            return false;
+        if (sink) {
+            sink->write(sinkSource, sinkTarget, buffer.data(), packetSize);
+            return 0;
         }
     } else {
-        struct icmp6_hdr* icmp6 = reinterpret_cast<struct icmp6_hdr*>(buffer);
-        icmp6->icmp6_type = ICMP6_ECHO_REQUEST;
+        struct icmp6_hdr* icmp6 = reinterpret_cast<struct icmp6_hdr*>(buffer.data());
+        icmp6->icmp6_type = reply ? ICMP6_ECHO_REPLY : ICMP6_ECHO_REQUEST;
         icmp6->icmp6_code = 0;
-        icmp6->icmp6_id = getpid() & 0xFFFF;
-        icmp6->icmp6_seq = htons(++sequence);
+        icmp6->icmp6_id = echoId;
+        icmp6->icmp6_seq = htons(seq);
         icmp6->icmp6_cksum = 0;
 
-        memcpy(buffer + sizeof(*icmp6), payload, payloadSize);
-        packetSize = sizeof(*icmp6) + payloadSize;
+        memcpy(buffer.data() + sizeof(*icmp6), payload, payloadSize);
 
-        icmp6->icmp6_cksum = net_utils::computeIPv6Checksum(reinterpret_cast<uint8_t*>(buffer), packetSize, srcAddr6, addr6);
+        icmp6->icmp6_cksum = net_utils::computeIPv6Checksum(buffer.data(), packetSize, srcAddr6, addr6);
 
-        ssize_t sent = sendto(sockfd, buffer, packetSize, 0, reinterpret_cast<struct sockaddr*>(&addr6), sizeof(addr6));
-        if (sent < 0) {
-            std::cerr << "[ICMP_CONNECTION] Failed to send ICMPv6 packet: " << strerror(errno) << std::endl;
-            return false;
+        if (sink) {
+            sink->write(sinkSource, sinkTarget, buffer.data(), packetSize);
+            return 0;
         }
     }
+
+    const struct sockaddr* addr = isIPv4 ? reinterpret_cast<const struct sockaddr*>(&addr4)
+                                         : reinterpret_cast<const struct sockaddr*>(&addr6);
+    socklen_t addrLen = isIPv4 ? sizeof(addr4) : sizeof(addr6);
+
+    // Raw sockets do not block on a full send buffer, they fail with ENOBUFS until the link drains it
+    auto giveUp = std::chrono::steady_clock::now() + SEND_BLOCK_TIMEOUT;
+    while (sendto(sockfd, buffer.data(), packetSize, 0, addr, addrLen) < 0) {
+        if (errno != ENOBUFS || !wait || std::chrono::steady_clock::now() >= giveUp) {
+            return errno;
+        }
+        struct pollfd pfd{sockfd, POLLOUT, 0};
+        poll(&pfd, 1, SEND_POLL_MS);
+    }
+    return 0;
+}
+
+bool ICMPConnection::sendPacket(const uint8_t* payload, size_t payloadSize) {
+    if (payloadSize > getMaxPayloadSize()) {
+        std::cerr << "[ICMP_CONNECTION] Payload size is higher than allowed" << std::endl;
+        return false;
+    }
+
+    uint16_t seq = ++sequence;
+    if (impairment) {
+        impairment->submit(payload, payloadSize, [this, seq](const std::vector<uint8_t>& packet) {
+            return sendEcho(packet.data(), packet.size(), seq) == 0;
+        });
+        return true;
+    }
+
+    int err = sendEcho(payload, payloadSize, seq);
+    if (err != 0) {
+        std::cerr << "[ICMP_CONNECTION] Failed to send " << (isIPv4 ? "ICMPv4" : "ICMPv6")
+                  << " packet: " << strerror(err) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+ICMPConnection::SendResult ICMPConnection::trySendPacket(const uint8_t* payload, size_t payloadSize) {
+    if (payloadSize > getMaxPayloadSize()) {
+        std::cerr << "[ICMP_CONNECTION] Payload size is higher than allowed" << std::endl;
+        return SendResult::FAILED;
+    }
+
+    // Emulated link queues the packet itself, it never pushes back
+    if (impairment) {
+        return sendPacket(payload, payloadSize) ? SendResult::SENT : SendResult::FAILED;
+    }
+
+    int err = sendEcho(payload, payloadSize, static_cast<uint16_t>(sequence + 1), false, false);
+    if (err == ENOBUFS) {
+        return SendResult::FULL;
+    }
+    if (err != 0) {
+        std::cerr << "[ICMP_CONNECTION] Failed to send " << (isIPv4 ? "ICMPv4" : "ICMPv6")
+                  << " packet: " << strerror(err) << std::endl;
+        return SendResult::FAILED;
+    }
+    ++sequence;
+    return SendResult::SENT;
+}
+
+bool ICMPConnection::sendReply(const uint8_t* payload, size_t payloadSize) {
+    if (payloadSize > getMaxPayloadSize()) {
+        std::cerr << "[ICMP_CONNECTION] Payload size is higher than allowed" << std::endl;
+        return false;
+    }
+
+    int err = sendEcho(payload, payloadSize, ++sequence, true);
+    if (err != 0) {
+        std::cerr << "[ICMP_CONNECTION] Failed to send " << (isIPv4 ? "ICMPv4" : "ICMPv6")
+                  << " reply: " << strerror(err) << std::endl;
+        return false;
+    }
     return true;
-}
\ No newline at end of file
+}
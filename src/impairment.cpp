@@ -0,0 +1,144 @@
+/**
+ * @file impairment.cpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#include "impairment.hpp"
+#include <algorithm>
+#include <iostream>
+
+constexpr auto REORDER_HOLD = std::chrono::milliseconds(1);    ///< Extra delay of a packet picked for reordering
+
+bool Impairment::Config::enabled(void) const {
+    return loss > 0 || reorder > 0 || duplicate > 0 || delay.count() > 0 || jitter.count() > 0 || rate > 0;
+}
+
+Impairment::Impairment(const Config& config)
+    : config(config), seed(config.seed != 0 ? config.seed : std::random_device{}()), random(seed) {
+    // Gilbert model: bursts last config.burst packets on average and the long-run loss stays config.loss
+    leaveBurst = 1.0 / std::max(config.burst, 1.0);
+    enterBurst = config.loss >= 1.0 ? 1.0 : std::min(1.0, config.loss * leaveBurst / (1.0 - config.loss));
+    thread = std::thread(&Impairment::run, this);
+}
+
+Impairment::~Impairment() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void Impairment::submit(const uint8_t* payload, size_t payloadSize, Transmit transmit) {
+    submitted.add();
+    std::unique_lock<std::mutex> lock(mutex);
+
+    double u = uniform(random);
+    if (inBurst) {
+        inBurst = u >= leaveBurst;
+    }
+    else {
+        inBurst = u < enterBurst;
+    }
+    if (inBurst) {
+        lost.add();
+        return;
+    }
+    if (held.size() >= config.limit) {
+        overflowed.add();
+        return;
+    }
+
+    // Serialization on the capped link first, then the propagation delay
+    auto now = Clock::now();
+    auto due = now;
+    if (config.rate > 0) {
+        auto transmission = std::chrono::nanoseconds(static_cast<uint64_t>(payloadSize) * 8 * 1000000000 / config.rate);
+        linkFree = std::max(linkFree, now) + transmission;
+        due = linkFree;
+    }
+    due += config.delay;
+    if (config.jitter.count() > 0) {
+        std::uniform_int_distribution<int64_t> spread(-config.jitter.count(), config.jitter.count());
+        due = std::max(now, due + std::chrono::microseconds(spread(random)));
+    }
+    if (config.reorder > 0 && uniform(random) < config.reorder) {
+        due += REORDER_HOLD;
+        reordered.add();
+    }
+
+    std::vector<uint8_t> data(payload, payload + payloadSize);
+    if (config.duplicate > 0 && uniform(random) < config.duplicate) {
+        duplicated.add();
+        hold(due, data, transmit);
+    }
+    hold(due, std::move(data), std::move(transmit));
+    lock.unlock();
+    cv.notify_all();
+}
+
+void Impairment::hold(Clock::time_point due, std::vector<uint8_t> data, Transmit transmit) {
+    Held packet;
+    packet.due = due;
+    packet.order = nextOrder++;
+    packet.data = std::move(data);
+    packet.transmit = std::move(transmit);
+    held.push(std::move(packet));
+}
+
+void Impairment::run(void) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        if (held.empty()) {
+            cv.wait(lock);
+            continue;
+        }
+        if (held.top().due > Clock::now()) {
+            cv.wait_until(lock, held.top().due);
+            continue;
+        }
+
+        // Socket may block on a full buffer, submit goes on meanwhile
+        Held packet = std::move(const_cast<Held&>(held.top()));
+        held.pop();
+        sending = true;
+        lock.unlock();
+        if (packet.transmit(packet.data)) {
+            delivered.add();
+        }
+        else {
+            failed.add();
+        }
+        lock.lock();
+        sending = false;
+        if (held.empty()) {
+            cv.notify_all();
+        }
+    }
+}
+
+void Impairment::drain(void) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] { return held.empty() && !sending; });
+}
+
+void Impairment::exportMetrics(metrics::Writer& out) const {
+    const std::string name = "secret_client_impairment_packets_total";
+    out.family(name, "counter", "Packets passing the emulated link, by what happened to them.");
+    out.sample(name, submitted.value(), metrics::label("action", "submitted"));
+    out.sample(name, delivered.value(), metrics::label("action", "delivered"));
+    out.sample(name, lost.value(), metrics::label("action", "lost"));
+    out.sample(name, overflowed.value(), metrics::label("action", "overflowed"));
+    out.sample(name, duplicated.value(), metrics::label("action", "duplicated"));
+    out.sample(name, reordered.value(), metrics::label("action", "reordered"));
+    out.sample(name, failed.value(), metrics::label("action", "failed"));
+}
+
+void Impairment::report(void) const {
+    std::cerr << "[IMPAIRMENT] " << submitted.value() << " packets in, " << delivered.value() << " delivered, "
+              << lost.value() << " lost, " << overflowed.value() << " tail dropped, " << duplicated.value()
+              << " duplicated, " << reordered.value() << " reordered, " << failed.value() << " send errors (seed "
+              << seed << ")" << std::endl;
+}
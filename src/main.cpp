@@ -15,13 +15,36 @@ int main(int argc, char* argv[]) {
     }
 
     if (argParser.isServer()) {
-        Server server("xrepcim00");
+        ServerConfig config;
+        config.spoolDir = argParser.getSpoolDir();
+        config.memoryLimit = argParser.getMemoryLimit();
+        config.idleTimeout = std::chrono::seconds(argParser.getIdleTimeout());
+        config.workers = argParser.getWorkers();
+        config.statsInterval = std::chrono::seconds(argParser.getStatsInterval());
+        config.idPriorities = argParser.getIdPriorities();
+        config.addressPriorities = argParser.getAddressPriorities();
+        config.ioMode = argParser.getIoMode();
+        config.outputPath = argParser.getOutputPath();
+        config.metricsFile = argParser.getMetricsFile();
+        config.metricsSocket = argParser.getMetricsSocket();
+        config.traceFile = argParser.getTraceFile();
+        config.replayFile = argParser.getReplayFile();
+        config.replaySpeed = argParser.getReplaySpeed();
+        config.sink = argParser.isSink();
+        config.receiver = argParser.getReceiver();
+        config.capture = argParser.getCapture();
+
+        Server server("xrepcim00", config);
         if(!server.run()) {
             return 1;
         }
     }
     else {
-        Client client(argParser.getFilePath(), argParser.getTargetAddress());
+        Client client(argParser.getFilePaths(), argParser.getTargetAddresses(), "xrepcim00",
+                      argParser.getPathMTU(), argParser.isResume(), argParser.isDelta(),
+                      argParser.isCompress(), argParser.isMultipath(), argParser.getMetricsFile(),
+                      argParser.getMetricsSocket(), argParser.getTraceFile(), argParser.getGenerateFile(),
+                      argParser.getImpairment());
         if (!client.run()) {
             return 1;
         }
@@ -0,0 +1,254 @@
+/**
+ * @file metrics.cpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#include "metrics.hpp"
+#include <iostream>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <filesystem>
+#include <cstring>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+uint64_t metrics::Counter::value(void) const {
+    uint64_t sum = 0;
+    for (const auto& shard : shards) {
+        sum += shard.value.load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+
+size_t metrics::Counter::shardIndex(void) {
+    static std::atomic<size_t> nextThread{0};
+    thread_local size_t index = nextThread.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+    return index;
+}
+
+void metrics::HighWater::update(uint64_t current) {
+    uint64_t seen = mark.load(std::memory_order_relaxed);
+    while (current > seen && !mark.compare_exchange_weak(seen, current, std::memory_order_relaxed)) {}
+}
+
+size_t metrics::Histogram::bucketOf(uint64_t value) {
+    value = std::min<uint64_t>(value, (uint64_t{1} << MAX_BITS) - 1);
+    if (value < (uint64_t{1} << SUB_BITS)) {
+        return static_cast<size_t>(value);
+    }
+    // Top SUB_BITS + 1 bits of the value pick the bucket, the rest is the error
+    int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+    size_t sub = static_cast<size_t>(value >> shift) - (size_t{1} << SUB_BITS);
+    return ((static_cast<size_t>(shift) + 1) << SUB_BITS) + sub;
+}
+
+uint64_t metrics::Histogram::bucketLimit(size_t bucket) {
+    if (bucket < (size_t{1} << SUB_BITS)) {
+        return bucket;
+    }
+    int shift = static_cast<int>(bucket >> SUB_BITS) - 1;
+    uint64_t sub = bucket & ((size_t{1} << SUB_BITS) - 1);
+    return (((uint64_t{1} << SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+void metrics::Histogram::record(uint64_t value) {
+    buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    sumNs.fetch_add(value, std::memory_order_relaxed);
+
+    uint64_t seen = maxNs.load(std::memory_order_relaxed);
+    while (value > seen && !maxNs.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+}
+
+uint64_t metrics::Histogram::quantile(double q) const {
+    uint64_t n = count();
+    if (n == 0) {
+        return 0;
+    }
+    // Rank of the wanted value, counted from 1
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * static_cast<double>(n) + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            return std::min(bucketLimit(i), max());
+        }
+    }
+    return max();
+}
+
+double metrics::Rate::update(uint64_t total) {
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - lastTime).count();
+
+    // Scrapes right after a file rewrite would measure almost nothing
+    if (lastTime != std::chrono::steady_clock::time_point{} &&
+        seconds < std::chrono::duration<double>(EXPORT_INTERVAL).count() / 2) {
+        return rate;
+    }
+    if (lastTime != std::chrono::steady_clock::time_point{}) {
+        rate = static_cast<double>(total - lastTotal) / seconds;
+    }
+    lastTotal = total;
+    lastTime = now;
+    return rate;
+}
+
+std::string metrics::label(const std::string& key, const std::string& value) {
+    std::string text = key + "=\"";
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            text += '\\';
+            text += c;
+        }
+        else if (c == '\n') {
+            text += "\\n";
+        }
+        else {
+            text += c;
+        }
+    }
+    return text + "\"";
+}
+
+void metrics::Writer::family(const std::string& name, const char* type, const std::string& help) {
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " " << type << "\n";
+}
+
+void metrics::Writer::sample(const std::string& name, uint64_t value, const std::string& labels) {
+    out << name;
+    if (!labels.empty()) {
+        out << "{" << labels << "}";
+    }
+    out << " " << value << "\n";
+}
+
+void metrics::Writer::sample(const std::string& name, double value, const std::string& labels) {
+    out << name;
+    if (!labels.empty()) {
+        out << "{" << labels << "}";
+    }
+    out << " " << std::fixed << std::setprecision(6) << value << std::defaultfloat << "\n";
+}
+
+void metrics::Writer::counter(const std::string& name, const std::string& help, uint64_t value) {
+    family(name, "counter", help);
+    sample(name, value);
+}
+
+void metrics::Writer::gauge(const std::string& name, const std::string& help, uint64_t value) {
+    family(name, "gauge", help);
+    sample(name, value);
+}
+
+void metrics::Writer::gauge(const std::string& name, const std::string& help, double value) {
+    family(name, "gauge", help);
+    sample(name, value);
+}
+
+metrics::Exporter::Exporter(const std::string& filePath, const std::string& socketPath, Collector collect)
+    : filePath(filePath), socketPath(socketPath), collect(std::move(collect)),
+      nextExport(std::chrono::steady_clock::now()) {}
+
+metrics::Exporter::~Exporter() {
+    if (listenFd >= 0) {
+        close(listenFd);
+        unlink(socketPath.c_str());
+    }
+}
+
+bool metrics::Exporter::open(void) {
+    if (socketPath.empty()) {
+        return true;
+    }
+
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    if (socketPath.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "[METRICS] Socket path " << socketPath << " is too long" << std::endl;
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, socketPath.c_str(), socketPath.size());
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) {
+        std::cerr << "[METRICS] Could not create socket: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    // Socket left behind by a killed process would make bind fail
+    unlink(socketPath.c_str());
+    if (bind(listenFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listenFd, 8) < 0) {
+        std::cerr << "[METRICS] Could not listen on " << socketPath << ": " << strerror(errno) << std::endl;
+        close(listenFd);
+        listenFd = -1;
+        return false;
+    }
+    return true;
+}
+
+void metrics::Exporter::poll(void) {
+    auto now = std::chrono::steady_clock::now();
+    bool due = now >= nextExport;
+    if (due) {
+        nextExport = now + EXPORT_INTERVAL;
+    }
+    due = due && !filePath.empty();
+
+    struct pollfd pfd{listenFd, POLLIN, 0};
+    bool waiting = listenFd >= 0 && ::poll(&pfd, 1, 0) > 0;
+    if (!due && !waiting) {
+        return;
+    }
+
+    Writer writer;
+    collect(writer);
+    std::string text = writer.str();
+
+    if (due) {
+        writeFile(text);
+    }
+
+    // Whole snapshot fits into the socket buffer, a reader that does not take it is dropped
+    int fd;
+    while (listenFd >= 0 && (fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC)) >= 0) {
+        send(fd, text.data(), text.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(fd);
+    }
+}
+
+void metrics::Exporter::flush(void) {
+    if (filePath.empty()) {
+        return;
+    }
+    Writer writer;
+    collect(writer);
+    writeFile(writer.str());
+}
+
+void metrics::Exporter::writeFile(const std::string& text) {
+    std::string tmpPath = filePath + ".tmp";
+    {
+        std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+        file << text;
+        if (!file) {
+            if (!fileFailed) {
+                std::cerr << "[METRICS] Could not write " << tmpPath << std::endl;
+            }
+            fileFailed = true;
+            return;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, filePath, ec);
+    if (ec && !fileFailed) {
+        std::cerr << "[METRICS] Could not replace " << filePath << ": " << ec.message() << std::endl;
+    }
+    fileFailed = static_cast<bool>(ec);
+}
@@ -13,12 +13,17 @@
 #include <ifaddrs.h>
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <unistd.h>
 #include <pcap/dlt.h>
 
 int net_utils::getLinkHeaderLen(int dataLink) {
     switch (dataLink) {
         case DLT_EN10MB:    return 14;
         case DLT_LINUX_SLL: return 16;
+#ifdef DLT_LINUX_SLL2
+        case DLT_LINUX_SLL2: return 20;
+#endif
         case DLT_NULL:      return 4;
         case DLT_RAW:       return 0;
         default:
@@ -43,12 +48,14 @@ int net_utils::resolveAddress(const std::string& input,
     std::memset(&addr6, 0, sizeof(addr6));
 
     if (net_utils::isIPv4(input)) {
+        inet_pton(AF_INET, input.c_str(), &addr4.sin_addr);
         addr4.sin_family = AF_INET;
         addr4.sin_port = 0;
         return net_utils::IPv4;
     }
 
     if (net_utils::isIPv6(input)) {
+        inet_pton(AF_INET6, input.c_str(), &addr6.sin6_addr);
         addr6.sin6_family = AF_INET6;
         addr6.sin6_port = 0;
         return net_utils::IPv6;
@@ -87,6 +94,57 @@ int net_utils::resolveAddress(const std::string& input,
     return net_utils::ERR;
 }
 
+std::vector<std::string> net_utils::resolveAllAddresses(const std::string& input) {
+    if (net_utils::isIPv4(input) || net_utils::isIPv6(input)) {
+        return {input};
+    }
+
+    std::vector<std::string> addresses;
+    struct addrinfo hints, *res;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_RAW;
+
+    for (auto [family, protocol] : {std::pair<int, int>{AF_INET, IPPROTO_ICMP}, {AF_INET6, IPPROTO_ICMPV6}}) {
+        hints.ai_family = family;
+        hints.ai_protocol = protocol;
+        if (getaddrinfo(input.c_str(), nullptr, &hints, &res) != 0) {
+            continue;
+        }
+        for (struct addrinfo* p = res; p != nullptr; p = p->ai_next) {
+            if (p->ai_family != family) {
+                continue;
+            }
+            struct sockaddr_storage addr;
+            std::memset(&addr, 0, sizeof(addr));
+            std::memcpy(&addr, p->ai_addr, p->ai_addrlen);
+            std::string text = net_utils::addressToString(addr);
+            if (!text.empty() && std::find(addresses.begin(), addresses.end(), text) == addresses.end()) {
+                addresses.push_back(text);
+            }
+        }
+        freeaddrinfo(res);
+    }
+    return addresses;
+}
+
+std::string net_utils::addressToString(const struct sockaddr_storage& addr) {
+    char buf[INET6_ADDRSTRLEN] = {0};
+
+    if (addr.ss_family == AF_INET) {
+        const auto* in = reinterpret_cast<const struct sockaddr_in*>(&addr);
+        if (inet_ntop(AF_INET, &in->sin_addr, buf, sizeof(buf))) {
+            return buf;
+        }
+    }
+    else if (addr.ss_family == AF_INET6) {
+        const auto* in6 = reinterpret_cast<const struct sockaddr_in6*>(&addr);
+        if (inet_ntop(AF_INET6, &in6->sin6_addr, buf, sizeof(buf))) {
+            return buf;
+        }
+    }
+    return {};
+}
+
 uint16_t net_utils::computeIPv4Checksum(const uint8_t* data, size_t length) {
     if (length == 0) {
         return 0xFFFF;
@@ -136,6 +194,29 @@ uint16_t net_utils::computeIPv6Checksum(const uint8_t* data, size_t length,
     return net_utils::computeIPv4Checksum(buf.data(), buf.size());
 }
 
+bool net_utils::getRouteSource(const struct sockaddr* dstAddr, socklen_t dstLen, struct sockaddr_storage& srcAddr) {
+    int fd = socket(dstAddr->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    // Port only has to be non-zero for connect, nothing is sent
+    struct sockaddr_storage dst;
+    std::memcpy(&dst, dstAddr, dstLen);
+    if (dst.ss_family == AF_INET) {
+        reinterpret_cast<struct sockaddr_in*>(&dst)->sin_port = htons(9);
+    }
+    else {
+        reinterpret_cast<struct sockaddr_in6*>(&dst)->sin6_port = htons(9);
+    }
+
+    socklen_t srcLen = sizeof(srcAddr);
+    bool ok = connect(fd, reinterpret_cast<struct sockaddr*>(&dst), dstLen) == 0 &&
+              getsockname(fd, reinterpret_cast<struct sockaddr*>(&srcAddr), &srcLen) == 0;
+    close(fd);
+    return ok;
+}
+
 bool net_utils::getSourceIPv6Address(struct sockaddr_in6& srcAddr) {
     struct ifaddrs *ifaddr, *ifa;
     if (getifaddrs(&ifaddr) == -1) {
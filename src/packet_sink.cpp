@@ -0,0 +1,99 @@
+/**
+ * @file packet_sink.cpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#include "packet_sink.hpp"
+#include "net_utils.hpp"
+#include <iostream>
+#include <cstring>
+#include <pcap.h>
+#include <sys/time.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+
+constexpr size_t IPV4_HEADER_SIZE = 20;
+constexpr size_t IPV6_HEADER_SIZE = 40;
+constexpr int SNAPLEN = 65535;
+constexpr uint8_t HOP_LIMIT = 64;
+
+PacketSink::PacketSink(const std::string& path) : path(path) {}
+
+PacketSink::~PacketSink() {
+    if (dumper) {
+        pcap_dump_close(dumper);
+    }
+    if (handle) {
+        pcap_close(handle);
+    }
+}
+
+bool PacketSink::open(void) {
+    if (path == NULL_SINK) {
+        return true;
+    }
+
+    handle = pcap_open_dead(DLT_RAW, SNAPLEN);
+    if (handle == nullptr) {
+        std::cerr << "[PACKET_SINK] pcap_open_dead failed" << std::endl;
+        return false;
+    }
+    dumper = pcap_dump_open(handle, path.c_str());
+    if (dumper == nullptr) {
+        std::cerr << "[PACKET_SINK] Could not create " << path << ": " << pcap_geterr(handle) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void PacketSink::write(const struct sockaddr_storage& srcAddr, const struct sockaddr_storage& dstAddr,
+                       const uint8_t* message, size_t size) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    bool isIPv4 = dstAddr.ss_family == AF_INET;
+    size_t headerSize = isIPv4 ? IPV4_HEADER_SIZE : IPV6_HEADER_SIZE;
+    frame.assign(headerSize + size, 0);
+
+    if (isIPv4) {
+        auto* ip = reinterpret_cast<struct iphdr*>(frame.data());
+        ip->version = 4;
+        ip->ihl = IPV4_HEADER_SIZE / 4;
+        ip->tot_len = htons(static_cast<uint16_t>(frame.size()));
+        ip->id = htons(ipId++);
+        ip->ttl = HOP_LIMIT;
+        ip->protocol = IPPROTO_ICMP;
+        ip->saddr = reinterpret_cast<const struct sockaddr_in*>(&srcAddr)->sin_addr.s_addr;
+        ip->daddr = reinterpret_cast<const struct sockaddr_in*>(&dstAddr)->sin_addr.s_addr;
+        ip->check = net_utils::computeIPv4Checksum(frame.data(), IPV4_HEADER_SIZE);
+    }
+    else {
+        auto* ip6 = reinterpret_cast<struct ip6_hdr*>(frame.data());
+        ip6->ip6_flow = htonl(6u << 28);
+        ip6->ip6_plen = htons(static_cast<uint16_t>(size));
+        ip6->ip6_nxt = IPPROTO_ICMPV6;
+        ip6->ip6_hlim = HOP_LIMIT;
+        ip6->ip6_src = reinterpret_cast<const struct sockaddr_in6*>(&srcAddr)->sin6_addr;
+        ip6->ip6_dst = reinterpret_cast<const struct sockaddr_in6*>(&dstAddr)->sin6_addr;
+    }
+    std::memcpy(frame.data() + headerSize, message, size);
+
+    ++packets;
+    bytes += frame.size();
+    if (dumper == nullptr) {
+        return;
+    }
+
+    struct pcap_pkthdr header;
+    gettimeofday(&header.ts, nullptr);
+    header.caplen = static_cast<bpf_u_int32>(frame.size());
+    header.len = header.caplen;
+    pcap_dump(reinterpret_cast<u_char*>(dumper), &header, frame.data());
+}
+
+bool PacketSink::flush(void) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (dumper && pcap_dump_flush(dumper) != 0) {
+        std::cerr << "[PACKET_SINK] Could not write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
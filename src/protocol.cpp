@@ -1,6 +1,7 @@
 #include "protocol.hpp"
 #include <cstring>
 #include <arpa/inet.h>
+#include <endian.h>
 #include <stdexcept>
 
 namespace protocol {
@@ -8,16 +9,24 @@ namespace protocol {
 std::vector<uint8_t> Metadata::serialize() const {
     std::vector<uint8_t> out;
 
+    if (fileName.size() > MAX_FILE_NAME) {
+        throw std::length_error("File name longer than 255 bytes");
+    }
     uint8_t nameLen = static_cast<uint8_t>(fileName.size());
     out.push_back(nameLen);
     out.insert(out.end(), fileName.begin(), fileName.end());
 
-    uint32_t fs = htonl(fileSize);
+    uint64_t fs = htobe64(fileSize);
     out.insert(out.end(), reinterpret_cast<uint8_t*>(&fs), reinterpret_cast<uint8_t*>(&fs) + sizeof(fs));
 
-    uint32_t tc = htonl(totalChunks);
+    uint64_t tc = htobe64(totalChunks);
     out.insert(out.end(), reinterpret_cast<uint8_t*>(&tc), reinterpret_cast<uint8_t*>(&tc) + sizeof(tc));
 
+    uint32_t cs = htonl(chunkSize);
+    out.insert(out.end(), reinterpret_cast<uint8_t*>(&cs), reinterpret_cast<uint8_t*>(&cs) + sizeof(cs));
+
+    out.push_back(kind);
+    out.push_back(codec);
     out.insert(out.end(), iv.begin(), iv.end());
 
     return out;
@@ -27,7 +36,7 @@ Metadata Metadata::deserialize(const uint8_t* data, size_t len) {
     Metadata meta;
     size_t offset = 0;
 
-    if (len < 1 + sizeof(uint32_t)*2) {
+    if (len < 1 || len < 1 + static_cast<size_t>(data[0]) + sizeof(uint64_t)*2 + sizeof(uint32_t) + sizeof(uint8_t)*2) {
         throw std::runtime_error("Invalid metadata length");
     }
 
@@ -36,13 +45,20 @@ Metadata Metadata::deserialize(const uint8_t* data, size_t len) {
     offset += nameLen;
 
     std::memcpy(&meta.fileSize, data + offset, sizeof(meta.fileSize));
-    meta.fileSize = ntohl(meta.fileSize);
+    meta.fileSize = be64toh(meta.fileSize);
     offset += sizeof(meta.fileSize);
 
     std::memcpy(&meta.totalChunks, data + offset, sizeof(meta.totalChunks));
-    meta.totalChunks = ntohl(meta.totalChunks);
+    meta.totalChunks = be64toh(meta.totalChunks);
     offset += sizeof(meta.totalChunks);
 
+    std::memcpy(&meta.chunkSize, data + offset, sizeof(meta.chunkSize));
+    meta.chunkSize = ntohl(meta.chunkSize);
+    offset += sizeof(meta.chunkSize);
+
+    meta.kind = data[offset++];
+    meta.codec = data[offset++];
+
     meta.iv.assign(data + offset, data + len);
 
     return meta;
@@ -51,8 +67,10 @@ Metadata Metadata::deserialize(const uint8_t* data, size_t len) {
 std::vector<uint8_t> Data::serialize() const {
     std::vector<uint8_t> out;
 
-    uint32_t cn = htonl(chunkNum);
+    uint64_t cn = htobe64(chunkNum);
     out.insert(out.end(), reinterpret_cast<uint8_t*>(&cn), reinterpret_cast<uint8_t*>(&cn) + sizeof(cn));
+    uint64_t tg = htobe64(tag);
+    out.insert(out.end(), reinterpret_cast<uint8_t*>(&tg), reinterpret_cast<uint8_t*>(&tg) + sizeof(tg));
     out.insert(out.end(), payload.begin(), payload.end());
 
     return out;
@@ -61,17 +79,290 @@ std::vector<uint8_t> Data::serialize() const {
 Data Data::deserialize(const uint8_t* data, size_t len) {
     Data d;
 
-    if (len < sizeof(uint32_t)) {
+    if (len < DATA_HEADER_SIZE) {
         throw std::runtime_error("Invalid data packet length");
     }
 
     std::memcpy(&d.chunkNum, data, sizeof(d.chunkNum));
-    d.chunkNum = ntohl(d.chunkNum);
+    d.chunkNum = be64toh(d.chunkNum);
+    std::memcpy(&d.tag, data + sizeof(d.chunkNum), sizeof(d.tag));
+    d.tag = be64toh(d.tag);
 
-    d.payload.assign(data + sizeof(d.chunkNum), data + len);
+    d.payload.assign(data + DATA_HEADER_SIZE, data + len);
     return d;
 }
 
+std::vector<uint8_t> End::serialize() const {
+    std::vector<uint8_t> out;
+
+    uint64_t tc = htobe64(totalChunks);
+    out.insert(out.end(), reinterpret_cast<uint8_t*>(&tc), reinterpret_cast<uint8_t*>(&tc) + sizeof(tc));
+
+    uint64_t fs = htobe64(fileSize);
+    out.insert(out.end(), reinterpret_cast<uint8_t*>(&fs), reinterpret_cast<uint8_t*>(&fs) + sizeof(fs));
+
+    std::vector<uint8_t> rootBytes = root;
+    rootBytes.resize(ROOT_SIZE, 0);
+    out.insert(out.end(), rootBytes.begin(), rootBytes.end());
+
+    return out;
+}
+
+End End::deserialize(const uint8_t* data, size_t len) {
+    End end;
+
+    if (len < sizeof(end.totalChunks) + sizeof(end.fileSize) + ROOT_SIZE) {
+        throw std::runtime_error("Invalid end packet length");
+    }
+
+    std::memcpy(&end.totalChunks, data, sizeof(end.totalChunks));
+    end.totalChunks = be64toh(end.totalChunks);
+    std::memcpy(&end.fileSize, data + sizeof(end.totalChunks), sizeof(end.fileSize));
+    end.fileSize = be64toh(end.fileSize);
+    end.root.assign(data + sizeof(end.totalChunks) + sizeof(end.fileSize),
+                    data + sizeof(end.totalChunks) + sizeof(end.fileSize) + ROOT_SIZE);
+
+    return end;
+}
+
+std::vector<uint8_t> ChunkStatus::serialize() const {
+    std::vector<uint8_t> out;
+    out.push_back(status);
+
+    uint32_t count = htonl(static_cast<uint32_t>(missing.size()));
+    out.insert(out.end(), reinterpret_cast<uint8_t*>(&count), reinterpret_cast<uint8_t*>(&count) + sizeof(count));
+
+    for (const auto& range : missing) {
+        uint64_t first = htobe64(range.first);
+        uint64_t end = htobe64(range.end);
+        out.insert(out.end(), reinterpret_cast<uint8_t*>(&first), reinterpret_cast<uint8_t*>(&first) + sizeof(first));
+        out.insert(out.end(), reinterpret_cast<uint8_t*>(&end), reinterpret_cast<uint8_t*>(&end) + sizeof(end));
+    }
+
+    return out;
+}
+
+ChunkStatus ChunkStatus::deserialize(const uint8_t* data, size_t len) {
+    ChunkStatus status;
+    size_t offset = 0;
+    constexpr size_t fixedLen = 1 + sizeof(uint32_t);
+
+    if (len < fixedLen) {
+        throw std::runtime_error("Invalid chunk status length");
+    }
+
+    status.status = data[offset++];
+
+    uint32_t count;
+    std::memcpy(&count, data + offset, sizeof(count));
+    count = ntohl(count);
+    offset += sizeof(count);
+
+    if ((len - offset) / (2 * sizeof(uint64_t)) < count) {
+        throw std::runtime_error("Invalid chunk status range count");
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        ChunkRange range;
+        std::memcpy(&range.first, data + offset, sizeof(range.first));
+        range.first = be64toh(range.first);
+        offset += sizeof(range.first);
+        std::memcpy(&range.end, data + offset, sizeof(range.end));
+        range.end = be64toh(range.end);
+        offset += sizeof(range.end);
+        status.missing.push_back(range);
+    }
+
+    return status;
+}
+
+std::vector<uint8_t> DeltaRequest::serialize() const {
+    std::vector<uint8_t> out;
+
+    uint64_t fb = htobe64(firstBlock);
+    out.insert(out.end(), reinterpret_cast<uint8_t*>(&fb), reinterpret_cast<uint8_t*>(&fb) + sizeof(fb));
+
+    uint32_t mp = htonl(maxPayload);
+    out.insert(out.end(), reinterpret_cast<uint8_t*>(&mp), reinterpret_cast<uint8_t*>(&mp) + sizeof(mp));
+
+    if (fileName.size() > MAX_FILE_NAME) {
+        throw std::length_error("File name longer than 255 bytes");
+    }
+    out.push_back(static_cast<uint8_t>(fileName.size()));
+    out.insert(out.end(), fileName.begin(), fileName.end());
+
+    return out;
+}
+
+DeltaRequest DeltaRequest::deserialize(const uint8_t* data, size_t len) {
+    DeltaRequest req;
+    constexpr size_t fixedLen = sizeof(uint64_t) + sizeof(uint32_t) + 1;
+
+    if (len < fixedLen || len < fixedLen + data[fixedLen - 1]) {
+        throw std::runtime_error("Invalid delta request length");
+    }
+
+    std::memcpy(&req.firstBlock, data, sizeof(req.firstBlock));
+    req.firstBlock = be64toh(req.firstBlock);
+
+    std::memcpy(&req.maxPayload, data + sizeof(req.firstBlock), sizeof(req.maxPayload));
+    req.maxPayload = ntohl(req.maxPayload);
+
+    req.fileName.assign(reinterpret_cast<const char*>(data + fixedLen), data[fixedLen - 1]);
+    return req;
+}
+
+std::vector<uint8_t> Signatures::serialize() const {
+    std::vector<uint8_t> out;
+    out.reserve(SIGNATURES_HEADER_SIZE + blocks.size() * SIGNATURE_SIZE);
+    out.push_back(found);
+
+    uint64_t bs = htobe64(basisSize);
+    out.insert(out.end(), reinterpret_cast<uint8_t*>(&bs), reinterpret_cast<uint8_t*>(&bs) + sizeof(bs));
+
+    uint32_t bl = htonl(blockSize);
+    out.insert(out.end(), reinterpret_cast<uint8_t*>(&bl), reinterpret_cast<uint8_t*>(&bl) + sizeof(bl));
+
+    uint64_t fb = htobe64(firstBlock);
+    out.insert(out.end(), reinterpret_cast<uint8_t*>(&fb), reinterpret_cast<uint8_t*>(&fb) + sizeof(fb));
+
+    uint32_t count = htonl(static_cast<uint32_t>(blocks.size()));
+    out.insert(out.end(), reinterpret_cast<uint8_t*>(&count), reinterpret_cast<uint8_t*>(&count) + sizeof(count));
+
+    for (const auto& block : blocks) {
+        uint32_t weak = htonl(block.weak);
+        uint64_t strong = htobe64(block.strong);
+        out.insert(out.end(), reinterpret_cast<uint8_t*>(&weak), reinterpret_cast<uint8_t*>(&weak) + sizeof(weak));
+        out.insert(out.end(), reinterpret_cast<uint8_t*>(&strong), reinterpret_cast<uint8_t*>(&strong) + sizeof(strong));
+    }
+
+    return out;
+}
+
+Signatures Signatures::deserialize(const uint8_t* data, size_t len) {
+    Signatures sig;
+    size_t offset = 0;
+
+    if (len < SIGNATURES_HEADER_SIZE) {
+        throw std::runtime_error("Invalid signatures length");
+    }
+
+    sig.found = data[offset++];
+
+    std::memcpy(&sig.basisSize, data + offset, sizeof(sig.basisSize));
+    sig.basisSize = be64toh(sig.basisSize);
+    offset += sizeof(sig.basisSize);
+
+    std::memcpy(&sig.blockSize, data + offset, sizeof(sig.blockSize));
+    sig.blockSize = ntohl(sig.blockSize);
+    offset += sizeof(sig.blockSize);
+
+    std::memcpy(&sig.firstBlock, data + offset, sizeof(sig.firstBlock));
+    sig.firstBlock = be64toh(sig.firstBlock);
+    offset += sizeof(sig.firstBlock);
+
+    uint32_t count;
+    std::memcpy(&count, data + offset, sizeof(count));
+    count = ntohl(count);
+    offset += sizeof(count);
+
+    if ((len - offset) / SIGNATURE_SIZE < count) {
+        throw std::runtime_error("Invalid signature count");
+    }
+
+    sig.blocks.resize(count);
+    for (auto& block : sig.blocks) {
+        std::memcpy(&block.weak, data + offset, sizeof(block.weak));
+        block.weak = ntohl(block.weak);
+        offset += sizeof(block.weak);
+        std::memcpy(&block.strong, data + offset, sizeof(block.strong));
+        block.strong = be64toh(block.strong);
+        offset += sizeof(block.strong);
+    }
+
+    return sig;
+}
+
+std::vector<uint8_t> ResumeRequest::serialize() const {
+    return {};
+}
+
+ResumeRequest ResumeRequest::deserialize(const uint8_t*, size_t) {
+    return ResumeRequest{};
+}
+
+std::vector<uint8_t> ResumeState::serialize() const {
+    std::vector<uint8_t> out;
+    out.push_back(found);
+
+    uint64_t fs = htobe64(fileSize);
+    out.insert(out.end(), reinterpret_cast<uint8_t*>(&fs), reinterpret_cast<uint8_t*>(&fs) + sizeof(fs));
+
+    uint32_t cs = htonl(chunkSize);
+    out.insert(out.end(), reinterpret_cast<uint8_t*>(&cs), reinterpret_cast<uint8_t*>(&cs) + sizeof(cs));
+
+    std::vector<uint8_t> ivBytes = iv;
+    ivBytes.resize(16, 0);
+    out.insert(out.end(), ivBytes.begin(), ivBytes.end());
+
+    uint32_t count = htonl(static_cast<uint32_t>(missing.size()));
+    out.insert(out.end(), reinterpret_cast<uint8_t*>(&count), reinterpret_cast<uint8_t*>(&count) + sizeof(count));
+
+    for (const auto& range : missing) {
+        uint64_t first = htobe64(range.first);
+        uint64_t end = htobe64(range.end);
+        out.insert(out.end(), reinterpret_cast<uint8_t*>(&first), reinterpret_cast<uint8_t*>(&first) + sizeof(first));
+        out.insert(out.end(), reinterpret_cast<uint8_t*>(&end), reinterpret_cast<uint8_t*>(&end) + sizeof(end));
+    }
+
+    return out;
+}
+
+ResumeState ResumeState::deserialize(const uint8_t* data, size_t len) {
+    ResumeState state;
+    size_t offset = 0;
+    constexpr size_t fixedLen = 1 + sizeof(uint64_t) + sizeof(uint32_t) + 16 + sizeof(uint32_t);
+
+    if (len < fixedLen) {
+        throw std::runtime_error("Invalid resume state length");
+    }
+
+    state.found = data[offset++];
+
+    std::memcpy(&state.fileSize, data + offset, sizeof(state.fileSize));
+    state.fileSize = be64toh(state.fileSize);
+    offset += sizeof(state.fileSize);
+
+    std::memcpy(&state.chunkSize, data + offset, sizeof(state.chunkSize));
+    state.chunkSize = ntohl(state.chunkSize);
+    offset += sizeof(state.chunkSize);
+
+    state.iv.assign(data + offset, data + offset + 16);
+    offset += 16;
+
+    uint32_t count;
+    std::memcpy(&count, data + offset, sizeof(count));
+    count = ntohl(count);
+    offset += sizeof(count);
+
+    if ((len - offset) / (2 * sizeof(uint64_t)) < count) {
+        throw std::runtime_error("Invalid resume state range count");
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        ChunkRange range;
+        std::memcpy(&range.first, data + offset, sizeof(range.first));
+        range.first = be64toh(range.first);
+        offset += sizeof(range.first);
+        std::memcpy(&range.end, data + offset, sizeof(range.end));
+        range.end = be64toh(range.end);
+        offset += sizeof(range.end);
+        state.missing.push_back(range);
+    }
+
+    return state;
+}
+
 PacketPtr buildMetadataPacket(const Metadata& meta, uint32_t seqNum, uint64_t clientId) {
     auto pkt = std::make_unique<Packet>();
     pkt->packetType = METADATA;
@@ -90,6 +381,74 @@ PacketPtr buildDataPacket(const Data& d, uint32_t seqNum, uint64_t clientId) {
     return pkt;
 }
 
+PacketPtr buildResumeRequestPacket(const ResumeRequest& req, uint32_t seqNum, uint64_t clientId) {
+    auto pkt = std::make_unique<Packet>();
+    pkt->packetType = RESUME_REQUEST;
+    pkt->seqNum = seqNum;
+    pkt->id = clientId;
+    pkt->payload = req;
+    return pkt;
+}
+
+PacketPtr buildEndPacket(const End& end, uint32_t seqNum, uint64_t clientId) {
+    auto pkt = std::make_unique<Packet>();
+    pkt->packetType = END;
+    pkt->seqNum = seqNum;
+    pkt->id = clientId;
+    pkt->payload = end;
+    return pkt;
+}
+
+PacketPtr buildDeltaRequestPacket(const DeltaRequest& req, uint32_t seqNum, uint64_t clientId) {
+    auto pkt = std::make_unique<Packet>();
+    pkt->packetType = DELTA_REQUEST;
+    pkt->seqNum = seqNum;
+    pkt->id = clientId;
+    pkt->payload = req;
+    return pkt;
+}
+
+PacketPtr buildSignaturesPacket(const Signatures& sig, uint32_t seqNum, uint64_t clientId) {
+    auto pkt = std::make_unique<Packet>();
+    pkt->packetType = SIGNATURES;
+    pkt->seqNum = seqNum;
+    pkt->id = clientId;
+    pkt->payload = sig;
+    return pkt;
+}
+
+PacketPtr buildResumeStatePacket(const ResumeState& state, uint32_t seqNum, uint64_t clientId) {
+    auto pkt = std::make_unique<Packet>();
+    pkt->packetType = RESUME_STATE;
+    pkt->seqNum = seqNum;
+    pkt->id = clientId;
+    pkt->payload = state;
+    return pkt;
+}
+
+PacketPtr buildChunkStatusPacket(const ChunkStatus& status, uint32_t seqNum, uint64_t clientId) {
+    auto pkt = std::make_unique<Packet>();
+    pkt->packetType = CHUNK_STATUS;
+    pkt->seqNum = seqNum;
+    pkt->id = clientId;
+    pkt->payload = status;
+    return pkt;
+}
+
+bool peekPacketType(const uint8_t* data, size_t len, PacketType& type) {
+    if (len < HEADER_SIZE) {
+        return false;
+    }
+
+    uint32_t magic;
+    std::memcpy(&magic, data, sizeof(magic));
+    if (ntohl(magic) != MAGIC_NUMBER || data[sizeof(magic)] != VERSION) {
+        return false;
+    }
+    type = static_cast<PacketType>(data[TYPE_OFFSET]);
+    return true;
+}
+
 std::vector<uint8_t> serializePacket(const Packet& pkt) {
     std::vector<uint8_t> out;
 
@@ -117,6 +476,24 @@ std::vector<uint8_t> serializePacket(const Packet& pkt) {
         const Data& data = std::get<Data>(pkt.payload);
         payload = data.serialize();
     } 
+    else if (pkt.packetType == RESUME_REQUEST) {
+        payload = std::get<ResumeRequest>(pkt.payload).serialize();
+    } 
+    else if (pkt.packetType == RESUME_STATE) {
+        payload = std::get<ResumeState>(pkt.payload).serialize();
+    } 
+    else if (pkt.packetType == END) {
+        payload = std::get<End>(pkt.payload).serialize();
+    } 
+    else if (pkt.packetType == DELTA_REQUEST) {
+        payload = std::get<DeltaRequest>(pkt.payload).serialize();
+    } 
+    else if (pkt.packetType == SIGNATURES) {
+        payload = std::get<Signatures>(pkt.payload).serialize();
+    } 
+    else if (pkt.packetType == CHUNK_STATUS) {
+        payload = std::get<ChunkStatus>(pkt.payload).serialize();
+    } 
     else {
         throw std::runtime_error("Unknown packet type");
     }
@@ -126,7 +503,7 @@ std::vector<uint8_t> serializePacket(const Packet& pkt) {
 }
 
 PacketPtr parsePacket(const uint8_t* data, size_t len) {
-    if (len < sizeof(uint32_t) + 2 + sizeof(uint32_t) + sizeof(uint64_t)) 
+    if (len < HEADER_SIZE) 
         return nullptr;
 
     auto pkt = std::make_unique<Packet>();
@@ -137,6 +514,9 @@ PacketPtr parsePacket(const uint8_t* data, size_t len) {
     offset += sizeof(pkt->magicNum);
 
     pkt->version = data[offset++];
+    if (pkt->magicNum != MAGIC_NUMBER || pkt->version != VERSION)
+        return nullptr;
+
     pkt->packetType = static_cast<PacketType>(data[offset++]);
 
     uint32_t seq;
@@ -157,6 +537,24 @@ PacketPtr parsePacket(const uint8_t* data, size_t len) {
     else if (pkt->packetType == DATA) {
         pkt->payload = Data::deserialize(data + offset, payloadLen);
     } 
+    else if (pkt->packetType == RESUME_REQUEST) {
+        pkt->payload = ResumeRequest::deserialize(data + offset, payloadLen);
+    } 
+    else if (pkt->packetType == RESUME_STATE) {
+        pkt->payload = ResumeState::deserialize(data + offset, payloadLen);
+    } 
+    else if (pkt->packetType == END) {
+        pkt->payload = End::deserialize(data + offset, payloadLen);
+    } 
+    else if (pkt->packetType == DELTA_REQUEST) {
+        pkt->payload = DeltaRequest::deserialize(data + offset, payloadLen);
+    } 
+    else if (pkt->packetType == SIGNATURES) {
+        pkt->payload = Signatures::deserialize(data + offset, payloadLen);
+    } 
+    else if (pkt->packetType == CHUNK_STATUS) {
+        pkt->payload = ChunkStatus::deserialize(data + offset, payloadLen);
+    } 
     else {
         throw std::runtime_error("Unknown packet type during parse");
     }
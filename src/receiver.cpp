@@ -0,0 +1,394 @@
+/**
+ * @file receiver.cpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#include "receiver.hpp"
+#include "xdp_receiver.hpp"
+#include "net_utils.hpp"
+#include "protocol.hpp"
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <pcap.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
+
+constexpr size_t RAW_BATCH = 64;                        ///< Packets taken from a socket by one recvmmsg
+constexpr size_t IPV6_HEADER_SIZE = 40;                 ///< Room for the rebuilt IPv6 header
+constexpr size_t RAW_SLOT = 65536 + IPV6_HEADER_SIZE;   ///< Buffer of one packet
+constexpr uint8_t RAW_HOP_LIMIT = 64;                   ///< Hop limit written into rebuilt IPv6 headers
+constexpr uint32_t ICMP_HEADER_SIZE = 8;                ///< Echo header in front of the protocol header (ICMP and ICMPv6)
+constexpr uint32_t MAGIC_AT = ICMP_HEADER_SIZE;         ///< Magic number relative to the ICMP header
+constexpr uint32_t VERSION_AT = ICMP_HEADER_SIZE + protocol::VERSION_OFFSET; ///< Version relative to the ICMP header
+
+/**
+ * @brief Builds the libpcap filter passing only echo requests that carry our magic and version
+ * @return Filter expression
+ */
+static std::string captureFilter(void) {
+    // Offsets count from the ICMP header, so IPv4 options (variable IHL) do not matter
+    std::string match = "[" + std::to_string(MAGIC_AT) + ":4] = " + std::to_string(protocol::MAGIC_NUMBER) + " and ";
+    std::string version = "[" + std::to_string(VERSION_AT) + "] = " + std::to_string(protocol::VERSION);
+    return "(icmp[icmptype] = icmp-echo and icmp" + match + "icmp" + version + ") or "
+           "(icmp6[icmp6type] = icmp6-echo and icmp6" + match + "icmp6" + version + ")";
+}
+
+std::unique_ptr<Receiver> Receiver::create(Backend backend, const std::string& replayFile, const Capture& capture) {
+    if (backend == Backend::RAW) {
+        return std::make_unique<RawReceiver>(capture);
+    }
+    if (backend == Backend::XDP) {
+        return std::make_unique<XdpReceiver>(capture);
+    }
+    return std::make_unique<PcapReceiver>(replayFile, capture);
+}
+
+PcapReceiver::PcapReceiver(const std::string& replayFile, const Capture& capture)
+    : replayFile(replayFile), capture(capture) {}
+
+PcapReceiver::~PcapReceiver() {
+    if (handle) {
+        pcap_close(handle);
+    }
+}
+
+bool PcapReceiver::open(void) {
+    char errbuf[PCAP_ERRBUF_SIZE];
+    pcap_t* opened;
+    // Offline handles read pcap and pcapng alike, the link type comes from the file
+    if (!replayFile.empty()) {
+        opened = pcap_open_offline(replayFile.c_str(), errbuf);
+        if (opened == nullptr) {
+            std::cerr << "[RECEIVER] pcap_open_offline failed: " << errbuf << std::endl;
+            return false;
+        }
+    }
+    else {
+        opened = openLive();
+        if (opened == nullptr) {
+            return false;
+        }
+    }
+
+    struct bpf_program fp;
+    std::string filter = captureFilter();
+    if (pcap_compile(opened, &fp, filter.c_str(), 1, PCAP_NETMASK_UNKNOWN) == -1) {
+        std::cerr << "[RECEIVER] pcap_compiler failed: " << pcap_geterr(opened) << std::endl;
+        pcap_close(opened);
+        return false;
+    }
+
+    if (pcap_setfilter(opened, &fp) == -1) {
+        std::cerr << "[RECEIVER] pcap_setfilter failed: " << pcap_geterr(opened) << std::endl;
+        pcap_freecode(&fp);
+        pcap_close(opened);
+        return false;
+    }
+    pcap_freecode(&fp);
+
+    int datalink = pcap_datalink(opened);
+    headerLen = net_utils::getLinkHeaderLen(datalink);
+    if (headerLen < 0) {
+        std::cerr << "[RECEIVER] Unsupported link type " << datalink << std::endl;
+        pcap_close(opened);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    handle = opened;
+    return true;
+}
+
+pcap_t* PcapReceiver::openLive(void) {
+    char errbuf[PCAP_ERRBUF_SIZE];
+    pcap_t* created = pcap_create(capture.device.c_str(), errbuf);
+    if (created == nullptr) {
+        std::cerr << "[RECEIVER] pcap_create failed: " << errbuf << std::endl;
+        return nullptr;
+    }
+
+    // Settings are only stored until the activation, which reports any of them the device refuses
+    pcap_set_snaplen(created, capture.snaplen);
+    pcap_set_promisc(created, 0);
+    pcap_set_timeout(created, capture.timeout);
+    pcap_set_buffer_size(created, capture.bufferSize);
+    pcap_set_immediate_mode(created, capture.immediate ? 1 : 0);
+
+    int status = pcap_activate(created);
+    if (status < 0) {
+        std::cerr << "[RECEIVER] Could not capture on " << capture.device << ": " << pcap_statustostr(status) << " "
+                  << pcap_geterr(created) << std::endl;
+        pcap_close(created);
+        return nullptr;
+    }
+    if (status > 0) {
+        std::cerr << "[RECEIVER] Capture on " << capture.device << ": " << pcap_statustostr(status) << " "
+                  << pcap_geterr(created) << std::endl;
+    }
+    return created;
+}
+
+void PcapReceiver::onPacket(unsigned char* user, const struct pcap_pkthdr* header, const unsigned char* packet) {
+    auto* self = reinterpret_cast<PcapReceiver*>(user);
+    size_t linkLen = static_cast<size_t>(self->headerLen);
+    struct timespec stamp{header->ts.tv_sec, static_cast<long>(header->ts.tv_usec) * 1000};
+    if (header->caplen < header->len) {
+        self->truncated.add();
+    }
+
+    // Runt without a whole IP header is handed over too, the server counts it as malformed
+    size_t length = header->caplen > linkLen ? header->caplen - linkLen : 0;
+    (*self->handler)(packet + std::min<size_t>(linkLen, header->caplen), length, stamp);
+}
+
+bool PcapReceiver::run(const Handler& handler) {
+    this->handler = &handler;
+    if (pcap_loop(handle, -1, onPacket, reinterpret_cast<unsigned char*>(this)) == PCAP_ERROR) {
+        // Truncated savefile, the packets before the damage were still handled
+        std::cerr << "[RECEIVER] pcap_loop failed: " << pcap_geterr(handle) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void PcapReceiver::stop(void) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (handle) {
+        pcap_breakloop(handle);
+    }
+}
+
+bool PcapReceiver::readStats(struct pcap_stat& stats) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return handle && replayFile.empty() && pcap_stats(handle, &stats) == 0;
+}
+
+void PcapReceiver::exportMetrics(metrics::Writer& out) {
+    // Kernel drops tell loss at the receiver apart from loss on the way
+    struct pcap_stat stats;
+    if (readStats(stats)) {
+        out.counter("secret_server_pcap_received_total", "Packets that passed the capture filter.", stats.ps_recv);
+        out.counter("secret_server_pcap_dropped_total", "Packets dropped because the capture buffer was full.",
+                    stats.ps_drop);
+        out.counter("secret_server_pcap_interface_dropped_total", "Packets dropped by the interface or its driver.",
+                    stats.ps_ifdrop);
+    }
+    out.counter("secret_server_pcap_truncated_total", "Packets cut short by the snapshot length.", truncated.value());
+}
+
+void PcapReceiver::report(void) {
+    struct pcap_stat stats;
+    if (readStats(stats)) {
+        std::cerr << "[RECEIVER] libpcap on " << capture.device << ": " << stats.ps_recv << " received, "
+                  << stats.ps_drop << " dropped (buffer full), " << stats.ps_ifdrop << " dropped by the interface, "
+                  << truncated.value() << " truncated" << std::endl;
+    }
+}
+
+RawReceiver::RawReceiver(const Capture& capture) : capture(capture) {}
+
+RawReceiver::~RawReceiver() {
+    for (int fd : {fd4, fd6, stopFd}) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+int RawReceiver::openSocket(int family) {
+    int protocol = family == AF_INET ? static_cast<int>(IPPROTO_ICMP) : static_cast<int>(IPPROTO_ICMPV6);
+    int fd = socket(family, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, protocol);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (capture.device != "any" &&
+        setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, capture.device.c_str(), capture.device.size()) < 0) {
+        std::cerr << "[RECEIVER] Could not bind to " << capture.device << ": " << strerror(errno) << std::endl;
+        close(fd);
+        return -1;
+    }
+
+    // Larger buffer rides out bursts, forcing it past rmem_max needs CAP_NET_ADMIN
+    int size = capture.bufferSize;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0) {
+        std::cerr << "[RECEIVER] Could not enable timestamps: " << strerror(errno) << std::endl;
+        close(fd);
+        return -1;
+    }
+
+    // IPv4 raw sockets see the IP header (variable length, X holds it), IPv6 ones start at the ICMPv6 header.
+    // Pings of other tools fail the magic and never wake the capture thread.
+    uint8_t echo = family == AF_INET ? ICMP_ECHO : ICMP6_ECHO_REQUEST;
+    uint16_t mode = family == AF_INET ? BPF_IND : BPF_ABS;
+    std::vector<struct sock_filter> code;
+    if (family == AF_INET) {
+        code.push_back(BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0));
+    }
+    code.push_back(BPF_STMT(BPF_LD | BPF_B | mode, 0));
+    code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, echo, 0, 5));
+    code.push_back(BPF_STMT(BPF_LD | BPF_W | mode, MAGIC_AT));
+    code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, protocol::MAGIC_NUMBER, 0, 3));
+    code.push_back(BPF_STMT(BPF_LD | BPF_B | mode, VERSION_AT));
+    code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, protocol::VERSION, 0, 1));
+    code.push_back(BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF));
+    code.push_back(BPF_STMT(BPF_RET | BPF_K, 0));
+
+    struct sock_fprog program{static_cast<unsigned short>(code.size()), code.data()};
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) < 0) {
+        std::cerr << "[RECEIVER] Could not attach socket filter: " << strerror(errno) << std::endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool RawReceiver::open(void) {
+    fd4 = openSocket(AF_INET);
+    if (fd4 < 0) {
+        std::cerr << "[RECEIVER] Could not open raw ICMP socket: " << strerror(errno) << std::endl;
+        return false;
+    }
+    fd6 = openSocket(AF_INET6);
+    if (fd6 < 0) {
+        std::cerr << "[RECEIVER] Could not open raw ICMPv6 socket, receiving IPv4 only" << std::endl;
+    }
+    stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stopFd < 0) {
+        std::cerr << "[RECEIVER] Could not create eventfd: " << strerror(errno) << std::endl;
+        return false;
+    }
+    buffers.resize(RAW_BATCH * RAW_SLOT);
+    return true;
+}
+
+bool RawReceiver::readBatch(int fd, const Handler& handler) {
+    // Room for the timestamp and the drop counter of each packet
+    constexpr size_t CONTROL_SIZE = CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t));
+    struct mmsghdr messages[RAW_BATCH];
+    struct iovec iovs[RAW_BATCH];
+    struct sockaddr_in6 names[RAW_BATCH];
+    alignas(struct cmsghdr) uint8_t controls[RAW_BATCH][CONTROL_SIZE];
+
+    // IPv6 packets are read behind room for the header rebuilt in front of them
+    bool isIPv6 = fd == fd6;
+    size_t offset = isIPv6 ? IPV6_HEADER_SIZE : 0;
+    std::memset(messages, 0, sizeof(messages));
+    for (size_t i = 0; i < RAW_BATCH; ++i) {
+        iovs[i].iov_base = buffers.data() + i * RAW_SLOT + offset;
+        iovs[i].iov_len = RAW_SLOT - IPV6_HEADER_SIZE;
+        messages[i].msg_hdr.msg_iov = &iovs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_name = &names[i];
+        messages[i].msg_hdr.msg_namelen = sizeof(names[i]);
+        messages[i].msg_hdr.msg_control = controls[i];
+        messages[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+    }
+
+    int count = recvmmsg(fd, messages, RAW_BATCH, MSG_DONTWAIT, nullptr);
+    if (count < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    batches.add();
+    received.add(static_cast<uint64_t>(count));
+
+    for (int i = 0; i < count; ++i) {
+        struct msghdr& header = messages[i].msg_hdr;
+        struct timespec stamp{};
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header); cmsg; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET) {
+                continue;
+            }
+            if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                std::memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+            }
+            else if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+                uint32_t drops;
+                std::memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+                (isIPv6 ? dropped6 : dropped4).store(drops, std::memory_order_relaxed);
+            }
+        }
+        if (stamp.tv_sec == 0) {
+            clock_gettime(CLOCK_REALTIME, &stamp);
+        }
+
+        uint8_t* packet = buffers.data() + i * RAW_SLOT;
+        size_t length = messages[i].msg_len;
+        if (isIPv6) {
+            auto* ip6 = reinterpret_cast<struct ip6_hdr*>(packet);
+            std::memset(ip6, 0, IPV6_HEADER_SIZE);
+            ip6->ip6_flow = htonl(6u << 28);
+            ip6->ip6_plen = htons(static_cast<uint16_t>(length));
+            ip6->ip6_nxt = IPPROTO_ICMPV6;
+            ip6->ip6_hlim = RAW_HOP_LIMIT;
+            ip6->ip6_src = names[i].sin6_addr;
+            length += IPV6_HEADER_SIZE;
+        }
+        handler(packet, length, stamp);
+    }
+    return true;
+}
+
+bool RawReceiver::run(const Handler& handler) {
+    std::vector<struct pollfd> fds{{stopFd, POLLIN, 0}, {fd4, POLLIN, 0}};
+    if (fd6 >= 0) {
+        fds.push_back({fd6, POLLIN, 0});
+    }
+
+    // Wakes on the first packet, no timeout decides how long packets wait
+    while (true) {
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "[RECEIVER] poll failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (fds[0].revents & POLLIN) {
+            uint64_t value;
+            ssize_t drained = read(stopFd, &value, sizeof(value));
+            static_cast<void>(drained);
+            return true;
+        }
+        for (size_t i = 1; i < fds.size(); ++i) {
+            if ((fds[i].revents & (POLLIN | POLLERR)) && !readBatch(fds[i].fd, handler)) {
+                std::cerr << "[RECEIVER] recvmmsg failed: " << strerror(errno) << std::endl;
+                return false;
+            }
+        }
+    }
+}
+
+void RawReceiver::stop(void) {
+    uint64_t value = 1;
+    if (stopFd >= 0) {
+        ssize_t written = write(stopFd, &value, sizeof(value));
+        static_cast<void>(written);
+    }
+}
+
+void RawReceiver::exportMetrics(metrics::Writer& out) {
+    out.counter("secret_server_raw_received_total", "Echo requests read from the raw sockets.", received.value());
+    out.counter("secret_server_raw_batches_total", "recvmmsg calls that returned packets.", batches.value());
+    out.counter("secret_server_raw_dropped_total", "Packets dropped because a raw socket buffer was full.",
+                dropped4.load(std::memory_order_relaxed) + dropped6.load(std::memory_order_relaxed));
+}
+
+void RawReceiver::report(void) {
+    std::cerr << "[RECEIVER] Raw sockets: " << received.value() << " received in " << batches.value() << " batches, "
+              << dropped4.load(std::memory_order_relaxed) + dropped6.load(std::memory_order_relaxed)
+              << " dropped (buffer full)" << std::endl;
+}
@@ -7,204 +7,950 @@
 #include "net_utils.hpp"
 #include "protocol.hpp"
 #include "encoder.hpp"
+#include "delta.hpp"
 #include "file_handler.hpp"
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
 #include <netinet/icmp6.h>
 #include <netinet/ip_icmp.h>
 #include <arpa/inet.h>
-#include <pcap.h>
 #include <iostream>
+#include <cstring>
+#include <filesystem>
+#include <algorithm>
+
+constexpr size_t MAX_RESUME_RANGES = 64;
+constexpr auto SWEEP_INTERVAL = std::chrono::seconds(1);  ///< Period of idle transfer checks
+constexpr size_t BUDGET_LOW_WATERMARK = 4;                ///< Spill down to (limit - limit / 4)
+constexpr size_t WORKER_QUEUE_CAPACITY = 256;             ///< Packets queued per worker, the rest waits in the fair queue
+constexpr size_t DRR_QUANTUM = 9000;                      ///< Bytes a client of weight 1 may dispatch per round
+constexpr size_t CLIENT_QUEUE_BYTES = 4 * 1024 * 1024;    ///< Payload bytes one client may have in the fair queue
+constexpr size_t REPORTED_CLIENTS = 8;                    ///< Deepest client queues listed in stats
+constexpr size_t MAX_AUTO_WORKERS = 4;                    ///< Upper bound of the worker count picked automatically
+constexpr auto NACK_INTERVAL = std::chrono::milliseconds(100); ///< Minimum time between two requests for missing chunks
+constexpr size_t FINISHED_MEMORY = 64;                    ///< Completed transfers per worker still confirmed to late End copies
+constexpr size_t REPLAY_QUEUE_LIMIT = 4096;               ///< Packets a replay may have waiting in the fair queue
+const std::string SINK_PATH = "/dev/null";                ///< Output of every transfer with --sink
+
+Server::Server(const std::string xlogin, const ServerConfig config)
+    : xlogin(std::move(xlogin)), config(std::move(config)), packetQueue(DRR_QUANTUM, this->config.replayFile.empty() ? CLIENT_QUEUE_BYTES : 0) {
+    key = encoder::deriveKey(this->xlogin);
+    diskWriter = std::make_unique<DiskWriter>(this->config.ioMode, 64 * 1024 * 1024, &pipeline);
+
+    size_t workerCount = this->config.workers;
+    if (workerCount == 0) {
+        workerCount = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, MAX_AUTO_WORKERS);
+    }
+    for (size_t i = 0; i < workerCount; ++i) {
+        workers.push_back(std::make_unique<Worker>(WORKER_QUEUE_CAPACITY));
+    }
 
-Server::Server(const std::string xlogin)
-    : xlogin(std::move(xlogin)) {}
+    if (!this->config.metricsFile.empty() || !this->config.metricsSocket.empty()) {
+        exporter = std::make_unique<metrics::Exporter>(this->config.metricsFile, this->config.metricsSocket,
+                                                       [this](metrics::Writer& out) { collectMetrics(out); });
+    }
+    if (!this->config.traceFile.empty()) {
+        pipeline.enableTrace(this->config.traceFile);
+        trace::installDumpSignal();
+    }
+}
 
 Server::~Server() {
     running = false;
     queueCV.notify_all();
+
+    // Closed queues release a consumer blocked on backpressure, workers drain what is left
+    for (auto& worker : workers) {
+        worker->queue.close();
+    }
     if (consumerThread.joinable()) {
         consumerThread.join();
     }
+    for (auto& worker : workers) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+
+    // Last state stays in the stats file after exit
+    if (exporter) {
+        exporter->flush();
+    }
+    pipeline.dump();
 }
 
-void Server::processPackets(const protocol::Metadata& metadata,
-                            chunker::ByteVector2D&& chunks) {
-    if (chunks.empty())
+void Server::accountMemory(size_t before, size_t after) {
+    memoryUsage += after;
+    memoryUsage -= before;
+    counters.memoryHigh.update(memoryUsage);
+}
+
+void Server::handlePacket(Worker& worker, QueuedPacket&& queued) {
+    PacketPtr& packet = queued.packet;
+    uint64_t clientId = packet->id;
+
+    if (packet->packetType == protocol::RESUME_REQUEST) {
+        handleResumeRequest(worker, clientId, queued.source);
         return;
+    }
+    if (auto request = std::get_if<protocol::DeltaRequest>(&packet->payload)) {
+        handleDeltaRequest(clientId, *request, queued.source);
+        return;
+    }
+    if (packet->packetType != protocol::METADATA && packet->packetType != protocol::DATA &&
+        packet->packetType != protocol::END) {
+        return;
+    }
+    if (!config.outputPath.empty() && !claimOutput(clientId)) {
+        return;
+    }
 
-    std::vector<uint8_t> cipherData = chunker::reassembleData(chunks);
-    std::vector<uint8_t> key = encoder::deriveKey(xlogin);
-    std::vector<uint8_t> iv = metadata.iv;
-    std::vector<uint8_t> plain;
+    auto& transfers = worker.transfers;
+    auto it = transfers.find(clientId);
+    auto finished = std::find(worker.finished.begin(), worker.finished.end(), clientId);
+    if (it == transfers.end() && finished != worker.finished.end()) {
+        // Confirmation got lost, the client asks again
+        if (packet->packetType == protocol::END) {
+            sendStatus(clientId, protocol::STATUS_DONE, {}, queued.source);
+            return;
+        }
+        worker.finished.erase(finished);
+    }
+    if (it == transfers.end()) {
+        it = transfers.emplace(clientId, openTransfer(clientId)).first;
+        accountMemory(0, it->second->getMemoryUsage());
+        counters.startedTransfers.add();
+    }
+
+    bool ok = true;
+    if (auto metadata = std::get_if<protocol::Metadata>(&packet->payload)) {
+        // New IV under a known ID means the client started over instead of resuming
+        if (it->second->hasMetadata() && it->second->getMetadata().iv != metadata->iv) {
+            dropTransfer(worker, it, true);
+            it = transfers.emplace(clientId, createTransfer(clientId)).first;
+        }
+    }
 
-    if (!encoder::decrypt(cipherData, key, iv, plain)) {
-        std::cout << "[SERVER] Decryption of the data failed" << std::endl;
+    Transfer& transfer = *it->second;
+    size_t before = transfer.getMemoryUsage();
+
+    if (auto metadata = std::get_if<protocol::Metadata>(&packet->payload)) {
+        ok = transfer.setMetadata(*metadata);
+    }
+    else if (auto data = std::get_if<protocol::Data>(&packet->payload)) {
+        counters.chunks.add();
+        counters.chunkBytes.add(data->payload.size());
+        ok = transfer.addChunk(std::move(*data));
+    }
+    else if (auto end = std::get_if<protocol::End>(&packet->payload)) {
+        ok = transfer.setEnd(*end);
+    }
+    accountMemory(before, transfer.getMemoryUsage());
+
+    if (!ok) {
+        std::cerr << "[SERVER] Transfer from client " << clientId << " failed" << std::endl;
+        counters.failedTransfers.add();
+        sendStatus(clientId, protocol::STATUS_FAILED, {}, queued.source);
+        dropTransfer(worker, it, true);
         return;
     }
 
-    if (!file_handler::writeFile(metadata.fileName, plain)) {
-        std::cout << "[SERVER] Could not save data to the file" << std::endl;
+    if (transfer.isComplete()) {
+        counters.completedTransfers.add();
+        sendStatus(clientId, protocol::STATUS_DONE, {}, queued.source);
+        worker.finished.push_back(clientId);
+        if (worker.finished.size() > FINISHED_MEMORY) {
+            worker.finished.pop_front();
+        }
+        dropTransfer(worker, it, false);
         return;
     }
+
+    // Damaged chunks are named right away, the client still has them buffered
+    std::vector<uint64_t> corrupt = transfer.takeCorruptChunks();
+    if (!corrupt.empty()) {
+        counters.corruptChunks.add(corrupt.size());
+        std::vector<protocol::ChunkRange> missing;
+        for (uint64_t chunkNum : corrupt) {
+            if (!missing.empty() && missing.back().end == chunkNum) {
+                ++missing.back().end;
+            }
+            else if (missing.size() < MAX_RESUME_RANGES) {
+                missing.push_back(protocol::ChunkRange{chunkNum, chunkNum + 1});
+            }
+        }
+        sendStatus(clientId, protocol::STATUS_MISSING, std::move(missing), queued.source);
+    }
+    // After End whatever is not here got lost on the way
+    else if (packet->packetType == protocol::END && transfer.hasEnd() && transfer.claimNack(NACK_INTERVAL)) {
+        sendStatus(clientId, protocol::STATUS_MISSING, transfer.getResumeState(MAX_RESUME_RANGES).missing,
+                   queued.source);
+    }
+
+    if (config.memoryLimit != 0 && memoryUsage > config.memoryLimit) {
+        enforceMemoryBudget(worker);
+    }
+}
+
+std::unique_ptr<Transfer> Server::createTransfer(uint64_t clientId) {
+    // Sink goes through the stream output, so decryption and the I/O thread still do all their work
+    const std::string& output = config.sink ? SINK_PATH : config.outputPath;
+    return std::make_unique<Transfer>(clientId, key, config.spoolDir, diskWriter.get(), output, &pipeline);
 }
 
-void Server::updateClientMetadata(uint64_t clientId) {
-    auto itMeta = clientPackets[clientId].find(0);
-    if (itMeta != clientPackets[clientId].end() && itMeta->second) {
-        if (auto metadata = std::get_if<protocol::Metadata>(&itMeta->second->payload)) {
-            clientTotalChunks[clientId] = metadata->totalChunks;
+std::unique_ptr<Transfer> Server::openTransfer(uint64_t clientId) {
+    auto transfer = createTransfer(clientId);
+    if (config.spoolDir.empty()) {
+        return transfer;
+    }
+
+    // Transfer parked by eviction (or the previous run) continues from its checkpoint
+    if (transfer->restore() && !transfer->isComplete()) {
+        return transfer;
+    }
+    return createTransfer(clientId);
+}
+
+void Server::dropTransfer(Worker& worker, std::map<uint64_t, std::unique_ptr<Transfer>>::iterator it, bool discard) {
+    accountMemory(it->second->getMemoryUsage(), 0);
+    if (discard) {
+        it->second->discard();
+    }
+    uint64_t clientId = it->first;
+    worker.transfers.erase(it);
+    releaseReplyConnection(clientId);
+
+    // Output path serves a single transfer, whatever way it ended
+    if (!config.outputPath.empty()) {
+        outputFailed = outputFailed || discard;
+        stopCapture();
+    }
+}
+
+void Server::enforceMemoryBudget(Worker& worker) {
+    size_t target = config.memoryLimit - config.memoryLimit / BUDGET_LOW_WATERMARK;
+
+    // Only the own shard is touched, other workers enforce the budget on their next packet
+    std::vector<std::pair<size_t, uint64_t>> bySize;
+    for (const auto& [clientId, transfer] : worker.transfers) {
+        bySize.emplace_back(transfer->getMemoryUsage(), clientId);
+    }
+
+    // Largest transfers first, they release the most memory per spill
+    std::sort(bySize.begin(), bySize.end(), std::greater<>());
+
+    // Spilling keeps the transfer alive, eviction is the last resort
+    for (bool evict : {false, true}) {
+        for (const auto& [usage, clientId] : bySize) {
+            if (memoryUsage <= target) {
+                return;
+            }
+
+            auto it = worker.transfers.find(clientId);
+            if (it == worker.transfers.end() || it->second->getMemoryUsage() == 0) {
+                continue;
+            }
+
+            size_t before = it->second->getMemoryUsage();
+            if (!evict && it->second->canSpill()) {
+                if (!it->second->spill()) {
+                    std::cerr << "[SERVER] Spilling transfer " << clientId << " failed" << std::endl;
+                    dropTransfer(worker, it, true);
+                    continue;
+                }
+                accountMemory(before, it->second->getMemoryUsage());
+                std::cerr << "[SERVER] Spilled " << before - it->second->getMemoryUsage()
+                          << " bytes of transfer " << clientId << " to disk" << std::endl;
+            }
+            else if (evict) {
+                std::cerr << "[SERVER] Memory budget exceeded, evicting transfer " << clientId
+                          << " holding " << before << " bytes" << std::endl;
+                counters.evictedTransfers.add();
+                dropTransfer(worker, it, true);
+            }
         }
     }
 }
 
-void Server::tryReassemble(uint64_t clientId) {
-    auto itTotal = clientTotalChunks.find(clientId);
-    if (itTotal == clientTotalChunks.end())
+void Server::evictIdleTransfers(Worker& worker) {
+    if (config.idleTimeout.count() == 0) {
         return;
+    }
 
-    uint32_t totalChunks = itTotal->second;
-    if (totalChunks == 0)
-        return;
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = worker.transfers.begin(); it != worker.transfers.end();) {
+        auto current = it++;
+        Transfer& transfer = *current->second;
+        if (now - transfer.getLastActivity() < config.idleTimeout) {
+            continue;
+        }
 
-    if (clientPackets[clientId].size() < totalChunks + 1)
-        return;
+        // With a spool the transfer only leaves memory, the client can still resume it
+        if (transfer.canSpill() && transfer.park()) {
+            std::cerr << "[SERVER] Parking idle transfer " << current->first << " in the spool" << std::endl;
+            dropTransfer(worker, current, false);
+        }
+        else {
+            std::cerr << "[SERVER] Evicting idle transfer " << current->first
+                      << " holding " << transfer.getMemoryUsage() << " bytes" << std::endl;
+            counters.evictedTransfers.add();
+            dropTransfer(worker, current, true);
+        }
+    }
+    closeIdleReplyConnections();
+}
+
+void Server::handleResumeRequest(Worker& worker, uint64_t clientId, const struct sockaddr_storage& source) {
+    protocol::ResumeState state;
+
+    auto it = worker.transfers.find(clientId);
+    if (it == worker.transfers.end() && !config.spoolDir.empty()) {
+        auto transfer = openTransfer(clientId);
+        if (transfer->hasMetadata()) {
+            it = worker.transfers.emplace(clientId, std::move(transfer)).first;
+            accountMemory(0, it->second->getMemoryUsage());
+        }
+    }
+
+    if (it != worker.transfers.end()) {
+        // Client is about to resend, so persist what is buffered before answering
+        size_t before = it->second->getMemoryUsage();
+        it->second->touch();
+        it->second->checkpoint();
+        accountMemory(before, it->second->getMemoryUsage());
+        state = it->second->getResumeState(MAX_RESUME_RANGES);
+    }
 
-    chunker::ByteVector2D chunks;
-    chunks.reserve(totalChunks);
+    auto reply = protocol::buildResumeStatePacket(state, 0, clientId);
+    sendToClient(*reply, source);
+}
+
+void Server::handleDeltaRequest(uint64_t clientId, const protocol::DeltaRequest& request,
+                                const struct sockaddr_storage& source) {
+    protocol::Signatures sig;
+    size_t perPacket = delta::signaturesPerPacket(std::min<size_t>(request.maxPayload, delta::MAX_REPLY_PAYLOAD));
+    std::string name = file_handler::getNameFromPath(request.fileName);
+
+    // Output of a stream has no previous version to diff against
+    if (!config.outputPath.empty() || name.empty() || perPacket == 0 ||
+        !delta::computeSignatures(name, request.firstBlock, perPacket * delta::SIGNATURE_WINDOW, sig)) {
+        sig = protocol::Signatures();
+        sig.firstBlock = request.firstBlock;
+        auto reply = protocol::buildSignaturesPacket(sig, 0, clientId);
+        sendToClient(*reply, source);
+        return;
+    }
 
-    for (uint32_t i = 1; i <= totalChunks; ++i) {
-        auto it = clientPackets[clientId].find(i);
-        if (it == clientPackets[clientId].end() || !it->second) {
-            std::cerr << "[SERVER] Missing packet client" << std::endl;
+    // Whole window at once, the client asks again from the first block it is missing
+    std::vector<protocol::BlockSignature> blocks = std::move(sig.blocks);
+    size_t offset = 0;
+    uint32_t seqNum = 0;
+    do {
+        size_t n = std::min(perPacket, blocks.size() - offset);
+        sig.firstBlock = request.firstBlock + offset;
+        sig.blocks.assign(blocks.begin() + static_cast<std::ptrdiff_t>(offset),
+                          blocks.begin() + static_cast<std::ptrdiff_t>(offset + n));
+        auto reply = protocol::buildSignaturesPacket(sig, seqNum++, clientId);
+        if (!sendToClient(*reply, source)) {
             return;
         }
+        offset += n;
+    } while (offset < blocks.size());
+}
+
+void Server::sendStatus(uint64_t clientId, uint8_t status, std::vector<protocol::ChunkRange> missing,
+                        const struct sockaddr_storage& source) {
+    protocol::ChunkStatus chunkStatus;
+    chunkStatus.status = status;
+    chunkStatus.missing = std::move(missing);
+
+    auto reply = protocol::buildChunkStatusPacket(chunkStatus, 0, clientId);
+    counters.statusReplies.add();
+    sendToClient(*reply, source);
+}
+
+bool Server::sendToClient(const protocol::Packet& packet, const struct sockaddr_storage& destination) {
+    // Clients of a recorded capture are long gone, replies would only need privileges
+    if (!config.replayFile.empty()) {
+        return true;
+    }
 
-        if (auto data = std::get_if<protocol::Data>(&it->second->payload)) {
-            chunks.push_back(data->payload);
-        } 
+    std::string address = net_utils::addressToString(destination);
+    if (address.empty()) {
+        counters.replyErrors.add();
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(replyMutex);
+    auto& reply = replyConnections[address];
+    if (!reply.connection) {
+        reply.connection = std::make_unique<ICMPConnection>(address);
+        // Socket is never read, without the filter it would queue a copy of every chunk the client sends
+        if (!reply.connection->connect() || !reply.connection->ignoreIncoming()) {
+            std::cerr << "[SERVER] Could not open reply socket to " << address << std::endl;
+            replyConnections.erase(address);
+            counters.replyErrors.add();
+            return false;
+        }
+    }
+    reply.clients.insert(packet.id);
+    reply.lastUsed = std::chrono::steady_clock::now();
+
+    auto serialized = protocol::serializePacket(packet);
+    if (!reply.connection->sendReply(serialized.data(), serialized.size())) {
+        counters.replyErrors.add();
+        return false;
+    }
+    return true;
+}
+
+void Server::releaseReplyConnection(uint64_t clientId) {
+    std::lock_guard<std::mutex> lock(replyMutex);
+    for (auto it = replyConnections.begin(); it != replyConnections.end();) {
+        it->second.clients.erase(clientId);
+        if (it->second.clients.empty()) {
+            it = replyConnections.erase(it);
+        }
         else {
-            std::cerr << "[SERVER] Unexpected packet type" << std::endl;
-            return;
+            ++it;
+        }
+    }
+}
+
+void Server::closeIdleReplyConnections(void) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(replyMutex);
+    for (auto it = replyConnections.begin(); it != replyConnections.end();) {
+        if (now - it->second.lastUsed >= config.idleTimeout) {
+            it = replyConnections.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+void Server::restoreTransfers(void) {
+    if (config.spoolDir.empty()) {
+        return;
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(config.spoolDir, ec);
+    if (ec) {
+        std::cerr << "[SERVER] Could not create spool directory " << config.spoolDir << ": " << ec.message() << std::endl;
+        return;
+    }
+
+    for (uint64_t id : Spool::listTransfers(config.spoolDir)) {
+        auto transfer = createTransfer(id);
+        if (!transfer->restore()) {
+            std::cerr << "[SERVER] Dropping unusable checkpoint of transfer " << id << std::endl;
+            transfer->discard();
+            continue;
+        }
+        if (!transfer->isComplete()) {
+            accountMemory(0, transfer->getMemoryUsage());
+            workerFor(id).transfers[id] = std::move(transfer);
+        }
+    }
+}
+
+bool Server::claimOutput(uint64_t clientId) {
+    std::lock_guard<std::mutex> lock(outputMutex);
+    if (!outputOwner) {
+        outputOwner = clientId;
+    }
+    if (*outputOwner == clientId) {
+        return true;
+    }
+
+    if (rejectedClients.insert(clientId).second) {
+        std::cerr << "[SERVER] Output is taken by client " << *outputOwner << ", ignoring client " << clientId << std::endl;
+    }
+    return false;
+}
+
+void Server::stopCapture(void) {
+    if (receiver) {
+        receiver->stop();
+    }
+}
+
+Server::Worker& Server::workerFor(uint64_t clientId) {
+    // Every packet of a transfer goes to the same worker, so the CBC chain stays in order
+    return *workers[clientId % workers.size()];
+}
+
+void Server::reportStats(void) {
+    // Nothing new to tell on an idle server
+    uint64_t dispatched = pipeline.histogram(trace::SERVER_CAPTURE_QUEUE).count();
+    if (dispatched == reportedPackets) {
+        return;
+    }
+    reportedPackets = dispatched;
+
+    size_t workerQueued = 0;
+    for (auto& worker : workers) {
+        workerQueued += worker->queue.size();
+    }
+    size_t captureQueued;
+    std::vector<std::pair<uint64_t, size_t>> depths;
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        captureQueued = packetQueue.size();
+        depths = packetQueue.depths();
+    }
+
+    std::cerr << "[SERVER] Queued packets: capture " << captureQueued << ", workers " << workerQueued
+              << ", buffered " << memoryUsage << " bytes, dropped " << counters.queueDrops.value() << std::endl;
+    receiver->report();
+
+    std::sort(depths.begin(), depths.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+    if (depths.size() > REPORTED_CLIENTS) {
+        depths.resize(REPORTED_CLIENTS);
+    }
+    for (const auto& [clientId, depth] : depths) {
+        std::cerr << "[SERVER] Client " << clientId << ": " << depth << " queued packets" << std::endl;
+    }
+    for (size_t i = 0; i < pipeline.size(); ++i) {
+        // Quantiles are cumulative since start, a stage that never ran is left out
+        const metrics::Histogram& histogram = pipeline.histogram(i);
+        if (histogram.count() == 0) {
+            continue;
         }
+        std::cerr << "[SERVER] Stage " << pipeline.name(i) << ": " << histogram.count() << " passes, p50 "
+                  << histogram.quantile(0.5) / 1000 << " us, p99 " << histogram.quantile(0.99) / 1000
+                  << " us, max " << histogram.max() / 1000 << " us" << std::endl;
     }
+}
+
+void Server::publishProgress(Worker& worker) {
+    std::map<uint64_t, TransferProgress> progress;
+    for (const auto& [clientId, transfer] : worker.transfers) {
+        TransferProgress& p = progress[clientId];
+        p.writtenChunks = transfer->getWrittenChunks();
+        p.bufferedChunks = transfer->getBufferedChunks();
+        p.totalChunks = transfer->hasMetadata() ? transfer->getMetadata().totalChunks : protocol::UNKNOWN_SIZE;
+        p.writtenBytes = transfer->getWrittenBytes();
+        p.memory = transfer->getMemoryUsage();
+    }
+
+    std::lock_guard<std::mutex> lock(worker.progressMutex);
+    worker.progress = std::move(progress);
+}
 
-    auto itMeta = clientPackets[clientId].find(0);
-    if (itMeta != clientPackets[clientId].end()) {
-        if (auto metadata = std::get_if<protocol::Metadata>(&itMeta->second->payload)) {
-            processPackets(*metadata, std::move(chunks));
+void Server::collectMetrics(metrics::Writer& out) {
+    uint64_t captured = counters.capturedPackets.value();
+    uint64_t capturedBytes = counters.capturedBytes.value();
+    out.counter("secret_server_captured_packets_total", "Echo requests handed over by the capture.", captured);
+    out.counter("secret_server_captured_bytes_total", "ICMP payload bytes of the captured echo requests.",
+                capturedBytes);
+    out.gauge("secret_server_captured_packets_per_second", "Capture rate over the last export interval.",
+              packetRate.update(captured));
+    out.gauge("secret_server_captured_bytes_per_second", "Captured payload bytes per second over the last export interval.",
+              byteRate.update(capturedBytes));
+    out.counter("secret_server_foreign_packets_total", "Echo requests that are not packets of this protocol.",
+                counters.foreignPackets.value());
+    out.counter("secret_server_malformed_packets_total", "Truncated packets and packets that did not parse.",
+                counters.malformedPackets.value());
+    out.counter("secret_server_chunks_total", "Data chunks handed to transfers.", counters.chunks.value());
+    out.counter("secret_server_chunk_bytes_total", "Payload bytes of the data chunks.", counters.chunkBytes.value());
+    out.counter("secret_server_corrupt_chunks_total", "Chunks dropped because their tag did not match.",
+                counters.corruptChunks.value());
+    out.counter("secret_server_transfers_started_total", "Transfers created.", counters.startedTransfers.value());
+    out.counter("secret_server_transfers_completed_total", "Transfers whose Merkle root matched.",
+                counters.completedTransfers.value());
+    out.counter("secret_server_transfers_failed_total", "Transfers dropped because of an error.",
+                counters.failedTransfers.value());
+    out.counter("secret_server_transfers_evicted_total", "Transfers evicted for memory or idleness.",
+                counters.evictedTransfers.value());
+    out.counter("secret_server_status_replies_total", "Chunk status packets sent to clients.",
+                counters.statusReplies.value());
+    out.counter("secret_server_reply_errors_total", "Replies that could not be sent.", counters.replyErrors.value());
+    out.counter("secret_server_queue_dropped_packets_total", "Packets dropped because their client's fair queue was full.",
+                counters.queueDrops.value());
+
+    size_t workerQueued = 0;
+    for (auto& worker : workers) {
+        workerQueued += worker->queue.size();
+    }
+    size_t captureQueued;
+    size_t captureBytes;
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        captureQueued = packetQueue.size();
+        captureBytes = packetQueue.byteSize();
+    }
+    out.gauge("secret_server_queued_bytes", "Payload bytes waiting in the fair queue.", static_cast<uint64_t>(captureBytes));
+    out.family("secret_server_queued_packets", "gauge", "Packets waiting in a queue.");
+    out.sample("secret_server_queued_packets", static_cast<uint64_t>(captureQueued), metrics::label("queue", "capture"));
+    out.sample("secret_server_queued_packets", static_cast<uint64_t>(workerQueued), metrics::label("queue", "workers"));
+    out.family("secret_server_queued_packets_high_water", "gauge", "Most packets ever waiting in a queue (one worker).");
+    out.sample("secret_server_queued_packets_high_water", counters.captureQueueHigh.value(),
+               metrics::label("queue", "capture"));
+    out.sample("secret_server_queued_packets_high_water", counters.workerQueueHigh.value(),
+               metrics::label("queue", "workers"));
+    out.gauge("secret_server_memory_bytes", "Bytes buffered by all transfers.", static_cast<uint64_t>(memoryUsage));
+    out.gauge("secret_server_memory_high_water_bytes", "Most bytes ever buffered by all transfers.",
+              counters.memoryHigh.value());
+
+    pipeline.exportMetrics(out, "secret_server_stage_latency_seconds");
+
+    if (receiver) {
+        receiver->exportMetrics(out);
+    }
+
+    std::map<uint64_t, TransferProgress> progress;
+    for (auto& worker : workers) {
+        std::lock_guard<std::mutex> lock(worker->progressMutex);
+        progress.insert(worker->progress.begin(), worker->progress.end());
+    }
+    out.gauge("secret_server_transfers_active", "Transfers in memory.", static_cast<uint64_t>(progress.size()));
+    if (progress.empty()) {
+        return;
+    }
+    out.family("secret_server_transfer_written_chunks", "gauge", "Chunks decrypted and written in order.");
+    for (const auto& [clientId, p] : progress) {
+        out.sample("secret_server_transfer_written_chunks", p.writtenChunks, metrics::label("client", std::to_string(clientId)));
+    }
+    out.family("secret_server_transfer_buffered_chunks", "gauge", "Out-of-order chunks waiting in memory or the spool.");
+    for (const auto& [clientId, p] : progress) {
+        out.sample("secret_server_transfer_buffered_chunks", p.bufferedChunks, metrics::label("client", std::to_string(clientId)));
+    }
+    out.family("secret_server_transfer_total_chunks", "gauge", "Chunks of the file, streams are left out until their end.");
+    for (const auto& [clientId, p] : progress) {
+        if (p.totalChunks != protocol::UNKNOWN_SIZE) {
+            out.sample("secret_server_transfer_total_chunks", p.totalChunks, metrics::label("client", std::to_string(clientId)));
         }
     }
+    out.family("secret_server_transfer_written_bytes", "gauge", "Plaintext bytes written.");
+    for (const auto& [clientId, p] : progress) {
+        out.sample("secret_server_transfer_written_bytes", p.writtenBytes, metrics::label("client", std::to_string(clientId)));
+    }
+    out.family("secret_server_transfer_memory_bytes", "gauge", "Bytes held in memory by the transfer.");
+    for (const auto& [clientId, p] : progress) {
+        out.sample("secret_server_transfer_memory_bytes", static_cast<uint64_t>(p.memory),
+                   metrics::label("client", std::to_string(clientId)));
+    }
+}
 
-    clientPackets.erase(clientId);
-    clientTotalChunks.erase(clientId);
+void Server::workerLoop(Worker& worker) {
+    auto nextSweep = std::chrono::steady_clock::now() + SWEEP_INTERVAL;
+
+    while (true) {
+        QueuedPacket queued;
+        if (worker.queue.popUntil(queued, nextSweep)) {
+            // Queue was full, the dispatcher may be waiting for this worker. Taking the mutex orders
+            // the notification after its check, so the wakeup is not lost
+            if (worker.queue.size() + 1 >= WORKER_QUEUE_CAPACITY) {
+                { std::lock_guard<std::mutex> lock(queueMutex); }
+                queueCV.notify_one();
+            }
+            auto start = std::chrono::steady_clock::now();
+            uint64_t clientId = queued.packet->id;
+            pipeline.record(trace::SERVER_WORKER_QUEUE, queued.enqueued, start, clientId);
+
+            handlePacket(worker, std::move(queued));
+            pipeline.record(trace::SERVER_PROCESS, start, std::chrono::steady_clock::now(), clientId);
+        }
+        else if (worker.queue.isClosed()) {
+            break;
+        }
+
+        if (std::chrono::steady_clock::now() >= nextSweep) {
+            evictIdleTransfers(worker);
+            if (exporter) {
+                publishProgress(worker);
+            }
+            nextSweep = std::chrono::steady_clock::now() + SWEEP_INTERVAL;
+        }
+    }
+}
+
+unsigned Server::priorityFor(uint64_t clientId, const struct sockaddr_storage& source) const {
+    auto byId = config.idPriorities.find(clientId);
+    if (byId != config.idPriorities.end()) {
+        return byId->second;
+    }
+
+    if (!config.addressPriorities.empty()) {
+        auto byAddress = config.addressPriorities.find(net_utils::addressToString(source));
+        if (byAddress != config.addressPriorities.end()) {
+            return byAddress->second;
+        }
+    }
+    return DEFAULT_PRIORITY;
 }
 
 void Server::packetConsumerLoop(void) {
+    auto nextReport = std::chrono::steady_clock::now() + config.statsInterval;
+
+    // Clients whose worker is full wait in their own queue instead of blocking everybody else
+    auto acceptsMore = [this](uint64_t clientId) { return !workerFor(clientId).queue.isFull(); };
+
     while (running) {
-        PacketPtr packet;
+        QueuedPacket queued;
+
+        if (config.statsInterval.count() != 0 && std::chrono::steady_clock::now() >= nextReport) {
+            reportStats();
+            nextReport = std::chrono::steady_clock::now() + config.statsInterval;
+        }
+        if (exporter) {
+            exporter->poll();
+        }
+        if (trace::takeDumpRequest()) {
+            pipeline.dump();
+        }
 
         {
             std::unique_lock<std::mutex> lock(queueMutex);
-            queueCV.wait(lock, [this] { return !packetQueue.empty() || !running; });
+            auto ready = [this] { return !packetQueue.empty() || !running; };
+            // Metrics readers are answered at least every EXPORT_INTERVAL, also on an idle server
+            auto wakeup = std::chrono::steady_clock::time_point::max();
+            if (config.statsInterval.count() != 0) {
+                wakeup = nextReport;
+            }
+            if (exporter) {
+                wakeup = std::min(wakeup, exporter->nextDeadline());
+            }
+            if (pipeline.isTracing()) {
+                wakeup = std::min(wakeup, std::chrono::steady_clock::now() + trace::DUMP_CHECK_INTERVAL);
+            }
+            if (wakeup != std::chrono::steady_clock::time_point::max()) {
+                queueCV.wait_until(lock, wakeup, ready);
+            }
+            else {
+                queueCV.wait(lock, ready);
+            }
 
             if (!running && packetQueue.empty())
                 break;
-
-            packet = std::move(packetQueue.front());
-            packetQueue.pop();
-            if (!packet) continue;
+            if (packetQueue.empty())
+                continue;
+
+            if (!packetQueue.pop(queued, acceptsMore)) {
+                // Every waiting client has a full worker, the first worker to take a packet wakes us
+                if (wakeup != std::chrono::steady_clock::time_point::max()) {
+                    queueCV.wait_until(lock, wakeup);
+                }
+                else {
+                    queueCV.wait(lock);
+                }
+                continue;
+            }
+            if (!config.replayFile.empty()) {
+                spaceCV.notify_one();
+            }
+            if (!queued.packet) continue;
         }
 
-        uint64_t clientId = packet->id;
-        uint32_t seq = packet->seqNum;
-
-        clientPackets[clientId][seq] = std::move(packet);
+        auto now = std::chrono::steady_clock::now();
+        pipeline.record(trace::SERVER_CAPTURE_QUEUE, queued.enqueued, now, queued.packet->id);
+        queued.enqueued = now;
 
-        updateClientMetadata(clientId);
-
-        tryReassemble(clientId);
+        // Dispatcher is the only producer, so the worker checked above still has room
+        Worker& worker = workerFor(queued.packet->id);
+        if (!worker.queue.push(std::move(queued))) {
+            break;
+        }
+        counters.workerQueueHigh.update(worker.queue.size());
     }
 }
 
-void Server::packetCaptureLoop(u_char* user, const struct pcap_pkthdr* header, const u_char* packet) {
-    auto* ctx = reinterpret_cast<PacketLoopContext*>(user);
-    int headerLen = ctx->headerLen;
-    Server* self = ctx->server;
+void Server::ingestPacket(const uint8_t* packet, size_t length, const struct timespec& stamp) {
+    if (!config.replayFile.empty()) {
+        throttleReplay(stamp);
+    }
+    else {
+        // Kernel timestamp is on the wall clock, the stage histograms on the steady one
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        auto age = std::chrono::seconds(now.tv_sec - stamp.tv_sec) + std::chrono::nanoseconds(now.tv_nsec - stamp.tv_nsec);
+        if (age.count() >= 0) {
+            auto received = std::chrono::steady_clock::now();
+            pipeline.record(trace::SERVER_KERNEL_QUEUE, received - age, received);
+        }
+    }
+    trace::Scope capture(&pipeline, trace::SERVER_CAPTURE);
+
+    counters.capturedPackets.add();
+    if (length == 0) {
+        counters.malformedPackets.add();
+        return;
+    }
+    size_t capturedLen = length;
 
-    const u_char* ipHeader = packet + headerLen;
+    const uint8_t* ipHeader = packet;
     uint8_t version = (*ipHeader) >> 4;
 
 
-    const u_char* icmpHeader = ipHeader;
+    const uint8_t* icmpHeader = ipHeader;
     const uint8_t* payload = nullptr;
     size_t ipHeaderLen = 0;
     size_t payloadLen = 0;
+    struct sockaddr_storage source;
+    std::memset(&source, 0, sizeof(source));
+    // Runts (a replayed savefile may hold anything) are rejected before any header field is read
     if (version == 4) {
         const auto* iph = reinterpret_cast<const struct ip*>(ipHeader);
+        if (length < sizeof(struct ip) || iph->ip_hl < 5) {
+            counters.malformedPackets.add();
+            return;
+        }
         ipHeaderLen = iph->ip_hl * 4;
+        if (ntohs(iph->ip_len) < ipHeaderLen + sizeof(struct icmphdr)) {
+            counters.malformedPackets.add();
+            return;
+        }
+        auto* src4 = reinterpret_cast<struct sockaddr_in*>(&source);
+        src4->sin_family = AF_INET;
+        src4->sin_addr = iph->ip_src;
         icmpHeader += ipHeaderLen;
         payloadLen = ntohs(iph->ip_len) - ipHeaderLen - sizeof(struct icmphdr);
         payload = reinterpret_cast<const uint8_t*>(icmpHeader + sizeof(struct icmphdr));
     } 
     else if (version == 6) {
+        const auto* ip6h = reinterpret_cast<const struct ip6_hdr*>(ipHeader);
+        if (length < sizeof(struct ip6_hdr) || ntohs(ip6h->ip6_plen) < sizeof(struct icmp6_hdr)) {
+            counters.malformedPackets.add();
+            return;
+        }
+        auto* src6 = reinterpret_cast<struct sockaddr_in6*>(&source);
+        src6->sin6_family = AF_INET6;
+        src6->sin6_addr = ip6h->ip6_src;
         ipHeaderLen = sizeof(struct ip6_hdr);
         icmpHeader += ipHeaderLen;
-        payloadLen = ntohs(reinterpret_cast<const struct ip6_hdr*>(ipHeader)->ip6_plen) - sizeof(struct icmp6_hdr);
+        payloadLen = ntohs(ip6h->ip6_plen) - sizeof(struct icmp6_hdr);
         payload = reinterpret_cast<const uint8_t*>(icmpHeader + sizeof(struct icmp6_hdr));
     }
 
-    if (!payload || payloadLen == 0) return;
+    if (!payload || payloadLen == 0) {
+        counters.foreignPackets.add();
+        return;
+    }
+
+    // Never read past captured bytes, even if IP header claims more
+    size_t payloadOffset = static_cast<size_t>(payload - ipHeader);
+    if (payloadOffset >= capturedLen) {
+        counters.malformedPackets.add();
+        return;
+    }
+    if (payloadLen > capturedLen - payloadOffset) {
+        payloadLen = capturedLen - payloadOffset;
+    }
+    counters.capturedBytes.add(payloadLen);
+
     try {
+        auto parseStart = std::chrono::steady_clock::now();
         protocol::PacketPtr packetPtr = protocol::parsePacket(payload, payloadLen);
+        pipeline.record(trace::SERVER_PARSE, parseStart, std::chrono::steady_clock::now(), payloadLen);
 
         if (packetPtr) {
-            std::lock_guard<std::mutex> lock(self->queueMutex);
-            self->packetQueue.push(std::move(packetPtr));
-            self->queueCV.notify_one();
+            uint64_t clientId = packetPtr->id;
+            unsigned weight = priorityFor(clientId, source);
+
+            // Capture must not block, a client that outruns its worker loses packets and resends them
+            std::lock_guard<std::mutex> lock(queueMutex);
+            if (!packetQueue.push(clientId, payloadLen, weight,
+                                  QueuedPacket{std::move(packetPtr), source, std::chrono::steady_clock::now()})) {
+                counters.queueDrops.add();
+                return;
+            }
+            counters.captureQueueHigh.update(packetQueue.size());
+            queueCV.notify_one();
         }
-    } catch (...) {}
+        else {
+            counters.foreignPackets.add();
+        }
+    } catch (...) {
+        // Our magic and version but a body that does not parse
+        counters.malformedPackets.add();
+    }
+}
+
+void Server::throttleReplay(const struct timespec& stamp) {
+    auto now = std::chrono::steady_clock::now();
+    double timestamp = static_cast<double>(stamp.tv_sec) + static_cast<double>(stamp.tv_nsec) / 1e9;
+    if (replayFirstStamp < 0) {
+        replayFirstStamp = timestamp;
+        replayStart = now;
+    }
+    if (config.replaySpeed > 0 && timestamp > replayFirstStamp) {
+        auto offset = std::chrono::duration<double>((timestamp - replayFirstStamp) / config.replaySpeed);
+        std::this_thread::sleep_until(replayStart + std::chrono::duration_cast<std::chrono::nanoseconds>(offset));
+    }
+
+    std::unique_lock<std::mutex> lock(queueMutex);
+    spaceCV.wait(lock, [this] { return packetQueue.size() < REPLAY_QUEUE_LIMIT || !running; });
 }
 
 bool Server::startPacketCapture(void) {
-    char errbuf[PCAP_ERRBUF_SIZE];
-    pcap_t *handle = pcap_open_live("any", 1500, 0, 100, errbuf);
-    if (handle == nullptr) {
-        std::cerr << "[SERVER] pcap_open_live failed: " << errbuf << std::endl;
+    if (!receiver->open()) {
         return false;
     }
-    
-    struct bpf_program fp;
-    char filter_exp[] = "icmp[icmptype] = icmp-echo or icmp6[icmp6type] = icmp6-echo";
-    if (pcap_compile(handle, &fp, filter_exp, 0, PCAP_NETMASK_UNKNOWN) == -1) {
-        std::cerr << "[SERVER] pcap_compiler failed: " << pcap_geterr(handle) << std::endl;
-        pcap_close(handle);
-        return false;
+    return receiver->run([this](const uint8_t* packet, size_t length, const struct timespec& stamp) {
+        ingestPacket(packet, length, stamp);
+    });
+}
+
+void Server::finishReplay(std::chrono::steady_clock::time_point started) {
+    {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        spaceCV.wait(lock, [this] { return packetQueue.empty(); });
     }
 
-    if (pcap_setfilter(handle, &fp) == -1) {
-        std::cerr << "[SERVER] pcap_setfilter failed: " << pcap_geterr(handle) << std::endl;
-        pcap_close(handle);
-        return false;
+    // Consumer stops first, so the packet it holds still reaches a worker, workers drain what is left
+    running = false;
+    queueCV.notify_all();
+    if (consumerThread.joinable()) {
+        consumerThread.join();
     }
-    
-    int datalink = pcap_datalink(handle);
-    int headerLen = net_utils::getLinkHeaderLen(datalink);
-    if (headerLen < 0) {
-        pcap_close(handle);
-        return false;
+    for (auto& worker : workers) {
+        worker->queue.close();
+    }
+    for (auto& worker : workers) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
     }
 
-    PacketLoopContext ctx{headerLen, this};
-    pcap_loop(handle, -1, packetCaptureLoop, reinterpret_cast<u_char*>(&ctx));
-    
-    pcap_close(handle);
-    return true;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    uint64_t packets = counters.capturedPackets.value();
+    uint64_t bytes = counters.capturedBytes.value();
+    std::cerr << "[SERVER] Replayed " << packets << " packets (" << bytes << " bytes) in " << seconds << " s, "
+              << static_cast<uint64_t>(static_cast<double>(packets) / seconds) << " packets/s, "
+              << static_cast<double>(bytes) / seconds / 1e6 << " MB/s" << std::endl;
+    std::cerr << "[SERVER] Transfers: " << counters.completedTransfers.value() << " completed, "
+              << counters.failedTransfers.value() << " failed, "
+              << counters.startedTransfers.value() - counters.completedTransfers.value() - counters.failedTransfers.value()
+              << " incomplete" << std::endl;
 }
 
 bool Server::run(void) {
+    if (exporter && !exporter->open()) {
+        return false;
+    }
+    receiver = Receiver::create(config.receiver, config.replayFile, config.capture);
     running = true;
 
+    restoreTransfers();
+
+    for (auto& worker : workers) {
+        worker->thread = std::thread(&Server::workerLoop, this, std::ref(*worker));
+    }
     consumerThread = std::thread(&Server::packetConsumerLoop, this);
 
-    return startPacketCapture();
+    auto started = std::chrono::steady_clock::now();
+    if (!startPacketCapture()) {
+        return false;
+    }
+    if (!config.replayFile.empty()) {
+        finishReplay(started);
+    }
+    if (outputFailed) {
+        std::cerr << "[SERVER] Transfer to " << config.outputPath << " did not complete" << std::endl;
+        return false;
+    }
+    return true;
 }
\ No newline at end of file
@@ -0,0 +1,149 @@
+/**
+ * @file spool.cpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#include "spool.hpp"
+#include <fstream>
+#include <filesystem>
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <cinttypes>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * @brief Formats transfer ID as fixed width hex (file name stem)
+ */
+static std::string idToHex(uint64_t id) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016" PRIx64, id);
+    return buf;
+}
+
+Spool::Spool(const std::string& dir, uint64_t id)
+    : fd(-1) {
+    std::string stem = (std::filesystem::path(dir) / idToHex(id)).string();
+    chunkPath = stem + ".chunks";
+    statePath = stem + ".state";
+}
+
+Spool::~Spool() {
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+bool Spool::openChunks(void) {
+    if (fd >= 0) {
+        return true;
+    }
+
+    fd = open(chunkPath.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        std::cerr << "[SPOOL] Cannot open " << chunkPath << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool Spool::writeChunk(uint64_t chunkNum, uint32_t chunkSize, const std::vector<uint8_t>& data) {
+    if (!openChunks()) {
+        return false;
+    }
+
+    off_t offset = static_cast<off_t>(chunkNum * chunkSize);
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t ret = pwrite(fd, data.data() + written, data.size() - written, offset + written);
+        if (ret < 0) {
+            std::cerr << "[SPOOL] Cannot write " << chunkPath << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        written += static_cast<size_t>(ret);
+    }
+    return true;
+}
+
+bool Spool::readChunk(uint64_t chunkNum, uint32_t chunkSize, size_t len, std::vector<uint8_t>& data) {
+    if (!openChunks()) {
+        return false;
+    }
+
+    data.resize(len);
+    off_t offset = static_cast<off_t>(chunkNum * chunkSize);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t ret = pread(fd, data.data() + done, len - done, offset + done);
+        if (ret <= 0) {
+            std::cerr << "[SPOOL] Cannot read chunk " << chunkNum << " from " << chunkPath << std::endl;
+            return false;
+        }
+        done += static_cast<size_t>(ret);
+    }
+    return true;
+}
+
+bool Spool::saveState(const std::vector<uint8_t>& state) {
+    std::string tempPath = statePath + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        if (!file.is_open() ||
+            !file.write(reinterpret_cast<const char*>(state.data()), static_cast<std::streamsize>(state.size()))) {
+            std::cerr << "[SPOOL] Cannot write " << tempPath << std::endl;
+            return false;
+        }
+    }
+
+    // Chunks referenced by the new state must hit the disk before the state does
+    if (fd >= 0) {
+        fdatasync(fd);
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tempPath, statePath, ec);
+    if (ec) {
+        std::cerr << "[SPOOL] Cannot rename " << tempPath << ": " << ec.message() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool Spool::loadState(std::vector<uint8_t>& state) {
+    std::ifstream file(statePath, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    state.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+void Spool::remove(void) {
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+
+    std::error_code ec;
+    std::filesystem::remove(chunkPath, ec);
+    std::filesystem::remove(statePath, ec);
+}
+
+std::vector<uint64_t> Spool::listTransfers(const std::string& dir) {
+    std::vector<uint64_t> ids;
+    std::error_code ec;
+
+    for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+        if (entry.path().extension() != ".state") {
+            continue;
+        }
+        try {
+            ids.push_back(std::stoull(entry.path().stem().string(), nullptr, 16));
+        } catch (const std::exception&) {
+            continue;
+        }
+    }
+    return ids;
+}
@@ -0,0 +1,156 @@
+/**
+ * @file trace.cpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#include "trace.hpp"
+#include <atomic>
+#include <csignal>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+const char* const trace::SERVER_STAGE_NAMES[trace::SERVER_STAGES] = {
+    "kernel_queue", "capture", "parse", "capture_queue", "worker_queue", "process", "reassemble", "decrypt", "write"
+};
+
+const char* const trace::CLIENT_STAGE_NAMES[trace::CLIENT_STAGES] = {
+    "read", "encrypt", "chunk", "serialize", "send"
+};
+
+static volatile std::sig_atomic_t dumpRequested = 0;   ///< Set by SIGUSR1
+
+/**
+ * @brief Kernel ID of the calling thread, the trace shows one row per thread
+ */
+static uint32_t threadId(void) {
+    thread_local uint32_t id = static_cast<uint32_t>(syscall(SYS_gettid));
+    return id;
+}
+
+trace::Pipeline::Pipeline(const char* const* names, size_t count) : names(names), epoch(Clock::now()) {
+    for (size_t i = 0; i < count; ++i) {
+        histograms.push_back(std::make_unique<metrics::Histogram>());
+    }
+}
+
+void trace::Pipeline::record(size_t stage, Clock::time_point start, Clock::time_point end, uint64_t arg) {
+    uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    histograms[stage]->record(ns);
+    if (tracePath.empty()) {
+        return;
+    }
+
+    Span span;
+    span.stage = static_cast<uint32_t>(stage);
+    span.thread = threadId();
+    span.startNs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(start - epoch).count());
+    span.durationNs = ns;
+    span.arg = arg;
+
+    std::lock_guard<std::mutex> lock(spanMutex);
+    spans[nextSpan] = span;
+    if (++nextSpan == spans.size()) {
+        nextSpan = 0;
+        wrapped = true;
+    }
+}
+
+void trace::Pipeline::enableTrace(const std::string& path) {
+    std::lock_guard<std::mutex> lock(spanMutex);
+    spans.assign(TRACE_CAPACITY, Span{});
+    nextSpan = 0;
+    wrapped = false;
+    tracePath = path;
+}
+
+bool trace::Pipeline::dump(void) {
+    if (tracePath.empty()) {
+        return true;
+    }
+
+    // Copy first, stages keep recording while the file is written
+    std::vector<Span> copy;
+    {
+        std::lock_guard<std::mutex> lock(spanMutex);
+        if (wrapped) {
+            copy.insert(copy.end(), spans.begin() + static_cast<std::ptrdiff_t>(nextSpan), spans.end());
+        }
+        copy.insert(copy.end(), spans.begin(), spans.begin() + static_cast<std::ptrdiff_t>(nextSpan));
+    }
+
+    std::string tmpPath = tracePath + ".tmp";
+    std::ofstream file(tmpPath, std::ios::trunc);
+    if (!file) {
+        std::cerr << "[TRACE] Could not write " << tmpPath << std::endl;
+        return false;
+    }
+
+    // Complete events ("X") with microsecond timestamps, nested stages show up nested
+    int pid = static_cast<int>(getpid());
+    file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    file << std::fixed << std::setprecision(3);
+    for (size_t i = 0; i < copy.size(); ++i) {
+        const Span& span = copy[i];
+        file << (i == 0 ? "\n" : ",\n")
+             << "{\"name\":\"" << names[span.stage] << "\",\"ph\":\"X\",\"pid\":" << pid
+             << ",\"tid\":" << span.thread << ",\"ts\":" << static_cast<double>(span.startNs) / 1000.0
+             << ",\"dur\":" << static_cast<double>(span.durationNs) / 1000.0
+             << ",\"args\":{\"arg\":" << span.arg << "}}";
+    }
+    file << "\n]}\n";
+    file.close();
+    if (!file) {
+        std::cerr << "[TRACE] Could not write " << tmpPath << std::endl;
+        return false;
+    }
+
+    if (std::rename(tmpPath.c_str(), tracePath.c_str()) != 0) {
+        std::cerr << "[TRACE] Could not replace " << tracePath << std::endl;
+        return false;
+    }
+    std::cerr << "[TRACE] Wrote " << copy.size() << " spans to " << tracePath << std::endl;
+    return true;
+}
+
+void trace::Pipeline::exportMetrics(metrics::Writer& out, const std::string& name) const {
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+    out.family(name, "summary", "Time spent in a stage of the pipeline (HDR histogram quantiles).");
+    for (size_t i = 0; i < histograms.size(); ++i) {
+        const metrics::Histogram& histogram = *histograms[i];
+        std::string stage = metrics::label("stage", names[i]);
+        for (double q : quantiles) {
+            std::ostringstream quantile;
+            quantile << q;
+            out.sample(name, static_cast<double>(histogram.quantile(q)) / 1e9,
+                       stage + "," + metrics::label("quantile", quantile.str()));
+        }
+        out.sample(name + "_sum", static_cast<double>(histogram.sum()) / 1e9, stage);
+        out.sample(name + "_count", histogram.count(), stage);
+    }
+}
+
+/**
+ * @brief Signal handler, only sets the flag the owner's loop checks
+ */
+static void requestDump(int) {
+    dumpRequested = 1;
+}
+
+void trace::installDumpSignal(void) {
+    struct sigaction action {};
+    action.sa_handler = requestDump;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, nullptr);
+}
+
+bool trace::takeDumpRequest(void) {
+    if (!dumpRequested) {
+        return false;
+    }
+    dumpRequested = 0;
+    return true;
+}
@@ -0,0 +1,536 @@
+/**
+ * @file transfer.cpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#include "transfer.hpp"
+#include "archive.hpp"
+#include "delta.hpp"
+#include <iostream>
+#include <filesystem>
+#include <cstring>
+#include <endian.h>
+
+constexpr size_t MAX_CHUNK_SIZE = 65535;
+constexpr uint64_t CHECKPOINT_INTERVAL = 4096;  ///< Chunks processed between two checkpoints
+constexpr uint32_t STATE_MAGIC = 0x53504C34;    ///< "SPL4" (metadata with content kind and codec, Merkle tree)
+constexpr size_t PENDING_OVERHEAD = 80;         ///< Estimated map node and vector header size
+constexpr size_t SPOOLED_OVERHEAD = 40;         ///< Estimated set node size
+
+/**
+ * @brief Appends big endian 64-bit number to the buffer
+ */
+static void appendU64(std::vector<uint8_t>& out, uint64_t value) {
+    uint64_t net = htobe64(value);
+    out.insert(out.end(), reinterpret_cast<uint8_t*>(&net), reinterpret_cast<uint8_t*>(&net) + sizeof(net));
+}
+
+/**
+ * @brief Reads big endian 64-bit number from the buffer and advances offset
+ */
+static bool readU64(const std::vector<uint8_t>& in, size_t& offset, uint64_t& value) {
+    if (in.size() < offset + sizeof(value)) {
+        return false;
+    }
+    std::memcpy(&value, in.data() + offset, sizeof(value));
+    value = be64toh(value);
+    offset += sizeof(value);
+    return true;
+}
+
+Transfer::Transfer(uint64_t id, const std::vector<uint8_t>& key, const std::string& spoolDir, DiskWriter* writer,
+                   const std::string& outputPath, trace::Pipeline* pipeline)
+    : id(id), key(key), tagKey(encoder::deriveTagKey(key)), outputPath(outputPath),
+      lastActivity(std::chrono::steady_clock::now()), output(writer), pipeline(pipeline) {
+    if (!spoolDir.empty()) {
+        spool = std::make_unique<Spool>(spoolDir, id);
+    }
+}
+
+size_t Transfer::expectedChunkSize(uint64_t chunkNum) const {
+    if (chunkNum >= metadata.totalChunks) {
+        return 0;
+    }
+
+    // Every chunk except the last one is exactly chunkSize long
+    if (chunkNum == metadata.totalChunks - 1) {
+        return encoder::cipherSize(metadata.fileSize) - chunkNum * metadata.chunkSize;
+    }
+    return metadata.chunkSize;
+}
+
+bool Transfer::isValidChunk(uint64_t chunkNum, size_t size) const {
+    if (metadata.totalChunks != protocol::UNKNOWN_SIZE) {
+        return expectedChunkSize(chunkNum) == size;
+    }
+
+    // Any chunk may turn out to be the last (shorter) one, the End packet settles it
+    return size != 0 && size <= metadata.chunkSize && size % encoder::BLOCK_SIZE == 0;
+}
+
+bool Transfer::hasChunk(uint64_t chunkNum) const {
+    return chunkNum < nextChunk || pendingChunks.count(chunkNum) || spooledChunks.count(chunkNum);
+}
+
+bool Transfer::setMetadata(const protocol::Metadata& meta) {
+    touch();
+    if (metadataReceived) {
+        return true;
+    }
+
+    if (meta.iv.size() != encoder::BLOCK_SIZE) {
+        std::cerr << "[TRANSFER] Invalid IV in metadata" << std::endl;
+        return false;
+    }
+    if (meta.chunkSize == 0 || meta.chunkSize > MAX_CHUNK_SIZE || meta.chunkSize % encoder::BLOCK_SIZE != 0) {
+        std::cerr << "[TRANSFER] Invalid chunk size in metadata" << std::endl;
+        return false;
+    }
+
+    if (meta.totalChunks == protocol::UNKNOWN_SIZE) {
+        if (meta.fileSize != protocol::UNKNOWN_SIZE) {
+            std::cerr << "[TRANSFER] Stream metadata with a known file size" << std::endl;
+            return false;
+        }
+    }
+    else if (meta.totalChunks != (encoder::cipherSize(meta.fileSize) + meta.chunkSize - 1) / meta.chunkSize) {
+        std::cerr << "[TRANSFER] Chunk count does not match file size" << std::endl;
+        return false;
+    }
+
+    if (meta.kind != protocol::CONTENT_FILE && meta.kind != protocol::CONTENT_ARCHIVE &&
+        meta.kind != protocol::CONTENT_DELTA) {
+        std::cerr << "[TRANSFER] Unknown content kind in metadata" << std::endl;
+        return false;
+    }
+    // Decompressor state is not checkpointed, so compressed content only comes as a stream
+    if (meta.codec > protocol::CODEC_LZ ||
+        (meta.codec != protocol::CODEC_NONE && meta.totalChunks != protocol::UNKNOWN_SIZE)) {
+        std::cerr << "[TRANSFER] Unsupported codec in metadata" << std::endl;
+        return false;
+    }
+
+    // Never let the client choose a directory
+    std::string name = file_handler::getNameFromPath(meta.fileName);
+    if (name.empty() || name == "." || name == "..") {
+        std::cerr << "[TRANSFER] Invalid file name in metadata" << std::endl;
+        return false;
+    }
+    // Archive must not collide with the directory of the same name it unpacks into
+    if (meta.kind == protocol::CONTENT_ARCHIVE) {
+        name += archive::EXTENSION;
+    }
+    // Delta is kept aside, the file it applies to stays untouched until the delta is complete
+    else if (meta.kind == protocol::CONTENT_DELTA) {
+        name += delta::EXTENSION;
+    }
+
+    metadata = meta;
+    metadata.fileName = name;
+    metadataReceived = true;
+    stream = metadata.totalChunks == protocol::UNKNOWN_SIZE;
+    chainBlock = metadata.iv;
+
+    decryptor = std::make_unique<encoder::Decryptor>(key, metadata.iv);
+    if (!decryptor->isValid() || !merkle.isValid() || tagKey.empty()) {
+        return false;
+    }
+    if (metadata.codec == protocol::CODEC_LZ) {
+        decompressor = std::make_unique<compress::Decompressor>();
+    }
+
+    bool opened = outputPath.empty() ? output.open(metadata.fileName, stream ? 0 : metadata.fileSize)
+                                     : output.openStream(outputPath);
+    if (!opened) {
+        return false;
+    }
+
+    for (auto it = pendingChunks.begin(); it != pendingChunks.end();) {
+        if (!isValidChunk(it->first, it->second.size())) {
+            std::cerr << "[TRANSFER] Dropping invalid chunk " << it->first << std::endl;
+            memoryUsage -= it->second.capacity() + PENDING_OVERHEAD;
+            it = pendingChunks.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+
+    // First checkpoint makes the transfer known to a restarted server
+    if (!checkpoint()) {
+        return false;
+    }
+
+    if (pendingEnd) {
+        protocol::End end = *pendingEnd;
+        pendingEnd.reset();
+        return setEnd(end);
+    }
+    return processReadyChunks();
+}
+
+bool Transfer::addChunk(protocol::Data&& data) {
+    trace::Scope scope(pipeline, trace::SERVER_REASSEMBLE, data.chunkNum);
+    touch();
+
+    // Duplicates are ignored, first copy wins
+    if (hasChunk(data.chunkNum)) {
+        return true;
+    }
+
+    // Damaged chunk is dropped before it can break the CBC chain, the client resends just this one
+    if (encoder::chunkTag(tagKey, id, data.chunkNum, data.payload.data(), data.payload.size()) != data.tag) {
+        std::cerr << "[TRANSFER] Chunk " << data.chunkNum << " failed its integrity tag" << std::endl;
+        corruptChunks.push_back(data.chunkNum);
+        return true;
+    }
+
+    if (metadataReceived && !isValidChunk(data.chunkNum, data.payload.size())) {
+        std::cerr << "[TRANSFER] Chunk " << data.chunkNum << " does not match metadata" << std::endl;
+        return true;
+    }
+
+    memoryUsage += data.payload.capacity() + PENDING_OVERHEAD;
+    pendingChunks.emplace(data.chunkNum, std::move(data.payload));
+
+    if (!metadataReceived) {
+        return true;
+    }
+    return processReadyChunks();
+}
+
+bool Transfer::setEnd(const protocol::End& end) {
+    touch();
+    if (!metadataReceived) {
+        pendingEnd = end;
+        return true;
+    }
+
+    if (end.root.size() != protocol::ROOT_SIZE) {
+        std::cerr << "[TRANSFER] Invalid Merkle root in end packet" << std::endl;
+        return false;
+    }
+    // Duplicate End
+    if (hasEnd()) {
+        return true;
+    }
+
+    // Size was known from the start, End only brings the root
+    if (metadata.totalChunks != protocol::UNKNOWN_SIZE) {
+        if (end.totalChunks != metadata.totalChunks || end.fileSize != metadata.fileSize) {
+            std::cerr << "[TRANSFER] End does not match metadata" << std::endl;
+            return false;
+        }
+        expectedRoot = end.root;
+        return processReadyChunks();
+    }
+
+    // Chunks are decrypted only once their successor arrived, so the last one can not be written yet
+    if (end.fileSize >= protocol::UNKNOWN_SIZE - encoder::BLOCK_SIZE ||
+        end.totalChunks != (encoder::cipherSize(end.fileSize) + metadata.chunkSize - 1) / metadata.chunkSize ||
+        end.totalChunks <= nextChunk) {
+        std::cerr << "[TRANSFER] End of stream does not match received chunks" << std::endl;
+        return false;
+    }
+
+    metadata.totalChunks = end.totalChunks;
+    metadata.fileSize = end.fileSize;
+    expectedRoot = end.root;
+
+    for (auto it = pendingChunks.begin(); it != pendingChunks.end();) {
+        if (!isValidChunk(it->first, it->second.size())) {
+            std::cerr << "[TRANSFER] Dropping invalid chunk " << it->first << std::endl;
+            memoryUsage -= it->second.capacity() + PENDING_OVERHEAD;
+            it = pendingChunks.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    return processReadyChunks();
+}
+
+bool Transfer::processReadyChunks(void) {
+    std::vector<uint8_t> cipher;
+    std::vector<uint8_t> plain;
+
+    while (nextChunk < metadata.totalChunks) {
+        // Last chunk carries the padding, a stream chunk is surely not the last one once its successor is here
+        if (metadata.totalChunks == protocol::UNKNOWN_SIZE && !hasChunk(nextChunk + 1)) {
+            break;
+        }
+
+        auto it = pendingChunks.find(nextChunk);
+        if (it != pendingChunks.end()) {
+            memoryUsage -= it->second.capacity() + PENDING_OVERHEAD;
+            cipher = std::move(it->second);
+            pendingChunks.erase(it);
+        }
+        else if (spooledChunks.count(nextChunk)) {
+            if (!spool->readChunk(nextChunk, metadata.chunkSize, expectedChunkSize(nextChunk), cipher)) {
+                return false;
+            }
+            spooledChunks.erase(nextChunk);
+            memoryUsage -= SPOOLED_OVERHEAD;
+        }
+        else {
+            break;
+        }
+
+        bool last = nextChunk == metadata.totalChunks - 1;
+        if (!last && cipher.size() != metadata.chunkSize) {
+            std::cerr << "[TRANSFER] Short chunk " << nextChunk << " in the middle of the stream" << std::endl;
+            return false;
+        }
+        {
+            trace::Scope decrypt(pipeline, trace::SERVER_DECRYPT, nextChunk);
+            if (!decryptor->update(cipher.data(), cipher.size(), plain, last)) {
+                std::cerr << "[TRANSFER] Decryption of chunk " << nextChunk << " failed" << std::endl;
+                return false;
+            }
+            if (!merkle.addLeaf(plain.data(), plain.size())) {
+                return false;
+            }
+        }
+        // Plaintext buffer goes to the I/O thread, the next chunk gets a new one
+        writtenBytes += plain.size();
+        if (decompressor) {
+            std::vector<uint8_t> raw;
+            if (!decompressor->update(plain.data(), plain.size(), raw)) {
+                return false;
+            }
+            plain = std::move(raw);
+        }
+        if (!plain.empty() && !output.write(std::move(plain))) {
+            return false;
+        }
+        plain = std::vector<uint8_t>();
+
+        chainBlock.assign(cipher.end() - encoder::BLOCK_SIZE, cipher.end());
+        ++nextChunk;
+
+        if (spool && ++chunksSinceCheckpoint >= CHECKPOINT_INTERVAL && nextChunk != metadata.totalChunks) {
+            if (!checkpoint()) {
+                return false;
+            }
+        }
+    }
+
+    if (!isComplete()) {
+        return true;
+    }
+
+    if (writtenBytes != metadata.fileSize) {
+        std::cerr << "[TRANSFER] Written size does not match metadata" << std::endl;
+        return false;
+    }
+    if (decompressor && !decompressor->finish()) {
+        std::cerr << "[TRANSFER] Compressed stream ends in the middle of a block" << std::endl;
+        return false;
+    }
+    if (merkle.root() != expectedRoot) {
+        std::cerr << "[TRANSFER] Merkle root does not match, the file is not the one the client sent" << std::endl;
+        return false;
+    }
+    if (!output.commit()) {
+        return false;
+    }
+    if (spool) {
+        spool->remove();
+    }
+
+    // Unpacked archive is removed, a broken one stays for inspection
+    if (metadata.kind == protocol::CONTENT_ARCHIVE && outputPath.empty()) {
+        if (!archive::extract(metadata.fileName, ".")) {
+            return false;
+        }
+        std::error_code ec;
+        std::filesystem::remove(metadata.fileName, ec);
+    }
+    else if (metadata.kind == protocol::CONTENT_DELTA && outputPath.empty()) {
+        std::string target = metadata.fileName.substr(0, metadata.fileName.size() - delta::EXTENSION.size());
+        if (!delta::apply(metadata.fileName, target, target)) {
+            return false;
+        }
+        std::error_code ec;
+        std::filesystem::remove(metadata.fileName, ec);
+    }
+    return true;
+}
+
+bool Transfer::checkpoint(void) {
+    // Streams can not be resumed, the client has nothing to resend from
+    if (!spool || !metadataReceived || stream) {
+        return true;
+    }
+    chunksSinceCheckpoint = 0;
+
+    if (!output.flush()) {
+        return false;
+    }
+
+    // Out-of-order chunks move to disk, which also frees their memory
+    for (auto& [chunkNum, data] : pendingChunks) {
+        if (!spool->writeChunk(chunkNum, metadata.chunkSize, data)) {
+            return false;
+        }
+        spooledChunks.insert(chunkNum);
+    }
+    pendingChunks.clear();
+    memoryUsage = spooledChunks.size() * SPOOLED_OVERHEAD;
+
+    std::vector<uint8_t> state;
+    state.push_back(static_cast<uint8_t>(STATE_MAGIC >> 24));
+    state.push_back(static_cast<uint8_t>(STATE_MAGIC >> 16));
+    state.push_back(static_cast<uint8_t>(STATE_MAGIC >> 8));
+    state.push_back(static_cast<uint8_t>(STATE_MAGIC));
+
+    std::vector<uint8_t> meta = metadata.serialize();
+    appendU64(state, meta.size());
+    state.insert(state.end(), meta.begin(), meta.end());
+
+    appendU64(state, nextChunk);
+    appendU64(state, writtenBytes);
+    state.insert(state.end(), chainBlock.begin(), chainBlock.end());
+    merkle.saveState(state);
+
+    // Received-chunk bitmap, bit i stands for chunk nextChunk + i
+    uint64_t bits = spooledChunks.empty() ? 0 : *spooledChunks.rbegin() - nextChunk + 1;
+    appendU64(state, bits);
+    std::vector<uint8_t> bitmap((bits + 7) / 8, 0);
+    for (uint64_t chunkNum : spooledChunks) {
+        uint64_t bit = chunkNum - nextChunk;
+        bitmap[bit / 8] |= static_cast<uint8_t>(1u << (bit % 8));
+    }
+    state.insert(state.end(), bitmap.begin(), bitmap.end());
+
+    return spool->saveState(state);
+}
+
+bool Transfer::restore(void) {
+    std::vector<uint8_t> state;
+    if (!spool || !spool->loadState(state) || state.size() < 4) {
+        return false;
+    }
+
+    uint32_t magic = (static_cast<uint32_t>(state[0]) << 24) | (static_cast<uint32_t>(state[1]) << 16) |
+                     (static_cast<uint32_t>(state[2]) << 8) | state[3];
+    size_t offset = 4;
+    uint64_t metaLen;
+    if (magic != STATE_MAGIC || !readU64(state, offset, metaLen) || state.size() - offset < metaLen) {
+        std::cerr << "[TRANSFER] Corrupted checkpoint of transfer " << id << std::endl;
+        return false;
+    }
+
+    try {
+        metadata = protocol::Metadata::deserialize(state.data() + offset, metaLen);
+    } catch (const std::exception& e) {
+        std::cerr << "[TRANSFER] Corrupted checkpoint of transfer " << id << ": " << e.what() << std::endl;
+        return false;
+    }
+    offset += metaLen;
+
+    uint64_t bits;
+    if (!readU64(state, offset, nextChunk) || !readU64(state, offset, writtenBytes) ||
+        state.size() < offset + encoder::BLOCK_SIZE) {
+        std::cerr << "[TRANSFER] Corrupted checkpoint of transfer " << id << std::endl;
+        return false;
+    }
+    chainBlock.assign(state.begin() + offset, state.begin() + offset + encoder::BLOCK_SIZE);
+    offset += encoder::BLOCK_SIZE;
+
+    if (!merkle.loadState(state.data(), state.size(), offset) || !readU64(state, offset, bits) || state.size() - offset < (bits + 7) / 8) {
+        std::cerr << "[TRANSFER] Corrupted checkpoint of transfer " << id << std::endl;
+        return false;
+    }
+    for (uint64_t bit = 0; bit < bits; ++bit) {
+        if (state[offset + bit / 8] & (1u << (bit % 8))) {
+            spooledChunks.insert(nextChunk + bit);
+            memoryUsage += SPOOLED_OVERHEAD;
+        }
+    }
+
+    // CBC continues from the last cipher block that made it into the output
+    decryptor = std::make_unique<encoder::Decryptor>(key, chainBlock);
+    if (!decryptor->isValid() || !output.resume(metadata.fileName, writtenBytes, metadata.fileSize)) {
+        return false;
+    }
+
+    metadataReceived = true;
+    touch();
+    return processReadyChunks();
+}
+
+bool Transfer::spill(void) {
+    if (!canSpill()) {
+        return false;
+    }
+    return checkpoint();
+}
+
+bool Transfer::park(void) {
+    if (!spill()) {
+        return false;
+    }
+    return output.close();
+}
+
+protocol::ResumeState Transfer::getResumeState(size_t maxRanges) const {
+    protocol::ResumeState state;
+    if (!metadataReceived) {
+        return state;
+    }
+
+    state.found = 1;
+    state.fileSize = metadata.fileSize;
+    state.chunkSize = metadata.chunkSize;
+    state.iv = metadata.iv;
+
+    uint64_t chunkNum = nextChunk;
+    while (chunkNum < metadata.totalChunks && maxRanges > 0) {
+        // Gap ends at the next chunk the server holds
+        uint64_t nextHeld = metadata.totalChunks;
+        auto pending = pendingChunks.lower_bound(chunkNum);
+        if (pending != pendingChunks.end() && pending->first < nextHeld) {
+            nextHeld = pending->first;
+        }
+        auto spooled = spooledChunks.lower_bound(chunkNum);
+        if (spooled != spooledChunks.end() && *spooled < nextHeld) {
+            nextHeld = *spooled;
+        }
+
+        if (nextHeld == chunkNum) {
+            ++chunkNum;
+            continue;
+        }
+
+        // No more room, client resends everything from here
+        protocol::ChunkRange range{chunkNum, maxRanges == 1 ? metadata.totalChunks : nextHeld};
+        state.missing.push_back(range);
+        chunkNum = range.end;
+        --maxRanges;
+    }
+
+    return state;
+}
+
+std::vector<uint64_t> Transfer::takeCorruptChunks(void) {
+    std::vector<uint64_t> chunks;
+    chunks.swap(corruptChunks);
+    return chunks;
+}
+
+bool Transfer::claimNack(std::chrono::milliseconds interval) {
+    auto now = std::chrono::steady_clock::now();
+    if (now - lastNack < interval) {
+        return false;
+    }
+    lastNack = now;
+    return true;
+}
+
+void Transfer::discard(void) {
+    output.discard();
+    if (spool) {
+        spool->remove();
+    }
+}
@@ -0,0 +1,419 @@
+/**
+ * @file xdp_receiver.cpp
+ * @author Michal Repcik (xrepcim00)
+ */
+#include "xdp_receiver.hpp"
+#include "protocol.hpp"
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+constexpr uint32_t XDP_FRAMES = 4096;           ///< Frames of the UMEM, all of them start in the fill ring
+constexpr uint32_t XDP_FRAME_SIZE = 4096;       ///< One frame per page, packets longer than a frame are dropped
+constexpr uint32_t XDP_RX_SIZE = 2048;          ///< Entries of the RX ring
+constexpr uint32_t XDP_BATCH = 64;              ///< Packets taken from the RX ring per pass
+constexpr uint32_t XDP_MAX_QUEUES = 64;         ///< Entries of the XSKMAP (highest queue + 1)
+constexpr size_t ETHERNET_HEADER_SIZE = 14;     ///< Header in front of the IP packet
+constexpr int16_t ICMP_AT = ETHERNET_HEADER_SIZE;       ///< ICMP header once the IP header is skipped
+constexpr int16_t MAGIC_AT = ICMP_AT + 8;               ///< Protocol magic behind the echo header
+constexpr int16_t VERSION_AT = MAGIC_AT + protocol::VERSION_OFFSET; ///< Protocol version
+
+/**
+ * @brief Calls the bpf system call (no libbpf needed)
+ */
+static long bpf(int command, union bpf_attr& attr) {
+    return syscall(__NR_bpf, command, &attr, sizeof(attr));
+}
+
+/**
+ * @struct Program
+ * @brief eBPF instructions with jumps to labels resolved once the program is complete
+ */
+struct Program {
+    enum Label { PASS, IPV6, ICMP, LABELS };
+
+    std::vector<struct bpf_insn> code;                  ///< Instructions
+    std::vector<std::pair<size_t, Label>> jumps;        ///< Jumps waiting for their target
+    size_t labels[LABELS] = {};                         ///< Position of every label
+
+    void emit(uint8_t op, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+        struct bpf_insn insn;
+        std::memset(&insn, 0, sizeof(insn));
+        insn.code = op;
+        insn.dst_reg = dst;
+        insn.src_reg = src;
+        insn.off = off;
+        insn.imm = imm;
+        code.push_back(insn);
+    }
+
+    void jump(uint8_t op, uint8_t dst, uint8_t src, int32_t imm, Label target) {
+        jumps.push_back({code.size(), target});
+        emit(op, dst, src, 0, imm);
+    }
+
+    void mark(Label label) {
+        labels[label] = code.size();
+    }
+
+    void link(void) {
+        for (const auto& [at, label] : jumps) {
+            code[at].off = static_cast<int16_t>(labels[label] - at - 1);
+        }
+    }
+};
+
+XdpReceiver::XdpReceiver(const Capture& capture) : capture(capture) {}
+
+XdpReceiver::~XdpReceiver() {
+    // Program goes first, so no packet is redirected to a socket that no longer exists
+    for (int fd : {linkFd, xskFd, progFd, mapFd, stopFd}) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    for (Ring* ring : {&fill, &rx}) {
+        if (ring->map) {
+            munmap(ring->map, ring->mapSize);
+        }
+    }
+    if (umem) {
+        munmap(umem, static_cast<size_t>(XDP_FRAMES) * XDP_FRAME_SIZE);
+    }
+}
+
+bool XdpReceiver::loadProgram(void) {
+    union bpf_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = XDP_MAX_QUEUES;
+    mapFd = static_cast<int>(bpf(BPF_MAP_CREATE, attr));
+    if (mapFd < 0) {
+        std::cerr << "[RECEIVER] Could not create XSKMAP: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    // r2 walks the packet so that r2 + ICMP_AT is the ICMP header, r7 holds the echo request type
+    using P = Program;
+    Program p;
+    p.emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+    p.emit(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data), 0);
+    p.emit(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end), 0);
+    p.emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+    p.emit(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, ETHERNET_HEADER_SIZE);
+    p.jump(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, P::PASS);
+    p.emit(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, 12, 0);
+    p.jump(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_5, 0, htons(ETH_P_IPV6), P::IPV6);
+    p.jump(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, htons(ETH_P_IP), P::PASS);
+
+    // IPv4, the header length comes from IHL
+    p.emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+    p.emit(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, ETHERNET_HEADER_SIZE + 20);
+    p.jump(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, P::PASS);
+    p.emit(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, ETHERNET_HEADER_SIZE + 9, 0);
+    p.jump(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, IPPROTO_ICMP, P::PASS);
+    p.emit(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, ETHERNET_HEADER_SIZE, 0);
+    p.emit(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, 0x0F);
+    p.emit(BPF_ALU64 | BPF_LSH | BPF_K, BPF_REG_5, 0, 0, 2);
+    p.jump(BPF_JMP | BPF_JLT | BPF_K, BPF_REG_5, 0, 20, P::PASS);
+    p.emit(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_2, BPF_REG_5, 0, 0);
+    p.emit(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_7, 0, 0, ICMP_ECHO);
+    p.jump(BPF_JMP | BPF_JA, 0, 0, 0, P::ICMP);
+
+    // IPv6, extension headers are left to the kernel
+    p.mark(P::IPV6);
+    p.emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+    p.emit(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, ETHERNET_HEADER_SIZE + 40);
+    p.jump(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, P::PASS);
+    p.emit(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, ETHERNET_HEADER_SIZE + 6, 0);
+    p.jump(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, IPPROTO_ICMPV6, P::PASS);
+    p.emit(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, 40);
+    p.emit(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_7, 0, 0, ICMP6_ECHO_REQUEST);
+
+    // Echo request with our magic and version, loads compare in network order
+    p.mark(P::ICMP);
+    p.emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+    p.emit(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, VERSION_AT + 1);
+    p.jump(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, P::PASS);
+    p.emit(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, ICMP_AT, 0);
+    p.jump(BPF_JMP | BPF_JNE | BPF_X, BPF_REG_5, BPF_REG_7, 0, P::PASS);
+    p.emit(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_5, BPF_REG_2, MAGIC_AT, 0);
+    p.jump(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, static_cast<int32_t>(htonl(protocol::MAGIC_NUMBER)), P::PASS);
+    p.emit(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, VERSION_AT, 0);
+    p.jump(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, protocol::VERSION, P::PASS);
+
+    // Queue without a socket falls back to XDP_PASS
+    p.emit(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, mapFd);
+    p.emit(0, 0, 0, 0, 0);
+    p.emit(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index), 0);
+    p.emit(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS);
+    p.emit(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+    p.emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+    p.mark(P::PASS);
+    p.emit(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+    p.emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+    p.link();
+
+    static const char license[] = "GPL";
+    std::vector<char> log(64 * 1024);
+    std::memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns = reinterpret_cast<uint64_t>(p.code.data());
+    attr.insn_cnt = static_cast<uint32_t>(p.code.size());
+    attr.license = reinterpret_cast<uint64_t>(license);
+    attr.log_buf = reinterpret_cast<uint64_t>(log.data());
+    attr.log_size = static_cast<uint32_t>(log.size());
+    attr.log_level = 1;
+    progFd = static_cast<int>(bpf(BPF_PROG_LOAD, attr));
+    if (progFd < 0) {
+        std::cerr << "[RECEIVER] Could not load XDP program: " << strerror(errno) << "\n" << log.data() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool XdpReceiver::mapRing(Ring& ring, off_t offset, const struct xdp_ring_offset& layout, uint32_t entries,
+                          size_t entrySize) {
+    ring.mapSize = layout.desc + entries * entrySize;
+    void* map = mmap(nullptr, ring.mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xskFd, offset);
+    if (map == MAP_FAILED) {
+        std::cerr << "[RECEIVER] Could not map AF_XDP ring: " << strerror(errno) << std::endl;
+        return false;
+    }
+    auto* base = static_cast<uint8_t*>(map);
+    ring.map = map;
+    ring.producer = reinterpret_cast<uint32_t*>(base + layout.producer);
+    ring.consumer = reinterpret_cast<uint32_t*>(base + layout.consumer);
+    ring.entries = base + layout.desc;
+    ring.mask = entries - 1;
+    return true;
+}
+
+bool XdpReceiver::createSocket(void) {
+    xskFd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (xskFd < 0) {
+        std::cerr << "[RECEIVER] Could not open AF_XDP socket: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    size_t umemSize = static_cast<size_t>(XDP_FRAMES) * XDP_FRAME_SIZE;
+    void* frames = mmap(nullptr, umemSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (frames == MAP_FAILED) {
+        std::cerr << "[RECEIVER] Could not allocate UMEM: " << strerror(errno) << std::endl;
+        return false;
+    }
+    umem = static_cast<uint8_t*>(frames);
+
+    struct xdp_umem_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.addr = reinterpret_cast<uint64_t>(umem);
+    reg.len = umemSize;
+    reg.chunk_size = XDP_FRAME_SIZE;
+    uint32_t fillSize = XDP_FRAMES;
+    uint32_t completionSize = XDP_BATCH;    // Unused, bind() still wants one
+    uint32_t rxSize = XDP_RX_SIZE;
+    if (setsockopt(xskFd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+        setsockopt(xskFd, SOL_XDP, XDP_UMEM_FILL_RING, &fillSize, sizeof(fillSize)) < 0 ||
+        setsockopt(xskFd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &completionSize, sizeof(completionSize)) < 0 ||
+        setsockopt(xskFd, SOL_XDP, XDP_RX_RING, &rxSize, sizeof(rxSize)) < 0) {
+        std::cerr << "[RECEIVER] Could not set up UMEM: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    struct xdp_mmap_offsets layout;
+    socklen_t layoutLen = sizeof(layout);
+    if (getsockopt(xskFd, SOL_XDP, XDP_MMAP_OFFSETS, &layout, &layoutLen) < 0) {
+        std::cerr << "[RECEIVER] Could not read AF_XDP ring layout: " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (!mapRing(fill, XDP_UMEM_PGOFF_FILL_RING, layout.fr, fillSize, sizeof(uint64_t)) ||
+        !mapRing(rx, XDP_PGOFF_RX_RING, layout.rx, rxSize, sizeof(struct xdp_desc))) {
+        return false;
+    }
+
+    // Every frame starts out free
+    auto* addresses = static_cast<uint64_t*>(fill.entries);
+    for (uint32_t i = 0; i < XDP_FRAMES; ++i) {
+        addresses[i] = static_cast<uint64_t>(i) * XDP_FRAME_SIZE;
+    }
+    __atomic_store_n(fill.producer, XDP_FRAMES, __ATOMIC_RELEASE);
+
+    // Generic mode always copies, native mode lets the driver pick zero-copy if it can
+    struct sockaddr_xdp address;
+    std::memset(&address, 0, sizeof(address));
+    address.sxdp_family = AF_XDP;
+    address.sxdp_flags = capture.xdpNative ? 0 : XDP_COPY;
+    address.sxdp_ifindex = ifindex;
+    address.sxdp_queue_id = capture.queue;
+    if (bind(xskFd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) < 0) {
+        std::cerr << "[RECEIVER] Could not bind AF_XDP socket to " << capture.device << " queue " << capture.queue
+                  << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool XdpReceiver::open(void) {
+    ifindex = if_nametoindex(capture.device.c_str());
+    if (ifindex == 0) {
+        std::cerr << "[RECEIVER] Unknown interface " << capture.device << std::endl;
+        return false;
+    }
+    if (!loadProgram() || !createSocket()) {
+        return false;
+    }
+
+    union bpf_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    uint32_t key = capture.queue;
+    attr.map_fd = static_cast<uint32_t>(mapFd);
+    attr.key = reinterpret_cast<uint64_t>(&key);
+    attr.value = reinterpret_cast<uint64_t>(&xskFd);
+    if (bpf(BPF_MAP_UPDATE_ELEM, attr) < 0) {
+        std::cerr << "[RECEIVER] Could not add AF_XDP socket to XSKMAP: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    // Link is owned by the process, the program goes away with it even after a crash
+    std::memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = static_cast<uint32_t>(progFd);
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = capture.xdpNative ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+    linkFd = static_cast<int>(bpf(BPF_LINK_CREATE, attr));
+    if (linkFd < 0) {
+        std::cerr << "[RECEIVER] Could not attach XDP program to " << capture.device << " ("
+                  << (capture.xdpNative ? "native" : "generic") << " mode): " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stopFd < 0) {
+        std::cerr << "[RECEIVER] Could not create eventfd: " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void XdpReceiver::readBatch(const Handler& handler) {
+    uint32_t consumer = *rx.consumer;
+    uint32_t available = __atomic_load_n(rx.producer, __ATOMIC_ACQUIRE) - consumer;
+    uint32_t count = std::min(available, XDP_BATCH);
+    if (count == 0) {
+        return;
+    }
+    batches.add();
+    received.add(count);
+
+    // No receive timestamp in copy mode, the ring is read right after the wakeup
+    struct timespec stamp;
+    clock_gettime(CLOCK_REALTIME, &stamp);
+
+    uint64_t frames[XDP_BATCH];
+    const auto* descs = static_cast<const struct xdp_desc*>(rx.entries);
+    for (uint32_t i = 0; i < count; ++i) {
+        const struct xdp_desc& desc = descs[(consumer + i) & rx.mask];
+        const uint8_t* packet = umem + desc.addr;
+        size_t length = desc.len > ETHERNET_HEADER_SIZE ? desc.len - ETHERNET_HEADER_SIZE : 0;
+        handler(packet + ETHERNET_HEADER_SIZE, length, stamp);
+        frames[i] = desc.addr & ~static_cast<uint64_t>(XDP_FRAME_SIZE - 1);
+    }
+    __atomic_store_n(rx.consumer, consumer + count, __ATOMIC_RELEASE);
+
+    // Every frame not in the fill ring is in our hands, so there is always room for the ones handed back
+    uint32_t producer = *fill.producer;
+    auto* addresses = static_cast<uint64_t*>(fill.entries);
+    for (uint32_t i = 0; i < count; ++i) {
+        addresses[(producer + i) & fill.mask] = frames[i];
+    }
+    __atomic_store_n(fill.producer, producer + count, __ATOMIC_RELEASE);
+}
+
+bool XdpReceiver::run(const Handler& handler) {
+    struct pollfd fds[2] = {{stopFd, POLLIN, 0}, {xskFd, POLLIN, 0}};
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "[RECEIVER] poll failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (fds[0].revents & POLLIN) {
+            uint64_t value;
+            ssize_t drained = read(stopFd, &value, sizeof(value));
+            static_cast<void>(drained);
+            return true;
+        }
+        if (fds[1].revents & POLLERR) {
+            std::cerr << "[RECEIVER] AF_XDP socket failed" << std::endl;
+            return false;
+        }
+        readBatch(handler);
+    }
+}
+
+void XdpReceiver::stop(void) {
+    uint64_t value = 1;
+    if (stopFd >= 0) {
+        ssize_t written = write(stopFd, &value, sizeof(value));
+        static_cast<void>(written);
+    }
+}
+
+bool XdpReceiver::readStatistics(struct xdp_statistics& stats) {
+    socklen_t length = sizeof(stats);
+    return xskFd >= 0 && getsockopt(xskFd, SOL_XDP, XDP_STATISTICS, &stats, &length) == 0;
+}
+
+void XdpReceiver::exportMetrics(metrics::Writer& out) {
+    out.counter("secret_server_xdp_received_total", "Echo requests read from the AF_XDP RX ring.", received.value());
+    out.counter("secret_server_xdp_batches_total", "Wakeups that found packets in the RX ring.", batches.value());
+    struct xdp_statistics stats;
+    if (readStatistics(stats)) {
+        const std::string name = "secret_server_xdp_dropped_total";
+        out.family(name, "counter", "Redirected packets the AF_XDP socket dropped, by reason.");
+        out.sample(name, static_cast<uint64_t>(stats.rx_ring_full), metrics::label("reason", "rx_ring_full"));
+        out.sample(name, static_cast<uint64_t>(stats.rx_fill_ring_empty_descs), metrics::label("reason", "fill_ring_empty"));
+        out.sample(name, static_cast<uint64_t>(stats.rx_dropped), metrics::label("reason", "other"));
+    }
+}
+
+void XdpReceiver::report(void) {
+    std::cerr << "[RECEIVER] AF_XDP on " << capture.device << " queue " << capture.queue << ": " << received.value()
+              << " received in " << batches.value() << " batches";
+    struct xdp_statistics stats;
+    if (readStatistics(stats)) {
+        std::cerr << ", " << stats.rx_ring_full << " dropped (RX ring full), " << stats.rx_fill_ring_empty_descs
+                  << " dropped (no free frame), " << stats.rx_dropped << " dropped (other)";
+    }
+    std::cerr << std::endl;
+}